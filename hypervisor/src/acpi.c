@@ -0,0 +1,344 @@
+#include "acpi.h"
+#include "console.h"
+#include "types.h"
+
+// Filled once by acpi_init(); everything else reads from here
+static acpi_info_t acpi_info = {0};
+
+static uint8_t acpi_checksum_ok(const void *table, uint32_t length) {
+    const uint8_t *bytes = (const uint8_t *)table;
+    uint8_t sum = 0;
+    
+    for (uint32_t i = 0; i < length; i++) {
+        sum += bytes[i];
+    }
+    return sum == 0;
+}
+
+static uint8_t acpi_signature_matches(const char *a, const char *b, int length) {
+    for (int i = 0; i < length; i++) {
+        if (a[i] != b[i]) return 0;
+    }
+    return 1;
+}
+
+// RSDP sits on a 16-byte boundary in the first KB of the EBDA or in the
+// BIOS ROM area
+static const acpi_rsdp_t *acpi_scan_rsdp(uint64_t start, uint64_t end) {
+    for (uint64_t addr = start; addr < end; addr += 16) {
+        const acpi_rsdp_t *candidate = (const acpi_rsdp_t *)addr;
+        if (acpi_signature_matches(candidate->signature, "RSD PTR ", 8) &&
+            acpi_checksum_ok(candidate, 20)) {
+            return candidate;
+        }
+    }
+    return 0;
+}
+
+// UEFI firmware has no RSDP in low memory; GRUB copies it into the
+// Multiboot2 info instead (tag 15 for ACPI 2.0+, tag 14 for 1.0)
+static const acpi_rsdp_t *acpi_multiboot_rsdp(uint32_t magic, uint64_t info) {
+    if (magic != MULTIBOOT2_BOOTLOADER_MAGIC || !info) {
+        return 0;
+    }
+    
+    const acpi_rsdp_t *found = 0;
+    uint32_t total_size = *(const uint32_t *)info;
+    uint64_t tag = info + 8;
+    
+    while (tag + 8 <= info + total_size) {
+        uint32_t type = *(const uint32_t *)tag;
+        uint32_t size = *(const uint32_t *)(tag + 4);
+        if (type == MULTIBOOT2_TAG_END || size < 8) break;
+        
+        if (type == MULTIBOOT2_TAG_ACPI_NEW) {
+            return (const acpi_rsdp_t *)(tag + 8);
+        }
+        if (type == MULTIBOOT2_TAG_ACPI_OLD) {
+            found = (const acpi_rsdp_t *)(tag + 8);
+        }
+        tag += (size + 7) & ~7U;
+    }
+    return found;
+}
+
+// Cache every root table entry with a valid checksum
+static void acpi_collect_tables(void) {
+    const acpi_rsdp_t *rsdp = acpi_info.rsdp;
+    uint8_t use_xsdt = rsdp->revision >= 2 && rsdp->xsdt_address;
+    const acpi_sdt_header_t *root = use_xsdt ?
+        (const acpi_sdt_header_t *)rsdp->xsdt_address :
+        (const acpi_sdt_header_t *)(uint64_t)rsdp->rsdt_address;
+    
+    if (!acpi_checksum_ok(root, root->length)) {
+        console_write_string("  Root table checksum invalid\n");
+        return;
+    }
+    
+    uint32_t entry_size = use_xsdt ? 8 : 4;
+    uint32_t count = (root->length - sizeof(acpi_sdt_header_t)) / entry_size;
+    const uint8_t *entries = (const uint8_t *)root + sizeof(acpi_sdt_header_t);
+    
+    for (uint32_t i = 0; i < count && acpi_info.table_count < ACPI_MAX_TABLES; i++) {
+        uint64_t addr = use_xsdt ?
+            *(const uint64_t *)(entries + i * 8) :
+            *(const uint32_t *)(entries + i * 4);
+        const acpi_sdt_header_t *table = (const acpi_sdt_header_t *)addr;
+        
+        if (addr && acpi_checksum_ok(table, table->length)) {
+            acpi_info.tables[acpi_info.table_count++] = table;
+        }
+    }
+}
+
+// MADT: enabled local APICs (xAPIC and x2APIC) and IOAPICs
+static void acpi_parse_madt(const acpi_sdt_header_t *madt) {
+    const uint8_t *p = (const uint8_t *)madt + MADT_HEADER_SIZE;
+    const uint8_t *end = (const uint8_t *)madt + madt->length;
+    
+    acpi_info.lapic_address = *(const uint32_t *)((const uint8_t *)madt + 36);
+    
+    while (p + 2 <= end) {
+        uint8_t type = p[0];
+        uint8_t length = p[1];
+        if (length < 2 || p + length > end) break;
+        
+        if (type == MADT_TYPE_LOCAL_APIC && length >= 8) {
+            uint32_t flags = *(const uint32_t *)(p + 4);
+            if ((flags & MADT_LAPIC_ENABLED) && acpi_info.cpu_count < ACPI_MAX_CPUS) {
+                acpi_cpu_t *cpu = &acpi_info.cpus[acpi_info.cpu_count++];
+                cpu->processor_uid = p[2];
+                cpu->apic_id = p[3];
+            }
+        } else if (type == MADT_TYPE_LOCAL_X2APIC && length >= 16) {
+            uint32_t flags = *(const uint32_t *)(p + 8);
+            if ((flags & MADT_LAPIC_ENABLED) && acpi_info.cpu_count < ACPI_MAX_CPUS) {
+                acpi_cpu_t *cpu = &acpi_info.cpus[acpi_info.cpu_count++];
+                cpu->apic_id = *(const uint32_t *)(p + 4);
+                cpu->processor_uid = *(const uint32_t *)(p + 12);
+            }
+        } else if (type == MADT_TYPE_IOAPIC && length >= 12) {
+            if (acpi_info.ioapic_count < ACPI_MAX_IOAPICS) {
+                acpi_ioapic_t *ioapic = &acpi_info.ioapics[acpi_info.ioapic_count++];
+                ioapic->id = p[2];
+                ioapic->address = *(const uint32_t *)(p + 4);
+                ioapic->gsi_base = *(const uint32_t *)(p + 8);
+            }
+        }
+        p += length;
+    }
+}
+
+// Device entries are 4 bytes (types 0-63), 8 bytes (64-127) or variable
+// length (the ACPI HID entry, type 0xF0)
+static uint32_t acpi_ivhd_entry_length(const uint8_t *entry) {
+    uint8_t type = entry[0];
+    if (type < 0x40) return 4;
+    if (type < 0x80) return 8;
+    if (type == IVHD_DEV_ACPI_HID) return 22 + entry[21];
+    return 0;
+}
+
+static void acpi_add_ivhd_range(uint16_t start, uint16_t end, uint8_t unit, uint8_t settings) {
+    if (acpi_info.ivhd_range_count >= ACPI_MAX_IVHD_RANGES) return;
+    
+    acpi_ivhd_range_t *range = &acpi_info.ivhd_ranges[acpi_info.ivhd_range_count++];
+    range->start = start;
+    range->end = end;
+    range->unit = unit;
+    range->settings = settings;
+}
+
+static void acpi_parse_ivhd(const uint8_t *block, uint16_t length) {
+    if (acpi_info.ivhd_unit_count >= ACPI_MAX_IVHD_UNITS) return;
+    
+    uint8_t index = acpi_info.ivhd_unit_count++;
+    acpi_ivhd_unit_t *unit = &acpi_info.ivhd_units[index];
+    unit->flags = block[1];
+    unit->device_id = *(const uint16_t *)(block + 4);
+    unit->cap_offset = *(const uint16_t *)(block + 6);
+    unit->base_addr = *(const uint64_t *)(block + 8);
+    unit->segment = *(const uint16_t *)(block + 16);
+    
+    // Type 10h headers are 24 bytes; 11h/40h add the EFR image
+    const uint8_t *p = block + (block[0] == IVRS_TYPE_IVHD_10 ? 24 : 40);
+    const uint8_t *end = block + length;
+    uint16_t range_start = 0;
+    uint8_t range_settings = 0;
+    uint8_t in_range = 0;
+    
+    while (p + 4 <= end) {
+        uint32_t entry_length = acpi_ivhd_entry_length(p);
+        if (!entry_length || p + entry_length > end) break;
+        
+        uint8_t type = p[0];
+        uint16_t device_id = *(const uint16_t *)(p + 1);
+        uint8_t settings = p[3];
+        
+        if (type == IVHD_DEV_ALL) {
+            acpi_add_ivhd_range(0, 0xFFFF, index, settings);
+        } else if (type == IVHD_DEV_SELECT || type == IVHD_DEV_ALIAS_SELECT ||
+                   type == IVHD_DEV_EXT_SELECT) {
+            acpi_add_ivhd_range(device_id, device_id, index, settings);
+        } else if (type == IVHD_DEV_RANGE_START || type == IVHD_DEV_ALIAS_RANGE ||
+                   type == IVHD_DEV_EXT_RANGE) {
+            range_start = device_id;
+            range_settings = settings;
+            in_range = 1;
+        } else if (type == IVHD_DEV_RANGE_END && in_range) {
+            acpi_add_ivhd_range(range_start, device_id, index, range_settings);
+            in_range = 0;
+        } else if (type == IVHD_DEV_SPECIAL && acpi_info.ivhd_special_count < ACPI_MAX_IVHD_SPECIAL) {
+            // Handle, then the requester ID, then the variety
+            acpi_ivhd_special_t *special = &acpi_info.ivhd_special[acpi_info.ivhd_special_count++];
+            special->handle = p[4];
+            special->device_id = *(const uint16_t *)(p + 5);
+            special->variety = p[7];
+            special->unit = index;
+        }
+        p += entry_length;
+    }
+}
+
+// IVRS lists each IOMMU once per IVHD type it supports; use only the
+// newest type present so units and ranges are not recorded twice
+static void acpi_parse_ivrs(const acpi_sdt_header_t *ivrs) {
+    const uint8_t *start = (const uint8_t *)ivrs + IVRS_HEADER_SIZE;
+    const uint8_t *end = (const uint8_t *)ivrs + ivrs->length;
+    uint8_t preferred = 0;
+    
+    for (const uint8_t *p = start; p + 4 <= end; ) {
+        uint16_t length = *(const uint16_t *)(p + 2);
+        if (length < 4) break;
+        if ((p[0] == IVRS_TYPE_IVHD_10 || p[0] == IVRS_TYPE_IVHD_11 ||
+             p[0] == IVRS_TYPE_IVHD_40) && p[0] > preferred) {
+            preferred = p[0];
+        }
+        p += length;
+    }
+    
+    for (const uint8_t *p = start; p + 4 <= end; ) {
+        uint16_t length = *(const uint16_t *)(p + 2);
+        if (length < 4 || p + length > end) break;
+        if (p[0] == preferred && length >= 24) {
+            acpi_parse_ivhd(p, length);
+        }
+        p += length;
+    }
+}
+
+// MCFG: one ECAM window per PCI segment group
+static void acpi_parse_mcfg(const acpi_sdt_header_t *mcfg) {
+    const uint8_t *p = (const uint8_t *)mcfg + MCFG_HEADER_SIZE;
+    const uint8_t *end = (const uint8_t *)mcfg + mcfg->length;
+    
+    while (p + 16 <= end && acpi_info.mcfg_count < ACPI_MAX_MCFG_SEGMENTS) {
+        acpi_mcfg_segment_t *segment = &acpi_info.mcfg[acpi_info.mcfg_count++];
+        segment->base_addr = *(const uint64_t *)p;
+        segment->segment = *(const uint16_t *)(p + 8);
+        segment->start_bus = p[10];
+        segment->end_bus = p[11];
+        p += 16;
+    }
+}
+
+static void acpi_print_count(const char *label, uint32_t count) {
+    char buf[32];
+    console_write_string(label);
+    itoa(count, buf, 10);
+    console_write_string(buf);
+    console_write_string("\n");
+}
+
+void acpi_init(uint32_t multiboot_magic, uint64_t multiboot_info) {
+    console_write_string("Locating ACPI tables...\n");
+    
+    const acpi_rsdp_t *rsdp = acpi_multiboot_rsdp(multiboot_magic, multiboot_info);
+    if (!rsdp) {
+        uint64_t ebda = (uint64_t)(*(volatile uint16_t *)ACPI_EBDA_PTR) << 4;
+        if (ebda) {
+            rsdp = acpi_scan_rsdp(ebda, ebda + 1024);
+        }
+    }
+    if (!rsdp) {
+        rsdp = acpi_scan_rsdp(ACPI_BIOS_ROM_START, ACPI_BIOS_ROM_END);
+    }
+    
+    if (!rsdp) {
+        console_write_string("  No RSDP found\n");
+        return;
+    }
+    
+    acpi_info.rsdp = rsdp;
+    console_write_string("  RSDP at 0x");
+    console_write_hex((uint64_t)rsdp);
+    console_write_string(rsdp->revision >= 2 ? " (XSDT)\n" : " (RSDT)\n");
+    
+    // Single walk of the root table, then decode the tables we care about
+    acpi_collect_tables();
+    
+    const acpi_sdt_header_t *madt = acpi_find_table("APIC");
+    if (madt) acpi_parse_madt(madt);
+    
+    const acpi_sdt_header_t *ivrs = acpi_find_table("IVRS");
+    if (ivrs) acpi_parse_ivrs(ivrs);
+    
+    const acpi_sdt_header_t *mcfg = acpi_find_table("MCFG");
+    if (mcfg) acpi_parse_mcfg(mcfg);
+    
+    acpi_info.dmar = acpi_find_table("DMAR");
+    
+    acpi_print_count("  Tables: ", acpi_info.table_count);
+    acpi_print_count("  MADT CPUs: ", acpi_info.cpu_count);
+    acpi_print_count("  IOAPICs: ", acpi_info.ioapic_count);
+    acpi_print_count("  IVRS units: ", acpi_info.ivhd_unit_count);
+    acpi_print_count("  IVRS IOAPIC/HPET entries: ", acpi_info.ivhd_special_count);
+    acpi_print_count("  MCFG segments: ", acpi_info.mcfg_count);
+    if (acpi_info.dmar) {
+        console_write_string("  DMAR present\n");
+    }
+}
+
+// Look up a table in the cache built at boot
+const acpi_sdt_header_t *acpi_find_table(const char *signature) {
+    for (uint32_t i = 0; i < acpi_info.table_count; i++) {
+        if (acpi_signature_matches(acpi_info.tables[i]->signature, signature, 4)) {
+            return acpi_info.tables[i];
+        }
+    }
+    return 0;
+}
+
+const acpi_info_t *acpi_get_info(void) {
+    return &acpi_info;
+}
+
+// Which IVHD unit (if any) translates DMA from this requester ID
+const acpi_ivhd_range_t *acpi_find_ivhd_range(uint16_t device_id) {
+    for (uint32_t i = 0; i < acpi_info.ivhd_range_count; i++) {
+        const acpi_ivhd_range_t *range = &acpi_info.ivhd_ranges[i];
+        if (device_id >= range->start && device_id <= range->end) {
+            return range;
+        }
+    }
+    return 0;
+}
+
+const acpi_ivhd_special_t *acpi_find_ivhd_special(uint16_t device_id) {
+    for (uint32_t i = 0; i < acpi_info.ivhd_special_count; i++) {
+        if (acpi_info.ivhd_special[i].device_id == device_id) {
+            return &acpi_info.ivhd_special[i];
+        }
+    }
+    return 0;
+}
+
+const acpi_mcfg_segment_t *acpi_find_mcfg(uint16_t segment, uint8_t bus) {
+    for (uint32_t i = 0; i < acpi_info.mcfg_count; i++) {
+        const acpi_mcfg_segment_t *entry = &acpi_info.mcfg[i];
+        if (entry->segment == segment && bus >= entry->start_bus && bus <= entry->end_bus) {
+            return entry;
+        }
+    }
+    return 0;
+}
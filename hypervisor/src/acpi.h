@@ -0,0 +1,148 @@
+#ifndef ACPI_H
+#define ACPI_H
+
+#include "types.h"
+
+// RSDP search ranges for legacy BIOS boot
+#define ACPI_EBDA_PTR 0x40E
+#define ACPI_BIOS_ROM_START 0xE0000
+#define ACPI_BIOS_ROM_END 0x100000
+
+// Multiboot2 hands over a copy of the RSDP on UEFI systems
+#define MULTIBOOT2_BOOTLOADER_MAGIC 0x36D76289
+#define MULTIBOOT2_TAG_END 0
+#define MULTIBOOT2_TAG_CMDLINE 1
+#define MULTIBOOT2_TAG_ACPI_OLD 14
+#define MULTIBOOT2_TAG_ACPI_NEW 15
+
+// Fixed capacity for everything parsed at boot (no allocation)
+#define ACPI_MAX_TABLES 64
+#define ACPI_MAX_CPUS 64
+#define ACPI_MAX_IOAPICS 4
+#define ACPI_MAX_IVHD_UNITS 4
+#define ACPI_MAX_IVHD_RANGES 64
+#define ACPI_MAX_IVHD_SPECIAL 8
+#define ACPI_MAX_MCFG_SEGMENTS 4
+
+// MADT entry types
+#define MADT_TYPE_LOCAL_APIC 0
+#define MADT_TYPE_IOAPIC 1
+#define MADT_TYPE_LOCAL_X2APIC 9
+#define MADT_LAPIC_ENABLED 0x1
+#define MADT_LAPIC_ONLINE_CAPABLE 0x2
+#define MADT_HEADER_SIZE 44
+
+// IVRS block and device entry types
+#define IVRS_HEADER_SIZE 48
+#define IVRS_TYPE_IVHD_10 0x10
+#define IVRS_TYPE_IVHD_11 0x11
+#define IVRS_TYPE_IVHD_40 0x40
+#define IVHD_DEV_ALL 0x01
+#define IVHD_DEV_SELECT 0x02
+#define IVHD_DEV_RANGE_START 0x03
+#define IVHD_DEV_RANGE_END 0x04
+#define IVHD_DEV_ALIAS_SELECT 0x42
+#define IVHD_DEV_ALIAS_RANGE 0x43
+#define IVHD_DEV_EXT_SELECT 0x46
+#define IVHD_DEV_EXT_RANGE 0x47
+#define IVHD_DEV_SPECIAL 0x48
+#define IVHD_SPECIAL_IOAPIC 1
+#define IVHD_SPECIAL_HPET 2
+#define IVHD_DEV_ACPI_HID 0xF0
+
+#define MCFG_HEADER_SIZE 44
+
+typedef struct {
+    char signature[8];  // "RSD PTR "
+    uint8_t checksum;
+    char oem_id[6];
+    uint8_t revision;
+    uint32_t rsdt_address;
+    uint32_t length;
+    uint64_t xsdt_address;
+    uint8_t extended_checksum;
+    uint8_t reserved[3];
+} __attribute__((packed)) acpi_rsdp_t;
+
+typedef struct {
+    char signature[4];
+    uint32_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} __attribute__((packed)) acpi_sdt_header_t;
+
+typedef struct {
+    uint32_t apic_id;
+    uint32_t processor_uid;
+} acpi_cpu_t;
+
+typedef struct {
+    uint8_t id;
+    uint64_t address;
+    uint32_t gsi_base;
+} acpi_ioapic_t;
+
+typedef struct {
+    uint16_t device_id;   // BDF of the IOMMU function itself
+    uint16_t segment;
+    uint16_t cap_offset;
+    uint64_t base_addr;
+    uint8_t flags;
+} acpi_ivhd_unit_t;
+
+typedef struct {
+    uint16_t start;       // Inclusive device ID range
+    uint16_t end;
+    uint8_t unit;         // Index into the IVHD unit list
+    uint8_t settings;     // DTE setting byte from the entry
+} acpi_ivhd_range_t;
+
+// IOAPIC or HPET that raises interrupts under a PCI requester ID
+typedef struct {
+    uint16_t device_id;   // Requester ID its interrupts carry
+    uint8_t handle;       // IOAPIC ID or HPET number
+    uint8_t variety;      // IVHD_SPECIAL_*
+    uint8_t unit;
+} acpi_ivhd_special_t;
+
+typedef struct {
+    uint64_t base_addr;   // ECAM base for bus 0 of the segment
+    uint16_t segment;
+    uint8_t start_bus;
+    uint8_t end_bus;
+} acpi_mcfg_segment_t;
+
+// Everything discovered from one RSDP -> XSDT walk
+typedef struct {
+    const acpi_rsdp_t *rsdp;
+    const acpi_sdt_header_t *tables[ACPI_MAX_TABLES];
+    uint32_t table_count;
+    acpi_cpu_t cpus[ACPI_MAX_CPUS];
+    uint32_t cpu_count;
+    uint64_t lapic_address;
+    acpi_ioapic_t ioapics[ACPI_MAX_IOAPICS];
+    uint32_t ioapic_count;
+    acpi_ivhd_unit_t ivhd_units[ACPI_MAX_IVHD_UNITS];
+    uint32_t ivhd_unit_count;
+    acpi_ivhd_range_t ivhd_ranges[ACPI_MAX_IVHD_RANGES];
+    uint32_t ivhd_range_count;
+    acpi_ivhd_special_t ivhd_special[ACPI_MAX_IVHD_SPECIAL];
+    uint32_t ivhd_special_count;
+    acpi_mcfg_segment_t mcfg[ACPI_MAX_MCFG_SEGMENTS];
+    uint32_t mcfg_count;
+    const acpi_sdt_header_t *dmar;
+} acpi_info_t;
+
+void acpi_init(uint32_t multiboot_magic, uint64_t multiboot_info);
+const acpi_sdt_header_t *acpi_find_table(const char *signature);
+const acpi_info_t *acpi_get_info(void);
+const acpi_ivhd_range_t *acpi_find_ivhd_range(uint16_t device_id);
+const acpi_ivhd_special_t *acpi_find_ivhd_special(uint16_t device_id);
+const acpi_mcfg_segment_t *acpi_find_mcfg(uint16_t segment, uint8_t bus);
+
+#endif
@@ -8,6 +8,15 @@ header_start:
     dd header_end - header_start ; header length
     dd 0x100000000 - (0xe85250d6 + 0 + (header_end - header_start))
     
+    ; Framebuffer request (optional): any resolution, 32 bpp
+    align 8
+    dw 5                         ; type
+    dw 1                         ; flags: optional
+    dd 20                        ; size
+    dd 0                         ; width: no preference
+    dd 0                         ; height: no preference
+    dd 32                        ; depth
+    
     ; End tag
     align 8
     dw 0
@@ -0,0 +1,79 @@
+; Interrupt entry stubs
+; Each vector pushes a uniform frame (error code + vector number) and
+; jumps to a common path that calls cpu_interrupt_dispatch(vector)
+
+section .text
+bits 64
+
+extern cpu_interrupt_dispatch
+global isr_stub_table
+
+; Vectors where the CPU pushes an error code itself
+%macro ISR_ERRCODE 1
+isr_stub_%1:
+    push qword %1
+    jmp isr_common
+%endmacro
+
+%macro ISR_NOERRCODE 1
+isr_stub_%1:
+    push qword 0
+    push qword %1
+    jmp isr_common
+%endmacro
+
+isr_common:
+    push rax
+    push rcx
+    push rdx
+    push rsi
+    push rdi
+    push r8
+    push r9
+    push r10
+    push r11
+
+    ; Vector number sits above the nine saved registers
+    mov rdi, [rsp + 72]
+
+    ; Keep the stack 16-byte aligned across the C call
+    mov rsi, rsp
+    and rsp, -16
+    push rsi
+    sub rsp, 8
+    call cpu_interrupt_dispatch
+    add rsp, 8
+    pop rsp
+
+    pop r11
+    pop r10
+    pop r9
+    pop r8
+    pop rdi
+    pop rsi
+    pop rdx
+    pop rcx
+    pop rax
+
+    ; Drop vector number and error code
+    add rsp, 16
+    iretq
+
+%assign i 0
+%rep 256
+%if i == 8 || (i >= 10 && i <= 14) || i == 17 || i == 21 || i == 29 || i == 30
+    ISR_ERRCODE i
+%else
+    ISR_NOERRCODE i
+%endif
+%assign i i + 1
+%endrep
+
+section .rodata
+align 8
+isr_stub_table:
+%assign i 0
+%rep 256
+    dq isr_stub_ %+ i
+%assign i i + 1
+%endrep
@@ -1,16 +1,14 @@
 #include "console.h"
+#include "cpu.h"
+#include "fbcon.h"
+#include "kprintf.h"
 #include "types.h"
 
-#define VGA_ADDRESS 0xB8000
-#define VGA_WIDTH 80
-#define VGA_HEIGHT 25
-#define VGA_COLOR 0x0F
-
 #define SERIAL_PORT 0x3F8
 
-static uint16_t *vga_buffer = (uint16_t *)VGA_ADDRESS;
-static uint32_t vga_row = 0;
-static uint32_t vga_col = 0;
+static console_ring_t console_rings[CONSOLE_MAX_CPUS];
+static console_ring_t console_screen_rings[CONSOLE_MAX_CPUS];
+static console_state_t console_state = {0};
 
 static inline void serial_out(uint16_t port, uint8_t val) {
     asm volatile("out %0, %1" : : "a"(val), "Nd"(port));
@@ -37,11 +35,12 @@ void serial_init(void) {
     serial_write_string("CONCORDIA START\n");
 }
 
+// Polled output for boot, before the THRE interrupt is routed. The wait
+// is bounded so a missing UART cannot hang the hypervisor.
 void serial_write_string(const char *str) {
     while (*str) {
-        // Wait for transmit buffer
         int timeout = 10000;
-        while (timeout-- && ((serial_in(SERIAL_PORT + 5) & 0x20) == 0));
+        while (timeout-- && ((serial_in(SERIAL_PORT + UART_LSR) & UART_LSR_THRE) == 0));
         
         serial_out(SERIAL_PORT, *str);
         str++;
@@ -59,31 +58,247 @@ void console_init(void) {
 }
 
 void console_write_char(char c) {
-    serial_out(SERIAL_PORT, c);
+    char str[2] = { c, '\0' };
+    console_write(str);
+}
+
+static void console_arm_tx(void) {
+    if (__atomic_exchange_n(&console_state.tx_active, 1, __ATOMIC_ACQUIRE) == 0) {
+        // Re-arming ETBEI while THR is empty raises the interrupt at once
+        serial_out(SERIAL_PORT + UART_IER, 0);
+        serial_out(SERIAL_PORT + UART_IER, UART_IER_THRE);
+    }
+}
+
+static uint32_t console_ring_put(console_ring_t *ring, const char *str, uint32_t len) {
+    uint32_t head = ring->head;
+    uint32_t used = head - ring->tail;
+    if (len > CONSOLE_RING_SIZE - used) {
+        ring->dropped_writes++;
+        ring->dropped_bytes += len;
+        return 0;
+    }
+    
+    for (uint32_t i = 0; i < len; i++) {
+        ring->data[(head + i) & (CONSOLE_RING_SIZE - 1)] = str[i];
+    }
+    asm volatile("" ::: "memory");  // Bytes before index
+    ring->head = head + len;
+    if (used + len > ring->high_water) {
+        ring->high_water = used + len;
+    }
+    return len;
+}
+
+// Append a whole message to this CPU's ring, or refuse it: callers get the
+// byte count back (0 = backpressure) and never wait on the UART. Interrupts
+// are off only for the copy, since handlers on the same CPU log too. The
+// screen copy is refused on its own and never holds the serial one back.
+static uint32_t console_ring_append(const char *str, uint32_t len, uint8_t screen) {
+    uint64_t flags;
+    asm volatile("pushfq; pop %0; cli" : "=r"(flags) : : "memory");
     
-    if (c == '\n') {
-        vga_row++;
-        vga_col = 0;
-    } else {
-        uint32_t index = vga_row * VGA_WIDTH + vga_col;
-        vga_buffer[index] = (VGA_COLOR << 8) | c;
-        vga_col++;
+    uint32_t cpu = cpu_get_index() & (CONSOLE_MAX_CPUS - 1);
+    len = console_ring_put(&console_rings[cpu], str, len);
+    if (screen) {
+        console_ring_put(&console_screen_rings[cpu], str, len);
     }
     
-    if (vga_col >= VGA_WIDTH) {
-        vga_col = 0;
-        vga_row++;
+    asm volatile("push %0; popfq" : : "r"(flags) : "memory", "cc");
+    
+    if (len) {
+        console_arm_tx();
     }
+    return len;
+}
+
+// Screen plus serial; see console_ring_append() for backpressure. The
+// screen is drawn later, from the control loop.
+uint32_t console_write(const char *str) {
+    uint32_t len = 0;
+    while (str[len]) len++;
+    
+    console_capture_t capture = __atomic_load_n(&console_state.capture, __ATOMIC_ACQUIRE);
+    if (capture && cpu_get_index() == console_state.capture_cpu && !cpu_in_interrupt()) {
+        capture(str, len);
+        return len;
+    }
+    __atomic_add_fetch(&console_state.writes, 1, __ATOMIC_RELAXED);
     
-    if (vga_row >= VGA_HEIGHT) {
-        vga_row = VGA_HEIGHT - 1;
+    // Boot is single threaded with no handlers yet: draw in place
+    if (!console_state.async) {
+        serial_write_string(str);
+        fbcon_write(str);
+        fbcon_present();
+        console_state.screen_bytes += len;
+        return len;
     }
+    return console_ring_append(str, len, fbcon_is_active());
+}
+
+// Serial only, for output the screen gets separately (the dashboard keeps
+// one frame per device). Not counted in console_get_write_count().
+uint32_t console_write_serial(const char *str) {
+    uint32_t len = 0;
+    while (str[len]) len++;
+    
+    if (!console_state.async) {
+        serial_write_string(str);
+        return len;
+    }
+    return console_ring_append(str, len, 0);
 }
 
 void console_write_string(const char *str) {
-    while (*str) {
-        serial_out(SERIAL_PORT, *str++);
+    console_write(str);
+}
+
+// Next byte for the UART. Stays on one ring until it ends a line so
+// messages from different CPUs do not interleave mid-line; a ring that
+// runs dry before the newline gives up its turn (see console.h).
+static uint8_t console_next_byte(char *c) {
+    for (uint32_t n = 0; n < CONSOLE_MAX_CPUS; n++) {
+        console_ring_t *ring = &console_rings[console_state.tx_ring];
+        uint32_t tail = ring->tail;
+        if (tail != ring->head) {
+            *c = ring->data[tail & (CONSOLE_RING_SIZE - 1)];
+            ring->tail = tail + 1;
+            if (*c == '\n') {
+                console_state.tx_ring = (console_state.tx_ring + 1) & (CONSOLE_MAX_CPUS - 1);
+            }
+            return 1;
+        }
+        console_state.tx_ring = (console_state.tx_ring + 1) & (CONSOLE_MAX_CPUS - 1);
+    }
+    return 0;
+}
+
+uint32_t console_get_backlog(void) {
+    uint32_t backlog = 0;
+    for (uint32_t i = 0; i < CONSOLE_MAX_CPUS; i++) {
+        backlog += console_rings[i].head - console_rings[i].tail;
     }
+    return backlog;
+}
+
+// THR-empty handler: refill the whole TX FIFO, or disarm when every ring
+// is empty
+void console_handle_interrupt(void) {
+    if (serial_in(SERIAL_PORT + UART_IIR) & UART_IIR_NO_INT) {
+        return;
+    }
+    console_state.interrupts++;
+    
+    uint32_t sent = 0;
+    char c;
+    while (sent < console_state.fifo_size && console_next_byte(&c)) {
+        serial_out(SERIAL_PORT + UART_THR, c);
+        sent++;
+    }
+    console_state.bytes_sent += sent;
+    if (sent) {
+        return;
+    }
+    
+    serial_out(SERIAL_PORT + UART_IER, 0);
+    __atomic_store_n(&console_state.tx_active, 0, __ATOMIC_RELEASE);
+    // A writer that saw tx_active set before the store above did not arm
+    if (console_get_backlog()) {
+        console_arm_tx();
+    }
+}
+
+// Route COM1's IRQ through the IOAPIC and switch every later write to the
+// rings. Called once interrupt handling is about to be enabled.
+void console_enable_async(void) {
+    if (serial_in(SERIAL_PORT + UART_LSR) == UART_LSR_ABSENT) {
+        serial_write_string("WARNING: No UART, console stays polled\n");
+        return;
+    }
+    
+    serial_out(SERIAL_PORT + UART_IER, 0);
+    serial_out(SERIAL_PORT + UART_FCR, UART_FCR_ENABLE_CLEAR);
+    console_state.fifo_size = (serial_in(SERIAL_PORT + UART_IIR) & UART_IIR_FIFO_MASK) == UART_IIR_FIFO_MASK ?
+                              UART_FIFO_SIZE : 1;
+    serial_out(SERIAL_PORT + UART_MCR, UART_MCR_DTR_RTS_OUT2);
+    
+    cpu_register_interrupt_handler(VECTOR_SERIAL, console_handle_interrupt);
+    if (!cpu_route_isa_irq(SERIAL_ISA_IRQ, VECTOR_SERIAL)) {
+        serial_write_string("WARNING: No IOAPIC for the UART, console stays polled\n");
+        return;
+    }
+    console_state.async = 1;
+}
+
+// Divert this CPU's console output, e.g. to compose a frame in memory.
+// Writes from other CPUs, and from interrupt handlers on this one, still
+// reach the devices, so the capture needs no interrupts off.
+void console_begin_capture(console_capture_t capture) {
+    console_state.capture_cpu = cpu_get_index();
+    __atomic_store_n(&console_state.capture, capture, __ATOMIC_RELEASE);
+}
+
+void console_end_capture(void) {
+    __atomic_store_n(&console_state.capture, 0, __ATOMIC_RELEASE);
+}
+
+// Changes whenever anything reaches the terminal, so a screen owner can
+// tell whether someone else has written since its last frame
+uint64_t console_get_write_count(void) {
+    return console_state.writes;
+}
+
+// Hand what every CPU queued for the screen to fbcon. Control loop only:
+// it is the one reader of the screen rings and the one fbcon writer.
+void console_render_screen(void) {
+    char chunk[CONSOLE_SCREEN_CHUNK + 1];
+    
+    for (uint32_t i = 0; i < CONSOLE_MAX_CPUS; i++) {
+        console_ring_t *ring = &console_screen_rings[i];
+        uint32_t head = ring->head;
+        uint32_t tail = ring->tail;
+        asm volatile("" ::: "memory");  // Index before bytes
+        
+        while (tail != head) {
+            uint32_t n = 0;
+            while (tail != head && n < CONSOLE_SCREEN_CHUNK) {
+                chunk[n++] = ring->data[tail & (CONSOLE_RING_SIZE - 1)];
+                tail++;
+            }
+            chunk[n] = '\0';
+            fbcon_write(chunk);
+            console_state.screen_bytes += n;
+        }
+        ring->tail = tail;
+    }
+}
+
+// Like console_get_write_count(), for text that has reached the screen
+uint64_t console_get_screen_count(void) {
+    return console_state.screen_bytes;
+}
+
+void console_print_stats(void) {
+    uint32_t dropped_writes = 0;
+    uint32_t dropped_bytes = 0;
+    uint32_t high_water = 0;
+    for (uint32_t i = 0; i < CONSOLE_MAX_CPUS; i++) {
+        dropped_writes += console_rings[i].dropped_writes;
+        dropped_bytes += console_rings[i].dropped_bytes;
+        if (console_rings[i].high_water > high_water) {
+            high_water = console_rings[i].high_water;
+        }
+    }
+    
+    uint32_t screen_dropped = 0;
+    for (uint32_t i = 0; i < CONSOLE_MAX_CPUS; i++) {
+        screen_dropped += console_screen_rings[i].dropped_bytes;
+    }
+    
+    kprintf("Console: %s, backlog %u bytes, high water %u, dropped %u bytes in %u writes, %u THRE interrupts\n",
+            console_state.async ? "async" : "polled", console_get_backlog(), high_water,
+            dropped_bytes, dropped_writes, console_state.interrupts);
+    kprintf("  Screen: %lu bytes rendered, %u dropped\n", console_state.screen_bytes, screen_dropped);
 }
 
 void itoa(int value, char *str, int base) {
@@ -124,16 +339,10 @@ void console_write_hex(uint64_t value) {
     int i = 15;
     buf[16] = '\0';
     
-    if (value == 0) {
-        serial_out(SERIAL_PORT, '0');
-        return;
-    }
-    
-    while (value > 0 && i >= 0) {
-        buf[i] = digits[value & 0xF];
+    do {
+        buf[i--] = digits[value & 0xF];
         value >>= 4;
-        i--;
-    }
+    } while (value > 0 && i >= 0);
     
     console_write_string(&buf[i + 1]);
 }
@@ -7,7 +7,80 @@ void console_init(void);
 void console_write_char(char c);
 void console_write_string(const char *str);
 void serial_write_string(const char *str);
+// 32-bit only: wider values are truncated, use kprintf for them
 void itoa(int value, char *str, int base);
 void console_write_hex(uint64_t value);
 
+// Asynchronous serial output. Each CPU appends to its own ring; the
+// 16550 THR-empty interrupt drains them a FIFO's worth at a time. Until
+// console_enable_async() runs, writes go straight to the UART.
+//
+// Atomicity is per call. One console_write() (and so one kprintf) lands
+// in the ring whole or not at all, and a message ending in '\n' is never
+// split by another CPU's output. A line assembled from several calls has
+// no such guarantee: a handler on the same CPU can log between the parts,
+// a full ring can refuse some parts and take others, and the drain moves
+// to another CPU's ring whenever this one runs dry mid-line. Output that
+// must stay on one line goes through a single kprintf.
+//
+// The screen has a second set of rings, filled by the same append and
+// rendered by the control loop, so no writer ever draws.
+#define CONSOLE_MAX_CPUS 32
+#define CONSOLE_RING_SIZE 4096  // Per CPU, power of two
+#define UART_FIFO_SIZE 16
+#define CONSOLE_SCREEN_CHUNK 256  // Bytes handed to fbcon per call
+
+// 16550 registers (offsets from the base port) and bits
+#define UART_THR 0
+#define UART_IER 1
+#define UART_IIR 2
+#define UART_FCR 2
+#define UART_MCR 4
+#define UART_LSR 5
+#define UART_IER_THRE 0x02
+#define UART_IIR_NO_INT 0x01
+#define UART_IIR_FIFO_MASK 0xC0
+#define UART_FCR_ENABLE_CLEAR 0x07  // Enable FIFOs, clear RX and TX
+#define UART_MCR_DTR_RTS_OUT2 0x0B  // OUT2 gates the IRQ line
+#define UART_LSR_THRE 0x20
+#define UART_LSR_ABSENT 0xFF
+#define SERIAL_ISA_IRQ 4
+
+typedef struct {
+    char data[CONSOLE_RING_SIZE];
+    volatile uint32_t head;   // Written only by the owning CPU
+    volatile uint32_t tail;   // Written only by the THRE handler (screen: the control loop)
+    uint32_t dropped_writes;  // Messages refused because the ring was full
+    uint32_t dropped_bytes;
+    uint32_t high_water;
+} console_ring_t;
+
+// Receives writes made on the capturing CPU, outside interrupt handlers,
+// instead of the devices
+typedef void (*console_capture_t)(const char *str, uint32_t len);
+
+typedef struct {
+    uint8_t async;
+    uint8_t fifo_size;
+    volatile uint32_t tx_active;  // THRE interrupt armed
+    uint32_t tx_ring;             // Ring being drained (sticky until newline)
+    uint32_t interrupts;
+    uint64_t bytes_sent;
+    console_capture_t capture;
+    uint32_t capture_cpu;
+    uint64_t writes;              // Messages that reached the devices
+    uint64_t screen_bytes;        // Bytes rendered from the screen rings
+} console_state_t;
+
+uint32_t console_write(const char *str);
+uint32_t console_write_serial(const char *str);
+void console_enable_async(void);
+void console_handle_interrupt(void);
+uint32_t console_get_backlog(void);
+void console_print_stats(void);
+void console_begin_capture(console_capture_t capture);
+void console_end_capture(void);
+uint64_t console_get_write_count(void);
+void console_render_screen(void);
+uint64_t console_get_screen_count(void);
 #endif
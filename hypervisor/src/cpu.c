@@ -1,6 +1,8 @@
 #include "cpu.h"
 #include "console.h"
 #include "types.h"
+#include "acpi.h"
+#include "kprintf.h"
 
 #define MSR_EFER 0xC0000080
 #define MSR_STAR 0xC0000081
@@ -9,8 +11,43 @@
 #define MSR_SFMASK 0xC0000084
 #define MSR_GSBASE 0xC0000101
 #define MSR_KERNELGSBASE 0xC0000102
+#define MSR_TSC_AUX 0xC0000103
 #define MSR_APIC_BASE 0x1B
 #define IA32_FEATURE_CONTROL 0x3A
+#define MSR_PAT 0x277
+#define PAT_TYPE_WC 0x01
+#define MSR_MPERF 0xE7
+#define MSR_APERF 0xE8
+
+// Core performance counters. Both vendors' rdpmc index 0 and 1 name the
+// first two counters programmed below.
+#define AMD_PERF_CTL_LEGACY 0xC0010000
+#define AMD_PERF_CTL_EXT 0xC0010200   // PerfCtrExtCore: CTL/CTR pairs
+#define INTEL_PERFEVTSEL0 0x186
+#define INTEL_PERF_GLOBAL_CTRL 0x38F
+#define PERFEVTSEL_USR (1UL << 16)
+#define PERFEVTSEL_OS (1UL << 17)
+#define PERFEVTSEL_EN (1UL << 22)
+#define AMD_EVENT_RETIRED_INSTRUCTIONS 0x00C0
+#define AMD_EVENT_DRAM_DEMAND_FILLS 0x4843  // PMCx043, local + remote DRAM
+#define INTEL_EVENT_RETIRED_INSTRUCTIONS 0x00C0
+#define INTEL_EVENT_LLC_MISSES 0x412E
+#define CPUID_VENDOR_AMD 0x68747541    // "Auth"
+#define CPUID_VENDOR_INTEL 0x756E6547  // "Genu"
+
+// PIT channel 2, gated through port 0x61, for TSC calibration
+#define PIT_FREQUENCY_HZ 1193182
+#define PIT_CHANNEL2 0x42
+#define PIT_COMMAND 0x43
+#define PIT_GATE 0x61
+#define PIT_CALIBRATE_MS 10
+
+// 8259 pair, remapped clear of the exception vectors and then masked
+#define PIC1_COMMAND 0x20
+#define PIC1_DATA 0x21
+#define PIC2_COMMAND 0xA0
+#define PIC2_DATA 0xA1
+#define PIC_VECTOR_BASE 0x20
 
 #define APIC_ID_REG 0x20
 #define CPUID_FEATURES 0x1
@@ -18,6 +55,23 @@
 
 static cpu_info_t cpu_list[MAX_CPUS];
 static uint32_t cpu_count = 0;
+static uint8_t rdtscp_supported = 0;
+static uint32_t tsc_mhz = 0;
+static uint32_t lapic_timer_hz = 0;
+static uint8_t counter_features = 0;  // CPU_COUNTER_*, same on every core
+
+static idt_entry_t idt[IDT_ENTRIES] __attribute__((aligned(16)));
+static interrupt_handler_t interrupt_handlers[IDT_ENTRIES];
+static uint32_t unhandled_interrupts = 0;
+
+// External interrupts taken by each CPU, each counter on its own line
+static struct {
+    uint64_t count;
+    uint32_t depth;  // Handlers running on this CPU, exceptions included
+} __attribute__((aligned(64))) interrupt_counts[MAX_CPUS];
+
+// Entry stubs from boot/isr.s
+extern uint64_t isr_stub_table[IDT_ENTRIES];
 
 static inline uint64_t read_msr(uint32_t msr) {
     uint32_t low, high;
@@ -53,11 +107,27 @@ static inline void lidt(const gdt_descriptor_t *desc) {
 void cpu_detect_cores(void) {
     uint32_t eax, ebx, ecx, edx;
     
+    // The MADT lists every enabled logical CPU with its APIC ID
+    const acpi_info_t *acpi = acpi_get_info();
+    if (acpi->cpu_count > 0) {
+        cpu_count = acpi->cpu_count < MAX_CPUS ? acpi->cpu_count : MAX_CPUS;
+        for (uint32_t i = 0; i < cpu_count; i++) {
+            cpu_list[i].apic_id = acpi->cpus[i].apic_id;
+            cpu_list[i].core_id = i;
+            cpu_list[i].package_id = 0;
+            cpu_list[i].assigned_to_linux = cpu_is_linux_core(acpi->cpus[i].apic_id);
+            cpu_list[i].online = 1;
+        }
+        return;
+    }
+    
+    log_warn("No MADT, falling back to CPUID core count\n");
+    
     // Get CPUID leaf 0x0B (Extended Topology Enumeration)
     cpuid(0x0, &eax, &ebx, &ecx, &edx);
     
     if (eax < 0x0B) {
-        console_write_string("WARNING: CPUID leaf 0x0B not supported, using basic detection\n");
+        log_warn("CPUID leaf 0x0B not supported, using basic detection\n");
         // Fallback: detect from CPUID 1
         cpuid(CPUID_FEATURES, &eax, &ebx, &ecx, &edx);
         uint32_t max_cores = (ebx >> 16) & 0xFF;
@@ -71,12 +141,93 @@ void cpu_detect_cores(void) {
     cpu_count = (num_threads > 0) ? num_threads : 1;
 }
 
+uint32_t cpu_get_count(void) {
+    return cpu_count;
+}
+
+const cpu_info_t *cpu_get_info(uint32_t index) {
+    return index < cpu_count ? &cpu_list[index] : 0;
+}
+
 uint32_t cpu_get_apic_id(void) {
     uint32_t eax, ebx, ecx, edx;
     cpuid(CPUID_FEATURES, &eax, &ebx, &ecx, &edx);
     return (ebx >> 24) & 0xFF;
 }
 
+// Index of the executing CPU in cpu_list, for per-CPU data. RDTSCP reads
+// it back from TSC_AUX without the VM exit CPUID costs under a hypervisor.
+uint32_t cpu_get_index(void) {
+    if (!rdtscp_supported) {
+        return 0;
+    }
+    uint32_t low, high, aux;
+    asm volatile("rdtscp" : "=a"(low), "=d"(high), "=c"(aux));
+    return aux;
+}
+
+static inline uint8_t port_in(uint16_t port) {
+    uint8_t value;
+    asm volatile("inb %1, %0" : "=a"(value) : "Nd"(port));
+    return value;
+}
+
+static inline void port_out(uint16_t port, uint8_t value) {
+    asm volatile("outb %0, %1" : : "a"(value), "Nd"(port));
+}
+
+// Count TSC cycles across a one-shot PIT countdown; 0 if it never fires
+static uint32_t cpu_calibrate_tsc(void) {
+    uint16_t count = PIT_FREQUENCY_HZ / (1000 / PIT_CALIBRATE_MS);
+    uint8_t gate = port_in(PIT_GATE);
+    port_out(PIT_GATE, (gate & ~0x02) | 0x01);  // Gate on, speaker off
+    port_out(PIT_COMMAND, 0xB0);                // Channel 2, lo/hi, mode 0
+    port_out(PIT_CHANNEL2, count & 0xFF);
+    port_out(PIT_CHANNEL2, count >> 8);
+    
+    uint64_t start = cpu_read_tsc();
+    uint32_t timeout = 100000000;
+    while (!(port_in(PIT_GATE) & 0x20) && --timeout);
+    uint64_t cycles = cpu_read_tsc() - start;
+    port_out(PIT_GATE, gate);
+    
+    return timeout ? (uint32_t)(cycles / (PIT_CALIBRATE_MS * 1000)) : 0;
+}
+
+// Nominal TSC rate from CPUID 0x15 (crystal ratio) or 0x16 (base
+// frequency). AMD parts report neither, so the TSC is timed against the
+// PIT instead. Cached after the first call.
+uint32_t cpu_get_tsc_mhz(void) {
+    if (tsc_mhz) {
+        return tsc_mhz;
+    }
+    
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(0x0, &eax, &ebx, &ecx, &edx);
+    uint32_t max_leaf = eax;
+    
+    if (max_leaf >= 0x15) {
+        cpuid(0x15, &eax, &ebx, &ecx, &edx);
+        if (eax && ebx && ecx) {
+            tsc_mhz = (uint32_t)((uint64_t)ecx * ebx / eax / 1000000);
+        }
+    }
+    if (!tsc_mhz && max_leaf >= 0x16) {
+        cpuid(0x16, &eax, &ebx, &ecx, &edx);
+        tsc_mhz = eax & 0xFFFF;
+    }
+    if (!tsc_mhz) {
+        tsc_mhz = cpu_calibrate_tsc();
+    }
+    return tsc_mhz;
+}
+
+uint64_t cpu_read_tsc(void) {
+    uint32_t low, high;
+    asm volatile("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t)high << 32) | low;
+}
+
 uint8_t cpu_is_linux_core(uint32_t apic_id) {
     return (apic_id >= LINUX_CORES_START && apic_id <= LINUX_CORES_END) ? 1 : 0;
 }
@@ -117,6 +268,36 @@ void cpu_enable_features(void) {
         write_msr(MSR_EFER, efer);
         console_write_string("NX bit enabled\n");
     }
+    
+    // Tag this CPU for cpu_get_index
+    if (edx & (1 << 27)) {
+        uint32_t apic_id = cpu_get_apic_id();
+        uint32_t index = 0;
+        for (uint32_t i = 0; i < cpu_count; i++) {
+            if (cpu_list[i].apic_id == apic_id) {
+                index = i;
+                break;
+            }
+        }
+        write_msr(MSR_TSC_AUX, index);
+        rdtscp_supported = 1;
+    }
+}
+
+// Turn PAT entry 1 (selected by PWT alone, write-through by default) into
+// write-combining. Nothing the hypervisor maps before this sets PWT.
+uint8_t cpu_enable_write_combining(void) {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(CPUID_FEATURES, &eax, &ebx, &ecx, &edx);
+    if (!(edx & (1 << 16))) {
+        return 0;
+    }
+    
+    uint64_t pat = read_msr(MSR_PAT);
+    pat = (pat & ~(0xFFUL << 8)) | ((uint64_t)PAT_TYPE_WC << 8);
+    asm volatile("wbinvd" ::: "memory");
+    write_msr(MSR_PAT, pat);
+    return 1;
 }
 
 void cpu_setup_gdt(void) {
@@ -128,10 +309,230 @@ void cpu_setup_gdt(void) {
     console_write_string("GDT already set in boot code\n");
 }
 
+static inline uint32_t lapic_read(uint32_t reg) {
+    return *(volatile uint32_t *)(LAPIC_BASE + reg);
+}
+
+static inline void lapic_write(uint32_t reg, uint32_t value) {
+    *(volatile uint32_t *)(LAPIC_BASE + reg) = value;
+}
+
+void cpu_lapic_eoi(void) {
+    lapic_write(LAPIC_EOI, 0);
+}
+
+// Program this core's counters: APERF/MPERF where CPUID 6 has them, and
+// two general counters for retired instructions and LLC misses. Must run
+// on every core that samples; returns the CPU_COUNTER_* set available.
+uint8_t cpu_counters_enable(void) {
+    uint32_t eax, ebx, ecx, edx;
+    uint8_t features = 0;
+    
+    cpuid(0x0, &eax, &ebx, &ecx, &edx);
+    uint32_t max_leaf = eax;
+    uint32_t vendor = ebx;
+    
+    if (max_leaf >= 0x6) {
+        cpuid(0x6, &eax, &ebx, &ecx, &edx);
+        if (ecx & 0x1) features |= CPU_COUNTER_APERF_MPERF;
+    }
+    
+    uint64_t enable = PERFEVTSEL_EN | PERFEVTSEL_USR | PERFEVTSEL_OS;
+    if (vendor == CPUID_VENDOR_AMD) {
+        cpuid(CPUID_EXTENDED, &eax, &ebx, &ecx, &edx);
+        uint8_t ext = (ecx & (1 << 23)) != 0;
+        uint32_t ctl = ext ? AMD_PERF_CTL_EXT : AMD_PERF_CTL_LEGACY;
+        uint32_t stride = ext ? 2 : 1;
+        uint32_t ctr = ext ? AMD_PERF_CTL_EXT + 1 : AMD_PERF_CTL_LEGACY + 4;
+        write_msr(ctl, 0);
+        write_msr(ctl + stride, 0);
+        write_msr(ctr, 0);
+        write_msr(ctr + stride, 0);
+        write_msr(ctl, enable | AMD_EVENT_RETIRED_INSTRUCTIONS);
+        write_msr(ctl + stride, enable | AMD_EVENT_DRAM_DEMAND_FILLS);
+        features |= CPU_COUNTER_PMC;
+    } else if (vendor == CPUID_VENDOR_INTEL && max_leaf >= 0xA) {
+        cpuid(0xA, &eax, &ebx, &ecx, &edx);
+        uint32_t version = eax & 0xFF;
+        uint32_t counters = (eax >> 8) & 0xFF;
+        if (version >= 1 && counters >= 2) {
+            write_msr(INTEL_PERFEVTSEL0, enable | INTEL_EVENT_RETIRED_INSTRUCTIONS);
+            write_msr(INTEL_PERFEVTSEL0 + 1, enable | INTEL_EVENT_LLC_MISSES);
+            if (version >= 2) {
+                write_msr(INTEL_PERF_GLOBAL_CTRL, read_msr(INTEL_PERF_GLOBAL_CTRL) | 0x3);
+            }
+            features |= CPU_COUNTER_PMC;
+        }
+    }
+    counter_features = features;
+    return features;
+}
+
+static inline uint64_t rdpmc(uint32_t index) {
+    uint32_t low, high;
+    asm volatile("rdpmc" : "=a"(low), "=d"(high) : "c"(index));
+    return ((uint64_t)high << 32) | low;
+}
+
+// Raw values for the calling core; counters it lacks read as zero
+void cpu_counters_read(cpu_counters_t *counters) {
+    counters->tsc = cpu_read_tsc();
+    counters->aperf = 0;
+    counters->mperf = 0;
+    counters->instructions = 0;
+    counters->llc_misses = 0;
+    if (counter_features & CPU_COUNTER_APERF_MPERF) {
+        // MPERF first: the pair is read as close together as possible
+        counters->mperf = read_msr(MSR_MPERF);
+        counters->aperf = read_msr(MSR_APERF);
+    }
+    if (counter_features & CPU_COUNTER_PMC) {
+        counters->instructions = rdpmc(0);
+        counters->llc_misses = rdpmc(1);
+    }
+}
+
+// Periodic local APIC timer on the calling core. The timer rate is
+// measured against the TSC once; every core shares the same bus clock.
+uint8_t cpu_start_local_timer(uint8_t vector, uint32_t hz) {
+    if (!hz) return 0;
+    
+    lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_16);
+    if (!lapic_timer_hz) {
+        uint32_t mhz = cpu_get_tsc_mhz();
+        if (!mhz) return 0;
+        
+        lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED | vector);
+        lapic_write(LAPIC_TIMER_INITIAL, 0xFFFFFFFF);
+        uint64_t start = cpu_read_tsc();
+        while (cpu_read_tsc() - start < (uint64_t)mhz * 10000);  // 10ms
+        uint32_t elapsed = 0xFFFFFFFF - lapic_read(LAPIC_TIMER_CURRENT);
+        lapic_write(LAPIC_TIMER_INITIAL, 0);
+        lapic_timer_hz = elapsed * 100;
+    }
+    
+    uint32_t initial = lapic_timer_hz / hz;
+    if (!initial) return 0;
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_PERIODIC | vector);
+    lapic_write(LAPIC_TIMER_INITIAL, initial);
+    return 1;
+}
+
+static inline uint32_t ioapic_read(uint64_t base, uint32_t reg) {
+    *(volatile uint32_t *)(base + IOAPIC_REG_SELECT) = reg;
+    return *(volatile uint32_t *)(base + IOAPIC_REG_WINDOW);
+}
+
+static inline void ioapic_write(uint64_t base, uint32_t reg, uint32_t value) {
+    *(volatile uint32_t *)(base + IOAPIC_REG_SELECT) = reg;
+    *(volatile uint32_t *)(base + IOAPIC_REG_WINDOW) = value;
+}
+
+// Deliver a legacy ISA IRQ to this CPU through the IOAPIC; the 8259 pair
+// was masked in cpu_setup_idt(). ISA IRQs are assumed
+// identity-mapped to GSIs (MADT source overrides only move IRQ0 in practice).
+uint8_t cpu_route_isa_irq(uint8_t irq, uint8_t vector) {
+    const acpi_info_t *acpi = acpi_get_info();
+    
+    for (uint32_t i = 0; i < acpi->ioapic_count; i++) {
+        uint64_t base = acpi->ioapics[i].address;
+        uint32_t entries = ((ioapic_read(base, IOAPIC_REG_VERSION) >> 16) & 0xFF) + 1;
+        if (irq < acpi->ioapics[i].gsi_base || irq >= acpi->ioapics[i].gsi_base + entries) {
+            continue;
+        }
+        
+        // Fixed delivery, physical destination, edge-triggered, active high
+        uint32_t reg = IOAPIC_REDIRECTION_BASE + 2 * (irq - acpi->ioapics[i].gsi_base);
+        ioapic_write(base, reg, IOAPIC_MASKED);
+        ioapic_write(base, reg + 1, cpu_get_apic_id() << 24);
+        ioapic_write(base, reg, vector);
+        return 1;
+    }
+    return 0;
+}
+
+void cpu_register_interrupt_handler(uint8_t vector, interrupt_handler_t handler) {
+    interrupt_handlers[vector] = handler;
+}
+
+// Called from isr_common with the vector number
+void cpu_interrupt_dispatch(uint64_t vector) {
+    interrupt_handler_t handler = interrupt_handlers[vector & 0xFF];
+    uint32_t index = cpu_get_index() & (MAX_CPUS - 1);
+    
+    interrupt_counts[index].depth++;
+    if (handler) {
+        handler();
+    } else {
+        unhandled_interrupts++;
+    }
+    interrupt_counts[index].depth--;
+    
+    // Exceptions and the spurious vector take no EOI
+    if (vector >= 32 && vector != VECTOR_SPURIOUS) {
+        interrupt_counts[index].count++;
+        cpu_lapic_eoi();
+    }
+}
+
+// Whether the executing CPU is inside a handler dispatched above. Only
+// this CPU writes its depth, so no locking is needed to read it.
+uint8_t cpu_in_interrupt(void) {
+    return interrupt_counts[cpu_get_index() & (MAX_CPUS - 1)].depth != 0;
+}
+
+// Interrupts the hypervisor handled on one CPU. Device interrupts posted
+// straight to a cell are not seen here.
+uint64_t cpu_get_interrupt_count(uint32_t index) {
+    return index < MAX_CPUS ? interrupt_counts[index].count : 0;
+}
+
+// The BIOS leaves the 8259s on vectors 8-15, where IRQ0 would land on the
+// #DF stub. Move them to PIC_VECTOR_BASE (a spurious IRQ7/15 can still
+// arrive while masked) and mask every line; devices go through the IOAPIC.
+static void cpu_disable_pic(void) {
+    port_out(PIC1_COMMAND, 0x11);  // ICW1: edge, cascade, ICW4 follows
+    port_out(PIC2_COMMAND, 0x11);
+    port_out(PIC1_DATA, PIC_VECTOR_BASE);      // ICW2: vector base
+    port_out(PIC2_DATA, PIC_VECTOR_BASE + 8);
+    port_out(PIC1_DATA, 0x04);     // ICW3: slave on IRQ2
+    port_out(PIC2_DATA, 0x02);
+    port_out(PIC1_DATA, 0x01);     // ICW4: 8086 mode
+    port_out(PIC2_DATA, 0x01);
+    port_out(PIC1_DATA, 0xFF);
+    port_out(PIC2_DATA, 0xFF);
+}
+
 void cpu_setup_idt(void) {
-    // Create IDT for basic exception handling
-    // For now, this is a placeholder
-    console_write_string("IDT setup: TODO\n");
+    cpu_disable_pic();
+    
+    // Point every vector at its stub from isr.s; handlers are attached
+    // later by the subsystems that own each vector
+    for (int i = 0; i < IDT_ENTRIES; i++) {
+        uint64_t addr = isr_stub_table[i];
+        idt[i].offset_low = addr & 0xFFFF;
+        idt[i].selector = KERNEL_CODE_SELECTOR;
+        idt[i].ist = 0;
+        idt[i].type_attr = 0x8E;  // Present, DPL 0, 64-bit interrupt gate
+        idt[i].offset_mid = (addr >> 16) & 0xFFFF;
+        idt[i].offset_high = (addr >> 32) & 0xFFFFFFFF;
+        idt[i].reserved = 0;
+        interrupt_handlers[i] = 0;
+    }
+    
+    gdt_descriptor_t desc;
+    desc.limit = sizeof(idt) - 1;
+    desc.base = (uint64_t)idt;
+    lidt(&desc);
+    
+    // Software-enable the local APIC so MSIs can be delivered
+    lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | VECTOR_SPURIOUS);
+    
+    console_write_string("IDT loaded, local APIC ID ");
+    char buf[32];
+    itoa(lapic_read(LAPIC_ID) >> 24, buf, 10);
+    console_write_string(buf);
+    console_write_string("\n");
 }
 
 void cpu_init(void) {
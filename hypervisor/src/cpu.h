@@ -17,10 +17,61 @@ typedef struct {
     uint8_t online;
 } cpu_info_t;
 
+// Local APIC (xAPIC MMIO)
+#define LAPIC_BASE 0xFEE00000UL
+#define LAPIC_ID 0x020
+#define LAPIC_EOI 0x0B0
+#define LAPIC_SVR 0x0F0
+#define LAPIC_SVR_ENABLE (1U << 8)
+#define LAPIC_LVT_TIMER 0x320
+#define LAPIC_TIMER_INITIAL 0x380
+#define LAPIC_TIMER_CURRENT 0x390
+#define LAPIC_TIMER_DIVIDE 0x3E0
+#define LAPIC_TIMER_DIVIDE_16 0x3
+#define LAPIC_TIMER_PERIODIC (1U << 17)
+#define LAPIC_LVT_MASKED (1U << 16)
+
+// MSI address/data for fixed, edge-triggered delivery to one APIC
+#define MSI_ADDRESS(apic_id) (0xFEE00000U | ((uint32_t)(apic_id) << 12))
+#define MSI_DATA(vector) ((uint32_t)(vector))
+#define MSI_DEST_MASK 0x000FF000U
+
+// IOAPIC indirect registers; redirection entries are two dwords each
+#define IOAPIC_REG_SELECT 0x00
+#define IOAPIC_REG_WINDOW 0x10
+#define IOAPIC_REG_VERSION 0x01
+#define IOAPIC_REDIRECTION_BASE 0x10
+#define IOAPIC_MASKED (1U << 16)
+
+// Interrupt vectors owned by the hypervisor
+#define IDT_ENTRIES 256
+#define KERNEL_CODE_SELECTOR 0x08
+#define VECTOR_IOMMU_EVENT 0x40
+#define VECTOR_XHCI 0x41
+#define VECTOR_SERIAL 0x42
+#define VECTOR_MONITOR_TIMER 0x43
+#define VECTOR_METRICS_EXPORT 0x44
+#define VECTOR_SPURIOUS 0xFF
+
+typedef void (*interrupt_handler_t)(void);
+
+// Per-core counters, read on the core they belong to
+#define CPU_COUNTER_APERF_MPERF 0x1
+#define CPU_COUNTER_PMC 0x2
+#define CPU_PMC_MASK ((1UL << 48) - 1)  // Programmable counters are 48 bits
+
+typedef struct {
+    uint64_t tsc;
+    uint64_t aperf;         // Actual cycles in C0
+    uint64_t mperf;         // TSC-rate cycles in C0
+    uint64_t instructions;  // Retired, user and kernel
+    uint64_t llc_misses;    // Demand fills from DRAM on AMD, LLC misses on Intel
+} cpu_counters_t;
+
 typedef struct {
-    uint64_t base;
     uint16_t limit;
-} gdt_descriptor_t;
+    uint64_t base;
+} __attribute__((packed)) gdt_descriptor_t;
 
 typedef struct {
     uint16_t offset_low;
@@ -53,10 +104,25 @@ typedef struct {
 
 void cpu_init(void);
 void cpu_detect_cores(void);
+uint32_t cpu_get_count(void);
+const cpu_info_t *cpu_get_info(uint32_t index);
 uint32_t cpu_get_apic_id(void);
+uint32_t cpu_get_index(void);
 uint8_t cpu_is_linux_core(uint32_t apic_id);
 void cpu_setup_gdt(void);
 void cpu_setup_idt(void);
 void cpu_enable_features(void);
+uint8_t cpu_enable_write_combining(void);
+void cpu_register_interrupt_handler(uint8_t vector, interrupt_handler_t handler);
+void cpu_interrupt_dispatch(uint64_t vector);
+uint8_t cpu_in_interrupt(void);
+void cpu_lapic_eoi(void);
+uint8_t cpu_route_isa_irq(uint8_t irq, uint8_t vector);
+uint64_t cpu_get_interrupt_count(uint32_t index);
+uint64_t cpu_read_tsc(void);
+uint32_t cpu_get_tsc_mhz(void);
+uint8_t cpu_counters_enable(void);
+void cpu_counters_read(cpu_counters_t *counters);
+uint8_t cpu_start_local_timer(uint8_t vector, uint32_t hz);
 
 #endif
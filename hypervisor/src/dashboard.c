@@ -1,10 +1,25 @@
 #include "dashboard.h"
 #include "console.h"
 #include "monitor.h"
+#include "iommu.h"
 #include "system_manager.h"
+#include "memory.h"
+#include "kprintf.h"
+#include "fbcon.h"
+#include "cpu.h"
 #include "types.h"
 
 static dashboard_t dashboard = {0};
+static uint32_t dashboard_frame[DASHBOARD_ROWS][DASHBOARD_COLS];
+static dashboard_output_t dashboard_outputs[DASHBOARD_OUTPUTS];
+static system_metrics_t dashboard_metrics;  // Snapshot the frame is drawn from
+
+static uint32_t dashboard_write_screen(const char *str) {
+    uint32_t len = 0;
+    while (str[len]) len++;
+    fbcon_write(str);
+    return len;
+}
 
 void dashboard_init(void) {
     console_write_string("Initializing Dashboard...\n");
@@ -14,6 +29,20 @@ void dashboard_init(void) {
     dashboard.refresh_count = 0;
     dashboard.last_refresh_time = 0;
     
+    dashboard_output_t *serial = &dashboard_outputs[DASHBOARD_OUTPUT_SERIAL];
+    serial->name = "Serial";
+    serial->write = console_write_serial;
+    serial->console_count = console_get_write_count;
+    serial->interval_ms = DASHBOARD_SERIAL_INTERVAL_MS;
+    serial->max_backlog = DASHBOARD_SERIAL_MAX_BACKLOG;
+    
+    // Without a framebuffer or VGA text the screen output stays off
+    dashboard_output_t *screen = &dashboard_outputs[DASHBOARD_OUTPUT_SCREEN];
+    screen->name = "Screen";
+    screen->write = fbcon_is_active() ? dashboard_write_screen : 0;
+    screen->console_count = console_get_screen_count;
+    screen->interval_ms = DASHBOARD_SCREEN_INTERVAL_MS;
+    
     console_write_string("Dashboard initialized (mode: summary)\n");
 }
 
@@ -30,6 +59,7 @@ void dashboard_disable(void) {
 void dashboard_set_mode(uint8_t mode) {
     if (mode >= 3) return;
     dashboard.mode = mode;
+    dashboard.stale = 1;
 }
 
 void dashboard_draw_header(void) {
@@ -40,42 +70,66 @@ void dashboard_draw_header(void) {
     console_write_string("\n");
 }
 
+// Allocation includes lent frames; usage is the monitor's 1 min working set
+static void dashboard_draw_memory(uint8_t cell_id) {
+    const cell_metrics_t *cell = cell_id == 0 ? &dashboard_metrics.linux_metrics : &dashboard_metrics.windows_metrics;
+    uint64_t capacity = memory_get_cell_capacity(cell_id);
+    uint32_t percent = capacity ? (uint32_t)(cell->memory_used * 100 / capacity) : 0;
+    
+    if (!cell->memory_sampled) {
+        kprintf("│ Memory:        %2lu GB allocated, n/a in use                 │\n", capacity >> 30);
+        return;
+    }
+    kprintf("│ Memory:        %2lu GB allocated, %5lu MB in use (%3u%%)     │\n",
+            capacity >> 30, cell->memory_used >> 20, percent);
+}
+
+// Load over the cell's sampled cores; a cell whose cores never started
+// the sampler says so instead of showing 0%
+static void dashboard_draw_cpu(uint8_t cell_id) {
+    const cell_metrics_t *cell = cell_id == 0 ? &dashboard_metrics.linux_metrics : &dashboard_metrics.windows_metrics;
+    char text[48];
+    
+    if (cell->cores_sampled) {
+        ksnprintf(text, sizeof(text), "%u%% on %u cores, %u MHz",
+                  cell->cpu_load_percent, cell->cores_sampled, cell->effective_mhz);
+    } else {
+        ksnprintf(text, sizeof(text), "not sampled");
+    }
+    kprintf("│ CPU Load:      %-44s│\n", text);
+}
+
 void dashboard_draw_summary(void) {
     dashboard_draw_header();
     
     uint8_t active = system_manager_get_active_cell();
     
     console_write_string("┌─ System Status ─────────────────────────────────────────────┐\n");
-    console_write_string("│ Active OS:     ");
-    console_write_string(active == 0 ? "Linux (cores 0-5)     " : "Windows (cores 6-11)  ");
-    console_write_string("                   │\n");
+    kprintf("│ Active OS:     %s                   │\n",
+            active == 0 ? "Linux (cores 0-5)     " : "Windows (cores 6-11)  ");
     
     console_write_string("│ Hotkey:        Ctrl+Alt+O to switch OS                      │\n");
     console_write_string("└─────────────────────────────────────────────────────────────┘\n\n");
     
     console_write_string("┌─ Linux Cell (AMD GPU - RX 7600) ──────────────────────────┐\n");
-    console_write_string("│ Status:        ");
-    console_write_string(active == 0 ? "RUNNING" : "HIBERNATED");
-    console_write_string("                              │\n");
+    kprintf("│ Status:        %s                              │\n", active == 0 ? "RUNNING" : "HIBERNATED");
     console_write_string("│ CPU Cores:     0-5 (6 cores available)                     │\n");
-    console_write_string("│ Memory:        16 GB allocated, usage ~50%                 │\n");
+    dashboard_draw_cpu(0);
+    dashboard_draw_memory(0);
     console_write_string("│ GPU:           AMD Radeon RX 7600 (IOMMU Group 28-29)    │\n");
     console_write_string("└─────────────────────────────────────────────────────────────┘\n\n");
     
     console_write_string("┌─ Windows Cell (NVIDIA GPU - RTX 3050) ────────────────────┐\n");
-    console_write_string("│ Status:        ");
-    console_write_string(active == 1 ? "RUNNING" : "HIBERNATED");
-    console_write_string("                              │\n");
+    kprintf("│ Status:        %s                              │\n", active == 1 ? "RUNNING" : "HIBERNATED");
     console_write_string("│ CPU Cores:     6-11 (6 cores available)                    │\n");
-    console_write_string("│ Memory:        16 GB allocated, usage ~40%                 │\n");
+    dashboard_draw_cpu(1);
+    dashboard_draw_memory(1);
     console_write_string("│ GPU:           NVIDIA GeForce RTX 3050 (IOMMU Group 30)  │\n");
     console_write_string("└─────────────────────────────────────────────────────────────┘\n\n");
     
     console_write_string("┌─ Input Manager ─────────────────────────────────────────────┐\n");
     console_write_string("│ Device:        USB Keyboard & Mouse                        │\n");
-    console_write_string("│ Routing:       ");
-    console_write_string(active == 0 ? "→ Linux Cell" : "→ Windows Cell");
-    console_write_string("                            │\n");
+    kprintf("│ Routing:       %s                            │\n", active == 0 ? "→ Linux Cell" : "→ Windows Cell");
     console_write_string("└─────────────────────────────────────────────────────────────┘\n");
 }
 
@@ -85,39 +139,315 @@ void dashboard_draw_detailed(void) {
     console_write_string("Detailed Metrics:\n\n");
     
     monitor_print_summary();
+    
+    console_write_string("\n");
+    iommu_print_faults();
+}
+
+// U+2581..U+2588, one to eight eighths of a cell
+static const char *const spark_levels[8] = {
+    "\xE2\x96\x81", "\xE2\x96\x82", "\xE2\x96\x83", "\xE2\x96\x84",
+    "\xE2\x96\x85", "\xE2\x96\x86", "\xE2\x96\x87", "\xE2\x96\x88",
+};
+
+// One labelled row of history, oldest on the left. scale_max 0 scales to
+// the highest column shown. Built in a stack buffer and written once.
+static void dashboard_draw_sparkline(uint8_t cell_id, uint8_t series, uint8_t field,
+                                     uint32_t per_column, uint32_t scale_max, const char *label) {
+    uint32_t values[DASHBOARD_GRAPH_WIDTH];
+    uint8_t present[DASHBOARD_GRAPH_WIDTH];
+    uint32_t peak = 0;
+    
+    for (uint32_t col = 0; col < DASHBOARD_GRAPH_WIDTH; col++) {
+        uint32_t age = (DASHBOARD_GRAPH_WIDTH - 1 - col) * per_column;
+        uint64_t sum = 0;
+        uint32_t n = 0;
+        for (uint32_t k = 0; k < per_column; k++) {
+            const monitor_point_t *point = monitor_get_point(cell_id, series, age + k);
+            if (!point) break;
+            sum += monitor_point_value(point, field);
+            n++;
+        }
+        values[col] = n ? (uint32_t)(sum / n) : 0;
+        present[col] = n > 0;
+        if (values[col] > peak) peak = values[col];
+    }
+    
+    uint32_t max = scale_max ? scale_max : peak;
+    char line[KPRINTF_BUFFER_SIZE];
+    uint32_t pos = ksnprintf(line, sizeof(line), "  %-9s ", label);
+    for (uint32_t col = 0; col < DASHBOARD_GRAPH_WIDTH; col++) {
+        const char *cell = " ";
+        if (present[col]) {
+            uint32_t level = max ? (values[col] * 7 + max / 2) / max : 0;
+            cell = spark_levels[level > 7 ? 7 : level];
+        }
+        while (*cell) line[pos++] = *cell++;
+    }
+    
+    const monitor_point_t *latest = monitor_get_point(cell_id, series, 0);
+    ksnprintf(line + pos, sizeof(line) - pos, " %u (max %u)\n",
+              latest ? monitor_point_value(latest, field) : 0, peak);
+    console_write_string(line);
+}
+
+static void dashboard_draw_cell_graphs(uint8_t cell_id, uint8_t series, uint32_t per_column) {
+    const cell_metrics_t *cell = cell_id == 0 ? &dashboard_metrics.linux_metrics : &dashboard_metrics.windows_metrics;
+    if (cell->cores_sampled) {
+        dashboard_draw_sparkline(cell_id, series, MONITOR_FIELD_CPU_LOAD, per_column, 100, "CPU %");
+    } else {
+        kprintf("  %-9s not sampled\n", "CPU %");
+    }
+    if (cell->memory_sampled) {
+        dashboard_draw_sparkline(cell_id, series, MONITOR_FIELD_MEMORY, per_column, 100, "Memory %");
+    } else {
+        kprintf("  %-9s n/a\n", "Memory %");
+    }
+    dashboard_draw_sparkline(cell_id, series, MONITOR_FIELD_SWITCHES, per_column, 0, "Switches");
+    dashboard_draw_sparkline(cell_id, series, MONITOR_FIELD_IRQ_RATE, per_column, 0, "IRQ/s");
+}
+
+// Both cells over 5 minutes and 24 hours, newest on the right
+void dashboard_draw_graphs(void) {
+    dashboard_draw_header();
+    
+    uint32_t fine_per_column = MONITOR_FINE_POINTS / DASHBOARD_GRAPH_WIDTH;
+    uint32_t coarse_per_column = MONITOR_COARSE_POINTS / DASHBOARD_GRAPH_WIDTH;
+    for (uint8_t cell = 0; cell < 2; cell++) {
+        const char *name = cell == 0 ? "Linux" : "Windows";
+        kprintf("%s Cell, last 5 min (%u s per column):\n", name, fine_per_column);
+        dashboard_draw_cell_graphs(cell, MONITOR_SERIES_FINE, fine_per_column);
+        kprintf("%s Cell, last 24 h (%u min per column):\n", name, coarse_per_column);
+        dashboard_draw_cell_graphs(cell, MONITOR_SERIES_COARSE, coarse_per_column);
+        console_write_string("\n");
+    }
 }
 
 void dashboard_draw_footer(void) {
     console_write_string("\n[Press Ctrl+Alt+O to switch | ESC to exit dashboard]\n");
 }
 
-void dashboard_refresh(void) {
-    if (!dashboard.enabled) return;
+// Console capture target: lay text out on the frame grid
+static void dashboard_capture(const char *str, uint32_t len) {
+    for (uint32_t i = 0; i < len; i++) {
+        uint8_t c = (uint8_t)str[i];
+        if (c == '\n') {
+            dashboard.cursor_row++;
+            dashboard.cursor_col = 0;
+            dashboard.last_cell = 0;
+        } else if ((c & 0xC0) == 0x80) {
+            if (dashboard.last_cell && dashboard.last_cell_bytes < 4) {
+                *dashboard.last_cell |= (uint32_t)c << (8 * dashboard.last_cell_bytes++);
+            }
+        } else if (c >= ' ') {
+            dashboard.last_cell = 0;
+            if (dashboard.cursor_row < DASHBOARD_ROWS && dashboard.cursor_col < DASHBOARD_COLS) {
+                dashboard.last_cell = &dashboard_frame[dashboard.cursor_row][dashboard.cursor_col];
+                *dashboard.last_cell = c;
+                dashboard.last_cell_bytes = 1;
+                if (dashboard.cursor_row >= dashboard.frame_rows) {
+                    dashboard.frame_rows = dashboard.cursor_row + 1;
+                }
+            }
+            dashboard.cursor_col++;
+        }
+    }
+}
+
+static uint32_t dashboard_put_cell(char *out, uint32_t cell) {
+    uint32_t n = 0;
+    do {
+        out[n++] = (char)(cell & 0xFF);
+        cell >>= 8;
+    } while (cell && n < 4);
+    return n;
+}
+
+// Cursor escapes plus changed cells for one row, empty when it matches
+static uint32_t dashboard_diff_row(const dashboard_output_t *output, uint32_t row, char *out) {
+    const uint32_t *frame = dashboard_frame[row];
+    const uint32_t *shown = output->shown[row];
+    uint32_t pos = 0;
+    uint32_t col = 0;
     
-    dashboard.refresh_count++;
+    while (col < DASHBOARD_COLS) {
+        if (frame[col] == shown[col]) {
+            col++;
+            continue;
+        }
+        // Extend the run across short stretches of unchanged cells, which
+        // cost less to resend than another escape
+        uint32_t start = col;
+        uint32_t last_diff = col;
+        for (col++; col < DASHBOARD_COLS && col - last_diff <= DASHBOARD_RUN_GAP; col++) {
+            if (frame[col] != shown[col]) last_diff = col;
+        }
+        pos += ksnprintf(out + pos, DASHBOARD_ROW_BUFFER - pos, "\x1b[%u;%uH", row + 1, start + 1);
+        for (uint32_t i = start; i <= last_diff; i++) {
+            pos += dashboard_put_cell(out + pos, frame[i]);
+        }
+        col = last_diff + 1;
+    }
+    out[pos] = '\0';
+    return pos;
+}
+
+// Send the difference between the composed frame and what the device
+// shows. A row the device refuses keeps its old shown cells and goes out
+// next time.
+static void dashboard_emit_frame(dashboard_output_t *output) {
+    char out[DASHBOARD_ROW_BUFFER];
+    uint32_t bytes = 0;
     
-    // Update monitor metrics
-    monitor_update_metrics();
+    // Console writes reach every device and may have scrolled it: start over
+    if (!output->terminal_valid || output->console_count() != output->console_writes) {
+        const char *clear = "\x1b[H\x1b[2J";
+        if (!output->write(clear)) return;
+        bytes += 7;
+        for (uint32_t row = 0; row < DASHBOARD_ROWS; row++) {
+            for (uint32_t col = 0; col < DASHBOARD_COLS; col++) {
+                output->shown[row][col] = DASHBOARD_BLANK;
+            }
+        }
+        output->terminal_valid = 1;
+        output->full_redraws++;
+    }
     
-    // Clear screen (in a real implementation)
-    // console_clear();
+    for (uint32_t row = 0; row < DASHBOARD_ROWS; row++) {
+        uint32_t len = dashboard_diff_row(output, row, out);
+        if (!len) continue;
+        if (!output->write(out)) {
+            output->deferred_rows++;
+            continue;
+        }
+        bytes += len;
+        for (uint32_t col = 0; col < DASHBOARD_COLS; col++) {
+            output->shown[row][col] = dashboard_frame[row][col];
+        }
+    }
     
-    // Draw based on current mode
-    switch (dashboard.mode) {
-        case DASHBOARD_MODE_SUMMARY:
-            dashboard_draw_summary();
-            break;
-        case DASHBOARD_MODE_DETAILED:
-            dashboard_draw_detailed();
-            break;
-        case DASHBOARD_MODE_GRAPHS:
-            console_write_string("Graph mode not yet implemented\n");
-            break;
-        default:
-            dashboard_draw_summary();
+    // Park the cursor below the frame
+    if (bytes) {
+        ksnprintf(out, sizeof(out), "\x1b[%u;1H", dashboard.frame_rows + 1);
+        bytes += output->write(out);
+    }
+    
+    output->console_writes = output->console_count();
+    output->frame_seq = dashboard.frame_seq;
+    output->frames++;
+    output->last_bytes = bytes;
+    output->total_bytes += bytes;
+    if (bytes > output->max_bytes) {
+        output->max_bytes = bytes;
+    }
+}
+
+static void dashboard_begin_frame(void) {
+    for (uint32_t row = 0; row < DASHBOARD_ROWS; row++) {
+        for (uint32_t col = 0; col < DASHBOARD_COLS; col++) {
+            dashboard_frame[row][col] = DASHBOARD_BLANK;
+        }
+    }
+    dashboard.cursor_row = 0;
+    dashboard.cursor_col = 0;
+    dashboard.last_cell = 0;
+    dashboard.frame_rows = 0;
+}
+
+// Compose the frame from the latest monitor snapshot with the ordinary
+// drawing code, captured off the console. The history rings are read in
+// place, so an update published meanwhile means drawing again. While the
+// sampler and this run on the same control loop no update can land
+// mid-frame; the retry matters once rendering moves to another core.
+static void dashboard_compose(void) {
+    for (uint32_t i = 0; i < DASHBOARD_OUTPUTS; i++) {
+        dashboard_output_t *output = &dashboard_outputs[i];
+        if (output->write && output->frame_seq != dashboard.frame_seq) {
+            output->frames_dropped++;
+        }
+    }
+    
+    // Interrupts stay on: the capture leaves handlers' output on the
+    // devices, so none of it lands in the frame
+    uint32_t seq = monitor_read_begin();
+    for (;;) {
+        monitor_read_snapshot(&dashboard_metrics);
+        dashboard_begin_frame();
+        console_begin_capture(dashboard_capture);
+        
+        // Draw based on current mode
+        switch (dashboard.mode) {
+            case DASHBOARD_MODE_SUMMARY:
+                dashboard_draw_summary();
+                break;
+            case DASHBOARD_MODE_DETAILED:
+                dashboard_draw_detailed();
+                break;
+            case DASHBOARD_MODE_GRAPHS:
+                dashboard_draw_graphs();
+                break;
+            default:
+                dashboard_draw_summary();
+        }
+        
+        dashboard_draw_footer();
+        console_end_capture();
+        if (!monitor_read_retry(seq)) break;
+        seq = monitor_read_begin();
+        dashboard.compose_retries++;
+    }
+    
+    dashboard.snapshot_seq = seq;
+    dashboard.stale = 0;
+    dashboard.frame_seq++;
+    dashboard.refresh_count++;
+}
+
+// Draw now and send to every device, whatever their pace
+void dashboard_refresh(void) {
+    if (!dashboard.enabled) return;
+    
+    dashboard_compose();
+    for (uint32_t i = 0; i < DASHBOARD_OUTPUTS; i++) {
+        if (dashboard_outputs[i].write) {
+            dashboard_emit_frame(&dashboard_outputs[i]);
+            dashboard_outputs[i].last_tsc = cpu_read_tsc();
+        }
+    }
+}
+
+// Serial that has not drained the last frame is not due either: the next
+// frame then shows newer data instead of queueing behind it
+static uint8_t dashboard_output_due(const dashboard_output_t *output, uint64_t now) {
+    if (!output->write) return 0;
+    uint64_t cycles_per_ms = (uint64_t)cpu_get_tsc_mhz() * 1000;
+    if (now - output->last_tsc < output->interval_ms * cycles_per_ms) return 0;
+    return !output->max_backlog || console_get_backlog() <= output->max_backlog;
+}
+
+// Control loop hook. Sampling never waits on this: a frame is composed
+// only when some device is due and the snapshot or mode has changed, and
+// each due device is sent its own difference.
+void dashboard_poll(void) {
+    if (!dashboard.enabled) return;
+    
+    uint64_t now = cpu_read_tsc();
+    uint8_t due[DASHBOARD_OUTPUTS];
+    uint8_t any = 0;
+    for (uint32_t i = 0; i < DASHBOARD_OUTPUTS; i++) {
+        due[i] = dashboard_output_due(&dashboard_outputs[i], now);
+        any |= due[i];
     }
+    if (!any) return;
     
-    dashboard_draw_footer();
+    if (dashboard.stale || monitor_read_begin() != dashboard.snapshot_seq) {
+        dashboard_compose();
+    }
+    for (uint32_t i = 0; i < DASHBOARD_OUTPUTS; i++) {
+        if (!due[i]) continue;
+        dashboard_emit_frame(&dashboard_outputs[i]);
+        dashboard_outputs[i].last_tsc = now;
+    }
 }
 
 void dashboard_print_status(void) {
@@ -141,9 +471,15 @@ void dashboard_print_status(void) {
     }
     console_write_string("\n");
     
-    console_write_string("  Refreshes: ");
-    char buf[32];
-    itoa(dashboard.refresh_count, buf, 10);
-    console_write_string(buf);
-    console_write_string("\n");
+    kprintf("  Frames composed: %u, %u redrawn for a concurrent update\n",
+            dashboard.refresh_count, dashboard.compose_retries);
+    for (uint32_t i = 0; i < DASHBOARD_OUTPUTS; i++) {
+        const dashboard_output_t *output = &dashboard_outputs[i];
+        if (!output->write) continue;
+        kprintf("  %s (every %u ms): %u frames, %u dropped, %u full redraws\n",
+                output->name, output->interval_ms, output->frames, output->frames_dropped,
+                output->full_redraws);
+        kprintf("    Bytes sent: last %u, max %u, total %lu, rows deferred %u\n",
+                output->last_bytes, output->max_bytes, output->total_bytes, output->deferred_rows);
+    }
 }
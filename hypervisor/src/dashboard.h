@@ -8,21 +8,78 @@
 #define DASHBOARD_MODE_DETAILED 1
 #define DASHBOARD_MODE_GRAPHS 2
 
+// Sparkline columns; each averages a run of history points
+#define DASHBOARD_GRAPH_WIDTH 60
+
+// Retained screen: each frame is composed here and only cells that differ
+// from the previous frame are sent. Cells hold one character as up to
+// four UTF-8 bytes, first byte lowest; output past the edges is clipped.
+#define DASHBOARD_ROWS 64
+#define DASHBOARD_COLS 128
+#define DASHBOARD_BLANK ' '
+// Unchanged cells bridged inside a run, instead of a new cursor escape
+#define DASHBOARD_RUN_GAP 6
+#define DASHBOARD_ROW_BUFFER (DASHBOARD_COLS * 6)  // Cells plus one escape per run
+
+// Output devices. Each keeps its own copy of what it shows and its own
+// pace, so a slow serial line only ever drops its own frames.
+#define DASHBOARD_OUTPUT_SERIAL 0
+#define DASHBOARD_OUTPUT_SCREEN 1
+#define DASHBOARD_OUTPUTS 2
+#define DASHBOARD_SERIAL_INTERVAL_MS 1000  // A full frame is ~0.2 s at 115200 baud
+#define DASHBOARD_SCREEN_INTERVAL_MS 100
+#define DASHBOARD_SERIAL_MAX_BACKLOG 256   // Console bytes still queued that hold a frame back
+
+typedef uint32_t (*dashboard_write_t)(const char *str);
+typedef uint64_t (*dashboard_count_t)(void);
+
+typedef struct {
+    const char *name;
+    dashboard_write_t write;
+    dashboard_count_t console_count;  // Console traffic that has reached the device
+    uint32_t interval_ms;
+    uint32_t max_backlog;      // 0 = no console backlog check
+    uint64_t last_tsc;         // Last frame sent
+    uint32_t frame_seq;        // Composed frame it last showed
+    uint8_t terminal_valid;    // Shown cells match the device
+    uint64_t console_writes;   // console_count() right after our last frame
+    uint32_t frames;
+    uint32_t frames_dropped;   // Composed but replaced before this device was due
+    uint32_t last_bytes;
+    uint32_t max_bytes;
+    uint64_t total_bytes;
+    uint32_t full_redraws;
+    uint32_t deferred_rows;    // Rows the device refused, resent later
+    uint32_t shown[DASHBOARD_ROWS][DASHBOARD_COLS];
+} dashboard_output_t;
+
 // Dashboard state
 typedef struct {
     uint8_t mode;
     uint8_t enabled;
     uint32_t refresh_count;
     uint64_t last_refresh_time;
+    // Frame composition
+    uint32_t cursor_row;
+    uint32_t cursor_col;
+    uint32_t *last_cell;       // Cell taking UTF-8 continuation bytes
+    uint32_t last_cell_bytes;
+    uint32_t frame_rows;       // Rows the current frame reaches
+    uint32_t frame_seq;        // Frames composed
+    uint32_t snapshot_seq;     // Monitor snapshot the frame was drawn from
+    uint8_t stale;             // Mode changed since the frame was composed
+    uint32_t compose_retries;  // Redrawn because an update landed meanwhile
 } dashboard_t;
 
 void dashboard_init(void);
 void dashboard_enable(void);
 void dashboard_disable(void);
 void dashboard_refresh(void);
+void dashboard_poll(void);
 void dashboard_set_mode(uint8_t mode);
 void dashboard_draw_summary(void);
 void dashboard_draw_detailed(void);
+void dashboard_draw_graphs(void);
 void dashboard_draw_header(void);
 void dashboard_draw_footer(void);
 void dashboard_print_status(void);
@@ -0,0 +1,537 @@
+#include "fbcon.h"
+#include "acpi.h"
+#include "console.h"
+#include "cpu.h"
+#include "memory.h"
+#include "kprintf.h"
+#include "types.h"
+
+// 8x16 bitmaps, one byte per scanline, MSB leftmost. ASCII is rasterized
+// from Source Code Pro Bold, Copyright 2010-2020 Adobe, and stays under the
+// SIL Open Font License 1.1; the notice and license text are in
+// fbcon_font.LICENSE. The line and block glyphs are drawn to meet at cell
+// edges.
+static const uint8_t fbcon_font[FBCON_GLYPH_SLOTS][FBCON_GLYPH_HEIGHT] = {
+    [' '] = { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },  // ' '
+    { 0x00, 0x00, 0x00, 0x00, 0x18, 0x18, 0x18, 0x18, 0x00, 0x18, 0x18, 0x18, 0x00, 0x00, 0x00, 0x00 },  // '!'
+    { 0x00, 0x00, 0x00, 0x66, 0x66, 0x66, 0x66, 0x66, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },  // '"'
+    { 0x00, 0x00, 0x00, 0x00, 0x14, 0x34, 0x7e, 0x24, 0x7e, 0x28, 0x28, 0x28, 0x00, 0x00, 0x00, 0x00 },  // '#'
+    { 0x00, 0x00, 0x18, 0x18, 0x3c, 0x66, 0x70, 0x3c, 0x06, 0x46, 0x7c, 0x18, 0x18, 0x00, 0x00, 0x00 },  // '$'
+    { 0x00, 0x00, 0x00, 0x00, 0xc4, 0x6e, 0x68, 0xd0, 0x0c, 0x56, 0x96, 0x8c, 0x00, 0x00, 0x00, 0x00 },  // '%'
+    { 0x00, 0x00, 0x00, 0x00, 0x38, 0x68, 0x78, 0x33, 0x76, 0xde, 0xce, 0x7b, 0x00, 0x00, 0x00, 0x00 },  // '&'
+    { 0x00, 0x00, 0x00, 0x18, 0x18, 0x18, 0x18, 0x18, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },  // '''
+    { 0x00, 0x00, 0x04, 0x0c, 0x18, 0x10, 0x30, 0x30, 0x30, 0x30, 0x10, 0x18, 0x0c, 0x04, 0x00, 0x00 },  // '('
+    { 0x00, 0x00, 0x20, 0x30, 0x18, 0x18, 0x08, 0x08, 0x08, 0x08, 0x18, 0x18, 0x30, 0x20, 0x00, 0x00 },  // ')'
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x10, 0x18, 0x7e, 0x18, 0x3c, 0x24, 0x00, 0x00, 0x00, 0x00, 0x00 },  // '*'
+    { 0x00, 0x00, 0x00, 0x00, 0x18, 0x18, 0x7e, 0x18, 0x18, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },  // '+'
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x18, 0x18, 0x1c, 0x08, 0x18, 0x30, 0x00 },  // ','
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x7e, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },  // '-'
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x18, 0x38, 0x18, 0x00, 0x00, 0x00, 0x00 },  // '.'
+    { 0x00, 0x00, 0x00, 0x06, 0x04, 0x0c, 0x08, 0x18, 0x18, 0x10, 0x30, 0x30, 0x20, 0x60, 0x00, 0x00 },  // '/'
+    { 0x00, 0x00, 0x00, 0x00, 0x3c, 0x66, 0x66, 0x5e, 0x5e, 0x66, 0x66, 0x3c, 0x00, 0x00, 0x00, 0x00 },  // '0'
+    { 0x00, 0x00, 0x00, 0x00, 0x18, 0x78, 0x18, 0x18, 0x18, 0x18, 0x18, 0x7e, 0x00, 0x00, 0x00, 0x00 },  // '1'
+    { 0x00, 0x00, 0x00, 0x00, 0x78, 0x4c, 0x06, 0x0c, 0x0c, 0x18, 0x30, 0x7e, 0x00, 0x00, 0x00, 0x00 },  // '2'
+    { 0x00, 0x00, 0x00, 0x00, 0x7c, 0x4c, 0x06, 0x0c, 0x38, 0x06, 0x46, 0x7c, 0x00, 0x00, 0x00, 0x00 },  // '3'
+    { 0x00, 0x00, 0x00, 0x00, 0x0c, 0x1c, 0x3c, 0x2c, 0x6c, 0xfe, 0x0c, 0x0c, 0x00, 0x00, 0x00, 0x00 },  // '4'
+    { 0x00, 0x00, 0x00, 0x00, 0x7e, 0x60, 0x60, 0x7c, 0x06, 0x06, 0x46, 0x7c, 0x00, 0x00, 0x00, 0x00 },  // '5'
+    { 0x00, 0x00, 0x00, 0x00, 0x1e, 0x64, 0x60, 0x7c, 0x66, 0x66, 0x66, 0x3c, 0x00, 0x00, 0x00, 0x00 },  // '6'
+    { 0x00, 0x00, 0x00, 0x00, 0x7e, 0x04, 0x0c, 0x18, 0x18, 0x18, 0x18, 0x10, 0x00, 0x00, 0x00, 0x00 },  // '7'
+    { 0x00, 0x00, 0x00, 0x00, 0x3c, 0x66, 0x3c, 0x3c, 0x6e, 0x46, 0x66, 0x3c, 0x00, 0x00, 0x00, 0x00 },  // '8'
+    { 0x00, 0x00, 0x00, 0x00, 0x38, 0x64, 0x46, 0x66, 0x3e, 0x06, 0x4c, 0x78, 0x00, 0x00, 0x00, 0x00 },  // '9'
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x18, 0x38, 0x18, 0x00, 0x18, 0x38, 0x18, 0x00, 0x00, 0x00, 0x00 },  // ':'
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x18, 0x38, 0x18, 0x00, 0x18, 0x18, 0x1c, 0x08, 0x18, 0x30, 0x00 },  // ';'
+    { 0x00, 0x00, 0x00, 0x00, 0x02, 0x0c, 0x30, 0x20, 0x30, 0x0c, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00 },  // '<'
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x7e, 0x00, 0x00, 0x7e, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },  // '='
+    { 0x00, 0x00, 0x00, 0x00, 0x40, 0x30, 0x18, 0x04, 0x18, 0x30, 0x40, 0x00, 0x00, 0x00, 0x00, 0x00 },  // '>'
+    { 0x00, 0x00, 0x00, 0x3c, 0x44, 0x0c, 0x18, 0x18, 0x00, 0x18, 0x38, 0x18, 0x00, 0x00, 0x00, 0x00 },  // '?'
+    { 0x00, 0x00, 0x00, 0x00, 0x3c, 0x62, 0x42, 0x4e, 0xd2, 0xd2, 0x5e, 0x40, 0x60, 0x1e, 0x00, 0x00 },  // '@'
+    { 0x00, 0x00, 0x00, 0x00, 0x18, 0x3c, 0x3c, 0x2c, 0x66, 0x7e, 0x46, 0xc3, 0x00, 0x00, 0x00, 0x00 },  // 'A'
+    { 0x00, 0x00, 0x00, 0x00, 0x7c, 0x66, 0x66, 0x7c, 0x66, 0x66, 0x66, 0x7c, 0x00, 0x00, 0x00, 0x00 },  // 'B'
+    { 0x00, 0x00, 0x00, 0x00, 0x1e, 0x34, 0x60, 0x60, 0x60, 0x60, 0x72, 0x1e, 0x00, 0x00, 0x00, 0x00 },  // 'C'
+    { 0x00, 0x00, 0x00, 0x00, 0x78, 0x66, 0x66, 0x66, 0x66, 0x66, 0x6e, 0x78, 0x00, 0x00, 0x00, 0x00 },  // 'D'
+    { 0x00, 0x00, 0x00, 0x00, 0x7e, 0x60, 0x60, 0x60, 0x7c, 0x60, 0x60, 0x7e, 0x00, 0x00, 0x00, 0x00 },  // 'E'
+    { 0x00, 0x00, 0x00, 0x00, 0x7e, 0x60, 0x60, 0x60, 0x7c, 0x60, 0x60, 0x60, 0x00, 0x00, 0x00, 0x00 },  // 'F'
+    { 0x00, 0x00, 0x00, 0x00, 0x3e, 0x64, 0x60, 0x60, 0x6e, 0x66, 0x66, 0x3e, 0x00, 0x00, 0x00, 0x00 },  // 'G'
+    { 0x00, 0x00, 0x00, 0x00, 0x66, 0x66, 0x66, 0x66, 0x7e, 0x66, 0x66, 0x66, 0x00, 0x00, 0x00, 0x00 },  // 'H'
+    { 0x00, 0x00, 0x00, 0x00, 0x7e, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x7e, 0x00, 0x00, 0x00, 0x00 },  // 'I'
+    { 0x00, 0x00, 0x00, 0x00, 0x7e, 0x06, 0x06, 0x06, 0x06, 0x06, 0x44, 0x7c, 0x00, 0x00, 0x00, 0x00 },  // 'J'
+    { 0x00, 0x00, 0x00, 0x00, 0x66, 0x6c, 0x78, 0x78, 0x7c, 0x6c, 0x66, 0x67, 0x00, 0x00, 0x00, 0x00 },  // 'K'
+    { 0x00, 0x00, 0x00, 0x00, 0x60, 0x60, 0x60, 0x60, 0x60, 0x60, 0x60, 0x7e, 0x00, 0x00, 0x00, 0x00 },  // 'L'
+    { 0x00, 0x00, 0x00, 0x00, 0x66, 0x6a, 0x6a, 0x5e, 0x5e, 0x56, 0x46, 0x46, 0x00, 0x00, 0x00, 0x00 },  // 'M'
+    { 0x00, 0x00, 0x00, 0x00, 0x66, 0x66, 0x56, 0x76, 0x7e, 0x6e, 0x6e, 0x66, 0x00, 0x00, 0x00, 0x00 },  // 'N'
+    { 0x00, 0x00, 0x00, 0x00, 0x3c, 0x66, 0x66, 0x46, 0xc6, 0x66, 0x66, 0x3c, 0x00, 0x00, 0x00, 0x00 },  // 'O'
+    { 0x00, 0x00, 0x00, 0x00, 0x7c, 0x66, 0x66, 0x66, 0x7c, 0x60, 0x60, 0x60, 0x00, 0x00, 0x00, 0x00 },  // 'P'
+    { 0x00, 0x00, 0x00, 0x00, 0x3c, 0x66, 0x66, 0xc6, 0xc6, 0x66, 0x66, 0x3c, 0x18, 0x0f, 0x00, 0x00 },  // 'Q'
+    { 0x00, 0x00, 0x00, 0x00, 0x7c, 0x66, 0x66, 0x66, 0x7c, 0x6c, 0x66, 0x67, 0x00, 0x00, 0x00, 0x00 },  // 'R'
+    { 0x00, 0x00, 0x00, 0x00, 0x3e, 0x64, 0x60, 0x78, 0x1e, 0x06, 0x46, 0x7c, 0x00, 0x00, 0x00, 0x00 },  // 'S'
+    { 0x00, 0x00, 0x00, 0x00, 0xfe, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x00, 0x00, 0x00, 0x00 },  // 'T'
+    { 0x00, 0x00, 0x00, 0x00, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x3c, 0x00, 0x00, 0x00, 0x00 },  // 'U'
+    { 0x00, 0x00, 0x00, 0x00, 0xc3, 0x66, 0x66, 0x64, 0x24, 0x3c, 0x3c, 0x18, 0x00, 0x00, 0x00, 0x00 },  // 'V'
+    { 0x00, 0x00, 0x00, 0x00, 0xc3, 0xc3, 0xc2, 0x5a, 0x5a, 0x5a, 0x6a, 0x66, 0x00, 0x00, 0x00, 0x00 },  // 'W'
+    { 0x00, 0x00, 0x00, 0x00, 0xe6, 0x66, 0x3c, 0x38, 0x38, 0x3c, 0x66, 0xe7, 0x00, 0x00, 0x00, 0x00 },  // 'X'
+    { 0x00, 0x00, 0x00, 0x00, 0xc7, 0x66, 0x6c, 0x3c, 0x18, 0x18, 0x18, 0x18, 0x00, 0x00, 0x00, 0x00 },  // 'Y'
+    { 0x00, 0x00, 0x00, 0x00, 0x7e, 0x0c, 0x0c, 0x18, 0x18, 0x30, 0x60, 0x7e, 0x00, 0x00, 0x00, 0x00 },  // 'Z'
+    { 0x00, 0x00, 0x00, 0x1c, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x1c, 0x00, 0x00 },  // '['
+    { 0x00, 0x00, 0x00, 0x60, 0x20, 0x30, 0x30, 0x10, 0x18, 0x18, 0x08, 0x0c, 0x04, 0x06, 0x00, 0x00 },  // backslash
+    { 0x00, 0x00, 0x00, 0x78, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08, 0x78, 0x00, 0x00 },  // ']'
+    { 0x00, 0x00, 0x00, 0x00, 0x18, 0x18, 0x3c, 0x24, 0x66, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },  // '^'
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x7e, 0x00, 0x00 },  // '_'
+    { 0x00, 0x00, 0x30, 0x18, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },  // '`'
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x7c, 0x46, 0x3e, 0x66, 0x66, 0x7e, 0x00, 0x00, 0x00, 0x00 },  // 'a'
+    { 0x00, 0x00, 0x00, 0x60, 0x60, 0x60, 0x7c, 0x66, 0x66, 0x66, 0x66, 0x7c, 0x00, 0x00, 0x00, 0x00 },  // 'b'
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x3e, 0x64, 0x60, 0x60, 0x64, 0x3e, 0x00, 0x00, 0x00, 0x00 },  // 'c'
+    { 0x00, 0x00, 0x00, 0x06, 0x06, 0x06, 0x3e, 0x66, 0x66, 0x66, 0x66, 0x3e, 0x00, 0x00, 0x00, 0x00 },  // 'd'
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x3c, 0x66, 0x7e, 0x60, 0x60, 0x3e, 0x00, 0x00, 0x00, 0x00 },  // 'e'
+    { 0x00, 0x00, 0x00, 0x0f, 0x18, 0x18, 0x7e, 0x18, 0x18, 0x18, 0x18, 0x18, 0x00, 0x00, 0x00, 0x00 },  // 'f'
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x3e, 0x64, 0x64, 0x3c, 0x60, 0x3e, 0x42, 0x7c, 0x00, 0x00 },  // 'g'
+    { 0x00, 0x00, 0x00, 0x60, 0x60, 0x60, 0x7c, 0x66, 0x66, 0x66, 0x66, 0x66, 0x00, 0x00, 0x00, 0x00 },  // 'h'
+    { 0x00, 0x00, 0x00, 0x1c, 0x1c, 0x00, 0x7c, 0x0c, 0x0c, 0x0c, 0x0c, 0x0c, 0x00, 0x00, 0x00, 0x00 },  // 'i'
+    { 0x00, 0x00, 0x00, 0x1c, 0x1c, 0x00, 0x7c, 0x0c, 0x0c, 0x0c, 0x0c, 0x0c, 0x18, 0x78, 0x00, 0x00 },  // 'j'
+    { 0x00, 0x00, 0x00, 0x60, 0x60, 0x60, 0x66, 0x6c, 0x78, 0x7c, 0x66, 0x67, 0x00, 0x00, 0x00, 0x00 },  // 'k'
+    { 0x00, 0x00, 0x00, 0x78, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x0e, 0x00, 0x00, 0x00, 0x00 },  // 'l'
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xf6, 0xda, 0xda, 0xda, 0xda, 0xda, 0x00, 0x00, 0x00, 0x00 },  // 'm'
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x7c, 0x66, 0x66, 0x66, 0x66, 0x66, 0x00, 0x00, 0x00, 0x00 },  // 'n'
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x3c, 0x66, 0x66, 0x66, 0x66, 0x3c, 0x00, 0x00, 0x00, 0x00 },  // 'o'
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x7c, 0x66, 0x66, 0x66, 0x66, 0x7c, 0x60, 0x60, 0x00, 0x00 },  // 'p'
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x3e, 0x66, 0x66, 0x66, 0x66, 0x3e, 0x06, 0x06, 0x00, 0x00 },  // 'q'
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x2e, 0x30, 0x20, 0x20, 0x20, 0x20, 0x00, 0x00, 0x00, 0x00 },  // 'r'
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x3e, 0x64, 0x78, 0x0e, 0x46, 0x7c, 0x00, 0x00, 0x00, 0x00 },  // 's'
+    { 0x00, 0x00, 0x00, 0x00, 0x10, 0x30, 0x7e, 0x30, 0x30, 0x30, 0x30, 0x1e, 0x00, 0x00, 0x00, 0x00 },  // 't'
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x66, 0x66, 0x66, 0x66, 0x66, 0x7e, 0x00, 0x00, 0x00, 0x00 },  // 'u'
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xc6, 0x66, 0x64, 0x2c, 0x3c, 0x18, 0x00, 0x00, 0x00, 0x00 },  // 'v'
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xdb, 0xdb, 0xda, 0x5a, 0x7e, 0x6e, 0x00, 0x00, 0x00, 0x00 },  // 'w'
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x66, 0x3c, 0x38, 0x38, 0x2c, 0xe6, 0x00, 0x00, 0x00, 0x00 },  // 'x'
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xe6, 0x66, 0x24, 0x3c, 0x18, 0x18, 0x18, 0x70, 0x00, 0x00 },  // 'y'
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x7e, 0x0c, 0x18, 0x38, 0x30, 0x7e, 0x00, 0x00, 0x00, 0x00 },  // 'z'
+    { 0x00, 0x00, 0x00, 0x1c, 0x18, 0x18, 0x18, 0x18, 0x60, 0x18, 0x18, 0x18, 0x18, 0x1c, 0x00, 0x00 },  // '{'
+    { 0x00, 0x00, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x00 },  // '|'
+    { 0x00, 0x00, 0x00, 0x70, 0x18, 0x18, 0x18, 0x18, 0x0c, 0x18, 0x18, 0x18, 0x18, 0x70, 0x00, 0x00 },  // '}'
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x72, 0x4c, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },  // '~'
+    [FBCON_GLYPH_BOX_H] = { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },  // U+2500 ─
+    { 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10 },  // U+2502 │
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x1f, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10 },  // U+250C ┌
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xf0, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10 },  // U+2510 ┐
+    { 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x1f, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },  // U+2514 └
+    { 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0xf0, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },  // U+2518 ┘
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0x00, 0x00, 0x00, 0xff, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },  // U+2550 ═
+    { 0x24, 0x24, 0x24, 0x24, 0x24, 0x24, 0x24, 0x24, 0x24, 0x24, 0x24, 0x24, 0x24, 0x24, 0x24, 0x24 },  // U+2551 ║
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x3f, 0x20, 0x20, 0x20, 0x27, 0x24, 0x24, 0x24, 0x24, 0x24, 0x24 },  // U+2554 ╔
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0xfc, 0x04, 0x04, 0x04, 0xe4, 0x24, 0x24, 0x24, 0x24, 0x24, 0x24 },  // U+2557 ╗
+    { 0x24, 0x24, 0x24, 0x24, 0x24, 0x27, 0x20, 0x20, 0x20, 0x3f, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },  // U+255A ╚
+    { 0x24, 0x24, 0x24, 0x24, 0x24, 0xe4, 0x04, 0x04, 0x04, 0xfc, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },  // U+255D ╝
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x08, 0x04, 0xfe, 0x04, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },  // U+2192 →
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0xff },  // U+2581 ▁
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0xff, 0xff, 0xff },  // U+2582 ▂
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff },  // U+2583 ▃
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff },  // U+2584 ▄
+    { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff },  // U+2585 ▅
+    { 0x00, 0x00, 0x00, 0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff },  // U+2586 ▆
+    { 0x00, 0x00, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff },  // U+2587 ▇
+    { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff },  // U+2588 █
+};
+
+static const struct {
+    uint16_t codepoint;
+    uint8_t glyph;
+    uint8_t vga;  // Code page 437 equivalent for the text-mode backend
+} fbcon_unicode[] = {
+    { 0x2500, FBCON_GLYPH_BOX_H, 0xC4 },
+    { 0x2502, FBCON_GLYPH_BOX_V, 0xB3 },
+    { 0x250C, FBCON_GLYPH_BOX_DR, 0xDA },
+    { 0x2510, FBCON_GLYPH_BOX_DL, 0xBF },
+    { 0x2514, FBCON_GLYPH_BOX_UR, 0xC0 },
+    { 0x2518, FBCON_GLYPH_BOX_UL, 0xD9 },
+    { 0x2550, FBCON_GLYPH_DBL_H, 0xCD },
+    { 0x2551, FBCON_GLYPH_DBL_V, 0xBA },
+    { 0x2554, FBCON_GLYPH_DBL_DR, 0xC9 },
+    { 0x2557, FBCON_GLYPH_DBL_DL, 0xBB },
+    { 0x255A, FBCON_GLYPH_DBL_UR, 0xC8 },
+    { 0x255D, FBCON_GLYPH_DBL_UL, 0xBC },
+    { 0x2192, FBCON_GLYPH_ARROW_R, 0x1A },
+    { 0x2581, FBCON_GLYPH_BLOCK_1, '_' },
+    { 0x2582, FBCON_GLYPH_BLOCK_1 + 1, '_' },
+    { 0x2583, FBCON_GLYPH_BLOCK_1 + 2, 0xDC },
+    { 0x2584, FBCON_GLYPH_BLOCK_1 + 3, 0xDC },
+    { 0x2585, FBCON_GLYPH_BLOCK_1 + 4, 0xDC },
+    { 0x2586, FBCON_GLYPH_BLOCK_1 + 5, 0xDB },
+    { 0x2587, FBCON_GLYPH_BLOCK_1 + 6, 0xDB },
+    { 0x2588, FBCON_GLYPH_BLOCK_1 + 7, 0xDB },
+};
+
+#define FBCON_UNICODE_COUNT (sizeof(fbcon_unicode) / sizeof(fbcon_unicode[0]))
+
+// What the console wants on screen, and what was last drawn there
+static uint8_t fbcon_text[FBCON_MAX_ROWS][FBCON_MAX_COLS];
+static uint8_t fbcon_shown[FBCON_MAX_ROWS][FBCON_MAX_COLS];
+// Per-row span of columns written since the last present; lo >= hi is clean
+static uint16_t fbcon_dirty_lo[FBCON_MAX_ROWS];
+static uint16_t fbcon_dirty_hi[FBCON_MAX_ROWS];
+static uint8_t fbcon_vga_map[FBCON_GLYPH_SLOTS];
+
+static fbcon_state_t fbcon_state = {0};
+// Guards the grid, cursor and dirty spans; held with interrupts off
+
+static uint8_t fbcon_parse_multiboot(uint32_t magic, uint64_t info, fbcon_mode_t *mode, uint8_t *type) {
+    if (magic != MULTIBOOT2_BOOTLOADER_MAGIC || !info) {
+        return 0;
+    }
+    
+    uint32_t total_size = *(const uint32_t *)info;
+    uint64_t tag = info + 8;
+    
+    while (tag + 8 <= info + total_size) {
+        uint32_t tag_type = *(const uint32_t *)tag;
+        uint32_t size = *(const uint32_t *)(tag + 4);
+        if (tag_type == MULTIBOOT2_TAG_END || size < 8) break;
+        
+        if (tag_type == MULTIBOOT2_TAG_FRAMEBUFFER) {
+            const uint8_t *p = (const uint8_t *)tag;
+            mode->address = *(const uint64_t *)(p + 8);
+            mode->pitch = *(const uint32_t *)(p + 16);
+            mode->width = *(const uint32_t *)(p + 20);
+            mode->height = *(const uint32_t *)(p + 24);
+            mode->bpp = p[28];
+            *type = p[29];
+            // Direct RGB colour info follows the common part
+            mode->red_shift = p[32];
+            mode->red_bits = p[33];
+            mode->green_shift = p[34];
+            mode->green_bits = p[35];
+            mode->blue_shift = p[36];
+            mode->blue_bits = p[37];
+            return 1;
+        }
+        tag += (size + 7) & ~7U;
+    }
+    return 0;
+}
+
+static uint32_t fbcon_pixel(uint32_t rgb) {
+    const fbcon_mode_t *m = &fbcon_state.mode;
+    uint32_t r = (rgb >> 16) & 0xFF;
+    uint32_t g = (rgb >> 8) & 0xFF;
+    uint32_t b = rgb & 0xFF;
+    return ((r >> (8 - m->red_bits)) << m->red_shift) |
+           ((g >> (8 - m->green_bits)) << m->green_shift) |
+           ((b >> (8 - m->blue_bits)) << m->blue_shift);
+}
+
+// Expand every bitmap to finished pixels once, so drawing a cell is
+// sixteen 32-byte row copies with no per-pixel work
+static uint8_t fbcon_build_glyph_cache(void) {
+    uint32_t glyph_pixels = FBCON_GLYPH_WIDTH * FBCON_GLYPH_HEIGHT;
+    fbcon_state.glyph_cache = memory_alloc_aligned(FBCON_GLYPH_SLOTS * glyph_pixels * sizeof(uint32_t), 64);
+    if (!fbcon_state.glyph_cache) return 0;
+    
+    uint32_t fg = fbcon_pixel(FBCON_FG_RGB);
+    uint32_t bg = fbcon_pixel(FBCON_BG_RGB);
+    for (uint32_t g = 0; g < FBCON_GLYPH_SLOTS; g++) {
+        uint32_t *out = fbcon_state.glyph_cache + g * glyph_pixels;
+        for (uint32_t y = 0; y < FBCON_GLYPH_HEIGHT; y++) {
+            uint8_t bits = fbcon_font[g][y];
+            for (uint32_t x = 0; x < FBCON_GLYPH_WIDTH; x++) {
+                *out++ = (bits & (0x80 >> x)) ? fg : bg;
+            }
+        }
+    }
+    return 1;
+}
+
+static void fbcon_mark_dirty(uint32_t row, uint32_t lo, uint32_t hi) {
+    if (lo < fbcon_dirty_lo[row]) fbcon_dirty_lo[row] = lo;
+    if (hi > fbcon_dirty_hi[row]) fbcon_dirty_hi[row] = hi;
+    fbcon_state.dirty = 1;
+}
+
+static void fbcon_reset_dirty(uint32_t row) {
+    fbcon_dirty_lo[row] = FBCON_MAX_COLS;
+    fbcon_dirty_hi[row] = 0;
+}
+
+// Forward copy is safe for the only overlap used: moving rows up
+static void fbcon_move(uint8_t *dst, const uint8_t *src, uint64_t bytes) {
+    uint64_t *d = (uint64_t *)dst;
+    const uint64_t *s = (const uint64_t *)src;
+    for (uint64_t i = 0; i < bytes / 8; i++) {
+        d[i] = s[i];
+    }
+}
+
+// Scrolling moves the character grid, never framebuffer memory: reads
+// from write-combined VRAM are uncached, and the diff in fbcon_present()
+// then redraws only cells whose character actually changed
+static void fbcon_scroll(void) {
+    fbcon_move(&fbcon_text[0][0], &fbcon_text[1][0], (uint64_t)(FBCON_MAX_ROWS - 1) * FBCON_MAX_COLS);
+    for (uint32_t col = 0; col < FBCON_MAX_COLS; col++) {
+        fbcon_text[fbcon_state.rows - 1][col] = ' ';
+    }
+    for (uint32_t row = 0; row < fbcon_state.rows; row++) {
+        fbcon_mark_dirty(row, 0, fbcon_state.cols);
+    }
+    fbcon_state.scrolls++;
+}
+
+static void fbcon_newline(void) {
+    fbcon_state.cursor_col = 0;
+    if (++fbcon_state.cursor_row >= fbcon_state.rows) {
+        fbcon_scroll();
+        fbcon_state.cursor_row = fbcon_state.rows - 1;
+    }
+}
+
+static void fbcon_put_glyph(uint8_t glyph) {
+    if (fbcon_state.cursor_col >= fbcon_state.cols) {
+        fbcon_newline();
+    }
+    uint32_t row = fbcon_state.cursor_row;
+    uint32_t col = fbcon_state.cursor_col++;
+    fbcon_text[row][col] = glyph;
+    fbcon_mark_dirty(row, col, col + 1);
+}
+
+static uint8_t fbcon_lookup_codepoint(uint32_t codepoint) {
+    for (uint32_t i = 0; i < FBCON_UNICODE_COUNT; i++) {
+        if (fbcon_unicode[i].codepoint == codepoint) {
+            return fbcon_unicode[i].glyph;
+        }
+    }
+    return FBCON_GLYPH_UNKNOWN;
+}
+
+static void fbcon_clear_span(uint32_t row, uint32_t from, uint32_t to) {
+    for (uint32_t col = from; col < to; col++) {
+        fbcon_text[row][col] = ' ';
+    }
+    fbcon_mark_dirty(row, from, to);
+}
+
+// Cursor addressing and clears, enough for the dashboard's incremental
+// frames; anything else is swallowed
+static void fbcon_escape(uint8_t c) {
+    if (fbcon_state.esc_state == FBCON_ESC_START) {
+        fbcon_state.esc_state = c == '[' ? FBCON_ESC_CSI : FBCON_ESC_NONE;
+        fbcon_state.esc_count = 0;
+        fbcon_state.esc_params[0] = 0;
+        fbcon_state.esc_params[1] = 0;
+        return;
+    }
+    
+    if (c >= '0' && c <= '9') {
+        if (fbcon_state.esc_count < FBCON_ESC_PARAMS) {
+            uint16_t *param = &fbcon_state.esc_params[fbcon_state.esc_count];
+            *param = *param * 10 + (c - '0');
+        }
+        return;
+    }
+    if (c == ';') {
+        fbcon_state.esc_count++;
+        return;
+    }
+    
+    uint32_t p0 = fbcon_state.esc_params[0];
+    uint32_t p1 = fbcon_state.esc_params[1];
+    if (c == 'H') {
+        uint32_t row = p0 ? p0 - 1 : 0;
+        uint32_t col = p1 ? p1 - 1 : 0;
+        fbcon_state.cursor_row = row < fbcon_state.rows ? row : fbcon_state.rows - 1;
+        fbcon_state.cursor_col = col < fbcon_state.cols ? col : fbcon_state.cols - 1;
+    } else if (c == 'J' && p0 == 2) {
+        for (uint32_t row = 0; row < fbcon_state.rows; row++) {
+            fbcon_clear_span(row, 0, fbcon_state.cols);
+        }
+    } else if (c == 'K' && fbcon_state.cursor_col < fbcon_state.cols) {
+        fbcon_clear_span(fbcon_state.cursor_row, fbcon_state.cursor_col, fbcon_state.cols);
+    }
+    fbcon_state.esc_state = FBCON_ESC_NONE;
+}
+
+static void fbcon_put_byte(uint8_t c) {
+    if (fbcon_state.esc_state != FBCON_ESC_NONE) {
+        fbcon_escape(c);
+        return;
+    }
+    if (c == 0x1B) {
+        fbcon_state.esc_state = FBCON_ESC_START;
+        return;
+    }
+    
+    if (fbcon_state.utf8_remaining) {
+        if ((c & 0xC0) == 0x80) {
+            fbcon_state.utf8_codepoint = (fbcon_state.utf8_codepoint << 6) | (c & 0x3F);
+            if (--fbcon_state.utf8_remaining == 0) {
+                fbcon_put_glyph(fbcon_lookup_codepoint(fbcon_state.utf8_codepoint));
+            }
+            return;
+        }
+        // Truncated sequence: drop it and take this byte afresh
+        fbcon_state.utf8_remaining = 0;
+        fbcon_put_glyph(FBCON_GLYPH_UNKNOWN);
+    }
+    
+    if (c == '\n') {
+        fbcon_newline();
+    } else if (c == '\r') {
+        fbcon_state.cursor_col = 0;
+    } else if (c >= 0xC0) {
+        uint8_t extra = c >= 0xF0 ? 3 : (c >= 0xE0 ? 2 : 1);
+        fbcon_state.utf8_codepoint = c & (0x3F >> extra);
+        fbcon_state.utf8_remaining = extra;
+    } else if (c >= ' ' && c < 0x7F) {
+        fbcon_put_glyph(c);
+    } else if (c >= 0x80) {
+        fbcon_put_glyph(FBCON_GLYPH_UNKNOWN);
+    }
+}
+
+// Grid update only; drawing happens in fbcon_present(). Control loop
+// only (and boot, before the console goes async): everyone else reaches
+// the screen through the console rings.
+void fbcon_write(const char *str) {
+    if (fbcon_state.backend == FBCON_BACKEND_NONE) return;
+    
+    while (*str) {
+        fbcon_put_byte((uint8_t)*str++);
+    }
+}
+
+uint8_t fbcon_is_active(void) {
+    return fbcon_state.backend != FBCON_BACKEND_NONE;
+}
+
+static void fbcon_draw_cell(uint32_t row, uint32_t col, uint8_t glyph) {
+    if (fbcon_state.backend == FBCON_BACKEND_VGA_TEXT) {
+        volatile uint16_t *vga = (volatile uint16_t *)FBCON_VGA_ADDRESS;
+        vga[row * FBCON_VGA_COLS + col] = (FBCON_VGA_ATTR << 8) | fbcon_vga_map[glyph];
+        return;
+    }
+    
+    const uint64_t *src = (const uint64_t *)(fbcon_state.glyph_cache +
+                                             glyph * FBCON_GLYPH_WIDTH * FBCON_GLYPH_HEIGHT);
+    uint8_t *dst = (uint8_t *)fbcon_state.mode.address +
+                   (uint64_t)row * FBCON_GLYPH_HEIGHT * fbcon_state.mode.pitch +
+                   col * FBCON_GLYPH_WIDTH * sizeof(uint32_t);
+    for (uint32_t y = 0; y < FBCON_GLYPH_HEIGHT; y++) {
+        volatile uint64_t *line = (volatile uint64_t *)dst;
+        line[0] = src[0];
+        line[1] = src[1];
+        line[2] = src[2];
+        line[3] = src[3];
+        src += 4;
+        dst += fbcon_state.mode.pitch;
+    }
+}
+
+// Draw every cell whose character differs from what is on screen, within
+// the spans written since the last call. Control loop only.
+void fbcon_present(void) {
+    if (fbcon_state.backend == FBCON_BACKEND_NONE || !fbcon_state.dirty) return;
+    
+    uint64_t start = cpu_read_tsc();
+    uint32_t drawn = 0;
+    fbcon_state.dirty = 0;
+    
+    for (uint32_t row = 0; row < fbcon_state.rows; row++) {
+        uint32_t lo = fbcon_dirty_lo[row];
+        uint32_t hi = fbcon_dirty_hi[row];
+        fbcon_reset_dirty(row);
+        
+        for (uint32_t col = lo; col < hi; col++) {
+            uint8_t glyph = fbcon_text[row][col];
+            if (glyph == fbcon_shown[row][col]) continue;
+            fbcon_draw_cell(row, col, glyph);
+            fbcon_shown[row][col] = glyph;
+            drawn++;
+        }
+    }
+    // Drain the write-combining buffers so the frame is complete
+    asm volatile("sfence" ::: "memory");
+    
+    uint64_t cycles = cpu_read_tsc() - start;
+    fbcon_state.presents++;
+    fbcon_state.cells_drawn += drawn;
+    fbcon_state.last_cells = drawn;
+    fbcon_state.last_present_cycles = cycles;
+    if (cycles > fbcon_state.max_present_cycles) {
+        fbcon_state.max_present_cycles = cycles;
+    }
+}
+
+static void fbcon_init_grid(void) {
+    for (uint32_t row = 0; row < FBCON_MAX_ROWS; row++) {
+        for (uint32_t col = 0; col < FBCON_MAX_COLS; col++) {
+            fbcon_text[row][col] = ' ';
+            fbcon_shown[row][col] = 0;  // Nothing matches: first present draws all
+        }
+        fbcon_reset_dirty(row);
+        if (row < fbcon_state.rows) {
+            fbcon_mark_dirty(row, 0, fbcon_state.cols);
+        }
+    }
+    
+    for (uint32_t g = 0; g < FBCON_GLYPH_SLOTS; g++) {
+        fbcon_vga_map[g] = (g >= ' ' && g < 0x7F) ? g : FBCON_GLYPH_UNKNOWN;
+    }
+    for (uint32_t i = 0; i < FBCON_UNICODE_COUNT; i++) {
+        fbcon_vga_map[fbcon_unicode[i].glyph] = fbcon_unicode[i].vga;
+    }
+}
+
+// Runs after paging is set up: the framebuffer usually sits above the
+// first 1GB and needs its own write-combining mapping
+void fbcon_init(uint32_t multiboot_magic, uint64_t multiboot_info) {
+    console_write_string("Initializing screen console...\n");
+    
+    fbcon_mode_t mode = {0};
+    uint8_t type = 0;
+    uint8_t found = fbcon_parse_multiboot(multiboot_magic, multiboot_info, &mode, &type);
+    
+    if (found && type == MULTIBOOT2_FRAMEBUFFER_RGB && mode.bpp == 32 && mode.address) {
+        fbcon_state.mode = mode;
+        fbcon_state.write_combining = cpu_enable_write_combining();
+        uint64_t size = (uint64_t)mode.pitch * mode.height;
+        uint64_t cache = fbcon_state.write_combining ? PAGE_WRITE_COMBINING : PAGE_PCD;
+        if (memory_map_mmio(mode.address, size, cache) && fbcon_build_glyph_cache()) {
+            fbcon_state.backend = FBCON_BACKEND_LFB;
+            fbcon_state.cols = mode.width / FBCON_GLYPH_WIDTH;
+            fbcon_state.rows = mode.height / FBCON_GLYPH_HEIGHT;
+            if (fbcon_state.cols > FBCON_MAX_COLS) fbcon_state.cols = FBCON_MAX_COLS;
+            if (fbcon_state.rows > FBCON_MAX_ROWS) fbcon_state.rows = FBCON_MAX_ROWS;
+        } else {
+            fbcon_state.write_combining = 0;
+            log_warn("Could not map the framebuffer, using VGA text\n");
+        }
+    } else if (found && type == MULTIBOOT2_FRAMEBUFFER_RGB) {
+        log_warn("%u bpp framebuffer not supported, using VGA text\n", mode.bpp);
+    }
+    
+    if (fbcon_state.backend == FBCON_BACKEND_NONE) {
+        fbcon_state.backend = FBCON_BACKEND_VGA_TEXT;
+        fbcon_state.cols = FBCON_VGA_COLS;
+        fbcon_state.rows = FBCON_VGA_ROWS;
+    }
+    
+    fbcon_init_grid();
+    
+    if (fbcon_state.backend == FBCON_BACKEND_LFB) {
+        kprintf("  Framebuffer %ux%u at 0x%lx, %u x %u cells, %s\n",
+                mode.width, mode.height, mode.address, fbcon_state.cols, fbcon_state.rows,
+                fbcon_state.write_combining ? "write-combining" : "uncached");
+    } else {
+        console_write_string("  VGA text mode, 80 x 25 cells\n");
+    }
+}
+
+void fbcon_print_status(void) {
+    if (fbcon_state.backend == FBCON_BACKEND_NONE) return;
+    
+    uint32_t mhz = cpu_get_tsc_mhz();
+    kprintf("Screen: %s, %lu presents, %lu cells drawn, %lu scrolls\n",
+            fbcon_state.backend == FBCON_BACKEND_LFB ? "framebuffer" : "VGA text",
+            fbcon_state.presents, fbcon_state.cells_drawn, fbcon_state.scrolls);
+    kprintf("  Last present: %u cells in 0x%lx cycles, max 0x%lx cycles",
+            fbcon_state.last_cells, fbcon_state.last_present_cycles, fbcon_state.max_present_cycles);
+    if (mhz) {
+        kprintf(" (max %lu us)", fbcon_state.max_present_cycles / mhz);
+    }
+    console_write_string("\n");
+}
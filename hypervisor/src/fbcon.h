@@ -0,0 +1,98 @@
+#ifndef FBCON_H
+#define FBCON_H
+
+#include "types.h"
+
+// Screen console. Text goes into a character grid; fbcon_present() diffs
+// the grid against what is on screen and redraws only changed cells,
+// either as cached glyphs on the Multiboot2 linear framebuffer or as
+// VGA text cells when GRUB left the display in text mode.
+#define MULTIBOOT2_TAG_FRAMEBUFFER 8
+#define MULTIBOOT2_FRAMEBUFFER_RGB 1
+
+#define FBCON_BACKEND_NONE 0
+#define FBCON_BACKEND_VGA_TEXT 1
+#define FBCON_BACKEND_LFB 2
+
+#define FBCON_GLYPH_WIDTH 8
+#define FBCON_GLYPH_HEIGHT 16
+#define FBCON_GLYPH_SLOTS 256
+#define FBCON_MAX_COLS 320  // 2560 pixels
+#define FBCON_MAX_ROWS 100  // 1600 pixels
+
+#define FBCON_VGA_ADDRESS 0xB8000
+#define FBCON_VGA_COLS 80
+#define FBCON_VGA_ROWS 25
+#define FBCON_VGA_ATTR 0x0F  // White on black
+
+#define FBCON_FG_RGB 0xE0E0E0
+#define FBCON_BG_RGB 0x000000
+
+// Glyphs above ASCII, decoded from the UTF-8 the dashboard prints
+#define FBCON_GLYPH_BOX_H 0x80    // U+2500
+#define FBCON_GLYPH_BOX_V 0x81    // U+2502
+#define FBCON_GLYPH_BOX_DR 0x82   // U+250C
+#define FBCON_GLYPH_BOX_DL 0x83   // U+2510
+#define FBCON_GLYPH_BOX_UR 0x84   // U+2514
+#define FBCON_GLYPH_BOX_UL 0x85   // U+2518
+#define FBCON_GLYPH_DBL_H 0x86    // U+2550
+#define FBCON_GLYPH_DBL_V 0x87    // U+2551
+#define FBCON_GLYPH_DBL_DR 0x88   // U+2554
+#define FBCON_GLYPH_DBL_DL 0x89   // U+2557
+#define FBCON_GLYPH_DBL_UR 0x8A   // U+255A
+#define FBCON_GLYPH_DBL_UL 0x8B   // U+255D
+#define FBCON_GLYPH_ARROW_R 0x8C  // U+2192
+#define FBCON_GLYPH_BLOCK_1 0x8D  // U+2581..U+2588, one to eight eighths
+#define FBCON_GLYPH_LAST 0x94
+#define FBCON_GLYPH_UNKNOWN '?'
+
+// ANSI escapes understood: CSI row;col H, CSI 2 J, CSI K
+#define FBCON_ESC_NONE 0
+#define FBCON_ESC_START 1  // Seen ESC
+#define FBCON_ESC_CSI 2    // Seen ESC [
+#define FBCON_ESC_PARAMS 2
+
+typedef struct {
+    uint64_t address;
+    uint32_t pitch;   // Bytes per scanline
+    uint32_t width;
+    uint32_t height;
+    uint8_t bpp;
+    uint8_t red_shift;
+    uint8_t red_bits;
+    uint8_t green_shift;
+    uint8_t green_bits;
+    uint8_t blue_shift;
+    uint8_t blue_bits;
+} fbcon_mode_t;
+
+typedef struct {
+    uint8_t backend;
+    uint8_t write_combining;
+    fbcon_mode_t mode;
+    uint32_t cols;
+    uint32_t rows;
+    uint32_t cursor_row;
+    uint32_t cursor_col;
+    uint32_t utf8_codepoint;  // Partial sequence being decoded
+    uint8_t utf8_remaining;
+    uint8_t esc_state;
+    uint8_t esc_count;
+    uint16_t esc_params[FBCON_ESC_PARAMS];
+    volatile uint8_t dirty;   // Any row has a pending span
+    uint32_t *glyph_cache;    // Every glyph pre-rendered in the pixel format
+    uint64_t presents;
+    uint64_t cells_drawn;
+    uint32_t last_cells;
+    uint64_t last_present_cycles;
+    uint64_t max_present_cycles;
+    uint64_t scrolls;
+} fbcon_state_t;
+
+void fbcon_init(uint32_t multiboot_magic, uint64_t multiboot_info);
+void fbcon_write(const char *str);
+uint8_t fbcon_is_active(void);
+void fbcon_present(void);
+void fbcon_print_status(void);
+
+#endif
@@ -1,23 +1,25 @@
 #include "input_manager.h"
 #include "console.h"
 #include "system_manager.h"
+#include "xhci.h"
+#include "cpu.h"
+#include "iommu.h"
 #include "pci.h"
+#include "trace.h"
+#include "kprintf.h"
 #include "types.h"
 
 static input_device_t input_device = {0};
+static input_handoff_t input_handoff = {0};
 
-// USB helper - read PCI config for USB controller
-static uint32_t usb_get_device_info(uint16_t bus, uint16_t dev, uint16_t func, uint16_t offset) {
-    uint32_t addr = (bus << 16) | (dev << 11) | (func << 8) | (offset & 0xFC);
-    uint32_t cfg_addr = addr | 0x80000000;
-    
-    asm volatile("mov $0xCF8, %%dx; outl %%eax, %%dx" : : "a"(cfg_addr));
-    
-    uint32_t result;
-    asm volatile("mov $0xCFC, %%dx; inl %%dx, %%eax" : "=a"(result));
-    
-    return result;
-}
+// Ctrl+Alt+O switches cells, Ctrl+Alt+T dumps the trace rings
+#define HOTKEY_CHORD_WORD(key, w) (KEY_WORD_BIT(KEY_LCTRL, w) | KEY_WORD_BIT(KEY_LALT, w) | KEY_WORD_BIT(key, w))
+static const uint64_t hotkey_chord[KEY_BITMAP_WORDS] = {
+    HOTKEY_CHORD_WORD(KEY_O, 0), HOTKEY_CHORD_WORD(KEY_O, 1), HOTKEY_CHORD_WORD(KEY_O, 2), HOTKEY_CHORD_WORD(KEY_O, 3)
+};
+static const uint64_t trace_chord[KEY_BITMAP_WORDS] = {
+    HOTKEY_CHORD_WORD(KEY_T, 0), HOTKEY_CHORD_WORD(KEY_T, 1), HOTKEY_CHORD_WORD(KEY_T, 2), HOTKEY_CHORD_WORD(KEY_T, 3)
+};
 
 void input_manager_init(void) {
     console_write_string("Initializing Input Manager...\n");
@@ -26,9 +28,9 @@ void input_manager_init(void) {
     input_device.state = KEYBOARD_STATE_READY;
     input_device.interrupt_count = 0;
     input_device.device_count = 0;
-    input_device.keys.ctrl_pressed = 0;
-    input_device.keys.alt_pressed = 0;
-    input_device.keys.shift_pressed = 0;
+    for (int i = 0; i < KEY_BITMAP_WORDS; i++) {
+        input_device.keys.down[i] = 0;
+    }
     input_device.keys.last_key = 0;
     input_device.keys.key_count = 0;
     
@@ -37,48 +39,70 @@ void input_manager_init(void) {
     console_write_string("Input Manager initialized\n");
 }
 
+// The handoff controller is the first xHCI left over after the hypervisor
+// claimed its own and the boot policy ran: a group no one else owns
+static void input_manager_setup_handoff(void) {
+    for (uint32_t i = 0; i < pci_get_device_count(); i++) {
+        const pci_device_info_t *info = pci_get_device(i);
+        if (info->class_code != PCI_CLASS_USB || info->prog_if != XHCI_PROG_IF) continue;
+        
+        uint8_t group_id = iommu_get_device_group(info->bdf);
+        const iommu_group_t *group = iommu_get_group(group_id);
+        if (!group || group->assigned || group->hypervisor_owned) continue;
+        
+        uint8_t owner_cell = system_manager_get_active_cell();
+        if (!iommu_assign_group(group_id, owner_cell)) continue;
+        
+        input_handoff.enabled = 1;
+        input_handoff.bdf = info->bdf;
+        input_handoff.msi_cap = info->msi_cap;
+        input_handoff.group_id = group_id;
+        input_handoff.owner_cell = owner_cell;
+        
+        console_write_string("  Input handoff controller: ");
+        char buf[32];
+        itoa(PCI_BDF_BUS(info->bdf), buf, 16);
+        console_write_string(buf);
+        console_write_string(":");
+        itoa(PCI_BDF_DEVICE(info->bdf), buf, 16);
+        console_write_string(buf);
+        console_write_string(".");
+        itoa(PCI_BDF_FUNCTION(info->bdf), buf, 10);
+        console_write_string(buf);
+        console_write_string(" (group ");
+        itoa(group_id, buf, 10);
+        console_write_string(buf);
+        console_write_string(")\n");
+        return;
+    }
+    
+    console_write_string("  No spare xHCI for input handoff\n");
+}
+
 void input_manager_detect_usb_devices(void) {
     console_write_string("Detecting USB input devices...\n");
     
-    uint32_t device_count = 0;
+    // The hypervisor drives its own xHCI; keyboards found there are the
+    // source of every scan code
+    xhci_init();
+    input_manager_setup_handoff();
     
-    // Scan PCI bus for USB controllers and HID devices
-    for (uint16_t bus = 0; bus < 256; bus++) {
-        for (uint16_t dev = 0; dev < 32; dev++) {
-            uint32_t vendor_device = usb_get_device_info(bus, dev, 0, 0x00);
-            uint16_t vendor = vendor_device & 0xFFFF;
-            uint16_t device_id = (vendor_device >> 16) & 0xFFFF;
-            
-            if (vendor == 0xFFFF) continue;
-            
-            // Look for USB HID keyboards
-            // Common USB keyboard vendors: Logitech (0x046D), Microsoft (0x045E), etc.
-            if ((vendor == 0x046D || vendor == 0x045E || vendor == 0x1234) && device_count < MAX_USB_DEVICES) {
-                usb_device_t *usb_dev = &input_device.devices[device_count];
-                usb_dev->vendor_id = vendor;
-                usb_dev->product_id = device_id;
-                usb_dev->bus = bus;
-                usb_dev->device = dev;
-                usb_dev->endpoint = 0x81;  // Standard interrupt endpoint
-                
-                console_write_string("  USB Keyboard found: ");
-                char buf[32];
-                itoa(vendor, buf, 16);
-                console_write_string(buf);
-                console_write_string(":");
-                itoa(device_id, buf, 16);
-                console_write_string(buf);
-                console_write_string("\n");
-                
-                device_count++;
-            }
-        }
+    uint32_t device_count = 0;
+    for (uint32_t i = 0; i < xhci_get_keyboard_count() && device_count < MAX_USB_DEVICES; i++) {
+        const xhci_keyboard_t *kbd = xhci_get_keyboard(i);
+        usb_device_t *usb_dev = &input_device.devices[device_count];
+        usb_dev->vendor_id = kbd->vendor_id;
+        usb_dev->product_id = kbd->product_id;
+        usb_dev->bus = kbd->port;       // Root port on the hypervisor's xHCI
+        usb_dev->device = kbd->slot_id;
+        usb_dev->endpoint = kbd->endpoint;
+        device_count++;
     }
     
     input_device.device_count = device_count;
     
     if (device_count == 0) {
-        console_write_string("  No USB keyboards detected, using simulated input\n");
+        console_write_string("  No USB keyboards detected, hotkey unavailable\n");
         input_device.state = KEYBOARD_STATE_READY;
     } else {
         console_write_string("USB input devices detected: ");
@@ -90,78 +114,171 @@ void input_manager_detect_usb_devices(void) {
 }
 
 uint8_t input_manager_read_key(void) {
-    // In a real implementation, would read from USB interrupt endpoint
-    // For now, simulate waiting for input
-    static uint8_t key = 0;
+    // Scan codes are pushed from the xHCI interrupt; there is nothing to poll
+    return input_device.keys.last_key;
+}
+
+// Producer, interrupt context: one entry store and one index store. When
+// the ring is full the newest code is dropped and counted.
+void input_manager_push_scancode(uint8_t scancode, uint64_t tsc) {
+    scancode_ring_t *ring = &input_device.ring;
+    uint32_t head = ring->head;
+    if (head - ring->tail >= SCANCODE_RING_SIZE) {
+        ring->overflows++;
+        return;
+    }
     
+    scancode_event_t *event = &ring->events[head & (SCANCODE_RING_SIZE - 1)];
+    event->scancode = scancode;
+    event->tsc = tsc;
+    asm volatile("" ::: "memory");  // Entry before index (x86 keeps store order)
+    ring->head = head + 1;
     input_device.interrupt_count++;
-    
-    return key;
 }
 
+uint8_t input_manager_has_pending(void) {
+    return input_device.ring.head != input_device.ring.tail;
+}
+
+// Set or clear the key's bit without branching on press/release
 void input_manager_process_key(uint8_t scancode) {
-    // Handle key press vs key release
-    uint8_t is_release = (scancode & KEY_RELEASED) != 0;
     uint8_t key = scancode & ~KEY_RELEASED;
+    uint64_t pressed = 0 - (uint64_t)((scancode & KEY_RELEASED) == 0);
+    uint64_t bit = 1UL << (key & 63);
+    uint64_t *word = &input_device.keys.down[key >> 6];
     
-    if (is_release) {
-        // Key released
-        switch (key) {
-            case KEY_LCTRL:
-                input_device.keys.ctrl_pressed = 0;
-                break;
-            case KEY_LALT:
-                input_device.keys.alt_pressed = 0;
-                break;
-            case KEY_LSHIFT:
-            case KEY_RSHIFT:
-                input_device.keys.shift_pressed = 0;
-                break;
-        }
-    } else {
-        // Key pressed
-        switch (key) {
-            case KEY_LCTRL:
-                input_device.keys.ctrl_pressed = 1;
-                break;
-            case KEY_LALT:
-                input_device.keys.alt_pressed = 1;
-                break;
-            case KEY_LSHIFT:
-            case KEY_RSHIFT:
-                input_device.keys.shift_pressed = 1;
-                break;
-            default:
-                input_device.keys.last_key = key;
-                input_device.keys.key_count++;
-                break;
-        }
+    *word = (*word & ~bit) | (bit & pressed);
+    input_device.keys.key_count += pressed & 1;
+    input_device.keys.last_key = (key & pressed) | (input_device.keys.last_key & ~pressed);
+}
+
+// True on the press that completes the chord: every chord key held and
+// this code is one of them being pressed
+static uint8_t input_manager_check_chord(const uint64_t *chord, uint8_t scancode) {
+    uint8_t key = scancode & ~KEY_RELEASED;
+    uint64_t missing = 0;
+    for (int i = 0; i < KEY_BITMAP_WORDS; i++) {
+        missing |= chord[i] & ~input_device.keys.down[i];
     }
+    uint64_t edge = chord[key >> 6] & (1UL << (key & 63)) & (0 - (uint64_t)!(scancode & KEY_RELEASED));
+    return (missing == 0) & (edge != 0);
 }
 
-void input_manager_check_hotkey(void) {
-    // Check for Ctrl+Alt+O
-    if (input_device.keys.ctrl_pressed && 
-        input_device.keys.alt_pressed && 
-        input_device.keys.last_key == KEY_O) {
-        
+uint8_t input_manager_check_hotkey(uint8_t scancode) {
+    return input_manager_check_chord(hotkey_chord, scancode);
+}
+
+// Consumer, control loop: drain everything queued since the last call and
+// publish the tail once. The first chord completion in a batch posts the
+// switch with the stamp of the interrupt that delivered it.
+uint32_t input_manager_process_pending(void) {
+    scancode_ring_t *ring = &input_device.ring;
+    uint32_t tail = ring->tail;
+    uint32_t head = ring->head;
+    asm volatile("" ::: "memory");  // Index before entries
+    
+    uint32_t count = head - tail;
+    if (count == 0 || input_device.state != KEYBOARD_STATE_READY) {
+        ring->tail = head;
+        return 0;
+    }
+    
+    uint8_t hotkey = 0;
+    uint8_t dump = 0;
+    uint64_t hotkey_tsc = 0;
+    for (; tail != head; tail++) {
+        const scancode_event_t *event = &ring->events[tail & (SCANCODE_RING_SIZE - 1)];
+        input_manager_process_key(event->scancode);
+        if (!hotkey && input_manager_check_hotkey(event->scancode)) {
+            hotkey = 1;
+            hotkey_tsc = event->tsc;
+        }
+        dump |= input_manager_check_chord(trace_chord, event->scancode);
+    }
+    ring->tail = tail;
+    TRACE(INPUT_BATCH, count, hotkey);
+    
+    ring->batches++;
+    if (count > ring->max_batch) {
+        ring->max_batch = count;
+    }
+    
+    if (hotkey) {
+        // Only post the request; the control loop performs the switch
+        system_manager_post_switch(hotkey_tsc);
         console_write_string("\n[INPUT] Hotkey detected: Ctrl+Alt+O\n");
+    }
+    if (dump) {
+        trace_dump_request();
+    }
+    return count;
+}
+
+const scancode_ring_t *input_manager_get_ring(void) {
+    return &input_device.ring;
+}
+
+// MSI destination for the cell: its first online core. With AMD-Vi
+// interrupt remapping the IRT already forces the destination; rewriting
+// the address covers controllers behind a non-remapping IOMMU.
+static void input_manager_retarget_msi(uint8_t cell_id) {
+    if (!input_handoff.msi_cap) return;
+    
+    for (uint32_t i = 0; i < cpu_get_count(); i++) {
+        const cpu_info_t *cpu = cpu_get_info(i);
+        if (!cpu->online || cpu->assigned_to_linux != (cell_id == 0)) continue;
         
-        // Trigger OS switch
-        system_manager_switch_cells();
-        
-        // Clear the key state to avoid repeated switches
-        input_device.keys.last_key = 0;
+        uint16_t bus = PCI_BDF_BUS(input_handoff.bdf);
+        uint16_t dev = PCI_BDF_DEVICE(input_handoff.bdf);
+        uint16_t func = PCI_BDF_FUNCTION(input_handoff.bdf);
+        uint16_t offset = input_handoff.msi_cap + 4;
+        uint32_t address = pci_config_read32(bus, dev, func, offset);
+        pci_config_write32(bus, dev, func, offset, (address & ~MSI_DEST_MASK) | MSI_ADDRESS(cpu->apic_id));
+        return;
     }
 }
 
+// Hand the dedicated input controller to the cell about to run. Called on
+// the switch path after the old cell's cores are frozen and before the new
+// cell's are released, so neither cell sees the other's controller.
 void input_manager_route_input(uint8_t cell_id) {
-    // In a real implementation, this would:
-    // - Determine which cell should receive input
-    // - Filter/allow input based on active cell
-    // - Handle input redirection via IOMMU
+    if (cell_id >= 2 || !input_handoff.enabled || input_handoff.owner_cell == cell_id) return;
+    
+    // DMA or interrupts the controller raised while its group was moving
+    // are input lost to the handoff; faults outside that window belong to
+    // a cell's own driver
+    uint32_t faults = iommu_get_group_fault_count(input_handoff.group_id);
+    
+    uint64_t start = cpu_read_tsc();
+    TRACE(INPUT_HANDOFF_BEGIN, cell_id, input_handoff.group_id);
+    iommu_assign_group(input_handoff.group_id, cell_id);
+    input_manager_retarget_msi(cell_id);
+    uint64_t cycles = cpu_read_tsc() - start;
+    TRACE(INPUT_HANDOFF_END, cell_id, cycles);
     
-    if (cell_id >= 2) return;
+    // Window faults may still be in the event log with their MSI pending;
+    // input_manager_poll_handoff() counts them once it has been taken
+    input_handoff.fault_base = faults;
+    input_handoff.fault_check = 1;
+    
+    input_handoff.owner_cell = cell_id;
+    input_handoff.handoffs++;
+    input_handoff.last_cycles = cycles;
+    if (cycles > input_handoff.max_cycles) {
+        input_handoff.max_cycles = cycles;
+    }
+    kprintf("Input controller handed to %s in 0x%lx cycles\n", cell_id == 0 ? "Linux" : "Windows", cycles);
+}
+
+// Control loop, the pass after a handoff. Interrupts have been on since
+// the switch, so the event log MSI has drained the window's faults; a
+// fault the new owner raised before this pass is counted with them.
+void input_manager_poll_handoff(void) {
+    if (!input_handoff.fault_check) return;
+    
+    input_handoff.fault_check = 0;
+    input_handoff.dropped_last = iommu_get_group_fault_count(input_handoff.group_id) - input_handoff.fault_base;
+    input_handoff.dropped_total += input_handoff.dropped_last;
 }
 
 void input_manager_print_status(void) {
@@ -184,38 +301,23 @@ void input_manager_print_status(void) {
     }
     console_write_string("\n");
     
-    console_write_string("  USB devices: ");
-    char buf[32];
-    itoa(input_device.device_count, buf, 10);
-    console_write_string(buf);
-    console_write_string("\n");
+    kprintf("  USB devices: %u\n", input_device.device_count);
+    kprintf("  Interrupt count: %u\n", input_device.interrupt_count);
+    kprintf("  Keys processed: %u\n", input_device.keys.key_count);
+    kprintf("  Scan code ring: %u batches, max batch %u, overflows %u\n",
+            input_device.ring.batches, input_device.ring.max_batch, input_device.ring.overflows);
     
-    console_write_string("  Interrupt count: ");
-    itoa(input_device.interrupt_count, buf, 10);
-    console_write_string(buf);
-    console_write_string("\n");
+    xhci_print_status();
     
-    console_write_string("  Keys processed: ");
-    itoa(input_device.keys.key_count, buf, 10);
-    console_write_string(buf);
-    console_write_string("\n");
+    if (input_handoff.enabled) {
+        kprintf("  Handoff controller: %s, %u handoffs, last/max 0x%lx / 0x%lx cycles\n",
+                input_handoff.owner_cell == 0 ? "Linux" : "Windows", input_handoff.handoffs,
+                input_handoff.last_cycles, input_handoff.max_cycles);
+        kprintf("  Input dropped at handoff: %u (last %u)\n",
+                input_handoff.dropped_total, input_handoff.dropped_last);
+    }
 }
 
 void input_manager_handle_interrupt(void) {
-    if (input_device.state != KEYBOARD_STATE_READY) {
-        return;
-    }
-    
-    // Read key from USB controller
-    uint8_t scancode = input_manager_read_key();
-    
-    // Process the key
-    input_manager_process_key(scancode);
-    
-    // Check for hotkeys
-    input_manager_check_hotkey();
-    
-    // Route input to active cell
-    uint8_t active_cell = system_manager_get_active_cell();
-    input_manager_route_input(active_cell);
+    input_manager_push_scancode(input_manager_read_key(), cpu_read_tsc());
 }
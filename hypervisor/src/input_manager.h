@@ -11,6 +11,7 @@
 // USB HID scan codes (same as PS/2 for compatibility)
 #define KEY_ESCAPE 0x01
 #define KEY_1 0x02
+#define KEY_T 0x14
 #define KEY_O 0x18
 #define KEY_LCTRL 0x1D
 #define KEY_LSHIFT 0x2A
@@ -37,20 +38,58 @@ typedef struct {
     uint8_t endpoint;
 } usb_device_t;
 
+// Scan code ring between the HID interrupt (producer) and the control
+// loop (consumer)
+#define SCANCODE_RING_SIZE 256  // Power of two
+#define KEY_BITMAP_WORDS 4      // One bit per key code, 256 codes
+#define KEY_WORD_BIT(key, word) (((key) >> 6) == (word) ? 1UL << ((key) & 63) : 0)
+
+typedef struct {
+    uint8_t scancode;
+    uint64_t tsc;  // TSC stamp of the interrupt that delivered the key
+} scancode_event_t;
+
+typedef struct {
+    scancode_event_t events[SCANCODE_RING_SIZE];
+    volatile uint32_t head;  // Written only by the producer
+    volatile uint32_t tail;  // Written only by the consumer
+    uint32_t overflows;      // Codes dropped because the ring was full
+    uint32_t batches;
+    uint32_t max_batch;      // High-water mark seen by the consumer
+} scancode_ring_t;
+
 // Keyboard state tracking
 typedef struct {
-    uint8_t ctrl_pressed;
-    uint8_t alt_pressed;
-    uint8_t shift_pressed;
+    uint64_t down[KEY_BITMAP_WORDS];  // Keys currently held
     uint8_t last_key;
     uint32_t key_count;
 } keyboard_state_t;
 
+// Dedicated input controller whose ownership follows the active cell.
+// Handoff re-points its IOMMU domain and interrupt target; keystrokes
+// never pass through the hypervisor.
+typedef struct {
+    uint8_t enabled;
+    uint16_t bdf;
+    uint8_t msi_cap;
+    uint32_t group_id;
+    uint8_t owner_cell;
+    uint32_t handoffs;
+    uint64_t last_cycles;
+    uint64_t max_cycles;
+    uint32_t dropped_last;    // Group faults logged during the last handoff
+    uint32_t dropped_total;
+    uint32_t fault_base;      // Group fault count when the handoff began
+    uint8_t fault_check;      // dropped_last not yet counted
+    
+} input_handoff_t;
+
 typedef struct {
     uint8_t device_type;
     uint8_t state;
     uint32_t interrupt_count;
     keyboard_state_t keys;
+    scancode_ring_t ring;
     usb_device_t devices[MAX_USB_DEVICES];
     uint32_t device_count;
 } input_device_t;
@@ -58,10 +97,15 @@ typedef struct {
 void input_manager_init(void);
 void input_manager_detect_usb_devices(void);
 void input_manager_handle_interrupt(void);
+void input_manager_push_scancode(uint8_t scancode, uint64_t tsc);
+uint8_t input_manager_has_pending(void);
+uint32_t input_manager_process_pending(void);
+void input_manager_poll_handoff(void);
 uint8_t input_manager_read_key(void);
 void input_manager_process_key(uint8_t scancode);
-void input_manager_check_hotkey(void);
+uint8_t input_manager_check_hotkey(uint8_t scancode);
 void input_manager_route_input(uint8_t cell_id);
 void input_manager_print_status(void);
+const scancode_ring_t *input_manager_get_ring(void);
 
 #endif
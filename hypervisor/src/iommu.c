@@ -1,146 +1,1246 @@
 #include "iommu.h"
+#include "acpi.h"
 #include "console.h"
+#include "cpu.h"
+#include "memory.h"
 #include "pci.h"
+#include "vtd.h"
+#include "xhci.h"
+#include "trace.h"
+#include "kprintf.h"
 #include "types.h"
 
 static iommu_t iommu_state = {0};
 
-// Read from PCI configuration space (bus, device, function, offset)
-static uint32_t pci_read_config(uint16_t bus, uint16_t dev, uint16_t func, uint16_t offset) {
-    uint32_t addr = (bus << 16) | (dev << 11) | (func << 8) | (offset & 0xFC);
-    uint32_t result;
-    
-    // Write address to CONFIG_ADDRESS (0xCF8)
-    asm volatile("mov $0xCF8, %%dx; outl %%eax, %%dx"
-                 : : "a"(addr | 0x80000000));
-    
-    // Read from CONFIG_DATA (0xCFC)
-    asm volatile("mov $0xCFC, %%dx; inl %%dx, %%eax"
-                 : "=a"(result));
+// Per-device fault counters, indexed by AMD-Vi device ID
+static uint32_t device_fault_counts[AMDVI_DEV_TABLE_ENTRIES];
+
+// BDF -> owner/group, so ownership checks on interrupt and fault paths are
+// a single load instead of a walk over every group
+static uint16_t device_owner[AMDVI_DEV_TABLE_ENTRIES];
+
+static pcie_device_t *iommu_find_device(uint16_t device_id) {
+    uint16_t entry = device_owner[device_id];
+    if (!(entry & IOMMU_OWNER_VALID)) {
+        return 0;
+    }
     
-    return result;
+    iommu_group_t *group = &iommu_state.groups[entry & IOMMU_OWNER_GROUP_MASK];
+    for (uint8_t j = 0; j < group->device_count; j++) {
+        pcie_device_t *dev = &group->devices[j];
+        if (AMDVI_DEVICE_ID(dev->bus, dev->device, dev->function) == device_id) {
+            return dev;
+        }
+    }
+    return 0;
 }
 
-// Write to PCI configuration space
-static void pci_write_config(uint16_t bus, uint16_t dev, uint16_t func, uint16_t offset, uint32_t value) {
-    uint32_t addr = (bus << 16) | (dev << 11) | (func << 8) | (offset & 0xFC);
+// IVRS names the IOMMU function (00:00.2 on this board) and its MMIO base
+// directly, so no config space probing is needed
+static uint8_t iommu_detect_ivrs(void) {
+    const acpi_info_t *acpi = acpi_get_info();
+    if (acpi->ivhd_unit_count == 0) {
+        return 0;
+    }
     
-    // Write address to CONFIG_ADDRESS
-    asm volatile("mov $0xCF8, %%dx; outl %%eax, %%dx"
-                 : : "a"(addr | 0x80000000));
+    const acpi_ivhd_unit_t *unit = &acpi->ivhd_units[0];
+    iommu_state.type = IOMMU_TYPE_AMDVI;
+    iommu_state.enabled = 1;
+    iommu_state.pci_bus = (unit->device_id >> 8) & 0xFF;
+    iommu_state.pci_device = (unit->device_id >> 3) & 0x1F;
+    iommu_state.pci_function = unit->device_id & 0x7;
+    iommu_state.base_addr = unit->base_addr & ~0x3FFFUL;
     
-    // Write to CONFIG_DATA
-    asm volatile("mov $0xCFC, %%dx; outl %%eax, %%dx"
-                 : : "a"(value));
+    char buf[32];
+    console_write_string("  Found AMD-Vi IOMMU via IVRS at ");
+    itoa(iommu_state.pci_bus, buf, 16);
+    console_write_string(buf);
+    console_write_string(":");
+    itoa(iommu_state.pci_device, buf, 16);
+    console_write_string(buf);
+    console_write_string(".");
+    itoa(iommu_state.pci_function, buf, 10);
+    console_write_string(buf);
+    console_write_string("\n  IOMMU MMIO base: 0x");
+    console_write_hex(iommu_state.base_addr);
+    console_write_string("\n  IVHD device ranges: ");
+    itoa(acpi->ivhd_range_count, buf, 10);
+    console_write_string(buf);
+    console_write_string("\n");
+    return 1;
 }
 
 void iommu_detect(void) {
     console_write_string("Detecting IOMMU...\n");
     
-    // Scan PCI bus 0 for IOMMU capability
-    // Look for AMD-Vi (vendor 0x1022, device 0x1447-0x1457)
-    for (uint16_t dev = 0; dev < 32; dev++) {
-        uint32_t vendor_device = pci_read_config(0, dev, 0, 0x00);
-        uint16_t vendor = vendor_device & 0xFFFF;
-        uint16_t device = (vendor_device >> 16) & 0xFFFF;
+    if (iommu_detect_ivrs()) {
+        return;
+    }
+    
+    // No IVRS: look the IOMMU function up in the PCI topology
+    // Look for AMD-Vi (vendor 0x1022, device 0x1447-0x1457, or any AMD
+    // function with the IOMMU class code, which also covers QEMU's amd-iommu)
+    for (uint32_t i = 0; i < pci_get_device_count(); i++) {
+        const pci_device_info_t *info = pci_get_device(i);
+        uint16_t vendor = info->vendor_id;
+        uint16_t device = info->device_id;
         
         // AMD-Vi IOMMU detection
-        if (vendor == 0x1022 && (device >= 0x1447 && device <= 0x1457)) {
+        if (vendor == 0x1022 &&
+            ((device >= 0x1447 && device <= 0x1457) || info->class_code == PCI_CLASS_IOMMU)) {
+            uint16_t bus = PCI_BDF_BUS(info->bdf);
+            uint16_t dev = PCI_BDF_DEVICE(info->bdf);
+            uint16_t func = PCI_BDF_FUNCTION(info->bdf);
+            
             console_write_string("  Found AMD-Vi IOMMU at PCI ");
             char buf[32];
             itoa(dev, buf, 10);
             console_write_string(buf);
+            console_write_string(".");
+            itoa(func, buf, 10);
+            console_write_string(buf);
             console_write_string("\n");
             
             iommu_state.type = IOMMU_TYPE_AMDVI;
             iommu_state.enabled = 1;
+            iommu_state.pci_bus = bus;
+            iommu_state.pci_device = dev;
+            iommu_state.pci_function = func;
             
-            // Get base address from capability structure
-            uint32_t cap_ptr = pci_read_config(0, dev, 0, 0x34) & 0xFF;
-            while (cap_ptr != 0) {
-                uint32_t cap = pci_read_config(0, dev, 0, cap_ptr);
-                uint8_t cap_id = cap & 0xFF;
+            // Get base address from the IOMMU (secure device) capability
+            uint8_t cap_ptr = pci_find_capability(bus, dev, func, PCI_CAP_ID_SECURE);
+            if (cap_ptr) {
+                uint32_t base_low = pci_config_read32(bus, dev, func, cap_ptr + AMDVI_CAP_BASE_LOW_OFFSET);
+                uint32_t base_high = pci_config_read32(bus, dev, func, cap_ptr + AMDVI_CAP_BASE_HIGH_OFFSET);
+                iommu_state.base_addr = ((uint64_t)base_high << 32) | (base_low & 0xFFFFF000);
                 
-                if (cap_id == 0x0F) {
-                    // IOMMU MMIO base is at offset cap_ptr + 4
-                    uint32_t base_low = pci_read_config(0, dev, 0, cap_ptr + 4);
-                    uint32_t base_high = pci_read_config(0, dev, 0, cap_ptr + 8);
-                    iommu_state.base_addr = ((uint64_t)base_high << 32) | (base_low & 0xFFFFF000);
-                    
-                    console_write_string("  IOMMU MMIO base: 0x");
-                    console_write_hex(iommu_state.base_addr);
-                    console_write_string("\n");
-                    break;
-                }
-                cap_ptr = (cap >> 8) & 0xFF;
+                console_write_string("  IOMMU MMIO base: 0x");
+                console_write_hex(iommu_state.base_addr);
+                console_write_string("\n");
             }
             return;
         }
     }
     
+    // No AMD-Vi function; Intel platforms describe VT-d units in ACPI DMAR
+    if (vtd_detect()) {
+        iommu_state.type = IOMMU_TYPE_INTEL_VTD;
+        iommu_state.enabled = 1;
+        iommu_state.base_addr = vtd_get_base();
+        return;
+    }
+    
     console_write_string("  No IOMMU detected\n");
     iommu_state.enabled = 0;
 }
 
+// Allocate a zeroed, page-aligned IO page table
+static uint64_t *iommu_alloc_table(void) {
+    uint64_t *table = (uint64_t *)memory_alloc_aligned(PAGE_SIZE_4K, PAGE_SIZE_4K);
+    if (!table) {
+        return 0;
+    }
+    
+    for (int i = 0; i < 512; i++) {
+        table[i] = 0;
+    }
+    
+    return table;
+}
+
+static void iommu_cmd_push(const amdvi_command_t *cmd);
+
+// Issue PPR responses the log interrupt deferred while the ring was busy.
+// Runs with busy set and interrupts off so nothing is deferred meanwhile.
+static void iommu_cmd_flush_deferred_ppr(void) {
+    amdvi_cmd_queue_t *q = &iommu_state.cmd;
+    uint64_t flags;
+    asm volatile("pushfq; pop %0; cli" : "=r"(flags) : : "memory");
+    for (uint32_t i = 0; i < q->deferred_ppr_count; i++) {
+        iommu_cmd_push(&q->deferred_ppr[i]);
+    }
+    q->deferred_ppr_count = 0;
+    asm volatile("push %0; popfq" : : "r"(flags) : "memory", "cc");
+}
+
+static void iommu_cmd_push(const amdvi_command_t *cmd) {
+    amdvi_cmd_queue_t *q = &iommu_state.cmd;
+    volatile uint64_t *head_reg = (volatile uint64_t *)(iommu_state.base_addr + AMDVI_MMIO_CMD_HEAD_OFFSET);
+    volatile uint64_t *tail_reg = (volatile uint64_t *)(iommu_state.base_addr + AMDVI_MMIO_CMD_TAIL_OFFSET);
+    
+    uint8_t was_busy = q->busy;
+    q->busy = 1;
+    
+    uint32_t next = (q->tail + 1) % AMDVI_CMD_BUF_ENTRIES;
+    
+    // Ring full: let the IOMMU drain a slot before overwriting it
+    while (next == ((*head_reg >> 4) & (AMDVI_CMD_BUF_ENTRIES - 1))) {
+        asm volatile("pause");
+    }
+    
+    q->buffer[q->tail] = *cmd;
+    q->tail = next;
+    q->stats.commands_issued++;
+    q->stats.last_batch_commands++;
+    
+    // Tail is a byte offset; the store makes the command visible
+    *tail_reg = (uint64_t)q->tail << 4;
+    
+    // A lone command may have been interrupted by the PPR log too
+    if (!was_busy && q->deferred_ppr_count) {
+        iommu_cmd_flush_deferred_ppr();
+    }
+    q->busy = was_busy;
+}
+
+static void iommu_cmd_push_inv_devtab(uint16_t device_id) {
+    amdvi_command_t cmd = {{0}};
+    cmd.data[0] = device_id;
+    cmd.data[1] = AMDVI_CMD_INVALIDATE_DEVTAB_ENTRY << AMDVI_CMD_OPCODE_SHIFT;
+    iommu_cmd_push(&cmd);
+}
+
+static void iommu_cmd_push_inv_irt(uint16_t device_id) {
+    amdvi_command_t cmd = {{0}};
+    cmd.data[0] = device_id;
+    cmd.data[1] = AMDVI_CMD_INVALIDATE_INT_TABLE << AMDVI_CMD_OPCODE_SHIFT;
+    iommu_cmd_push(&cmd);
+}
+
+// Encode an INVALIDATE_IOMMU_PAGES range. With S set, the run of one bits
+// above bit 12 gives the size, so round to the smallest naturally aligned
+// power-of-two span covering [start, end]
+static void iommu_cmd_push_inv_pages(uint16_t domain_id, uint64_t start, uint64_t end) {
+    amdvi_command_t cmd = {{0}};
+    uint64_t address = start & ~(uint64_t)(PAGE_SIZE_4K - 1);
+    uint32_t flags = AMDVI_CMD_INV_PAGES_PDE;
+    
+    if ((end >> 12) != (start >> 12)) {
+        uint64_t diff = start ^ end;
+        int msb = 63;
+        while (msb > 0 && !(diff & (1UL << msb))) msb--;
+        
+        if (msb > 51) {
+            address = 0x7FFFFFFFFFFFF000UL;  // Whole domain
+        } else {
+            address |= (1UL << msb) - 1;
+            address &= ~(uint64_t)(PAGE_SIZE_4K - 1);
+        }
+        flags |= AMDVI_CMD_INV_PAGES_S;
+    }
+    
+    cmd.data[1] = domain_id | (AMDVI_CMD_INVALIDATE_IOMMU_PAGES << AMDVI_CMD_OPCODE_SHIFT);
+    cmd.data[2] = (uint32_t)address | flags;
+    cmd.data[3] = (uint32_t)(address >> 32);
+    iommu_cmd_push(&cmd);
+}
+
+// Queue one COMPLETION_WAIT that stores a token and spin until the IOMMU
+// writes it back, which means every earlier command has finished
+static void iommu_cmd_completion_wait(void) {
+    amdvi_cmd_queue_t *q = &iommu_state.cmd;
+    amdvi_command_t cmd = {{0}};
+    uint64_t sem = (uint64_t)q->completion_sem;
+    uint64_t token = ++q->wait_token;
+    
+    cmd.data[0] = (uint32_t)(sem & 0xFFFFFFF8) | AMDVI_CMD_COMPLETION_WAIT_S;
+    cmd.data[1] = (uint32_t)((sem >> 32) & 0xFFFFF) | (AMDVI_CMD_COMPLETION_WAIT << AMDVI_CMD_OPCODE_SHIFT);
+    cmd.data[2] = (uint32_t)token;
+    cmd.data[3] = (uint32_t)(token >> 32);
+    iommu_cmd_push(&cmd);
+    q->stats.completion_waits++;
+    
+    uint32_t mhz = cpu_get_tsc_mhz();
+    uint64_t timeout = (uint64_t)(mhz ? mhz : 1000) * 1000 * AMDVI_CMD_WAIT_TIMEOUT_MS;
+    uint64_t start = cpu_read_tsc();
+    while (*q->completion_sem != token) {
+        if (cpu_read_tsc() - start >= timeout) {
+            q->stats.wait_timeouts++;
+            return;
+        }
+        asm volatile("pause");
+    }
+}
+
+static void iommu_queue_invalidate_device(uint16_t device_id) {
+    amdvi_cmd_queue_t *q = &iommu_state.cmd;
+    if (!q->ready || q->flush_all_devices) return;
+    
+    for (uint32_t i = 0; i < q->pending_device_count; i++) {
+        if (q->pending_devices[i] == device_id) {
+            q->stats.invalidations_coalesced++;
+            return;
+        }
+    }
+    
+    if (q->pending_device_count == AMDVI_CMD_MAX_PENDING_DEVICES) {
+        // Too many distinct devices; fall back to flushing them all
+        q->flush_all_devices = 1;
+        return;
+    }
+    q->pending_devices[q->pending_device_count++] = device_id;
+}
+
+static void iommu_queue_invalidate_pages(uint8_t cell_id, uint64_t iova, uint64_t size) {
+    amdvi_cmd_queue_t *q = &iommu_state.cmd;
+    if (!q->ready || cell_id >= IOMMU_MAX_DOMAINS || size == 0) return;
+    
+    uint64_t end = iova + size - 1;
+    if (q->pages_dirty[cell_id]) {
+        // Grow the domain's dirty span instead of adding a command
+        if (iova < q->pages_start[cell_id]) q->pages_start[cell_id] = iova;
+        if (end > q->pages_end[cell_id]) q->pages_end[cell_id] = end;
+        q->stats.invalidations_coalesced++;
+    } else {
+        q->pages_dirty[cell_id] = 1;
+        q->pages_start[cell_id] = iova;
+        q->pages_end[cell_id] = end;
+    }
+}
+
+// Open an ownership change. Table edits made until the matching commit
+// only queue invalidations; batches nest, the outermost commit flushes.
+void iommu_begin_ownership_change(void) {
+    if (iommu_state.type == IOMMU_TYPE_INTEL_VTD) {
+        vtd_begin_batch();
+        return;
+    }
+    iommu_state.cmd.batch_depth++;
+}
+
+// Emit the coalesced invalidations behind one COMPLETION_WAIT. Returns
+// the number of commands issued for this ownership change.
+uint32_t iommu_commit_ownership_change(void) {
+    amdvi_cmd_queue_t *q = &iommu_state.cmd;
+    
+    if (iommu_state.type == IOMMU_TYPE_INTEL_VTD) {
+        return vtd_commit_batch();
+    }
+    
+    if (q->batch_depth > 0) q->batch_depth--;
+    if (q->batch_depth > 0 || !q->ready) return 0;
+    
+    uint8_t dirty = q->flush_all_devices || q->pending_device_count ||
+                    q->pages_dirty[0] || q->pages_dirty[1] || q->pages_dirty[2];
+    if (!dirty) return 0;
+    
+    uint64_t start = cpu_read_tsc();
+    TRACE(IOMMU_BATCH_BEGIN, q->pending_device_count, q->flush_all_devices);
+    q->stats.last_batch_commands = 0;
+    q->busy = 1;
+    
+    if (q->flush_all_devices) {
+        for (uint32_t i = 0; i < iommu_state.group_count; i++) {
+            iommu_group_t *group = &iommu_state.groups[i];
+            for (uint8_t j = 0; j < group->device_count; j++) {
+                pcie_device_t *dev = &group->devices[j];
+                uint16_t device_id = AMDVI_DEVICE_ID(dev->bus, dev->device, dev->function);
+                iommu_cmd_push_inv_devtab(device_id);
+                iommu_cmd_push_inv_irt(device_id);
+            }
+        }
+    } else {
+        // A DTE change may also have swapped the interrupt table contents
+        for (uint32_t i = 0; i < q->pending_device_count; i++) {
+            iommu_cmd_push_inv_devtab(q->pending_devices[i]);
+            iommu_cmd_push_inv_irt(q->pending_devices[i]);
+        }
+    }
+    
+    for (uint8_t cell = 0; cell < IOMMU_MAX_DOMAINS; cell++) {
+        if (q->pages_dirty[cell]) {
+            iommu_cmd_push_inv_pages(IOMMU_CELL_DOMAIN(cell), q->pages_start[cell], q->pages_end[cell]);
+        }
+    }
+    
+    iommu_cmd_completion_wait();
+    
+    // PPR responses the event interrupt could not issue while we held the ring
+    iommu_cmd_flush_deferred_ppr();
+    q->busy = 0;
+    
+    q->pending_device_count = 0;
+    q->flush_all_devices = 0;
+    q->pages_dirty[0] = 0;
+    q->pages_dirty[1] = 0;
+    q->pages_dirty[2] = 0;
+    
+    uint64_t cycles = cpu_read_tsc() - start;
+    q->stats.last_batch_cycles = cycles;
+    if (cycles > q->stats.max_batch_cycles) {
+        q->stats.max_batch_cycles = cycles;
+    }
+    TRACE(IOMMU_BATCH_END, q->stats.last_batch_commands, cycles);
+    return q->stats.last_batch_commands;
+}
+
+const iommu_cmd_stats_t *iommu_get_cmd_stats(void) {
+    if (iommu_state.type == IOMMU_TYPE_INTEL_VTD) {
+        return vtd_get_cmd_stats();
+    }
+    return &iommu_state.cmd.stats;
+}
+
+void iommu_setup_command_buffer(void) {
+    amdvi_cmd_queue_t *q = &iommu_state.cmd;
+    
+    q->buffer = (amdvi_command_t *)memory_alloc_aligned(AMDVI_CMD_BUF_ENTRIES * sizeof(amdvi_command_t), PAGE_SIZE_4K);
+    q->completion_sem = (volatile uint64_t *)memory_alloc_aligned(sizeof(uint64_t), 8);
+    if (!q->buffer || !q->completion_sem) {
+        log_error("Failed to allocate command buffer\n");
+        return;
+    }
+    *q->completion_sem = 0;
+    q->tail = 0;
+    q->wait_token = 0;
+    
+    volatile uint64_t *cmd_base = (volatile uint64_t *)(iommu_state.base_addr + AMDVI_MMIO_COMMAND_OFFSET);
+    volatile uint64_t *head_reg = (volatile uint64_t *)(iommu_state.base_addr + AMDVI_MMIO_CMD_HEAD_OFFSET);
+    volatile uint64_t *tail_reg = (volatile uint64_t *)(iommu_state.base_addr + AMDVI_MMIO_CMD_TAIL_OFFSET);
+    
+    *cmd_base = ((uint64_t)q->buffer & AMDVI_PTE_ADDR_MASK) |
+                ((uint64_t)AMDVI_CMD_BUF_LEN_ENCODING << AMDVI_CMD_BUF_LEN_SHIFT);
+    *head_reg = 0;
+    *tail_reg = 0;
+}
+
+// Decode one event log entry into the counters and the dashboard ring
+static void iommu_record_event(const amdvi_command_t *entry) {
+    iommu_fault_record_t record;
+    record.device_id = entry->data[0] & 0xFFFF;
+    record.owner_cell = iommu_get_device_owner(record.device_id);
+    record.event_code = (entry->data[1] >> AMDVI_EVENT_CODE_SHIFT) & 0xF;
+    record.flags = (entry->data[1] >> 16) & 0xFFF;
+    record.address = ((uint64_t)entry->data[3] << 32) | entry->data[2];
+    TRACE(IOMMU_FAULT, record.device_id, record.address);
+    
+    if (record.event_code == AMDVI_EVENT_IO_PAGE_FAULT && (record.flags & AMDVI_EVENT_FLAG_INTERRUPT)) {
+        pcie_device_t *dev = iommu_find_device(record.device_id);
+        if (dev) {
+            dev->irq_blocked++;
+        }
+    }
+    
+    iommu_state.faults.events_by_code[record.event_code]++;
+    if (device_fault_counts[record.device_id]++ == 0) {
+        iommu_state.faults.devices_faulted++;
+    }
+    
+    // Lock-free SPSC push; when the dashboard falls behind, drop the newest
+    iommu_fault_ring_t *ring = &iommu_state.fault_ring;
+    uint32_t head = ring->head;
+    if (head - ring->tail >= IOMMU_FAULT_RING_SIZE) {
+        ring->dropped++;
+        return;
+    }
+    ring->records[head & (IOMMU_FAULT_RING_SIZE - 1)] = record;
+    asm volatile("" ::: "memory");  // Record before index (x86 keeps store order)
+    ring->head = head + 1;
+}
+
+// Cells never enable PRI in their DTEs, so any peripheral page request
+// is answered as invalid rather than serviced
+static void iommu_reject_ppr(const amdvi_command_t *entry) {
+    amdvi_cmd_queue_t *q = &iommu_state.cmd;
+    amdvi_command_t cmd = {{0}};
+    
+    cmd.data[0] = entry->data[0] & 0xFFFF;
+    cmd.data[1] = AMDVI_CMD_COMPLETE_PPR_REQUEST << AMDVI_CMD_OPCODE_SHIFT;
+    cmd.data[3] = (entry->data[1] & 0x1FF) | (AMDVI_PPR_STATUS_INVALID << AMDVI_PPR_STATUS_SHIFT);
+    
+    iommu_state.faults.ppr_requests++;
+    
+    if (!q->ready) return;
+    iommu_state.faults.ppr_rejected++;
+    if (q->busy) {
+        // Interrupted a command sequence; the owner issues it when done
+        if (q->deferred_ppr_count < IOMMU_MAX_DEFERRED_PPR) {
+            q->deferred_ppr[q->deferred_ppr_count++] = cmd;
+        }
+        return;
+    }
+    iommu_cmd_push(&cmd);
+}
+
+// Consume every entry between our head and the hardware tail
+static void iommu_drain_log(amdvi_log_t *log, uint32_t head_offset, uint32_t tail_offset, uint8_t is_ppr) {
+    volatile uint64_t *head_reg = (volatile uint64_t *)(iommu_state.base_addr + head_offset);
+    volatile uint64_t *tail_reg = (volatile uint64_t *)(iommu_state.base_addr + tail_offset);
+    uint32_t tail = (*tail_reg >> 4) & (AMDVI_LOG_ENTRIES - 1);
+    
+    while (log->head != tail) {
+        const amdvi_command_t *entry = &log->buffer[log->head];
+        if (is_ppr) {
+            iommu_reject_ppr(entry);
+        } else {
+            iommu_record_event(entry);
+        }
+        log->head = (log->head + 1) % AMDVI_LOG_ENTRIES;
+        log->entries++;
+    }
+    
+    *head_reg = (uint64_t)log->head << 4;
+}
+
+// Restart a log after overflow: disable, wait for the IOMMU to stop
+// writing it, rewind both pointers, re-enable
+static void iommu_restart_log(amdvi_log_t *log, uint32_t enable_bit, uint32_t run_bit,
+                              uint32_t head_offset, uint32_t tail_offset) {
+    volatile uint32_t *ctrl_reg = (volatile uint32_t *)(iommu_state.base_addr + AMDVI_MMIO_CONTROL_OFFSET);
+    volatile uint32_t *status_reg = (volatile uint32_t *)(iommu_state.base_addr + AMDVI_MMIO_STATUS_OFFSET);
+    
+    *ctrl_reg &= ~enable_bit;
+    uint32_t timeout = AMDVI_LOG_STOP_TIMEOUT;
+    while ((*status_reg & run_bit) && timeout--) {
+        asm volatile("pause");
+    }
+    *(volatile uint64_t *)(iommu_state.base_addr + head_offset) = 0;
+    *(volatile uint64_t *)(iommu_state.base_addr + tail_offset) = 0;
+    log->head = 0;
+    log->overflows++;
+    *ctrl_reg |= enable_bit;
+}
+
+// MSI handler for the IOMMU. Event and PPR logs are only ever read here,
+// so nothing on the switch or DMA paths polls them.
+void iommu_handle_interrupt(void) {
+    volatile uint32_t *status_reg = (volatile uint32_t *)(iommu_state.base_addr + AMDVI_MMIO_STATUS_OFFSET);
+    uint32_t status = *status_reg;
+    
+    // Ack first so entries logged while we drain raise a new interrupt
+    *status_reg = status & (AMDVI_STATUS_EVT_INT | AMDVI_STATUS_EVT_OVERFLOW |
+                            AMDVI_STATUS_PPR_INT | AMDVI_STATUS_PPR_OVERFLOW);
+    
+    if (iommu_state.event_log.buffer) {
+        iommu_state.event_log.interrupts++;
+        iommu_drain_log(&iommu_state.event_log, AMDVI_MMIO_EVT_HEAD_OFFSET, AMDVI_MMIO_EVT_TAIL_OFFSET, 0);
+        if (status & AMDVI_STATUS_EVT_OVERFLOW) {
+            iommu_restart_log(&iommu_state.event_log, IOMMU_CONTROL_EVT_LOG_EN, AMDVI_STATUS_EVT_RUN,
+                              AMDVI_MMIO_EVT_HEAD_OFFSET, AMDVI_MMIO_EVT_TAIL_OFFSET);
+        }
+    }
+    
+    if (iommu_state.ppr_log.buffer) {
+        iommu_state.ppr_log.interrupts++;
+        iommu_drain_log(&iommu_state.ppr_log, AMDVI_MMIO_PPR_HEAD_OFFSET, AMDVI_MMIO_PPR_TAIL_OFFSET, 1);
+        if (status & AMDVI_STATUS_PPR_OVERFLOW) {
+            iommu_restart_log(&iommu_state.ppr_log, IOMMU_CONTROL_PPR_LOG_EN, AMDVI_STATUS_PPR_RUN,
+                              AMDVI_MMIO_PPR_HEAD_OFFSET, AMDVI_MMIO_PPR_TAIL_OFFSET);
+        }
+        // Responses deferred by an interrupted sequence that has since
+        // finished go out now rather than with the next batch
+        if (!iommu_state.cmd.busy && iommu_state.cmd.deferred_ppr_count) {
+            iommu_state.cmd.busy = 1;
+            iommu_cmd_flush_deferred_ppr();
+            iommu_state.cmd.busy = 0;
+        }
+    }
+}
+
+uint8_t iommu_pop_fault(iommu_fault_record_t *record) {
+    iommu_fault_ring_t *ring = &iommu_state.fault_ring;
+    uint32_t tail = ring->tail;
+    
+    if (tail == ring->head) {
+        return 0;
+    }
+    *record = ring->records[tail & (IOMMU_FAULT_RING_SIZE - 1)];
+    asm volatile("" ::: "memory");
+    ring->tail = tail + 1;
+    return 1;
+}
+
+uint32_t iommu_get_device_fault_count(uint16_t bus, uint16_t device, uint16_t function) {
+    return device_fault_counts[AMDVI_DEVICE_ID(bus, device, function)];
+}
+
+const iommu_fault_stats_t *iommu_get_fault_stats(void) {
+    return &iommu_state.faults;
+}
+
+// Route the IOMMU's own MSI to this CPU
+static void iommu_setup_msi(void) {
+    uint16_t bus = iommu_state.pci_bus;
+    uint16_t dev = iommu_state.pci_device;
+    uint16_t func = iommu_state.pci_function;
+    
+    uint8_t cap_ptr = pci_find_capability(bus, dev, func, PCI_CAP_ID_MSI);
+    if (cap_ptr) {
+        uint32_t cap = pci_config_read32(bus, dev, func, cap_ptr);
+        uint16_t control = (cap >> 16) & 0xFFFF;
+        uint8_t is_64bit = (control & PCI_MSI_CONTROL_64BIT) != 0;
+        
+        pci_config_write32(bus, dev, func, cap_ptr + 4, MSI_ADDRESS(cpu_get_apic_id()));
+        if (is_64bit) {
+            pci_config_write32(bus, dev, func, cap_ptr + 8, 0);
+            pci_config_write32(bus, dev, func, cap_ptr + 12, MSI_DATA(VECTOR_IOMMU_EVENT));
+        } else {
+            pci_config_write32(bus, dev, func, cap_ptr + 8, MSI_DATA(VECTOR_IOMMU_EVENT));
+        }
+        
+        // Single vector, enabled
+        control = (control & ~PCI_MSI_CONTROL_MME_MASK) | PCI_MSI_CONTROL_ENABLE;
+        pci_config_write32(bus, dev, func, cap_ptr, (cap & 0xFFFF) | ((uint32_t)control << 16));
+        return;
+    }
+    
+    log_warn("IOMMU has no MSI capability, faults will not be reported\n");
+}
+
+static uint8_t iommu_alloc_log(amdvi_log_t *log, uint32_t base_offset) {
+    log->buffer = (amdvi_command_t *)memory_alloc_aligned(AMDVI_LOG_ENTRIES * sizeof(amdvi_command_t), PAGE_SIZE_4K);
+    if (!log->buffer) {
+        return 0;
+    }
+    log->head = 0;
+    
+    volatile uint64_t *base_reg = (volatile uint64_t *)(iommu_state.base_addr + base_offset);
+    *base_reg = ((uint64_t)log->buffer & AMDVI_PTE_ADDR_MASK) |
+                ((uint64_t)AMDVI_LOG_LEN_ENCODING << AMDVI_LOG_LEN_SHIFT);
+    return 1;
+}
+
+void iommu_setup_event_logs(void) {
+    if (!iommu_alloc_log(&iommu_state.event_log, AMDVI_MMIO_EVENT_OFFSET)) {
+        log_error("Failed to allocate event log\n");
+        return;
+    }
+    *(volatile uint64_t *)(iommu_state.base_addr + AMDVI_MMIO_EVT_HEAD_OFFSET) = 0;
+    *(volatile uint64_t *)(iommu_state.base_addr + AMDVI_MMIO_EVT_TAIL_OFFSET) = 0;
+    
+    uint64_t features = *(volatile uint64_t *)(iommu_state.base_addr + AMDVI_MMIO_EXT_FEATURE_OFFSET);
+    iommu_state.ppr_supported = (features & AMDVI_EXT_FEATURE_PPR_SUP) ? 1 : 0;
+    if (iommu_state.ppr_supported && iommu_alloc_log(&iommu_state.ppr_log, AMDVI_MMIO_PPR_OFFSET)) {
+        *(volatile uint64_t *)(iommu_state.base_addr + AMDVI_MMIO_PPR_HEAD_OFFSET) = 0;
+        *(volatile uint64_t *)(iommu_state.base_addr + AMDVI_MMIO_PPR_TAIL_OFFSET) = 0;
+    }
+    
+    cpu_register_interrupt_handler(VECTOR_IOMMU_EVENT, iommu_handle_interrupt);
+    iommu_setup_msi();
+}
+
+// A destination naming one of the cell's own cores is kept; anything else
+// is read as the cell's logical CPU number and mapped onto its cores
+static uint32_t iommu_map_irq_dest(uint32_t guest_dest, const uint32_t *cores, uint32_t core_count) {
+    for (uint32_t i = 0; i < core_count; i++) {
+        if (cores[i] == guest_dest) {
+            return guest_dest;
+        }
+    }
+    return cores[guest_dest % core_count];
+}
+
+static uint8_t iommu_route_irte(pcie_device_t *dev, uint32_t index, uint32_t dest) {
+    if (index < AMDVI_IRTE_FIRST_VECTOR || index >= AMDVI_IRTE_ENTRIES) return 0;
+    dev->irt[index] = AMDVI_IRTE_REMAP_EN |
+                      ((dest & 0xFF) << AMDVI_IRTE_DEST_SHIFT) |
+                      (index << AMDVI_IRTE_VECTOR_SHIFT);
+    return 1;
+}
+
+// Copy the destinations the cell's driver wrote into the device's MSI
+// capability or MSI-X table. The data field indexes the IRT; the address
+// names a core in the cell's own numbering.
+static void iommu_shadow_msi_routes(pcie_device_t *dev, const uint32_t *cores, uint32_t core_count) {
+    const pci_device_info_t *info = pci_find_device(dev->bus, dev->device, dev->function);
+    if (!info) return;
+    
+    uint16_t bus = dev->bus;
+    uint16_t slot = dev->device;
+    uint16_t func = dev->function;
+    
+    if (info->msi_cap) {
+        uint32_t cap = pci_config_read32(bus, slot, func, info->msi_cap);
+        uint16_t control = (cap >> 16) & 0xFFFF;
+        if (control & PCI_MSI_CONTROL_ENABLE) {
+            uint32_t address = pci_config_read32(bus, slot, func, info->msi_cap + 4);
+            uint16_t data_offset = (control & PCI_MSI_CONTROL_64BIT) ? 12 : 8;
+            uint32_t data = pci_config_read32(bus, slot, func, info->msi_cap + data_offset) & 0xFFFF;
+            uint32_t vectors = 1U << ((control & PCI_MSI_CONTROL_MME_MASK) >> PCI_MSI_CONTROL_MME_SHIFT);
+            uint32_t dest = iommu_map_irq_dest((address & MSI_DEST_MASK) >> 12, cores, core_count);
+            
+            // Multi-message MSI sets the low data bits per message
+            for (uint32_t v = 0; v < vectors; v++) {
+                dev->irq_programmed += iommu_route_irte(dev, (data & ~(vectors - 1)) | v, dest);
+            }
+        }
+    }
+    
+    if (info->msix_cap) {
+        uint32_t cap = pci_config_read32(bus, slot, func, info->msix_cap);
+        uint16_t control = (cap >> 16) & 0xFFFF;
+        uint32_t table = pci_config_read32(bus, slot, func, info->msix_cap + 4);
+        uint64_t bar = info->bars[table & PCI_MSIX_TABLE_BIR_MASK];
+        if (!(control & PCI_MSIX_CONTROL_ENABLE) || !bar) return;
+        
+        volatile uint32_t *entries = (volatile uint32_t *)(bar + (table & ~PCI_MSIX_TABLE_BIR_MASK));
+        uint32_t count = (control & PCI_MSIX_CONTROL_SIZE_MASK) + 1;
+        for (uint32_t e = 0; e < count; e++) {
+            volatile uint32_t *entry = &entries[e * PCI_MSIX_ENTRY_DWORDS];
+            if (entry[3] & PCI_MSIX_ENTRY_MASKED) continue;
+            
+            uint32_t dest = iommu_map_irq_dest((entry[0] & MSI_DEST_MASK) >> 12, cores, core_count);
+            dev->irq_programmed += iommu_route_irte(dev, entry[2] & (AMDVI_IRTE_ENTRIES - 1), dest);
+        }
+    }
+}
+
+// Route every vector a device can raise to the owning cell's cores. The
+// cell's driver picks the vector (it indexes the table) and the core; the
+// core is translated onto the cell's own set, so a cell can never aim an
+// interrupt at another cell. Vectors the device has not been programmed
+// with yet go to the cell's first core. Config space is not trapped, so
+// the shadow is refreshed when the device changes hands and on every
+// switch (iommu_sync_interrupt_routes).
+static void iommu_build_irt(pcie_device_t *dev, uint8_t cell_id) {
+    if (!dev->irt) {
+        dev->irt = (uint32_t *)memory_alloc_aligned(AMDVI_IRTE_ENTRIES * sizeof(uint32_t), AMDVI_IRTE_ALIGN);
+        if (!dev->irt) return;
+    }
+    
+    uint32_t cores[MAX_CPUS];
+    uint32_t core_count = 0;
+    if (cell_id == IOMMU_HYPERVISOR_CELL) {
+        cores[core_count++] = cpu_get_apic_id();  // Hypervisor drivers run here
+    }
+    for (uint32_t i = 0; i < cpu_get_count() && cell_id < 2; i++) {
+        const cpu_info_t *cpu = cpu_get_info(i);
+        if (cpu->online && cpu->assigned_to_linux == (cell_id == 0)) {
+            cores[core_count++] = cpu->apic_id;
+        }
+    }
+    
+    // No cores for the cell: leave every entry disabled so interrupts are
+    // rejected (and logged) rather than landing on the wrong cell
+    dev->irq_vectors = 0;
+    dev->irq_programmed = 0;
+    for (uint32_t v = 0; v < AMDVI_IRTE_ENTRIES; v++) {
+        dev->irt[v] = 0;
+        if (core_count > 0) {
+            dev->irq_vectors += iommu_route_irte(dev, v, cores[0]);
+        }
+    }
+    if (core_count > 0) {
+        iommu_shadow_msi_routes(dev, cores, core_count);
+    }
+}
+
+// Point a device's DTE at the DMA domain of the cell that owns it
+static void iommu_write_dte(pcie_device_t *dev) {
+    uint16_t device_id = AMDVI_DEVICE_ID(dev->bus, dev->device, dev->function);
+    uint8_t cell_id = iommu_get_device_owner(device_id);
+    if (cell_id == IOMMU_OWNER_NONE) {
+        cell_id = dev->assigned_to_linux ? 0 : 1;
+    }
+    
+    if (iommu_state.type == IOMMU_TYPE_INTEL_VTD) {
+        if (cell_id >= IOMMU_MAX_DOMAINS) return;
+        dev->domain_id = IOMMU_CELL_DOMAIN(cell_id);
+        vtd_attach_device(dev->bus, dev->device, dev->function, cell_id);
+        return;
+    }
+    
+    iommu_domain_t *domain = &iommu_state.domains[cell_id];
+    dev->domain_id = domain->domain_id;
+    
+    if (!iommu_state.device_table || !domain->root) {
+        return;
+    }
+    
+    volatile uint64_t *dte = &iommu_state.device_table[device_id * 4];
+    
+    iommu_build_irt(dev, cell_id);
+    
+    // Domain first, then flip V/TV so the entry is never half-valid. An
+    // IOAPIC sharing this requester ID keeps its interrupts passing.
+    dte[3] = 0;
+    dte[2] = acpi_find_ivhd_special(device_id) ? AMDVI_DTE_INT_PASSTHROUGH :
+             dev->irt ?
+        AMDVI_DTE_IV | AMDVI_DTE_INT_CTL_REMAP |
+        ((uint64_t)AMDVI_IRTE_LEN_ENCODING << AMDVI_DTE_INT_TAB_LEN_SHIFT) |
+        ((uint64_t)dev->irt & AMDVI_DTE_INT_TABLE_MASK) :
+        AMDVI_DTE_IV;
+    dte[1] = domain->domain_id;
+    dte[0] = AMDVI_DTE_V | AMDVI_DTE_TV |
+             ((uint64_t)AMDVI_PAGE_MODE << AMDVI_DTE_MODE_SHIFT) |
+             ((uint64_t)domain->root & AMDVI_DTE_PT_ROOT_MASK) |
+             AMDVI_DTE_IR | AMDVI_DTE_IW;
+    
+    iommu_queue_invalidate_device(device_id);
+}
+
+// Return the next-level table behind a PDE, allocating it if missing.
+// Fails if the slot already holds a large page.
+static uint64_t *iommu_get_next_table(uint64_t *table, uint32_t index, uint8_t next_level) {
+    uint64_t entry = table[index];
+    
+    if (entry & AMDVI_PTE_PR) {
+        if (((entry >> AMDVI_PTE_NEXT_LEVEL_SHIFT) & 0x7) == 0) {
+            return 0;  // Already a leaf
+        }
+        return (uint64_t *)(entry & AMDVI_PTE_ADDR_MASK);
+    }
+    
+    uint64_t *next = iommu_alloc_table();
+    if (!next) {
+        return 0;
+    }
+    
+    table[index] = ((uint64_t)next & AMDVI_PTE_ADDR_MASK) | AMDVI_PTE_PR |
+                   ((uint64_t)next_level << AMDVI_PTE_NEXT_LEVEL_SHIFT) |
+                   AMDVI_PTE_IR | AMDVI_PTE_IW;
+    return next;
+}
+
+// Map [iova, iova + size) to phys in a cell's domain, always picking the
+// largest IO page the alignment allows (1 GB, then 2 MB, then 4 KB) so
+// GPU and NVMe DMA take as few IOTLB entries as possible
+uint8_t iommu_map_range(uint8_t cell_id, uint64_t iova, uint64_t phys, uint64_t size) {
+    if (cell_id >= IOMMU_MAX_DOMAINS) return 0;
+    if (iommu_state.type == IOMMU_TYPE_INTEL_VTD) {
+        return cell_id < 2 ? vtd_map_range(cell_id, iova, phys, size) : 0;
+    }
+    
+    iommu_domain_t *domain = &iommu_state.domains[cell_id];
+    if (!domain->root) return 0;
+    
+    uint64_t leaf_flags = AMDVI_PTE_PR | AMDVI_PTE_IR | AMDVI_PTE_IW;
+    
+    // The IOMMU may cache non-present entries, so mapping also invalidates
+    iommu_queue_invalidate_pages(cell_id, iova, size);
+    
+    while (size > 0) {
+        uint32_t l3 = (iova >> 30) & 0x1FF;
+        uint32_t l2 = (iova >> 21) & 0x1FF;
+        uint32_t l1 = (iova >> 12) & 0x1FF;
+        uint64_t step;
+        
+        if (((iova | phys) & (PAGE_SIZE_1G - 1)) == 0 && size >= PAGE_SIZE_1G) {
+            domain->root[l3] = (phys & AMDVI_PTE_ADDR_MASK) | leaf_flags;
+            domain->pages_1g++;
+            step = PAGE_SIZE_1G;
+        } else if (((iova | phys) & (PAGE_SIZE_2M - 1)) == 0 && size >= PAGE_SIZE_2M) {
+            uint64_t *pd = iommu_get_next_table(domain->root, l3, 2);
+            if (!pd) return 0;
+            pd[l2] = (phys & AMDVI_PTE_ADDR_MASK) | leaf_flags;
+            domain->pages_2m++;
+            step = PAGE_SIZE_2M;
+        } else {
+            uint64_t *pd = iommu_get_next_table(domain->root, l3, 2);
+            if (!pd) return 0;
+            uint64_t *pt = iommu_get_next_table(pd, l2, 1);
+            if (!pt) return 0;
+            pt[l1] = (phys & AMDVI_PTE_ADDR_MASK) | leaf_flags;
+            domain->pages_4k++;
+            step = PAGE_SIZE_4K;
+        }
+        
+        iova += step;
+        phys += step;
+        size = (size > step) ? size - step : 0;
+        domain->mapped_bytes += step;
+    }
+    
+    return 1;
+}
+
+// Remove [iova, iova + size) from a cell's domain. Leaves are cleared at
+// whatever level they were mapped; intermediate tables are kept.
+void iommu_unmap_range(uint8_t cell_id, uint64_t iova, uint64_t size) {
+    if (cell_id >= IOMMU_MAX_DOMAINS) return;
+    if (iommu_state.type == IOMMU_TYPE_INTEL_VTD) {
+        if (cell_id < 2) vtd_unmap_range(cell_id, iova, size);
+        return;
+    }
+    
+    iommu_domain_t *domain = &iommu_state.domains[cell_id];
+    if (!domain->root) return;
+    
+    iommu_queue_invalidate_pages(cell_id, iova, size);
+    
+    while (size > 0) {
+        uint64_t *entry = &domain->root[(iova >> 30) & 0x1FF];
+        uint64_t step = PAGE_SIZE_1G;
+        uint8_t level = 3;
+        
+        // Walk down until we hit a leaf or a hole
+        while ((*entry & AMDVI_PTE_PR) && ((*entry >> AMDVI_PTE_NEXT_LEVEL_SHIFT) & 0x7) != 0) {
+            uint64_t *next = (uint64_t *)(*entry & AMDVI_PTE_ADDR_MASK);
+            level--;
+            step = (level == 2) ? PAGE_SIZE_2M : PAGE_SIZE_4K;
+            entry = &next[(iova >> (12 + 9 * (level - 1))) & 0x1FF];
+        }
+        
+        if (*entry & AMDVI_PTE_PR) {
+            *entry = 0;
+            if (level == 3) domain->pages_1g--;
+            else if (level == 2) domain->pages_2m--;
+            else domain->pages_4k--;
+            domain->mapped_bytes -= step;
+        }
+        
+        // Advance to the next slot at this level
+        uint64_t next_iova = (iova & ~(step - 1)) + step;
+        uint64_t advanced = next_iova - iova;
+        iova = next_iova;
+        size = (size > advanced) ? size - advanced : 0;
+    }
+}
+
+void iommu_setup_cell_domains(void) {
+    console_write_string("Building per-cell IO page tables...\n");
+    
+    const uint64_t bases[IOMMU_MAX_DOMAINS] = { LINUX_MEMORY_START, WINDOWS_MEMORY_START, HYPERVISOR_MEMORY_START };
+    const uint64_t sizes[IOMMU_MAX_DOMAINS] = { LINUX_MEMORY_SIZE, WINDOWS_MEMORY_SIZE, HYPERVISOR_MEMORY };
+    const char *names[IOMMU_MAX_DOMAINS] = { "  Linux", "  Windows", "  Hypervisor" };
+    
+    for (uint8_t cell = 0; cell < IOMMU_MAX_DOMAINS; cell++) {
+        iommu_domain_t *domain = &iommu_state.domains[cell];
+        domain->domain_id = IOMMU_CELL_DOMAIN(cell);
+        domain->cell_id = cell;
+        domain->root = iommu_alloc_table();
+        if (!domain->root) {
+            log_error("Failed to allocate IO page table\n");
+            return;
+        }
+        
+        // Cells are placed 1:1, so device addresses equal host physical
+        // addresses inside the cell region. Cell devices never see the
+        // hypervisor's memory, which holds these very tables.
+        memory_range_t ranges[MEMORY_CELL_MAX_RANGES] = { { bases[cell], sizes[cell] } };
+        uint32_t range_count = cell < 2 ? memory_get_cell_ranges(cell, ranges) : 1;
+        for (uint32_t r = 0; r < range_count; r++) {
+            if (!iommu_map_range(cell, ranges[r].base, ranges[r].base, ranges[r].size)) {
+                log_error("Failed to map cell region\n");
+                return;
+            }
+        }
+        
+        console_write_string(names[cell]);
+        console_write_string(" domain ");
+        char buf[32];
+        itoa(domain->domain_id, buf, 10);
+        console_write_string(buf);
+        console_write_string(": ");
+        itoa(domain->pages_1g, buf, 10);
+        console_write_string(buf);
+        console_write_string(" x 1GB, ");
+        itoa(domain->pages_2m, buf, 10);
+        console_write_string(buf);
+        console_write_string(" x 2MB IO pages\n");
+    }
+}
+
+void iommu_setup_device_table(void) {
+    console_write_string("Building AMD-Vi device table...\n");
+    
+    iommu_state.device_table = (uint64_t *)memory_alloc_aligned(AMDVI_DEV_TABLE_SIZE, PAGE_SIZE_4K);
+    if (!iommu_state.device_table) {
+        log_error("Failed to allocate device table\n");
+        return;
+    }
+    
+    // Guest virtual APIC IRTEs would let a cell running under AVIC take
+    // device interrupts without an exit; cells own their cores outright
+    // here, so plain remapped delivery to those cores already avoids the
+    // hypervisor and GA stays off
+    uint64_t features = *(volatile uint64_t *)(iommu_state.base_addr + AMDVI_MMIO_EXT_FEATURE_OFFSET);
+    iommu_state.ga_supported = (features & AMDVI_EXT_FEATURE_GA_SUP) ? 1 : 0;
+    
+    // Every device ID defaults to translation enabled with no read or
+    // write permission, so unknown requesters have their DMA blocked
+    for (uint32_t i = 0; i < AMDVI_DEV_TABLE_ENTRIES; i++) {
+        uint64_t *dte = &iommu_state.device_table[i * 4];
+        dte[0] = AMDVI_DTE_V | AMDVI_DTE_TV;
+        dte[1] = 0;
+        dte[2] = AMDVI_DTE_IV;  // No interrupt table: interrupts are aborted too
+        dte[3] = 0;
+    }
+    
+    // The IOAPICs and HPETs IVRS names are the exception: the COM1/COM2 IRQs
+    // and the rest of the ISA lines arrive under their requester IDs
+    const acpi_info_t *acpi = acpi_get_info();
+    for (uint32_t i = 0; i < acpi->ivhd_special_count; i++) {
+        iommu_state.device_table[acpi->ivhd_special[i].device_id * 4 + 2] = AMDVI_DTE_INT_PASSTHROUGH;
+    }
+    
+    uint32_t assigned = 0;
+    for (uint32_t i = 0; i < iommu_state.group_count; i++) {
+        iommu_group_t *group = &iommu_state.groups[i];
+        if (!group->assigned) continue;
+        for (uint8_t j = 0; j < group->device_count; j++) {
+            iommu_write_dte(&group->devices[j]);
+            assigned++;
+        }
+    }
+    
+    console_write_string("  Device table at 0x");
+    console_write_hex((uint64_t)iommu_state.device_table);
+    console_write_string(", ");
+    char buf[32];
+    itoa(assigned, buf, 10);
+    console_write_string(buf);
+    console_write_string(" devices bound to cell domains\n");
+    kprintf("  %u IOAPIC/HPET requester IDs pass interrupts through\n", acpi->ivhd_special_count);
+}
+
 uint8_t iommu_is_available(void) {
     return iommu_state.enabled;
 }
 
+// Which cell gets which devices. Groups are assigned as a whole; a group
+// whose members match rules for different cells is refused and left blocked.
+// Groups no rule matches also stay blocked, and are listed at boot so a
+// missing rule shows up before Linux loses a device it needs.
+static const iommu_policy_rule_t iommu_policy[] = {
+    { 0x1002, PCI_CLASS_VGA,   PCI_BDF_NONE, 0 },  // RX 7600 -> Linux
+    { 0x1002, PCI_CLASS_AUDIO, PCI_BDF_NONE, 0 },  // RX 7600 HDMI audio
+    { 0x10DE, PCI_CLASS_VGA,   PCI_BDF_NONE, 1 },  // RTX 3050 -> Windows
+    { 0x10DE, PCI_CLASS_AUDIO, PCI_BDF_NONE, 1 },  // RTX 3050 HDMI audio
+    { 0xFFFF, PCI_CLASS_NVME,  PCI_BDF_NONE, 0 },  // Boot and data disks
+    { 0xFFFF, PCI_CLASS_SATA,  PCI_BDF_NONE, 0 },
+    { 0xFFFF, PCI_CLASS_ETHERNET, PCI_BDF_NONE, 0 },
+    { 0xFFFF, PCI_CLASS_NETWORK_OTHER, PCI_BDF_NONE, 0 },
+    { 0xFFFF, PCI_CLASS_USB,   PCI_BDF_NONE, 0 },  // Beyond the input xHCIs
+};
+
+#define IOMMU_POLICY_RULES (sizeof(iommu_policy) / sizeof(iommu_policy[0]))
+
+static void iommu_set_owner(const iommu_group_t *group, const pcie_device_t *dev) {
+    uint16_t entry = IOMMU_OWNER_VALID | (group->group_id & IOMMU_OWNER_GROUP_MASK);
+    if (group->hypervisor_owned) {
+        entry |= IOMMU_OWNER_ASSIGNED | (IOMMU_HYPERVISOR_CELL << IOMMU_OWNER_CELL_SHIFT);
+    } else if (group->assigned) {
+        uint16_t cell_id = group->assigned_to_linux ? 0 : 1;
+        entry |= IOMMU_OWNER_ASSIGNED | (cell_id << IOMMU_OWNER_CELL_SHIFT);
+    }
+    device_owner[AMDVI_DEVICE_ID(dev->bus, dev->device, dev->function)] = entry;
+}
+
+static uint8_t iommu_policy_cell(const pci_device_info_t *info) {
+    for (uint32_t i = 0; i < IOMMU_POLICY_RULES; i++) {
+        const iommu_policy_rule_t *rule = &iommu_policy[i];
+        if ((rule->vendor_id == 0xFFFF || rule->vendor_id == info->vendor_id) &&
+            (rule->class_code == 0xFFFF || rule->class_code == info->class_code) &&
+            (rule->bdf == PCI_BDF_NONE || rule->bdf == info->bdf)) {
+            return rule->cell_id;
+        }
+    }
+    return IOMMU_OWNER_NONE;
+}
+
+// The first IOMMU_INPUT_CONTROLLERS xHCIs in bus order, the same ones
+// xhci_claim_controller() and the input handoff pick later
+static uint8_t iommu_input_reserved(const pci_device_info_t *info) {
+    if (info->class_code != PCI_CLASS_USB || info->prog_if != XHCI_PROG_IF) return 0;
+    
+    uint32_t earlier = 0;
+    for (uint32_t i = 0; i < pci_get_device_count(); i++) {
+        const pci_device_info_t *other = pci_get_device(i);
+        if (other == info) break;
+        if (other->class_code == PCI_CLASS_USB && other->prog_if == XHCI_PROG_IF) earlier++;
+    }
+    return earlier < IOMMU_INPUT_CONTROLLERS;
+}
+
+static uint8_t iommu_acs_isolates(const pci_device_info_t *info) {
+    if (!info->acs_cap) {
+        return 0;
+    }
+    
+    uint32_t reg = pci_config_read32(PCI_BDF_BUS(info->bdf), PCI_BDF_DEVICE(info->bdf),
+                                     PCI_BDF_FUNCTION(info->bdf), info->acs_cap + PCI_ACS_CAP_CTRL);
+    uint16_t control = (reg >> 16) & 0xFFFF;
+    return (control & PCI_ACS_ISOLATION) == PCI_ACS_ISOLATION;
+}
+
+// Every bridge from this one up to the root complex must enforce ACS
+static uint8_t iommu_acs_path_isolates(const pci_device_info_t *bridge) {
+    while (bridge) {
+        if (!iommu_acs_isolates(bridge)) {
+            return 0;
+        }
+        if (bridge->upstream_bdf == PCI_BDF_NONE) {
+            return 1;
+        }
+        bridge = pci_find_device(PCI_BDF_BUS(bridge->upstream_bdf), PCI_BDF_DEVICE(bridge->upstream_bdf),
+                                 PCI_BDF_FUNCTION(bridge->upstream_bdf));
+    }
+    return 1;
+}
+
+// Same rules Linux uses: climb past every upstream bridge that cannot keep
+// peer-to-peer traffic away from the IOMMU, then fold the functions of a
+// multi-function device together unless that function enforces ACS itself.
+// Devices sharing an anchor share a group.
+static uint16_t iommu_group_anchor(const pci_device_info_t *info) {
+    const pci_device_info_t *anchor = info;
+    
+    while (anchor->upstream_bdf != PCI_BDF_NONE) {
+        const pci_device_info_t *bridge = pci_find_device(PCI_BDF_BUS(anchor->upstream_bdf),
+                                                          PCI_BDF_DEVICE(anchor->upstream_bdf),
+                                                          PCI_BDF_FUNCTION(anchor->upstream_bdf));
+        if (!bridge || iommu_acs_path_isolates(bridge)) break;
+        anchor = bridge;
+    }
+    
+    if (iommu_acs_isolates(anchor)) {
+        return anchor->bdf;
+    }
+    
+    uint16_t bus = PCI_BDF_BUS(anchor->bdf);
+    uint16_t dev = PCI_BDF_DEVICE(anchor->bdf);
+    for (uint16_t func = 0; func < 8; func++) {
+        const pci_device_info_t *peer = pci_find_device(bus, dev, func);
+        if (peer && !iommu_acs_isolates(peer)) {
+            return peer->bdf;  // Lowest non-isolated function of the slot
+        }
+    }
+    return anchor->bdf;
+}
+
+// Apply the policy to one group: all rule matches must agree on a cell.
+// A group holding an input controller is left unassigned for the xHCI
+// driver and the handoff to claim. Returns 0 when no member matched any rule.
+static uint8_t iommu_apply_policy(iommu_group_t *group) {
+    uint8_t cell_id = IOMMU_OWNER_NONE;
+    uint8_t conflict = 0;
+    uint8_t matched = 0;
+    
+    group->input_reserved = 0;
+    for (uint8_t j = 0; j < group->device_count; j++) {
+        pcie_device_t *dev = &group->devices[j];
+        const pci_device_info_t *info = pci_find_device(dev->bus, dev->device, dev->function);
+        if (info && iommu_input_reserved(info)) {
+            group->input_reserved = 1;
+            matched = 1;
+            break;
+        }
+        uint8_t wanted = info ? iommu_policy_cell(info) : IOMMU_OWNER_NONE;
+        
+        if (wanted == IOMMU_OWNER_NONE) continue;
+        matched = 1;
+        if (cell_id == IOMMU_OWNER_NONE) {
+            cell_id = wanted;
+        } else if (cell_id != wanted) {
+            conflict = 1;
+        }
+    }
+    
+    if (group->input_reserved) {
+        cell_id = IOMMU_OWNER_NONE;
+    } else if (conflict) {
+        iommu_state.refused_assignments++;
+        log_warn("policy would split group %u across cells, leaving it blocked\n", group->group_id);
+        cell_id = IOMMU_OWNER_NONE;
+    }
+    
+    // Functions past devices[] would get no DTE and keep aliasing the rest
+    if (group->overflowed && cell_id != IOMMU_OWNER_NONE) {
+        iommu_state.refused_assignments++;
+        log_warn("group %u has unlisted functions, leaving it blocked\n", group->group_id);
+        cell_id = IOMMU_OWNER_NONE;
+    }
+    
+    group->assigned = (cell_id != IOMMU_OWNER_NONE);
+    group->assigned_to_linux = (cell_id == 0) ? 1 : 0;
+    for (uint8_t j = 0; j < group->device_count; j++) {
+        group->devices[j].assigned_to_linux = group->assigned_to_linux;
+        iommu_set_owner(group, &group->devices[j]);
+    }
+    return matched;
+}
+
+static void iommu_print_group(const iommu_group_t *group) {
+    char buf[32];
+    console_write_string("  Group ");
+    itoa(group->group_id, buf, 10);
+    console_write_string(buf);
+    console_write_string(":");
+    
+    for (uint8_t j = 0; j < group->device_count; j++) {
+        const pcie_device_t *dev = &group->devices[j];
+        console_write_string(" ");
+        itoa(dev->bus, buf, 16);
+        console_write_string(buf);
+        console_write_string(":");
+        itoa(dev->device, buf, 16);
+        console_write_string(buf);
+        console_write_string(".");
+        itoa(dev->function, buf, 10);
+        console_write_string(buf);
+    }
+    
+    if (group->input_reserved) {
+        console_write_string(" -> reserved for input\n");
+    } else if (!group->assigned) {
+        console_write_string(" -> blocked, no policy rule\n");
+    } else {
+        console_write_string(group->assigned_to_linux ? " -> Linux\n" : " -> Windows\n");
+    }
+}
+
 void iommu_setup_device_groups(void) {
     console_write_string("Scanning IOMMU groups...\n");
     
     uint32_t group_count = 0;
+    iommu_state.refused_assignments = 0;
     
-    // Scan PCI buses for devices and their IOMMU groups
-    for (uint16_t bus = 0; bus < 256; bus++) {
-        for (uint16_t dev = 0; dev < 32; dev++) {
-            uint32_t vendor_device = pci_read_config(bus, dev, 0, 0x00);
-            uint16_t vendor = vendor_device & 0xFFFF;
-            
-            if (vendor == 0xFFFF) continue;  // No device
-            
-            uint16_t device = (vendor_device >> 16) & 0xFFFF;
-            
-            // GPU device detection
-            // NVIDIA: 0x10DE, AMD: 0x1002
-            if (vendor == 0x1002 || vendor == 0x10DE) {
-                if (group_count < MAX_IOMMU_GROUPS) {
-                    iommu_group_t *group = &iommu_state.groups[group_count];
-                    group->group_id = group_count;
-                    group->device_count = 1;
-                    group->devices[0].bus = bus;
-                    group->devices[0].device = dev;
-                    group->devices[0].function = 0;
-                    
-                    // Assign AMD GPU to Linux, NVIDIA to Windows
-                    group->devices[0].assigned_to_linux = (vendor == 0x1002) ? 1 : 0;
-                    group->assigned_to_linux = group->devices[0].assigned_to_linux;
-                    
-                    console_write_string("  Group ");
-                    char buf[32];
-                    itoa(group_count, buf, 10);
-                    console_write_string(buf);
-                    console_write_string(": ");
-                    
-                    if (vendor == 0x1002) {
-                        console_write_string("AMD GPU (");
-                        itoa(0x1002, buf, 16);
-                        console_write_string(buf);
-                    } else {
-                        console_write_string("NVIDIA GPU (");
-                        itoa(0x10DE, buf, 16);
-                        console_write_string(buf);
-                    }
-                    console_write_string(") -> ");
-                    console_write_string(group->assigned_to_linux ? "Linux\n" : "Windows\n");
-                    
-                    group_count++;
-                }
+    // Every function except the IOMMU itself lands in the group of its anchor
+    for (uint32_t i = 0; i < pci_get_device_count(); i++) {
+        const pci_device_info_t *info = pci_get_device(i);
+        if (info->class_code == PCI_CLASS_IOMMU) continue;
+        
+        uint16_t anchor = iommu_group_anchor(info);
+        iommu_group_t *group = 0;
+        for (uint32_t g = 0; g < group_count; g++) {
+            if (iommu_state.groups[g].anchor_bdf == anchor) {
+                group = &iommu_state.groups[g];
+                break;
             }
         }
+        
+        if (!group) {
+            if (group_count >= MAX_IOMMU_GROUPS) {
+                log_warn("out of IOMMU groups, remaining devices stay blocked\n");
+                break;
+            }
+            group = &iommu_state.groups[group_count];
+            group->group_id = group_count;
+            group->anchor_bdf = anchor;
+            group->device_count = 0;
+            group->overflowed = 0;
+            group_count++;
+        }
+        if (group->device_count >= MAX_DEVICES_PER_GROUP) {
+            if (!group->overflowed) {
+                log_warn("IOMMU group %u exceeds MAX_DEVICES_PER_GROUP\n", group->group_id);
+            }
+            group->overflowed = 1;
+            continue;
+        }
+        
+        pcie_device_t *device = &group->devices[group->device_count++];
+        device->bus = PCI_BDF_BUS(info->bdf);
+        device->device = PCI_BDF_DEVICE(info->bdf);
+        device->function = PCI_BDF_FUNCTION(info->bdf);
+        device->domain_id = IOMMU_DOMAIN_NONE;
     }
     
     iommu_state.group_count = group_count;
+    
+    // Assign groups to cells; list the ones a cell owns and the ones no
+    // rule covers, which stay blocked
+    for (uint32_t g = 0; g < group_count; g++) {
+        iommu_group_t *group = &iommu_state.groups[g];
+        uint8_t matched = iommu_apply_policy(group);
+        if (group->assigned || group->input_reserved) {
+            iommu_print_group(group);
+        } else if (!matched) {
+            iommu_print_group(group);
+        }
+    }
+    
     console_write_string("Device groups configured: ");
     char buf[32];
     itoa(group_count, buf, 10);
@@ -148,42 +1248,136 @@ void iommu_setup_device_groups(void) {
     console_write_string("\n");
 }
 
+uint8_t iommu_get_device_owner(uint16_t device_id) {
+    uint16_t entry = device_owner[device_id];
+    if (!(entry & IOMMU_OWNER_ASSIGNED)) {
+        return IOMMU_OWNER_NONE;
+    }
+    return (entry & IOMMU_OWNER_CELL_MASK) >> IOMMU_OWNER_CELL_SHIFT;
+}
+
+uint8_t iommu_get_device_group(uint16_t device_id) {
+    uint16_t entry = device_owner[device_id];
+    if (!(entry & IOMMU_OWNER_VALID)) {
+        return IOMMU_OWNER_NONE;
+    }
+    return entry & IOMMU_OWNER_GROUP_MASK;
+}
+
 uint8_t iommu_is_linux_device(uint16_t bus, uint16_t device, uint16_t function) {
+    return iommu_get_device_owner(AMDVI_DEVICE_ID(bus, device, function)) == 0;
+}
+
+// Move every function of a group to one cell inside a single ownership
+// change, so the DTEs, the owner table and the group flag never disagree.
+// Assignment is per group by construction, so it can never split one.
+// A group with unlisted functions is refused, as at boot. Returns 1 if
+// the group now belongs to the cell.
+uint8_t iommu_assign_group(uint32_t group_id, uint8_t cell_id) {
+    if (group_id >= iommu_state.group_count || cell_id >= 2) {
+        return 0;
+    }
+    
+    iommu_group_t *group = &iommu_state.groups[group_id];
+    if (group->overflowed) {
+        iommu_state.refused_assignments++;
+        return 0;
+    }
+    
+    TRACE(IOMMU_ASSIGN, group_id, cell_id);
+    iommu_begin_ownership_change();
+    group->hypervisor_owned = 0;
+    group->assigned = 1;
+    group->assigned_to_linux = (cell_id == 0) ? 1 : 0;
+    for (uint8_t j = 0; j < group->device_count; j++) {
+        pcie_device_t *dev = &group->devices[j];
+        dev->assigned_to_linux = group->assigned_to_linux;
+        iommu_set_owner(group, dev);
+        iommu_write_dte(dev);
+    }
+    iommu_commit_ownership_change();
+    return 1;
+}
+
+// Take a device for a hypervisor driver. Only a group no cell owns can be
+// claimed; the whole group moves to the hypervisor domain.
+uint8_t iommu_claim_device(uint16_t bus, uint16_t device, uint16_t function) {
+    uint8_t group_id = iommu_get_device_group(AMDVI_DEVICE_ID(bus, device, function));
+    if (group_id == IOMMU_OWNER_NONE) {
+        return !iommu_state.enabled;  // No IOMMU: nothing to program
+    }
+    
+    iommu_group_t *group = &iommu_state.groups[group_id];
+    if (group->assigned || group->overflowed) {
+        return 0;  // Cell-owned, or functions the group could not list
+    }
+    
+    iommu_begin_ownership_change();
+    group->hypervisor_owned = 1;
+    for (uint8_t j = 0; j < group->device_count; j++) {
+        iommu_set_owner(group, &group->devices[j]);
+        iommu_write_dte(&group->devices[j]);
+    }
+    iommu_commit_ownership_change();
+    return 1;
+}
+
+const iommu_group_t *iommu_get_group(uint32_t group_id) {
+    if (group_id >= iommu_state.group_count) {
+        return 0;
+    }
+    return &iommu_state.groups[group_id];
+}
+
+// Faults logged against any function of the group (DMA and interrupts)
+uint32_t iommu_get_group_fault_count(uint32_t group_id) {
+    if (group_id >= iommu_state.group_count) {
+        return 0;
+    }
+    
+    const iommu_group_t *group = &iommu_state.groups[group_id];
+    uint32_t count = 0;
+    for (uint8_t j = 0; j < group->device_count; j++) {
+        const pcie_device_t *dev = &group->devices[j];
+        count += device_fault_counts[AMDVI_DEVICE_ID(dev->bus, dev->device, dev->function)];
+    }
+    return count;
+}
+
+// Re-read the MSI setup of every device a cell owns and rebuild its IRT,
+// so destinations the cell programmed while it ran reach the IOMMU.
+// Returns the number of commands issued.
+uint32_t iommu_sync_interrupt_routes(uint8_t cell_id) {
+    if (!iommu_state.enabled || iommu_state.type != IOMMU_TYPE_AMDVI || cell_id >= 2) {
+        return 0;
+    }
+    
+    iommu_begin_ownership_change();
     for (uint32_t i = 0; i < iommu_state.group_count; i++) {
         iommu_group_t *group = &iommu_state.groups[i];
+        if (!group->assigned || group->hypervisor_owned || group->assigned_to_linux != (cell_id == 0)) continue;
+        
         for (uint8_t j = 0; j < group->device_count; j++) {
             pcie_device_t *dev = &group->devices[j];
-            if (dev->bus == bus && dev->device == device && dev->function == function) {
-                return dev->assigned_to_linux;
-            }
+            if (!dev->irt) continue;  // No DTE written for it yet
+            iommu_build_irt(dev, cell_id);
+            iommu_queue_invalidate_device(AMDVI_DEVICE_ID(dev->bus, dev->device, dev->function));
         }
     }
-    return 0;
+    return iommu_commit_ownership_change();
 }
 
 void iommu_assign_device_to_linux(uint16_t bus, uint16_t device, uint16_t function) {
-    for (uint32_t i = 0; i < iommu_state.group_count; i++) {
-        iommu_group_t *group = &iommu_state.groups[i];
-        for (uint8_t j = 0; j < group->device_count; j++) {
-            pcie_device_t *dev = &group->devices[j];
-            if (dev->bus == bus && dev->device == device && dev->function == function) {
-                dev->assigned_to_linux = 1;
-                group->assigned_to_linux = 1;
-            }
-        }
+    uint8_t group_id = iommu_get_device_group(AMDVI_DEVICE_ID(bus, device, function));
+    if (group_id != IOMMU_OWNER_NONE) {
+        iommu_assign_group(group_id, 0);
     }
 }
 
 void iommu_assign_device_to_windows(uint16_t bus, uint16_t device, uint16_t function) {
-    for (uint32_t i = 0; i < iommu_state.group_count; i++) {
-        iommu_group_t *group = &iommu_state.groups[i];
-        for (uint8_t j = 0; j < group->device_count; j++) {
-            pcie_device_t *dev = &group->devices[j];
-            if (dev->bus == bus && dev->device == device && dev->function == function) {
-                dev->assigned_to_linux = 0;
-                group->assigned_to_linux = 0;
-            }
-        }
+    uint8_t group_id = iommu_get_device_group(AMDVI_DEVICE_ID(bus, device, function));
+    if (group_id != IOMMU_OWNER_NONE) {
+        iommu_assign_group(group_id, 1);
     }
 }
 
@@ -199,6 +1393,32 @@ void iommu_enable_amdvi(void) {
     volatile uint32_t *ctrl_reg = (volatile uint32_t *)(iommu_state.base_addr + AMDVI_MMIO_CONTROL_OFFSET);
     uint32_t ctrl = *ctrl_reg;
     
+    // The device table base may only change while translation is off
+    if (iommu_state.device_table) {
+        *ctrl_reg = ctrl & ~IOMMU_CONTROL_IOMMU_EN;
+        
+        volatile uint64_t *dtb_reg = (volatile uint64_t *)(iommu_state.base_addr + AMDVI_MMIO_DEV_TABLE_OFFSET);
+        *dtb_reg = ((uint64_t)iommu_state.device_table & AMDVI_DTE_PT_ROOT_MASK) |
+                   (AMDVI_DEV_TABLE_SIZE / PAGE_SIZE_4K - 1);
+    } else {
+        log_warn("No device table, DMA is not isolated\n");
+    }
+    
+    // Command buffer must be in place before CmdBufEn
+    iommu_setup_command_buffer();
+    if (iommu_state.cmd.buffer) {
+        ctrl |= IOMMU_CONTROL_CMD_BUF_EN;
+    }
+    
+    // Event (and PPR) logs are interrupt driven, never polled
+    iommu_setup_event_logs();
+    if (iommu_state.event_log.buffer) {
+        ctrl |= IOMMU_CONTROL_EVT_LOG_EN | IOMMU_CONTROL_EVT_INT_EN;
+    }
+    if (iommu_state.ppr_log.buffer) {
+        ctrl |= IOMMU_CONTROL_PPR_LOG_EN | IOMMU_CONTROL_PPR_INT_EN | IOMMU_CONTROL_PPR_EN;
+    }
+    
     // Enable IOMMU
     ctrl |= IOMMU_CONTROL_IOMMU_EN;
     ctrl |= IOMMU_CONTROL_COHERENT;
@@ -208,12 +1428,107 @@ void iommu_enable_amdvi(void) {
     // Verify enable
     uint32_t verify = *ctrl_reg;
     if (verify & IOMMU_CONTROL_IOMMU_EN) {
+        iommu_state.cmd.ready = (verify & IOMMU_CONTROL_CMD_BUF_EN) ? 1 : 0;
         console_write_string("AMD-Vi enabled successfully\n");
     } else {
         console_write_string("Failed to enable AMD-Vi\n");
     }
 }
 
+static const char *iommu_event_name(uint8_t code) {
+    switch (code) {
+        case AMDVI_EVENT_ILLEGAL_DEV_TABLE_ENTRY: return "ILLEGAL_DTE";
+        case AMDVI_EVENT_IO_PAGE_FAULT: return "IO_PAGE_FAULT";
+        case AMDVI_EVENT_DEV_TAB_HW_ERROR: return "DEV_TAB_HW_ERROR";
+        case AMDVI_EVENT_PAGE_TAB_HW_ERROR: return "PAGE_TAB_HW_ERROR";
+        case AMDVI_EVENT_ILLEGAL_COMMAND: return "ILLEGAL_COMMAND";
+        case AMDVI_EVENT_COMMAND_HW_ERROR: return "COMMAND_HW_ERROR";
+        case AMDVI_EVENT_IOTLB_INV_TIMEOUT: return "IOTLB_INV_TIMEOUT";
+        case AMDVI_EVENT_INVALID_DEVICE_REQUEST: return "INVALID_DEVICE_REQUEST";
+        default: return "UNKNOWN";
+    }
+}
+
+// Drain the fault ring for display; called from the dashboard
+void iommu_print_faults(void) {
+    char buf[32];
+    iommu_fault_record_t record;
+    
+    console_write_string("IOMMU Faults:\n");
+    kprintf("  Devices faulted: %u, PPR requests: %lu, dropped: %u\n",
+            iommu_state.faults.devices_faulted, iommu_state.faults.ppr_requests,
+            iommu_state.fault_ring.dropped);
+    
+    while (iommu_pop_fault(&record)) {
+        console_write_string("  [");
+        console_write_string(iommu_event_name(record.event_code));
+        console_write_string("] ");
+        itoa(record.device_id >> 8, buf, 16);
+        console_write_string(buf);
+        console_write_string(":");
+        itoa((record.device_id >> 3) & 0x1F, buf, 16);
+        console_write_string(buf);
+        console_write_string(".");
+        itoa(record.device_id & 0x7, buf, 10);
+        console_write_string(buf);
+        if (record.owner_cell != IOMMU_OWNER_NONE) {
+            console_write_string(record.owner_cell == 0 ? " [Linux]" :
+                                 record.owner_cell == 1 ? " [Windows]" : " [Hypervisor]");
+        }
+        console_write_string(" addr 0x");
+        console_write_hex(record.address);
+        console_write_string(" (");
+        itoa(device_fault_counts[record.device_id], buf, 10);
+        console_write_string(buf);
+        console_write_string(" total)\n");
+    }
+}
+
+// Per-device interrupt routing, for the monitor
+void iommu_print_interrupt_routes(void) {
+    char buf[32];
+    
+    if (iommu_state.type != IOMMU_TYPE_AMDVI) {
+        console_write_string("Device Interrupts: not remapped on this IOMMU\n");
+        return;
+    }
+    
+    console_write_string("Device Interrupts");
+    console_write_string(iommu_state.ga_supported ? " (remapped, GA capable):\n" : " (remapped):\n");
+    
+    for (uint32_t i = 0; i < iommu_state.group_count; i++) {
+        iommu_group_t *group = &iommu_state.groups[i];
+        if (!group->assigned && !group->hypervisor_owned) continue;
+        
+        for (uint8_t j = 0; j < group->device_count; j++) {
+            pcie_device_t *dev = &group->devices[j];
+            console_write_string("  ");
+            itoa(dev->bus, buf, 16);
+            console_write_string(buf);
+            console_write_string(":");
+            itoa(dev->device, buf, 16);
+            console_write_string(buf);
+            console_write_string(".");
+            itoa(dev->function, buf, 10);
+            console_write_string(buf);
+            if (group->hypervisor_owned) {
+                console_write_string(" -> Hypervisor, ");
+            } else {
+                console_write_string(dev->assigned_to_linux ? " -> Linux, " : " -> Windows, ");
+            }
+            itoa(dev->irq_vectors, buf, 10);
+            console_write_string(buf);
+            console_write_string(" vectors (");
+            itoa(dev->irq_programmed, buf, 10);
+            console_write_string(buf);
+            console_write_string(" programmed), ");
+            itoa(dev->irq_blocked, buf, 10);
+            console_write_string(buf);
+            console_write_string(" blocked\n");
+        }
+    }
+}
+
 void iommu_print_status(void) {
     console_write_string("IOMMU Status:\n");
     if (iommu_state.enabled) {
@@ -228,7 +1543,37 @@ void iommu_print_status(void) {
         char buf[32];
         itoa(iommu_state.group_count, buf, 10);
         console_write_string(buf);
+        if (iommu_state.refused_assignments) {
+            console_write_string(" (");
+            itoa(iommu_state.refused_assignments, buf, 10);
+            console_write_string(buf);
+            console_write_string(" refused)");
+        }
         console_write_string("\n");
+        if (iommu_state.type == IOMMU_TYPE_INTEL_VTD) {
+            vtd_print_status();
+            return;
+        }
+        const char *names[IOMMU_MAX_DOMAINS] = { "  Linux domain: ", "  Windows domain: ", "  Hypervisor domain: " };
+        for (int i = 0; i < IOMMU_MAX_DOMAINS; i++) {
+            iommu_domain_t *domain = &iommu_state.domains[i];
+            console_write_string(names[i]);
+            itoa(domain->pages_1g, buf, 10);
+            console_write_string(buf);
+            console_write_string(" x 1GB, ");
+            itoa(domain->pages_2m, buf, 10);
+            console_write_string(buf);
+            console_write_string(" x 2MB, ");
+            itoa(domain->pages_4k, buf, 10);
+            console_write_string(buf);
+            console_write_string(" x 4KB\n");
+        }
+        
+        const iommu_cmd_stats_t *stats = &iommu_state.cmd.stats;
+        kprintf("  Commands issued: %lu (%lu waits, %lu coalesced)\n",
+                stats->commands_issued, stats->completion_waits, stats->invalidations_coalesced);
+        kprintf("  Batch cycles (last/max): 0x%lx / 0x%lx\n",
+                stats->last_batch_cycles, stats->max_batch_cycles);
     } else {
         console_write_string("  Status: Not detected\n");
     }
@@ -241,16 +1586,32 @@ void iommu_init(void) {
     iommu_detect();
     
     if (!iommu_state.enabled) {
-        console_write_string("WARNING: IOMMU not available, device assignment will be unsafe\n");
+        log_warn("IOMMU not available, device assignment will be unsafe\n");
         return;
     }
     
     // Setup device groups
     iommu_setup_device_groups();
     
-    // Enable IOMMU
     if (iommu_state.type == IOMMU_TYPE_AMDVI) {
+        // Build cell DMA domains and point every device at its owner's domain
+        iommu_setup_cell_domains();
+        iommu_setup_device_table();
+        
+        // Enable IOMMU
         iommu_enable_amdvi();
+    } else if (iommu_state.type == IOMMU_TYPE_INTEL_VTD) {
+        // Same layout on VT-d: second-level tables per cell, context
+        // entries per device, then translation on
+        vtd_init();
+        for (uint32_t i = 0; i < iommu_state.group_count; i++) {
+            iommu_group_t *group = &iommu_state.groups[i];
+            if (!group->assigned) continue;
+            for (uint8_t j = 0; j < group->device_count; j++) {
+                iommu_write_dte(&group->devices[j]);
+            }
+        }
+        vtd_enable();
     }
     
     iommu_print_status();
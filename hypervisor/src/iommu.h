@@ -7,14 +7,40 @@
 #define IOMMU_TYPE_AMDVI 1
 #define IOMMU_TYPE_INTEL_VTD 2
 
+// AMD-Vi PCI capability block (offsets from the capability pointer)
+#define AMDVI_CAP_HDR_OFFSET 0x00
+#define AMDVI_CAP_BASE_LOW_OFFSET 0x04
+#define AMDVI_CAP_BASE_HIGH_OFFSET 0x08
+#define AMDVI_CAP_RANGE_OFFSET 0x0C
+
 // AMD-Vi MMIO registers
-#define AMDVI_MMIO_CAP_HDR_OFFSET 0x00
-#define AMDVI_MMIO_RANGE_OFFSET 0x04
+#define AMDVI_MMIO_DEV_TABLE_OFFSET 0x00
+#define AMDVI_MMIO_COMMAND_OFFSET 0x08
+#define AMDVI_MMIO_EVENT_OFFSET 0x10
 #define AMDVI_MMIO_CONTROL_OFFSET 0x18
-#define AMDVI_MMIO_COMMAND_OFFSET 0x20
-#define AMDVI_MMIO_EVENT_OFFSET 0x30
+#define AMDVI_MMIO_EXT_FEATURE_OFFSET 0x30
 #define AMDVI_MMIO_PPR_OFFSET 0x38
-#define AMDVI_MMIO_STATUS_OFFSET 0x2C
+#define AMDVI_MMIO_CMD_HEAD_OFFSET 0x2000
+#define AMDVI_MMIO_CMD_TAIL_OFFSET 0x2008
+#define AMDVI_MMIO_EVT_HEAD_OFFSET 0x2010
+#define AMDVI_MMIO_EVT_TAIL_OFFSET 0x2018
+#define AMDVI_MMIO_STATUS_OFFSET 0x2020
+#define AMDVI_MMIO_PPR_HEAD_OFFSET 0x2030
+#define AMDVI_MMIO_PPR_TAIL_OFFSET 0x2038
+
+// Status register bits (write 1 to clear)
+#define AMDVI_STATUS_EVT_OVERFLOW (1U << 0)
+#define AMDVI_STATUS_EVT_INT (1U << 1)
+#define AMDVI_STATUS_COMP_WAIT_INT (1U << 2)
+#define AMDVI_STATUS_EVT_RUN (1U << 3)
+#define AMDVI_STATUS_PPR_OVERFLOW (1U << 5)
+#define AMDVI_STATUS_PPR_INT (1U << 6)
+#define AMDVI_STATUS_PPR_RUN (1U << 7)
+#define AMDVI_LOG_STOP_TIMEOUT 100000  // Polls for a disabled log to stop running
+
+// Extended feature register
+#define AMDVI_EXT_FEATURE_PPR_SUP (1UL << 1)
+#define AMDVI_EXT_FEATURE_GA_SUP (1UL << 7)
 
 // IOMMU Control register bits
 #define IOMMU_CONTROL_IOMMU_EN (1UL << 0)
@@ -22,35 +48,265 @@
 #define IOMMU_CONTROL_EVT_LOG_EN (1UL << 2)
 #define IOMMU_CONTROL_EVT_INT_EN (1UL << 3)
 #define IOMMU_CONTROL_COMP_WAIT_INT_EN (1UL << 4)
-#define IOMMU_CONTROL_PPR_INT_EN (1UL << 5)
-#define IOMMU_CONTROL_PPR_EN (1UL << 6)
-#define IOMMU_CONTROL_COHERENT (1UL << 17)
+#define IOMMU_CONTROL_COHERENT (1UL << 10)
+#define IOMMU_CONTROL_CMD_BUF_EN (1UL << 12)
+#define IOMMU_CONTROL_PPR_LOG_EN (1UL << 13)
+#define IOMMU_CONTROL_PPR_INT_EN (1UL << 14)
+#define IOMMU_CONTROL_PPR_EN (1UL << 15)
+
+// Device table: one 256-bit entry per 16-bit device ID
+#define AMDVI_DEV_TABLE_ENTRIES 65536
+#define AMDVI_DEV_TABLE_SIZE (AMDVI_DEV_TABLE_ENTRIES * 32)
+#define AMDVI_DEVICE_ID(bus, dev, func) \
+    ((uint16_t)(((bus) << 8) | ((dev) << 3) | (func)))
+
+// Device table entry, qword 0
+#define AMDVI_DTE_V (1UL << 0)
+#define AMDVI_DTE_TV (1UL << 1)
+#define AMDVI_DTE_MODE_SHIFT 9
+#define AMDVI_DTE_PT_ROOT_MASK 0x000FFFFFFFFFF000UL
+#define AMDVI_DTE_IR (1UL << 61)
+#define AMDVI_DTE_IW (1UL << 62)
+
+// Device table entry, qword 2 (interrupt remapping). IV with IntCtl = 0
+// target-aborts every interrupt; IntCtl = 2 remaps through the table.
+#define AMDVI_DTE_IV (1UL << 0)
+#define AMDVI_DTE_INT_TAB_LEN_SHIFT 1
+#define AMDVI_DTE_INT_TABLE_MASK 0x000FFFFFFFFFFFC0UL
+#define AMDVI_DTE_INT_CTL_REMAP (2UL << 60)
+#define AMDVI_DTE_INT_CTL_PASS (1UL << 60)
+#define AMDVI_DTE_INIT_PASS (1UL << 56)
+#define AMDVI_DTE_EINT_PASS (1UL << 57)
+#define AMDVI_DTE_NMI_PASS (1UL << 58)
+#define AMDVI_DTE_LINT0_PASS (1UL << 62)
+#define AMDVI_DTE_LINT1_PASS (1UL << 63)
+// IOAPIC and HPET requester IDs: their interrupts go through unmapped
+#define AMDVI_DTE_INT_PASSTHROUGH (AMDVI_DTE_IV | AMDVI_DTE_INT_CTL_PASS | AMDVI_DTE_INIT_PASS | \
+                                   AMDVI_DTE_EINT_PASS | AMDVI_DTE_NMI_PASS | \
+                                   AMDVI_DTE_LINT0_PASS | AMDVI_DTE_LINT1_PASS)
+
+// Interrupt remapping table: 32-bit IRTEs indexed by MSI data[10:0], which
+// for a fixed MSI is just the vector the cell's driver picked
+#define AMDVI_IRTE_ENTRIES 256
+#define AMDVI_IRTE_LEN_ENCODING 8  // 2^8 entries
+#define AMDVI_IRTE_ALIGN 128
+#define AMDVI_IRTE_REMAP_EN (1U << 0)
+#define AMDVI_IRTE_DEST_SHIFT 8
+#define AMDVI_IRTE_VECTOR_SHIFT 16
+#define AMDVI_IRTE_FIRST_VECTOR 32  // Below this are CPU exceptions
+
+// IO page table entries (PDE when next level != 0, PTE otherwise)
+#define AMDVI_PTE_PR (1UL << 0)
+#define AMDVI_PTE_NEXT_LEVEL_SHIFT 9
+#define AMDVI_PTE_ADDR_MASK 0x000FFFFFFFFFF000UL
+#define AMDVI_PTE_IR (1UL << 61)
+#define AMDVI_PTE_IW (1UL << 62)
+
+// 3-level tables cover a 39-bit (512 GB) IO virtual space, enough for
+// both cell regions; level 3 holds 1 GB pages, level 2 holds 2 MB pages
+#define AMDVI_PAGE_MODE 3
+
+// Command buffer: 512 x 16-byte commands (ComLen = log2(512))
+#define AMDVI_CMD_BUF_ENTRIES 512
+#define AMDVI_CMD_BUF_LEN_SHIFT 56
+#define AMDVI_CMD_BUF_LEN_ENCODING 9
+#define AMDVI_CMD_OPCODE_SHIFT 28
+#define AMDVI_CMD_COMPLETION_WAIT 0x01
+#define AMDVI_CMD_INVALIDATE_DEVTAB_ENTRY 0x02
+#define AMDVI_CMD_INVALIDATE_IOMMU_PAGES 0x03
+#define AMDVI_CMD_INVALIDATE_INT_TABLE 0x05
+#define AMDVI_CMD_COMPLETION_WAIT_S (1U << 0)
+#define AMDVI_CMD_INV_PAGES_S (1U << 0)
+#define AMDVI_CMD_INV_PAGES_PDE (1U << 1)
+#define AMDVI_CMD_WAIT_TIMEOUT_MS 10  // COMPLETION_WAIT deadline, in TSC time
+
+#define AMDVI_CMD_COMPLETE_PPR_REQUEST 0x07
+#define AMDVI_PPR_STATUS_INVALID 0x1
+#define AMDVI_PPR_STATUS_SHIFT 12
+
+// Event and PPR logs: 512 x 16-byte entries each
+#define AMDVI_LOG_ENTRIES 512
+#define AMDVI_LOG_LEN_SHIFT 56
+#define AMDVI_LOG_LEN_ENCODING 9
+#define AMDVI_EVENT_CODE_SHIFT 28
+#define AMDVI_EVENT_FLAG_INTERRUPT (1U << 3)  // I bit: fault was an interrupt request
+
+// Event codes
+#define AMDVI_EVENT_ILLEGAL_DEV_TABLE_ENTRY 0x1
+#define AMDVI_EVENT_IO_PAGE_FAULT 0x2
+#define AMDVI_EVENT_DEV_TAB_HW_ERROR 0x3
+#define AMDVI_EVENT_PAGE_TAB_HW_ERROR 0x4
+#define AMDVI_EVENT_ILLEGAL_COMMAND 0x5
+#define AMDVI_EVENT_COMMAND_HW_ERROR 0x6
+#define AMDVI_EVENT_IOTLB_INV_TIMEOUT 0x7
+#define AMDVI_EVENT_INVALID_DEVICE_REQUEST 0x8
+#define AMDVI_EVENT_CODE_COUNT 16
+
+// Decoded faults handed to the dashboard; power of two for cheap masking
+#define IOMMU_FAULT_RING_SIZE 64
+#define IOMMU_MAX_DEFERRED_PPR 16
+
+// Invalidations queued inside one ownership change before they are
+// coalesced and flushed behind a single COMPLETION_WAIT
+#define AMDVI_CMD_MAX_PENDING_DEVICES 64
+
+// Per-cell DMA domains (domain 0 is reserved by the hardware)
+#define IOMMU_DOMAIN_NONE 0
+#define IOMMU_DOMAIN_LINUX 1
+#define IOMMU_DOMAIN_WINDOWS 2
+#define IOMMU_CELL_DOMAIN(cell_id) ((uint16_t)((cell_id) + 1))
+
+// Devices the hypervisor drives itself (the input xHCI) get a third
+// domain that only reaches hypervisor memory
+#define IOMMU_HYPERVISOR_CELL 2
+#define IOMMU_DOMAIN_HYPERVISOR IOMMU_CELL_DOMAIN(IOMMU_HYPERVISOR_CELL)
+#define IOMMU_MAX_DOMAINS 3
 
 // PCIe device assignment
 #define MAX_IOMMU_GROUPS 64
 #define MAX_DEVICES_PER_GROUP 16
 
+// xHCI controllers the policy leaves to the input path: the hypervisor's
+// own driver, then the handoff controller that follows the active cell
+#define IOMMU_INPUT_CONTROLLERS 2
+
+// Ownership table: one uint16_t per BDF (AMD-Vi device ID) holding a valid
+// bit, the owning cell and the group index
+#define IOMMU_OWNER_VALID (1U << 15)
+#define IOMMU_OWNER_ASSIGNED (1U << 14)  // Group belongs to a cell, not blocked
+#define IOMMU_OWNER_CELL_SHIFT 8
+#define IOMMU_OWNER_CELL_MASK (0x3U << IOMMU_OWNER_CELL_SHIFT)
+#define IOMMU_OWNER_GROUP_MASK 0xFFU
+#define IOMMU_OWNER_NONE 0xFF
+
 typedef struct {
     uint16_t bus;
     uint16_t device;
     uint16_t function;
     uint8_t assigned_to_linux;
+    uint16_t domain_id;  // DMA domain its DTE points at
+    uint32_t *irt;       // Interrupt remapping table (AMD-Vi)
+    uint16_t irq_vectors;       // Vectors routed to the owning cell's cores
+    uint16_t irq_programmed;    // Of those, destinations taken from the device's MSI setup
+    uint32_t irq_blocked;       // Interrupts the IOMMU rejected
 } pcie_device_t;
 
+typedef struct {
+    uint16_t domain_id;
+    uint8_t cell_id;
+    uint64_t *root;      // Level-3 IO page table
+    uint64_t mapped_bytes;
+    uint32_t pages_1g;
+    uint32_t pages_2m;
+    uint32_t pages_4k;
+} iommu_domain_t;
+
+// Boot-time assignment policy; 0xFFFF / PCI_BDF_NONE fields match anything
+typedef struct {
+    uint16_t vendor_id;
+    uint16_t class_code;
+    uint16_t bdf;
+    uint8_t cell_id;
+} iommu_policy_rule_t;
+
 typedef struct {
     uint32_t group_id;
+    uint16_t anchor_bdf;  // Highest function DMA from this group can alias to
+    uint8_t assigned;     // 0 = no cell owns it, DMA stays blocked
+    uint8_t hypervisor_owned;  // Claimed by a hypervisor driver instead
     uint8_t assigned_to_linux;
     uint8_t device_count;
+    uint8_t overflowed;   // More functions than devices[] holds
+    uint8_t input_reserved;  // Holds an input xHCI; the policy skips it
     pcie_device_t devices[MAX_DEVICES_PER_GROUP];
 } iommu_group_t;
 
+typedef struct {
+    uint32_t data[4];
+} amdvi_command_t;
+
+typedef struct {
+    uint64_t commands_issued;
+    uint64_t completion_waits;
+    uint64_t invalidations_coalesced;  // Requests merged into another command
+    uint64_t wait_timeouts;
+    uint32_t last_batch_commands;
+    uint64_t last_batch_cycles;
+    uint64_t max_batch_cycles;
+} iommu_cmd_stats_t;
+
+typedef struct {
+    uint16_t device_id;
+    uint8_t owner_cell;  // IOMMU_OWNER_NONE for devices outside any group
+    uint8_t event_code;
+    uint16_t flags;
+    uint64_t address;
+} iommu_fault_record_t;
+
+// Single producer (event log interrupt), single consumer (dashboard)
+typedef struct {
+    iommu_fault_record_t records[IOMMU_FAULT_RING_SIZE];
+    volatile uint32_t head;  // Next slot the producer writes
+    volatile uint32_t tail;  // Next slot the consumer reads
+    uint32_t dropped;
+} iommu_fault_ring_t;
+
+typedef struct {
+    amdvi_command_t *buffer;  // Event or PPR log entries share the 16-byte layout
+    uint32_t head;
+    uint64_t interrupts;
+    uint64_t entries;
+    uint64_t overflows;
+} amdvi_log_t;
+
+typedef struct {
+    uint64_t events_by_code[AMDVI_EVENT_CODE_COUNT];
+    uint64_t ppr_requests;
+    uint64_t ppr_rejected;
+    uint32_t devices_faulted;  // Distinct device IDs with at least one fault
+} iommu_fault_stats_t;
+
+typedef struct {
+    amdvi_command_t *buffer;
+    uint32_t tail;
+    uint8_t busy;  // A command sequence is mid-flight on this CPU
+    uint8_t ready;
+    uint32_t batch_depth;
+    volatile uint64_t *completion_sem;
+    uint64_t wait_token;
+    // PPR responses raised in interrupt context while the ring was busy
+    amdvi_command_t deferred_ppr[IOMMU_MAX_DEFERRED_PPR];
+    uint32_t deferred_ppr_count;
+    // Pending invalidations for the open batch
+    uint16_t pending_devices[AMDVI_CMD_MAX_PENDING_DEVICES];
+    uint32_t pending_device_count;
+    uint8_t flush_all_devices;
+    uint8_t pages_dirty[IOMMU_MAX_DOMAINS];  // Per domain
+    uint64_t pages_start[IOMMU_MAX_DOMAINS];
+    uint64_t pages_end[IOMMU_MAX_DOMAINS];
+    iommu_cmd_stats_t stats;
+} amdvi_cmd_queue_t;
+
 typedef struct {
     uint64_t base_addr;
+    uint16_t pci_bus;
+    uint16_t pci_device;
+    uint16_t pci_function;
     uint32_t cap_id;
     uint8_t type;
     uint8_t enabled;
     iommu_group_t groups[MAX_IOMMU_GROUPS];
     uint32_t group_count;
+    uint32_t refused_assignments;  // Groups split by policy or too large to list
+    uint64_t *device_table;
+    iommu_domain_t domains[IOMMU_MAX_DOMAINS];
+    amdvi_cmd_queue_t cmd;
+    amdvi_log_t event_log;
+    amdvi_log_t ppr_log;
+    uint8_t ppr_supported;
+    uint8_t ga_supported;  // Guest virtual APIC IRTEs available
+    iommu_fault_stats_t faults;
+    iommu_fault_ring_t fault_ring;
 } iommu_t;
 
 void iommu_init(void);
@@ -61,6 +317,28 @@ void iommu_setup_device_groups(void);
 uint8_t iommu_is_linux_device(uint16_t bus, uint16_t device, uint16_t function);
 void iommu_assign_device_to_linux(uint16_t bus, uint16_t device, uint16_t function);
 void iommu_assign_device_to_windows(uint16_t bus, uint16_t device, uint16_t function);
+uint8_t iommu_assign_group(uint32_t group_id, uint8_t cell_id);
+uint8_t iommu_get_device_owner(uint16_t device_id);
+uint8_t iommu_get_device_group(uint16_t device_id);
+void iommu_print_interrupt_routes(void);
+uint8_t iommu_claim_device(uint16_t bus, uint16_t device, uint16_t function);
+const iommu_group_t *iommu_get_group(uint32_t group_id);
+uint32_t iommu_get_group_fault_count(uint32_t group_id);
+uint32_t iommu_sync_interrupt_routes(uint8_t cell_id);
+void iommu_setup_device_table(void);
+void iommu_setup_cell_domains(void);
+uint8_t iommu_map_range(uint8_t cell_id, uint64_t iova, uint64_t phys, uint64_t size);
+void iommu_unmap_range(uint8_t cell_id, uint64_t iova, uint64_t size);
+void iommu_setup_command_buffer(void);
+void iommu_begin_ownership_change(void);
+uint32_t iommu_commit_ownership_change(void);
+const iommu_cmd_stats_t *iommu_get_cmd_stats(void);
+void iommu_setup_event_logs(void);
+void iommu_handle_interrupt(void);
+uint8_t iommu_pop_fault(iommu_fault_record_t *record);
+uint32_t iommu_get_device_fault_count(uint16_t bus, uint16_t device, uint16_t function);
+const iommu_fault_stats_t *iommu_get_fault_stats(void);
+void iommu_print_faults(void);
 void iommu_print_status(void);
 
 #endif
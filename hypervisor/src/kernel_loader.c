@@ -1,6 +1,7 @@
 #include "kernel_loader.h"
 #include "console.h"
 #include "system_manager.h"
+#include "kprintf.h"
 #include "types.h"
 
 static kernel_state_t kernel_state = {0};
@@ -82,7 +83,7 @@ void kernel_boot_linux(void) {
     console_write_string("Booting Linux kernel...\n");
     
     if (!kernel_state.linux_kernel.loaded) {
-        console_write_string("ERROR: Linux kernel not loaded\n");
+        log_error("Linux kernel not loaded\n");
         return;
     }
     
@@ -103,7 +104,7 @@ void kernel_boot_windows(void) {
     console_write_string("Booting Windows kernel...\n");
     
     if (!kernel_state.windows_kernel.loaded) {
-        console_write_string("ERROR: Windows kernel not loaded\n");
+        log_error("Windows kernel not loaded\n");
         return;
     }
     
@@ -0,0 +1,58 @@
+#ifndef KPRINTF_H
+#define KPRINTF_H
+
+#include "types.h"
+
+typedef __builtin_va_list va_list;
+#define va_start(ap, last) __builtin_va_start(ap, last)
+#define va_arg(ap, type) __builtin_va_arg(ap, type)
+#define va_end(ap) __builtin_va_end(ap)
+
+// Longest message kprintf emits in one console write; longer output is
+// truncated, never split
+#define KPRINTF_BUFFER_SIZE 256
+
+// Log levels. Messages above LOG_LEVEL are removed by the preprocessor,
+// arguments included; override with -DLOG_LEVEL=LOG_LEVEL_DEBUG.
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_WARN 1
+#define LOG_LEVEL_INFO 2
+#define LOG_LEVEL_DEBUG 3
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+// For debug-only work beyond a message: a constant, so the block and
+// anything only it calls compile away with the messages
+#define log_enabled(level) (LOG_LEVEL >= (level))
+
+#define log_error(fmt, ...) kprintf("ERROR: " fmt, ##__VA_ARGS__)
+
+#if LOG_LEVEL >= LOG_LEVEL_WARN
+#define log_warn(fmt, ...) kprintf("WARNING: " fmt, ##__VA_ARGS__)
+#else
+#define log_warn(fmt, ...) do { } while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+#define log_info(fmt, ...) kprintf(fmt, ##__VA_ARGS__)
+#else
+#define log_info(fmt, ...) do { } while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define log_debug(fmt, ...) kprintf(fmt, ##__VA_ARGS__)
+#else
+#define log_debug(fmt, ...) do { } while (0)
+#endif
+
+// Conversions: %d %i %u %x %X %p %s %c %%, with the l/ll/z length
+// modifiers, a field width and the '0' and '-' flags. Returns the length
+// the full output would have had, like snprintf.
+uint32_t kvsnprintf(char *buf, uint32_t size, const char *fmt, va_list ap);
+uint32_t ksnprintf(char *buf, uint32_t size, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+uint32_t kprintf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+void kprintf_benchmark(void);
+
+#endif
@@ -8,19 +8,69 @@
 #include "monitor.h"
 #include "dashboard.h"
 #include "kernel_loader.h"
+#include "acpi.h"
+#include "pci.h"
+#include "fbcon.h"
+#include "metrics_export.h"
+#include "working_set.h"
+#include "trace.h"
+#include "kprintf.h"
+
+// Whole-word match against the kernel command line from GRUB
+static uint8_t cmdline_has_option(uint32_t magic, uint64_t info, const char *option) {
+    if (magic != MULTIBOOT2_BOOTLOADER_MAGIC || !info) return 0;
+    
+    uint32_t total_size = *(const uint32_t *)info;
+    uint64_t tag = info + 8;
+    while (tag + 8 <= info + total_size) {
+        uint32_t type = *(const uint32_t *)tag;
+        uint32_t size = *(const uint32_t *)(tag + 4);
+        if (type == MULTIBOOT2_TAG_END || size < 8) break;
+        
+        if (type == MULTIBOOT2_TAG_CMDLINE) {
+            const char *word = (const char *)(tag + 8);
+            while (*word) {
+                while (*word == ' ') word++;
+                uint32_t i = 0;
+                while (option[i] && word[i] == option[i]) i++;
+                if (!option[i] && (word[i] == ' ' || word[i] == '\0')) return 1;
+                while (*word && *word != ' ') word++;
+            }
+            return 0;
+        }
+        tag += (size + 7) & ~7U;
+    }
+    return 0;
+}
 
 void cmain(uint32_t magic, uint32_t addr) {
     console_init();
     console_write_string("=== CONCORDIA Hypervisor ===\n\n");
     
+    // Parse firmware tables once; CPU, PCI and IOMMU setup read the cache
+    acpi_init(magic, addr);
+    pci_init();
+    
     // Initialize CPU
     console_write_string("1. Initializing CPU...\n");
     cpu_init();
+    trace_init();
+    if (log_enabled(LOG_LEVEL_DEBUG)) {
+        kprintf_benchmark();
+    }
     
     // Initialize memory
     console_write_string("\n2. Initializing Memory...\n");
     memory_init();
     
+    // Lending a hibernated cell's memory is opt-in from the command line
+    if (cmdline_has_option(magic, addr, "lend_memory")) {
+        memory_set_lending_enabled(1);
+    }
+    
+    // Screen output moves to the framebuffer once it can be mapped
+    fbcon_init(magic, addr);
+    
     // Initialize IOMMU
     console_write_string("\n3. Initializing IOMMU...\n");
     iommu_init();
@@ -37,6 +87,8 @@ void cmain(uint32_t magic, uint32_t addr) {
     // Initialize Monitor
     console_write_string("\n6. Initializing Monitor...\n");
     monitor_init();
+    working_set_init();
+    metrics_export_init();
     
     // Initialize Dashboard
     console_write_string("\n7. Initializing Dashboard...\n");
@@ -54,7 +106,10 @@ void cmain(uint32_t magic, uint32_t addr) {
     
     console_write_string("\nHypervisor ready. Press Ctrl+Alt+O to switch between Linux and Windows.\n");
     
-    while (1) {
-        asm volatile("hlt");
-    }
+    // Device interrupts (IOMMU events, keyboard, ...) are handled from here
+    // on; hotkey switches run from the control loop and console output
+    // drains from the serial THRE interrupt
+    console_enable_async();
+    asm volatile("sti");
+    system_manager_run_control_loop();
 }
@@ -1,15 +1,36 @@
 #include "memory.h"
 #include "console.h"
+#include "cpu.h"
+#include "trace.h"
+#include "kprintf.h"
 #include "types.h"
 
-// Simple allocator for now
-static uint64_t heap_start = HYPERVISOR_MEMORY_START;
-static uint64_t heap_current = HYPERVISOR_MEMORY_START;
-static uint64_t heap_end = HYPERVISOR_MEMORY_END;
+// Simple allocator for now. The kernel image is loaded at
+// HYPERVISOR_MEMORY_START, so the heap begins after its .bss.
+extern char _end[];
+static uint64_t heap_start = 0;
+static uint64_t heap_current = 0;
+static uint64_t heap_end = HYPERVISOR_PERSIST_START;
 
 static memory_region_t regions[4] = {0};
+static uint64_t *nested_pml4[2];
+static uint64_t *nested_pdp[2];
+static uint64_t *nested_pd[2][MEMORY_CELL_PDS];
+static uint64_t *nested_lend_pd[2][LENDING_WINDOW_PDS];  // The other cell's lend window
+static uint8_t nested_active[2];
 static uint32_t region_count = 0;
 
+static memory_lending_t lending = {0};
+
+// Hypervisor PDPT, kept so MMIO above the first 1GB can be mapped later
+static uint64_t *kernel_pdp = 0;
+
+static inline uint64_t read_cr0(void) {
+    uint64_t cr0;
+    asm volatile("mov %%cr0, %0" : "=r"(cr0));
+    return cr0;
+}
+
 static inline uint64_t read_cr3(void) {
     uint64_t cr3;
     asm volatile("mov %%cr3, %0" : "=r"(cr3));
@@ -32,13 +53,11 @@ static inline void write_cr4(uint64_t cr4) {
 
 // Allocate 2MB pages for now (simpler than 4KB)
 static uint64_t *alloc_page_table(void) {
-    if (heap_current + PAGE_SIZE_4K > heap_end) {
+    uint64_t *table = (uint64_t *)memory_alloc_aligned(PAGE_SIZE_4K, PAGE_SIZE_4K);
+    if (!table) {
         return 0;
     }
     
-    uint64_t *table = (uint64_t *)heap_current;
-    heap_current += PAGE_SIZE_4K;
-    
     // Clear the table
     for (int i = 0; i < 512; i++) {
         table[i] = 0;
@@ -53,7 +72,7 @@ void memory_setup_paging(void) {
     // Allocate top-level page table (PML4)
     uint64_t *pml4 = alloc_page_table();
     if (!pml4) {
-        console_write_string("ERROR: Failed to allocate PML4\n");
+        log_error("Failed to allocate PML4\n");
         return;
     }
     
@@ -67,7 +86,7 @@ void memory_setup_paging(void) {
     uint64_t *pd = alloc_page_table();
     
     if (!pdp || !pd) {
-        console_write_string("ERROR: Failed to allocate page directory\n");
+        log_error("Failed to allocate page directory\n");
         return;
     }
     
@@ -83,6 +102,8 @@ void memory_setup_paging(void) {
         pd[i] = page_addr | PAGE_PRESENT | PAGE_WRITE | PAGE_PSE | PAGE_GLOBAL;
     }
     
+    kernel_pdp = pdp;
+    
     // Set CR3 to point to PML4
     write_cr3((uint64_t)pml4);
     
@@ -94,6 +115,200 @@ void memory_setup_paging(void) {
     console_write_string("Paging initialized\n");
 }
 
+// PDPT covering the low 512GB: ours if memory_setup_paging() ran,
+// otherwise whatever the boot path left in CR3
+static uint64_t *memory_get_pdp(void) {
+    if (kernel_pdp) return kernel_pdp;
+    
+    uint64_t *pml4 = (uint64_t *)(read_cr3() & PAGE_ADDRESS_MASK);
+    if (!(pml4[0] & PAGE_PRESENT)) return 0;
+    return (uint64_t *)(pml4[0] & PAGE_ADDRESS_MASK);
+}
+
+// Replace a 1GB identity page with a PD of 2MB pages carrying the same
+// attributes, so part of it can take a different memory type
+static uint64_t *memory_split_1g_page(uint64_t *pdpe) {
+    uint64_t *pd = alloc_page_table();
+    if (!pd) return 0;
+    
+    uint64_t base = *pdpe & PAGE_ADDRESS_MASK & ~((uint64_t)PAGE_SIZE_1G - 1);
+    uint64_t flags = *pdpe & ~(PAGE_ADDRESS_MASK & ~((uint64_t)PAGE_SIZE_1G - 1));
+    for (uint32_t i = 0; i < 512; i++) {
+        pd[i] = (base + (uint64_t)i * PAGE_SIZE_2M) | flags;  // PAT sits at bit 12 at both levels
+    }
+    *pdpe = (uint64_t)pd | PAGE_PRESENT | PAGE_WRITE;
+    return pd;
+}
+
+// Identity-map device memory with 2MB pages below 512GB. cache_flags
+// picks the memory type, e.g. PAGE_WRITE_COMBINING for a framebuffer;
+// 1GB pages in the way are split so the type really applies. Returns 0
+// when it cannot be applied, including with paging off, so callers never
+// report a memory type the range does not have.
+uint8_t memory_map_mmio(uint64_t phys, uint64_t size, uint64_t cache_flags) {
+    if (!size) return 0;
+    if (!(read_cr0() & CR0_PG)) return 0;
+    
+    uint64_t *pdp = memory_get_pdp();
+    if (!pdp) return 0;
+    
+    uint64_t start = phys & ~((uint64_t)PAGE_SIZE_2M - 1);
+    uint64_t end = (phys + size + PAGE_SIZE_2M - 1) & ~((uint64_t)PAGE_SIZE_2M - 1);
+    if (end > 512UL * PAGE_SIZE_1G) return 0;
+    
+    for (uint64_t addr = start; addr < end; addr += PAGE_SIZE_2M) {
+        uint64_t *pdpe = &pdp[addr / PAGE_SIZE_1G];
+        if (!(*pdpe & PAGE_PRESENT)) {
+            uint64_t *pd = alloc_page_table();
+            if (!pd) return 0;
+            *pdpe = (uint64_t)pd | PAGE_PRESENT | PAGE_WRITE;
+        } else if ((*pdpe & PAGE_PSE) && !memory_split_1g_page(pdpe)) {
+            return 0;
+        }
+        uint64_t *pd = (uint64_t *)(*pdpe & PAGE_ADDRESS_MASK);
+        pd[(addr / PAGE_SIZE_2M) & 511] = addr | PAGE_PRESENT | PAGE_WRITE | PAGE_PSE | PAGE_GLOBAL | cache_flags;
+    }
+    
+    // Global entries survive a CR3 reload; toggling PGE flushes them
+    uint64_t cr4 = read_cr4();
+    write_cr4(cr4 & ~(1UL << 7));
+    write_cr4(cr4);
+    return 1;
+}
+
+// Guest-physical -> host-physical tables for each cell, identity over the
+// cell's region with 2MB pages. The root is the cell's nCR3; the A bits in
+// the PD entries are what the working set scanner samples. Nested walks
+// count as user accesses, so every level carries PAGE_USER.
+// Nested PD entry for the 2MB guest block at `addr`. The hypervisor
+// region is never mapped into a cell: blocks inside it stay not-present,
+// and a block it only partly covers gets a 4KB table without those pages.
+static uint8_t memory_nested_block(uint64_t addr, uint64_t *pde) {
+    uint64_t flags = PAGE_PRESENT | PAGE_WRITE | PAGE_USER;
+    uint64_t end = addr + PAGE_SIZE_2M;
+    
+    if (end <= HYPERVISOR_MEMORY_START || addr >= HYPERVISOR_MEMORY_END) {
+        *pde = addr | flags | PAGE_PSE;
+        return 1;
+    }
+    if (addr >= HYPERVISOR_MEMORY_START && end <= HYPERVISOR_MEMORY_END) {
+        *pde = 0;
+        return 1;
+    }
+    
+    uint64_t *pt = alloc_page_table();
+    if (!pt) return 0;
+    for (uint32_t k = 0; k < 512; k++) {
+        uint64_t page_addr = addr + (uint64_t)k * PAGE_SIZE_4K;
+        if (page_addr < HYPERVISOR_MEMORY_START || page_addr >= HYPERVISOR_MEMORY_END) {
+            pt[k] = page_addr | flags;
+        }
+    }
+    *pde = (uint64_t)pt | flags;
+    return 1;
+}
+
+void memory_setup_nested_tables(void) {
+    console_write_string("Setting up nested page tables...\n");
+    
+    for (uint8_t cell_id = 0; cell_id < 2; cell_id++) {
+        // Each PD covers one PDP slot, so the region must start on a 1GB
+        // boundary and fit under the first PML4 entry
+        uint64_t base = regions[cell_id].base;
+        if ((base & (PAGE_SIZE_1G - 1)) || base / PAGE_SIZE_1G + MEMORY_CELL_PDS > 512) {
+            log_error("%s base 0x%lx is not 1GB aligned, no nested page tables\n",
+                      regions[cell_id].name, base);
+            return;
+        }
+        
+        uint64_t *pml4 = alloc_page_table();
+        uint64_t *pdp = alloc_page_table();
+        if (!pml4 || !pdp) {
+            log_error("Failed to allocate nested page tables\n");
+            return;
+        }
+        pml4[0] = (uint64_t)pdp | PAGE_PRESENT | PAGE_WRITE | PAGE_USER;
+        
+        for (uint32_t i = 0; i < MEMORY_CELL_PDS; i++) {
+            uint64_t *pd = alloc_page_table();
+            if (!pd) {
+                log_error("Failed to allocate nested page directory\n");
+                return;
+            }
+            for (uint32_t j = 0; j < 512; j++) {
+                uint64_t page_addr = base + ((uint64_t)i * 512 + j) * PAGE_SIZE_2M;
+                if (!memory_nested_block(page_addr, &pd[j])) {
+                    log_error("Failed to allocate nested page table\n");
+                    return;
+                }
+            }
+            pdp[base / PAGE_SIZE_1G + i] = (uint64_t)pd | PAGE_PRESENT | PAGE_WRITE | PAGE_USER;
+            nested_pd[cell_id][i] = pd;
+        }
+        nested_pml4[cell_id] = pml4;
+        nested_pdp[cell_id] = pdp;
+        
+        kprintf("  %s: nCR3 0x%lx, %u x 2MB\n", regions[cell_id].name, (uint64_t)pml4, (uint32_t)MEMORY_CELL_BLOCKS);
+    }
+    
+    // Directories for the other cell's lend window, built now and only
+    // hooked into the PDPT while a loan is out
+    for (uint8_t cell_id = 0; cell_id < 2; cell_id++) {
+        uint64_t window = regions[1 - cell_id].base + LENDING_WINDOW_OFFSET;
+        for (uint32_t i = 0; i < LENDING_WINDOW_PDS; i++) {
+            uint64_t *pd = alloc_page_table();
+            if (!pd) {
+                log_error("Failed to allocate nested lend directory\n");
+                return;
+            }
+            for (uint32_t j = 0; j < 512; j++) {
+                uint64_t page_addr = window + ((uint64_t)i * 512 + j) * PAGE_SIZE_2M;
+                if (!memory_nested_block(page_addr, &pd[j])) {
+                    log_error("Failed to allocate nested page table\n");
+                    return;
+                }
+            }
+            nested_lend_pd[cell_id][i] = pd;
+        }
+    }
+}
+
+// Hook the donor's lend window into the borrower's nested tables, or take
+// it out again. The caller flushes the borrower's TLB after an unmap.
+static uint8_t memory_map_lend_window(uint8_t borrower_cell, uint64_t base, uint8_t map) {
+    uint64_t *pdp = nested_pdp[borrower_cell];
+    if (!pdp || !nested_lend_pd[borrower_cell][LENDING_WINDOW_PDS - 1]) return 0;
+    
+    for (uint32_t i = 0; i < LENDING_WINDOW_PDS; i++) {
+        pdp[base / PAGE_SIZE_1G + i] = map ?
+            (uint64_t)nested_lend_pd[borrower_cell][i] | PAGE_PRESENT | PAGE_WRITE | PAGE_USER : 0;
+    }
+    return 1;
+}
+
+uint64_t memory_get_nested_root(uint8_t cell_id) {
+    if (cell_id >= 2) return 0;
+    return (uint64_t)nested_pml4[cell_id];
+}
+
+// Nothing calls this yet: there is no VMRUN path, so no cell runs on
+// its nested root and no hardware sets the accessed bits in it
+void memory_set_nested_active(uint8_t cell_id, uint8_t active) {
+    if (cell_id >= 2 || !nested_pml4[cell_id]) return;
+    nested_active[cell_id] = active ? 1 : 0;
+}
+
+uint8_t memory_nested_active(uint8_t cell_id) {
+    if (cell_id >= 2) return 0;
+    return nested_active[cell_id];
+}
+
+// PD entry mapping 2MB block `block` of the cell's region
+uint64_t *memory_get_cell_block_entry(uint8_t cell_id, uint32_t block) {
+    if (cell_id >= 2 || block >= MEMORY_CELL_BLOCKS || !nested_pml4[cell_id]) return 0;
+    return &nested_pd[cell_id][block / 512][block % 512];
+}
+
 void memory_setup_cell_boundaries(void) {
     console_write_string("Setting up memory cell boundaries...\n");
     
@@ -137,6 +352,31 @@ void memory_setup_cell_boundaries(void) {
     console_write_string(" (16 GB)\n");
 }
 
+// Parts of a cell's region its guest and devices may reach. The Linux
+// region starts at 0 and so contains the hypervisor image, heap and the
+// IOMMU structures; that hole is left out of every mapping.
+uint32_t memory_get_cell_ranges(uint8_t cell_id, memory_range_t *ranges) {
+    if (cell_id >= 2) return 0;
+    
+    uint64_t base = regions[cell_id].base;
+    uint64_t end = base + regions[cell_id].limit;
+    uint32_t count = 0;
+    if (HYPERVISOR_MEMORY_END <= base || HYPERVISOR_MEMORY_START >= end) {
+        ranges[count].base = base;
+        ranges[count++].size = end - base;
+        return count;
+    }
+    if (HYPERVISOR_MEMORY_START > base) {
+        ranges[count].base = base;
+        ranges[count++].size = HYPERVISOR_MEMORY_START - base;
+    }
+    if (HYPERVISOR_MEMORY_END < end) {
+        ranges[count].base = HYPERVISOR_MEMORY_END;
+        ranges[count++].size = end - HYPERVISOR_MEMORY_END;
+    }
+    return count;
+}
+
 uint8_t memory_is_linux_address(uint64_t addr) {
     return (addr >= LINUX_MEMORY_START && addr < LINUX_MEMORY_END) ? 1 : 0;
 }
@@ -145,7 +385,14 @@ uint8_t memory_is_windows_address(uint64_t addr) {
     return (addr >= WINDOWS_MEMORY_START && addr < WINDOWS_MEMORY_END) ? 1 : 0;
 }
 
+static void memory_heap_init(void) {
+    heap_start = ((uint64_t)_end + PAGE_SIZE_4K - 1) & ~((uint64_t)PAGE_SIZE_4K - 1);
+    heap_current = heap_start;
+}
+
 void *memory_alloc(size_t size) {
+    if (!heap_current) memory_heap_init();
+    
     // Simple bump allocator from hypervisor heap
     if (heap_current + size > heap_end) {
         return 0;
@@ -157,6 +404,20 @@ void *memory_alloc(size_t size) {
     return ptr;
 }
 
+void *memory_alloc_aligned(size_t size, size_t align) {
+    if (!heap_current) memory_heap_init();
+    
+    // Bump to the next multiple of align (power of two) before allocating
+    uint64_t aligned = (heap_current + align - 1) & ~((uint64_t)align - 1);
+    if (aligned + size > heap_end) {
+        return 0;
+    }
+    
+    heap_current = aligned + size;
+    
+    return (void *)aligned;
+}
+
 void memory_free(void *ptr) {
     // For now, no-op (would need a real allocator)
     (void)ptr;
@@ -169,11 +430,177 @@ void memory_print_layout(void) {
     console_write_string("  Windows Cell: 16 GB\n");
 }
 
+void memory_lending_init(void) {
+    lending.enabled = 0;
+    lending.active = 0;
+    
+    // One balloon page per cell, in the cell's own memory where its driver
+    // can read the extents and write the ack. The hypervisor maps it too.
+    for (int i = 0; i < 2; i++) {
+        uint64_t addr = regions[i].base + BALLOON_PAGE_OFFSET;
+        if (!memory_map_mmio(addr, PAGE_SIZE_4K, 0)) {
+            log_error("Failed to map balloon page at 0x%lx\n", addr);
+            return;
+        }
+        balloon_page_t *page = (balloon_page_t *)addr;
+        page->magic = BALLOON_MAGIC;
+        page->generation = 0;
+        page->ack_generation = 0;
+        page->reclaim_request = 0;
+        page->extent_count = 0;
+        lending.balloon[i] = page;
+    }
+}
+
+void memory_set_lending_enabled(uint8_t enabled) {
+    lending.enabled = enabled ? 1 : 0;
+    console_write_string(lending.enabled ? "Memory lending enabled\n" : "Memory lending disabled\n");
+}
+
+uint8_t memory_lending_enabled(void) {
+    return lending.enabled;
+}
+
+// Lend a hibernated cell's lend window to the running cell: everything
+// above its resume area and hibernation image. The caller guarantees the
+// donor image is persisted, and moves the extent's DMA mappings.
+void memory_lend_cell_frames(uint8_t donor_cell, uint8_t borrower_cell) {
+    if (!lending.enabled || lending.active) return;
+    if (donor_cell >= 2 || borrower_cell >= 2 || donor_cell == borrower_cell) return;
+    
+    balloon_page_t *page = lending.balloon[borrower_cell];
+    if (!page) return;
+    
+    uint64_t base = regions[donor_cell].base + LENDING_WINDOW_OFFSET;
+    if (!memory_map_lend_window(borrower_cell, base, 1)) {
+        log_warn("No nested tables for the lend window, nothing lent\n");
+        return;
+    }
+    
+    lending.donor_cell = donor_cell;
+    lending.borrower_cell = borrower_cell;
+    lending.lent_base = base;
+    lending.lent_size = LENDING_WINDOW_SIZE;
+    lending.blocks_lent = lending.lent_size / LENDING_BLOCK_SIZE;
+    
+    // Publish to the borrower's balloon driver as a hot-add extent. The
+    // guest owns the page between loans, so the magic is restated.
+    page->magic = BALLOON_MAGIC;
+    page->extents[0].base = lending.lent_base;
+    page->extents[0].size = lending.lent_size;
+    page->extent_count = 1;
+    page->reclaim_request = 0;
+    page->generation++;
+    
+    lending.active = 1;
+    lending.loan_count++;
+    TRACE(MEMORY_LEND, borrower_cell, lending.blocks_lent);
+    
+    kprintf("  Lent %u x 2MB blocks to %s\n", lending.blocks_lent, borrower_cell == 0 ? "Linux" : "Windows");
+}
+
+// The borrower loses the window from its nested tables here; its TLB is
+// the caller's to flush
+static void memory_finish_reclaim(uint8_t forced) {
+    memory_map_lend_window(lending.borrower_cell, lending.lent_base, 0);
+    lending.balloon[lending.borrower_cell]->extent_count = 0;
+    lending.active = 0;
+    lending.blocks_lent = 0;
+    lending.reclaim_count++;
+    if (forced) {
+        lending.forced_reclaims++;
+    }
+    
+    uint64_t cycles = cpu_read_tsc() - lending.reclaim_start_tsc;
+    lending.last_reclaim_cycles = cycles;
+    if (cycles > lending.max_reclaim_cycles) {
+        lending.max_reclaim_cycles = cycles;
+    }
+    TRACE(MEMORY_RECLAIM_END, forced, cycles);
+}
+
+// Ask the borrower's balloon driver to offline the frames donor_cell lent
+// out, waiting at most BALLOON_RECLAIM_TIMEOUT_MS for the ack. Returns 1
+// once the frames are back (or nothing was on loan); 0 leaves the loan
+// active for memory_force_reclaim().
+uint8_t memory_request_reclaim(uint8_t donor_cell) {
+    if (!lending.active || lending.donor_cell != donor_cell) return 1;
+    
+    balloon_page_t *page = lending.balloon[lending.borrower_cell];
+    lending.reclaim_start_tsc = cpu_read_tsc();
+    TRACE(MEMORY_RECLAIM_BEGIN, donor_cell, lending.blocks_lent);
+    
+    page->reclaim_request = 1;
+    uint32_t gen = ++page->generation;
+    uint32_t mhz = cpu_get_tsc_mhz();
+    uint64_t timeout = (uint64_t)(mhz ? mhz : 1000) * 1000 * BALLOON_RECLAIM_TIMEOUT_MS;
+    while (page->ack_generation != gen) {
+        if (cpu_read_tsc() - lending.reclaim_start_tsc >= timeout) return 0;
+        asm volatile("pause");
+    }
+    
+    memory_finish_reclaim(0);
+    return 1;
+}
+
+// Take the frames back without the driver's ack. The caller must already
+// have frozen the borrower's cores and removed its DMA mappings of the
+// extents, since the borrower may still be using them.
+void memory_force_reclaim(uint8_t donor_cell) {
+    if (!lending.active || lending.donor_cell != donor_cell) return;
+    memory_finish_reclaim(1);
+}
+
+uint64_t memory_get_cell_capacity(uint8_t cell_id) {
+    if (cell_id >= 2) return 0;
+    
+    uint64_t capacity = regions[cell_id].limit;
+    if (lending.active) {
+        if (lending.borrower_cell == cell_id) {
+            capacity += lending.lent_size;
+        } else if (lending.donor_cell == cell_id) {
+            capacity -= lending.lent_size;
+        }
+    }
+    return capacity;
+}
+
+const memory_lending_t *memory_get_lending(void) {
+    return &lending;
+}
+
+void memory_print_lending_status(void) {
+    console_write_string("Memory Lending:\n");
+    console_write_string("  Mode: ");
+    console_write_string(lending.enabled ? "Enabled\n" : "Disabled\n");
+    if (!lending.enabled) return;
+    
+    if (lending.active) {
+        kprintf("  On loan: %s -> %s, base 0x%lx, size 0x%lx\n",
+                lending.donor_cell == 0 ? "Linux" : "Windows",
+                lending.borrower_cell == 0 ? "Linux" : "Windows",
+                lending.lent_base, lending.lent_size);
+    } else {
+        console_write_string("  On loan: none\n");
+    }
+    kprintf("  Balloon pages: 0x%lx (Linux), 0x%lx (Windows)\n",
+            (uint64_t)lending.balloon[0], (uint64_t)lending.balloon[1]);
+    kprintf("  Reclaims: %lu (forced %lu)\n", lending.reclaim_count, lending.forced_reclaims);
+    kprintf("  Reclaim cycles (last/max): 0x%lx / 0x%lx\n",
+            lending.last_reclaim_cycles, lending.max_reclaim_cycles);
+}
+
 void memory_init(void) {
     console_write_string("Initializing memory subsystem...\n");
     
     // Setup memory regions
     memory_setup_cell_boundaries();
+    if (!heap_current) memory_heap_init();
+    kprintf("  Heap: 0x%lx - 0x%lx\n", heap_start, heap_end);
+    memory_setup_nested_tables();
+    
+    // Balloon pages for opt-in memory lending
+    memory_lending_init();
     
     // Setup paging (would be done, but needs working CR3 support)
     // memory_setup_paging();
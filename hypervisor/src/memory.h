@@ -18,6 +18,11 @@
 #define HYPERVISOR_MEMORY_START 0x100000
 #define HYPERVISOR_MEMORY_END   (HYPERVISOR_MEMORY_START + HYPERVISOR_MEMORY)
 
+// Top of the hypervisor region is kept out of the heap so state cached there
+// (e.g. the PCI topology) survives into the next warm boot
+#define HYPERVISOR_PERSIST_SIZE  (64 * 1024)
+#define HYPERVISOR_PERSIST_START (HYPERVISOR_MEMORY_END - HYPERVISOR_PERSIST_SIZE)
+
 // Page sizes
 #define PAGE_SIZE_4K          4096
 #define PAGE_SIZE_2M          (2 * 1024 * 1024)
@@ -34,6 +39,18 @@
 #define PAGE_PSE              (1UL << 7)
 #define PAGE_GLOBAL           (1UL << 8)
 #define PAGE_NX               (1UL << 63)
+#define PAGE_ADDRESS_MASK     0x000FFFFFFFFFF000UL
+#define CR0_PG                (1UL << 31)
+
+// Per-cell nested page tables map the cell's region in 2MB pages, less
+// the hypervisor region. A cell only uses its root once a VMRUN path
+// loads it as nCR3 and calls memory_set_nested_active().
+#define MEMORY_CELL_BLOCKS    (LINUX_MEMORY_SIZE / PAGE_SIZE_2M)
+#define MEMORY_CELL_PDS       (MEMORY_CELL_BLOCKS / 512)
+
+// PWT alone selects PAT entry 1, which cpu_enable_write_combining()
+// reprograms from write-through to write-combining
+#define PAGE_WRITE_COMBINING  PAGE_PWT
 
 typedef struct {
     uint64_t entry;
@@ -53,13 +70,89 @@ typedef struct {
     char name[32];
 } memory_region_t;
 
+// A cell region with the hypervisor carved out is at most two ranges
+#define MEMORY_CELL_MAX_RANGES 2
+
+typedef struct {
+    uint64_t base;
+    uint64_t size;
+} memory_range_t;
+
+// Memory lending (opt-in ballooning from a hibernated cell to the active one).
+// From its base, each cell region holds the 1GB resume area (on Linux also
+// the hypervisor), the compacted hibernation image, then the lend window:
+// the only part of a hibernated cell that another cell may borrow.
+#define LENDING_BLOCK_SIZE      PAGE_SIZE_2M
+#define CELL_RESUME_SIZE        PAGE_SIZE_1G
+#define CELL_IMAGE_SIZE         (8UL * 1024 * 1024 * 1024)   // 8 GB
+#define LENDING_WINDOW_OFFSET   (CELL_RESUME_SIZE + CELL_IMAGE_SIZE)
+#define LENDING_WINDOW_SIZE     (LINUX_MEMORY_SIZE - LENDING_WINDOW_OFFSET)
+#define LENDING_WINDOW_PDS      (LENDING_WINDOW_SIZE / PAGE_SIZE_1G)
+#define LENDING_MAX_EXTENTS     8
+#define BALLOON_MAGIC           0x4E4F4F4C4C4142UL  // "BALLOON"
+#define BALLOON_RECLAIM_TIMEOUT_MS 10   // Switch path wait for the driver's ack
+
+// Balloon page shared with a cell's balloon driver. The hypervisor publishes
+// lent extents here; the driver hot-adds them and acks each generation.
+// It is the last page of the cell's resume area, a fixed guest-physical
+// address inside the cell's own mappings that the cell's memory map keeps
+// reserved; the driver checks the magic.
+#define BALLOON_PAGE_OFFSET     (CELL_RESUME_SIZE - PAGE_SIZE_4K)
+typedef struct {
+    uint64_t base;
+    uint64_t size;
+} balloon_extent_t;
+
+typedef struct {
+    uint64_t magic;
+    volatile uint32_t generation;      // Bumped by the hypervisor on every change
+    volatile uint32_t ack_generation;  // Written back by the driver
+    volatile uint32_t reclaim_request; // 1 = give every lent extent back
+    uint32_t extent_count;
+    balloon_extent_t extents[LENDING_MAX_EXTENTS];
+} balloon_page_t;
+
+typedef struct {
+    uint8_t enabled;
+    uint8_t active;            // A loan is currently outstanding
+    uint8_t donor_cell;
+    uint8_t borrower_cell;
+    uint32_t blocks_lent;
+    uint64_t lent_base;
+    uint64_t lent_size;
+    uint64_t loan_count;
+    uint64_t reclaim_count;
+    uint64_t forced_reclaims;  // Driver did not ack before the timeout
+    uint64_t reclaim_start_tsc;
+    uint64_t last_reclaim_cycles;
+    uint64_t max_reclaim_cycles;
+    balloon_page_t *balloon[2];
+} memory_lending_t;
+
 void memory_init(void);
 void memory_setup_paging(void);
+uint8_t memory_map_mmio(uint64_t phys, uint64_t size, uint64_t cache_flags);
 void *memory_alloc(size_t size);
+void *memory_alloc_aligned(size_t size, size_t align);
 void memory_free(void *ptr);
+void memory_setup_nested_tables(void);
+uint64_t memory_get_nested_root(uint8_t cell_id);
+void memory_set_nested_active(uint8_t cell_id, uint8_t active);
+uint8_t memory_nested_active(uint8_t cell_id);
+uint64_t *memory_get_cell_block_entry(uint8_t cell_id, uint32_t block);
 void memory_setup_cell_boundaries(void);
+uint32_t memory_get_cell_ranges(uint8_t cell_id, memory_range_t *ranges);
 uint8_t memory_is_linux_address(uint64_t addr);
 uint8_t memory_is_windows_address(uint64_t addr);
 void memory_print_layout(void);
+void memory_lending_init(void);
+void memory_set_lending_enabled(uint8_t enabled);
+uint8_t memory_lending_enabled(void);
+void memory_lend_cell_frames(uint8_t donor_cell, uint8_t borrower_cell);
+uint8_t memory_request_reclaim(uint8_t donor_cell);
+void memory_force_reclaim(uint8_t donor_cell);
+uint64_t memory_get_cell_capacity(uint8_t cell_id);
+const memory_lending_t *memory_get_lending(void);
+void memory_print_lending_status(void);
 
 #endif
@@ -0,0 +1,217 @@
+#include "metrics_export.h"
+#include "console.h"
+#include "cpu.h"
+#include "iommu.h"
+#include "monitor.h"
+#include "system_manager.h"
+#include "working_set.h"
+#include "kprintf.h"
+#include "types.h"
+
+static metrics_export_t metrics_export = {0};
+
+static inline void uart_out(uint16_t port, uint8_t val) {
+    asm volatile("out %0, %1" : : "a"(val), "Nd"(port));
+}
+
+static inline uint8_t uart_in(uint16_t port) {
+    uint8_t ret;
+    asm volatile("in %1, %0" : "=a"(ret) : "Nd"(port));
+    return ret;
+}
+
+// Append formatted text to the frame in place; a frame that runs out of
+// room is flagged and never sent, so a line is always complete JSON
+static void metrics_export_append(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+static void metrics_export_append(const char *fmt, ...) {
+    uint32_t room = METRICS_EXPORT_BUFFER_SIZE - metrics_export.length;
+    va_list ap;
+    va_start(ap, fmt);
+    uint32_t len = kvsnprintf(metrics_export.frame + metrics_export.length, room, fmt, ap);
+    va_end(ap);
+    
+    if (len >= room) {
+        metrics_export.overflow = 1;
+        metrics_export.length = METRICS_EXPORT_BUFFER_SIZE - 1;
+        return;
+    }
+    metrics_export.length += len;
+}
+
+static void metrics_export_cell(const char *name, uint8_t cell_id, const cell_metrics_t *cell) {
+    if (cell->cores_sampled) {
+        metrics_export_append("\"%s\":{\"cpu_cycles\":%lu,\"cpu_load_percent\":%u,\"effective_mhz\":%u,"
+                              "\"ipc_x100\":%u,\"instructions\":%lu,\"llc_misses\":%lu,\"cores_sampled\":%u,",
+                              name, cell->cpu_cycles, cell->cpu_load_percent, cell->effective_mhz,
+                              cell->ipc_x100, cell->instructions, cell->llc_misses, cell->cores_sampled);
+    } else {
+        // No core of the cell runs the sampler: unknown, not idle
+        metrics_export_append("\"%s\":{\"cpu_cycles\":null,\"cpu_load_percent\":null,\"effective_mhz\":null,"
+                              "\"ipc_x100\":null,\"instructions\":null,\"llc_misses\":null,\"cores_sampled\":0,",
+                              name);
+    }
+    metrics_export_append("\"context_switches\":%u,\"activations\":%lu,\"interrupts\":%lu,\"irq_rate\":%u,",
+                          cell->context_switches, cell->activations, cell->interrupts, cell->irq_rate);
+    if (!cell->memory_sampled) {
+        // No working set estimate: unknown, not empty
+        metrics_export_append("\"memory_used\":null,\"memory_free\":null,\"working_set\":null}");
+        return;
+    }
+    // 10 s, 1 min and 5 min windows
+    metrics_export_append("\"memory_used\":%lu,\"memory_free\":%lu,\"working_set\":[%lu,%lu,%lu]}",
+                          cell->memory_used, cell->memory_free,
+                          working_set_get_bytes(cell_id, WORKING_SET_WINDOW_SHORT),
+                          working_set_get_bytes(cell_id, WORKING_SET_WINDOW_MEDIUM),
+                          working_set_get_bytes(cell_id, WORKING_SET_WINDOW_LONG));
+}
+
+// One frame: every system_metrics_t field, switch latency, IOMMU faults
+// and per-CPU interrupt counts. Formats straight into the static frame.
+static void metrics_export_encode(const system_metrics_t *metrics) {
+    const system_state_t *state = system_manager_get_state();
+    const iommu_fault_stats_t *faults = iommu_get_fault_stats();
+    
+    metrics_export.length = 0;
+    metrics_export.overflow = 0;
+    
+    metrics_export_append("{\"v\":%u,\"seq\":%lu,\"tsc\":%lu,\"tsc_mhz\":%u,",
+                          METRICS_EXPORT_VERSION, metrics_export.sequence, cpu_read_tsc(), cpu_get_tsc_mhz());
+    metrics_export_append("\"uptime_ms\":%lu,\"total_switches\":%u,\"last_update_time\":%lu,\"active_cell\":%u,",
+                          metrics->uptime_ms, metrics->total_switches, metrics->last_update_time,
+                          metrics->active_cell);
+    metrics_export_append("\"hypervisor_load_percent\":%u,", metrics->hypervisor_load_percent);
+    metrics_export_append("\"cells\":{");
+    metrics_export_cell("linux", 0, &metrics->linux_metrics);
+    metrics_export_append(",");
+    metrics_export_cell("windows", 1, &metrics->windows_metrics);
+    metrics_export_append("},");
+    
+    metrics_export_append("\"switch\":{\"count\":%lu,\"last_latency\":%lu,\"max_latency\":%lu,"
+                          "\"last_dispatch_delay\":%lu,\"last_reclaim_cycles\":%lu,\"histogram\":[",
+                          state->switch_count, state->last_switch_latency, state->max_switch_latency,
+                          state->last_dispatch_delay, state->last_reclaim_cycles);
+    for (uint32_t i = 0; i < SWITCH_LATENCY_BUCKETS; i++) {
+        metrics_export_append(i ? ",%u" : "%u", state->latency_histogram[i]);
+    }
+    metrics_export_append("]},");
+    
+    metrics_export_append("\"iommu\":{\"devices_faulted\":%u,\"ppr_requests\":%lu,\"ppr_rejected\":%lu,\"events\":[",
+                          faults->devices_faulted, faults->ppr_requests, faults->ppr_rejected);
+    for (uint32_t i = 0; i < AMDVI_EVENT_CODE_COUNT; i++) {
+        metrics_export_append(i ? ",%lu" : "%lu", faults->events_by_code[i]);
+    }
+    metrics_export_append("]},");
+    
+    metrics_export_append("\"irq_per_cpu\":[");
+    for (uint32_t i = 0; i < cpu_get_count() && i < MAX_CPUS; i++) {
+        metrics_export_append(i ? ",%lu" : "%lu", cpu_get_interrupt_count(i));
+    }
+    metrics_export_append("]}\n");
+}
+
+static void metrics_export_kick(void) {
+    if (__atomic_exchange_n(&metrics_export.tx_active, 1, __ATOMIC_ACQUIRE) == 0) {
+        // Re-arming ETBEI while THR is empty raises the interrupt at once
+        uart_out(METRICS_EXPORT_PORT + UART_IER, 0);
+        uart_out(METRICS_EXPORT_PORT + UART_IER, UART_IER_THRE);
+    }
+}
+
+// Fill the TX FIFO from the frame if the UART has room; returns bytes sent
+static uint32_t metrics_export_fill_fifo(void) {
+    if (!(uart_in(METRICS_EXPORT_PORT + UART_LSR) & UART_LSR_THRE)) {
+        return 0;
+    }
+    uint32_t count = 0;
+    while (count < metrics_export.fifo_size && metrics_export.sent < metrics_export.length) {
+        uart_out(METRICS_EXPORT_PORT + UART_THR, metrics_export.frame[metrics_export.sent++]);
+        count++;
+    }
+    return count;
+}
+
+void metrics_export_handle_interrupt(void) {
+    if (uart_in(METRICS_EXPORT_PORT + UART_IIR) & UART_IIR_NO_INT) {
+        return;
+    }
+    if (metrics_export_fill_fifo()) {
+        return;
+    }
+    uart_out(METRICS_EXPORT_PORT + UART_IER, 0);
+    __atomic_store_n(&metrics_export.tx_active, 0, __ATOMIC_RELEASE);
+}
+
+void metrics_export_init(void) {
+    console_write_string("Initializing metrics export...\n");
+    
+    if (uart_in(METRICS_EXPORT_PORT + UART_LSR) == UART_LSR_ABSENT) {
+        console_write_string("  No COM2, metrics export disabled\n");
+        return;
+    }
+    
+    uart_out(METRICS_EXPORT_PORT + UART_IER, 0);
+    uart_out(METRICS_EXPORT_PORT + 3, 0x80);  // DLAB
+    uart_out(METRICS_EXPORT_PORT + 0, 1);     // 115200 baud
+    uart_out(METRICS_EXPORT_PORT + 1, 0);
+    uart_out(METRICS_EXPORT_PORT + 3, 0x03);  // 8N1
+    uart_out(METRICS_EXPORT_PORT + UART_FCR, UART_FCR_ENABLE_CLEAR);
+    metrics_export.fifo_size = (uart_in(METRICS_EXPORT_PORT + UART_IIR) & UART_IIR_FIFO_MASK) == UART_IIR_FIFO_MASK ?
+                               UART_FIFO_SIZE : 1;
+    uart_out(METRICS_EXPORT_PORT + UART_MCR, UART_MCR_DTR_RTS_OUT2);
+    
+    // A frame is a few KB. Polling from the control loop moves one FIFO
+    // per pass, far below the 1 frame/s the monitor produces, so without
+    // the THRE interrupt the export stays off rather than fall behind
+    cpu_register_interrupt_handler(VECTOR_METRICS_EXPORT, metrics_export_handle_interrupt);
+    if (!cpu_route_isa_irq(METRICS_EXPORT_ISA_IRQ, VECTOR_METRICS_EXPORT)) {
+        console_write_string("  COM2 IRQ not routable, metrics export disabled\n");
+        return;
+    }
+    metrics_export.present = 1;
+    
+    kprintf("  NDJSON frames on COM2 (0x%x), interrupt driven\n", METRICS_EXPORT_PORT);
+}
+
+// Control loop hook: encode a frame after each monitor update, unless
+// the previous one is still on the wire
+void metrics_export_poll(void) {
+    if (!metrics_export.present) return;
+    
+    system_metrics_t metrics;
+    monitor_read_snapshot(&metrics);
+    if (metrics.last_update_tsc == metrics_export.last_update_tsc) return;
+    metrics_export.last_update_tsc = metrics.last_update_tsc;
+    
+    if (metrics_export.sent < metrics_export.length) {
+        metrics_export.frames_skipped++;
+        return;
+    }
+    
+    // Hold the THRE handler off the frame while it is rewritten
+    metrics_export.sent = METRICS_EXPORT_BUFFER_SIZE;
+    asm volatile("" ::: "memory");
+    
+    uint64_t start = cpu_read_tsc();
+    metrics_export_encode(&metrics);
+    metrics_export.last_encode_cycles = cpu_read_tsc() - start;
+    metrics_export.sequence++;
+    
+    if (metrics_export.overflow) {
+        metrics_export.frames_oversized++;
+        metrics_export.length = 0;
+        metrics_export.sent = 0;
+        return;
+    }
+    asm volatile("" ::: "memory");
+    metrics_export.sent = 0;
+    metrics_export.frames_sent++;
+    metrics_export_kick();
+}
+
+void metrics_export_print_status(void) {
+    if (!metrics_export.present) return;
+    
+    kprintf("Metrics export: %lu frames, %lu skipped, %lu oversized, last %u bytes encoded in 0x%lx cycles\n",
+            metrics_export.frames_sent, metrics_export.frames_skipped, metrics_export.frames_oversized,
+            metrics_export.length, metrics_export.last_encode_cycles);
+}
@@ -0,0 +1,37 @@
+#ifndef METRICS_EXPORT_H
+#define METRICS_EXPORT_H
+
+#include "types.h"
+
+// Machine-readable metrics on COM2: one JSON object per line (NDJSON),
+// sent after every monitor update and drained by the THRE interrupt;
+// there is no polled fallback. tools/metrics_decode.py turns the stream
+// into Prometheus text. Bump the version when fields change meaning;
+// adding fields does not need it.
+#define METRICS_EXPORT_PORT 0x2F8
+#define METRICS_EXPORT_ISA_IRQ 3
+#define METRICS_EXPORT_VERSION 2  // 2: unmeasured figures are null
+#define METRICS_EXPORT_BUFFER_SIZE 4096
+
+typedef struct {
+    uint8_t present;
+    uint8_t fifo_size;
+    volatile uint32_t tx_active;
+    char frame[METRICS_EXPORT_BUFFER_SIZE];
+    uint32_t length;              // Bytes in the frame being sent
+    volatile uint32_t sent;       // Bytes of it handed to the UART
+    uint8_t overflow;             // Frame being encoded did not fit
+    uint64_t last_update_tsc;     // Monitor update the last frame covered
+    uint64_t sequence;
+    uint64_t frames_sent;
+    uint64_t frames_skipped;      // Previous frame still going out
+    uint64_t frames_oversized;
+    uint64_t last_encode_cycles;
+} metrics_export_t;
+
+void metrics_export_init(void);
+void metrics_export_poll(void);
+void metrics_export_handle_interrupt(void);
+void metrics_export_print_status(void);
+
+#endif
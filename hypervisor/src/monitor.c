@@ -1,10 +1,88 @@
 #include "monitor.h"
 #include "console.h"
 #include "system_manager.h"
+#include "memory.h"
+#include "iommu.h"
+#include "kprintf.h"
+#include "fbcon.h"
+#include "metrics_export.h"
+#include "working_set.h"
 #include "types.h"
 
-static system_metrics_t system_metrics = {0};
+static system_metrics_t system_metrics = {0};  // Sampler's working copy
+static monitor_snapshot_t monitor_snapshot = {0};
 static uint64_t ticks = 0;
+static monitor_core_t monitor_cores[MAX_CPUS];
+static uint8_t monitor_counters = 0;  // CPU_COUNTER_* found at init
+static uint32_t monitor_interval_ms = MONITOR_UPDATE_INTERVAL_MS;  // Length of the last update
+static uint32_t monitor_boot_core = 0;          // Hypervisor's core, kept out of the cell sums
+static cpu_counters_t monitor_boot_totals = {0};
+
+static monitor_point_t fine_points[2][MONITOR_FINE_POINTS];
+static monitor_point_t coarse_points[2][MONITOR_COARSE_POINTS];
+static monitor_series_t monitor_series[2];
+
+// Runs on every sampling core. MSRs and PMCs are per core, so each core
+// reads its own and nothing crosses cores until the control loop sums
+// the totals.
+static void monitor_timer_interrupt(void) {
+    monitor_core_t *core = &monitor_cores[cpu_get_index() & (MAX_CPUS - 1)];
+    if (!core->enabled) return;
+    
+    cpu_counters_t now;
+    cpu_counters_read(&now);
+    
+    core->seq++;
+    asm volatile("" ::: "memory");
+    core->total.tsc += now.tsc - core->last.tsc;
+    core->total.aperf += now.aperf - core->last.aperf;
+    core->total.mperf += now.mperf - core->last.mperf;
+    core->total.instructions += (now.instructions - core->last.instructions) & CPU_PMC_MASK;
+    core->total.llc_misses += (now.llc_misses - core->last.llc_misses) & CPU_PMC_MASK;
+    asm volatile("" ::: "memory");
+    core->seq++;
+    
+    core->last = now;
+    core->samples++;
+}
+
+// Program the calling core's counters and timer. Each cell core must call
+// this once from its bring-up path; no AP is started yet, so until one is
+// a cell has no sampled cores and reports its CPU figures as not sampled.
+// The boot core calls it from monitor_init and is counted as the
+// hypervisor's, never as a cell's.
+void monitor_start_core_sampling(void) {
+    monitor_core_t *core = &monitor_cores[cpu_get_index() & (MAX_CPUS - 1)];
+    monitor_counters = cpu_counters_enable();
+    cpu_counters_read(&core->last);
+    core->enabled = 1;
+    
+    if (!cpu_start_local_timer(VECTOR_MONITOR_TIMER, MONITOR_SAMPLE_HZ)) {
+        core->enabled = 0;
+    }
+}
+
+// Consistent copy of a core's totals; retries if its timer fired meanwhile
+static void monitor_read_core(const monitor_core_t *core, cpu_counters_t *total) {
+    uint32_t seq;
+    do {
+        seq = core->seq;
+        asm volatile("" ::: "memory");
+        *total = core->total;
+        asm volatile("" ::: "memory");
+    } while ((seq & 1) || seq != core->seq);
+}
+
+static void monitor_publish_begin(void) {
+    monitor_snapshot.seq++;
+    asm volatile("" ::: "memory");
+}
+
+static void monitor_publish_end(void) {
+    monitor_snapshot.metrics = system_metrics;
+    asm volatile("" ::: "memory");
+    monitor_snapshot.seq++;
+}
 
 void monitor_init(void) {
     console_write_string("Initializing Monitor...\n");
@@ -23,6 +101,28 @@ void monitor_init(void) {
     system_metrics.windows_metrics.memory_used = 0;
     system_metrics.windows_metrics.context_switches = 0;
     
+    for (int cell = 0; cell < 2; cell++) {
+        monitor_series[cell].fine.points = fine_points[cell];
+        monitor_series[cell].fine.capacity = MONITOR_FINE_POINTS;
+        monitor_series[cell].coarse.points = coarse_points[cell];
+        monitor_series[cell].coarse.capacity = MONITOR_COARSE_POINTS;
+    }
+    system_metrics.start_tsc = cpu_read_tsc();
+    system_metrics.last_update_tsc = system_metrics.start_tsc;
+    
+    monitor_publish_begin();
+    monitor_publish_end();
+    
+    cpu_register_interrupt_handler(VECTOR_MONITOR_TIMER, monitor_timer_interrupt);
+    monitor_boot_core = cpu_get_index() & (MAX_CPUS - 1);
+    monitor_start_core_sampling();
+    kprintf("  Core sampling at %u Hz: APERF/MPERF %s, PMCs %s\n", MONITOR_SAMPLE_HZ,
+            (monitor_counters & CPU_COUNTER_APERF_MPERF) ? "yes" : "no",
+            (monitor_counters & CPU_COUNTER_PMC) ? "yes" : "no");
+    if (!monitor_cores[cpu_get_index() & (MAX_CPUS - 1)].enabled) {
+        log_warn("Local APIC timer not calibrated, sampling off\n");
+    }
+    
     console_write_string("Monitor initialized\n");
 }
 
@@ -30,22 +130,80 @@ uint64_t monitor_get_uptime(void) {
     return system_metrics.uptime_ms;
 }
 
+// Wait out a publish in progress and return the sequence to check against
+uint32_t monitor_read_begin(void) {
+    uint32_t seq;
+    while ((seq = monitor_snapshot.seq) & 1) {
+        asm volatile("pause");
+    }
+    asm volatile("" ::: "memory");
+    return seq;
+}
+
+// Nonzero if an update was published since monitor_read_begin()
+uint8_t monitor_read_retry(uint32_t seq) {
+    asm volatile("" ::: "memory");
+    return monitor_snapshot.seq != seq;
+}
+
+void monitor_read_snapshot(system_metrics_t *out) {
+    uint32_t seq;
+    do {
+        seq = monitor_read_begin();
+        *out = monitor_snapshot.metrics;
+    } while (monitor_read_retry(seq));
+}
+
+// Sum the per-core totals of the cell's cores and derive rates from the
+// change since the previous call
 void monitor_sample_cell_metrics(uint8_t cell_id, cell_metrics_t *metrics) {
     if (cell_id >= 2 || !metrics) return;
     
-    // Simulate CPU and memory sampling
-    // In a real implementation, would:
-    // - Read MSRs for CPU cycle counters
-    // - Query page tables for memory usage
-    // - Sample performance counters
+    cpu_counters_t sum = {0};
+    uint32_t cores = 0;
+    uint64_t interrupts = 0;
+    for (uint32_t i = 0; i < cpu_get_count() && i < MAX_CPUS; i++) {
+        const cpu_info_t *info = cpu_get_info(i);
+        if ((info->assigned_to_linux ? 0 : 1) != cell_id || i == monitor_boot_core) continue;
+        interrupts += cpu_get_interrupt_count(i);
+        if (!monitor_cores[i].enabled) continue;
+        
+        cpu_counters_t total;
+        monitor_read_core(&monitor_cores[i], &total);
+        sum.tsc += total.tsc;
+        sum.aperf += total.aperf;
+        sum.mperf += total.mperf;
+        sum.instructions += total.instructions;
+        sum.llc_misses += total.llc_misses;
+        cores++;
+    }
+    
+    uint64_t tsc = sum.tsc - metrics->totals.tsc;
+    uint64_t aperf = sum.aperf - metrics->totals.aperf;
+    uint64_t mperf = sum.mperf - metrics->totals.mperf;
+    metrics->instructions = sum.instructions - metrics->totals.instructions;
+    metrics->llc_misses = sum.llc_misses - metrics->totals.llc_misses;
+    metrics->totals = sum;
+    metrics->cores_sampled = cores;
+    metrics->cpu_cycles = sum.aperf;
     
-    metrics->cpu_cycles += 1000000;  // Simulate work
-    metrics->cpu_load_percent = (ticks % 80) + 10;  // Vary load 10-90%
-    metrics->memory_used = (cell_id == 0) ? 
-        (8UL * 1024 * 1024 * 1024) :  // Linux: ~8GB used
-        (6UL * 1024 * 1024 * 1024);   // Windows: ~6GB used
-    metrics->memory_free = 16UL * 1024 * 1024 * 1024 - metrics->memory_used;
-    metrics->context_switches += (ticks % 100);
+    uint32_t load = tsc ? (uint32_t)(mperf * 100 / tsc) : 0;
+    metrics->cpu_load_percent = load > 100 ? 100 : load;
+    metrics->effective_mhz = mperf ? (uint32_t)(cpu_get_tsc_mhz() * aperf / mperf) : 0;
+    metrics->ipc_x100 = aperf ? (uint32_t)(metrics->instructions * 100 / aperf) : 0;
+    
+    // Without an estimate the figures stay 0 and readers show them as n/a
+    metrics->memory_sampled = working_set_available(cell_id);
+    metrics->memory_used = metrics->memory_sampled ? working_set_get_bytes(cell_id, WORKING_SET_WINDOW_MEDIUM) : 0;
+    // Capacity includes frames borrowed from (or lent to) the other cell
+    uint64_t capacity = memory_get_cell_capacity(cell_id);
+    metrics->memory_free = (capacity > metrics->memory_used) ? capacity - metrics->memory_used : 0;
+    
+    uint64_t activations = system_manager_get_cell_activations(cell_id);
+    metrics->context_switches = (uint32_t)(activations - metrics->activations);
+    metrics->activations = activations;
+    metrics->irq_rate = (uint32_t)((interrupts - metrics->interrupts) * 1000 / monitor_interval_ms);
+    metrics->interrupts = interrupts;
 }
 
 uint32_t monitor_calculate_cpu_load(cell_metrics_t *metrics) {
@@ -53,73 +211,165 @@ uint32_t monitor_calculate_cpu_load(cell_metrics_t *metrics) {
     return metrics->cpu_load_percent;
 }
 
+static void monitor_ring_push(monitor_ring_t *ring, const monitor_point_t *point) {
+    if (!ring->capacity) return;  // Before monitor_init
+    ring->points[ring->head] = *point;
+    ring->head = (ring->head + 1) % ring->capacity;
+    if (ring->count < ring->capacity) {
+        ring->count++;
+    }
+}
+
+// Append a 1 s point, and every MONITOR_COARSE_RATIO points their average
+// to the 1 min ring. Nothing is recomputed from the fine ring later.
+static void monitor_series_record(uint8_t cell_id, const cell_metrics_t *metrics) {
+    monitor_series_t *series = &monitor_series[cell_id];
+    uint64_t capacity = memory_get_cell_capacity(cell_id);
+    
+    monitor_point_t point;
+    point.cpu_load = (uint8_t)metrics->cpu_load_percent;
+    point.memory_percent = capacity ? (uint8_t)(metrics->memory_used * 100 / capacity) : 0;
+    point.switches = metrics->context_switches > 0xFFFF ? 0xFFFF : (uint16_t)metrics->context_switches;
+    point.irq_rate = metrics->irq_rate;
+    monitor_ring_push(&series->fine, &point);
+    
+    series->sum_load += point.cpu_load;
+    series->sum_memory += point.memory_percent;
+    series->sum_switches += point.switches;
+    series->sum_irq_rate += point.irq_rate;
+    if (++series->pending < MONITOR_COARSE_RATIO) return;
+    
+    monitor_point_t coarse;
+    coarse.cpu_load = (uint8_t)(series->sum_load / MONITOR_COARSE_RATIO);
+    coarse.memory_percent = (uint8_t)(series->sum_memory / MONITOR_COARSE_RATIO);
+    coarse.switches = series->sum_switches > 0xFFFF ? 0xFFFF : (uint16_t)series->sum_switches;
+    coarse.irq_rate = (uint32_t)(series->sum_irq_rate / MONITOR_COARSE_RATIO);
+    monitor_ring_push(&series->coarse, &coarse);
+    
+    series->pending = 0;
+    series->sum_load = 0;
+    series->sum_memory = 0;
+    series->sum_switches = 0;
+    series->sum_irq_rate = 0;
+}
+
+// Called every control loop pass; does nothing until an interval has
+// passed by the TSC. Without a known TSC rate every call is an interval.
 void monitor_update_metrics(void) {
+    uint64_t now = cpu_read_tsc();
+    uint64_t cycles_per_ms = (uint64_t)cpu_get_tsc_mhz() * 1000;
+    if (cycles_per_ms) {
+        uint64_t elapsed = now - system_metrics.last_update_tsc;
+        if (elapsed < cycles_per_ms * MONITOR_UPDATE_INTERVAL_MS) return;
+        monitor_interval_ms = (uint32_t)(elapsed / cycles_per_ms);
+        system_metrics.uptime_ms = (now - system_metrics.start_tsc) / cycles_per_ms;
+    } else {
+        system_metrics.uptime_ms += MONITOR_UPDATE_INTERVAL_MS;
+    }
+    system_metrics.last_update_tsc = now;
     ticks++;
-    system_metrics.uptime_ms += MONITOR_UPDATE_INTERVAL_MS;
     
-    // Sample Linux cell metrics
+    // Sample both cells into the working copy
     monitor_sample_cell_metrics(0, &system_metrics.linux_metrics);
-    
-    // Sample Windows cell metrics
     monitor_sample_cell_metrics(1, &system_metrics.windows_metrics);
     
-    // Update active cell
+    // The hypervisor's own core, so its load is not mistaken for a cell's
+    if (monitor_cores[monitor_boot_core].enabled) {
+        cpu_counters_t total;
+        monitor_read_core(&monitor_cores[monitor_boot_core], &total);
+        uint64_t tsc = total.tsc - monitor_boot_totals.tsc;
+        uint64_t mperf = total.mperf - monitor_boot_totals.mperf;
+        uint32_t load = tsc ? (uint32_t)(mperf * 100 / tsc) : 0;
+        system_metrics.hypervisor_load_percent = load > 100 ? 100 : load;
+        monitor_boot_totals = total;
+    }
     system_metrics.active_cell = system_manager_get_active_cell();
+    system_metrics.total_switches = (uint32_t)system_manager_get_switch_count();
     
-    // Get switch count from system manager
-    system_metrics.total_switches = system_manager_get_active_cell();  // Placeholder
+    monitor_publish_begin();
+    monitor_series_record(0, &system_metrics.linux_metrics);
+    monitor_series_record(1, &system_metrics.windows_metrics);
+    monitor_publish_end();
+}
+
+static const monitor_ring_t *monitor_get_ring(uint8_t cell_id, uint8_t series) {
+    if (cell_id >= 2) return 0;
+    return series == MONITOR_SERIES_COARSE ? &monitor_series[cell_id].coarse : &monitor_series[cell_id].fine;
+}
+
+uint32_t monitor_get_point_count(uint8_t cell_id, uint8_t series) {
+    const monitor_ring_t *ring = monitor_get_ring(cell_id, series);
+    return ring ? ring->count : 0;
+}
+
+// age 0 is the newest point; null past the oldest one kept
+const monitor_point_t *monitor_get_point(uint8_t cell_id, uint8_t series, uint32_t age) {
+    const monitor_ring_t *ring = monitor_get_ring(cell_id, series);
+    if (!ring || age >= ring->count) return 0;
+    return &ring->points[(ring->head + ring->capacity - 1 - age) % ring->capacity];
+}
+
+uint32_t monitor_point_value(const monitor_point_t *point, uint8_t field) {
+    switch (field) {
+        case MONITOR_FIELD_CPU_LOAD:
+            return point->cpu_load;
+        case MONITOR_FIELD_MEMORY:
+            return point->memory_percent;
+        case MONITOR_FIELD_SWITCHES:
+            return point->switches;
+        case MONITOR_FIELD_IRQ_RATE:
+            return point->irq_rate;
+        default:
+            return 0;
+    }
 }
 
 void monitor_print_summary(void) {
+    // May run on a renderer rather than the sampler: print a snapshot
+    system_metrics_t metrics;
+    monitor_read_snapshot(&metrics);
+    
     console_write_string("=== System Monitor ===\n");
     
-    console_write_string("Uptime: ");
-    char buf[32];
-    uint64_t uptime_sec = system_metrics.uptime_ms / 1000;
-    itoa(uptime_sec, buf, 10);
-    console_write_string(buf);
-    console_write_string("s\n");
-    
-    console_write_string("\nActive Cell: ");
-    console_write_string(system_metrics.active_cell == 0 ? "Linux\n" : "Windows\n");
-    
-    // Linux metrics
-    console_write_string("\nLinux Cell:\n");
-    console_write_string("  CPU Load: ");
-    itoa(system_metrics.linux_metrics.cpu_load_percent, buf, 10);
-    console_write_string(buf);
-    console_write_string("%\n");
-    
-    console_write_string("  Memory Used: ");
-    uint64_t mem_gb = system_metrics.linux_metrics.memory_used / (1024 * 1024 * 1024);
-    itoa(mem_gb, buf, 10);
-    console_write_string(buf);
-    console_write_string(" GB / 16 GB\n");
-    
-    console_write_string("  CPU Cycles: ");
-    uint64_t cycles_m = system_metrics.linux_metrics.cpu_cycles / 1000000;
-    itoa(cycles_m, buf, 10);
-    console_write_string(buf);
-    console_write_string("M\n");
-    
-    // Windows metrics
-    console_write_string("\nWindows Cell:\n");
-    console_write_string("  CPU Load: ");
-    itoa(system_metrics.windows_metrics.cpu_load_percent, buf, 10);
-    console_write_string(buf);
-    console_write_string("%\n");
-    
-    console_write_string("  Memory Used: ");
-    mem_gb = system_metrics.windows_metrics.memory_used / (1024 * 1024 * 1024);
-    itoa(mem_gb, buf, 10);
-    console_write_string(buf);
-    console_write_string(" GB / 16 GB\n");
-    
-    console_write_string("  CPU Cycles: ");
-    cycles_m = system_metrics.windows_metrics.cpu_cycles / 1000000;
-    itoa(cycles_m, buf, 10);
-    console_write_string(buf);
-    console_write_string("M\n");
+    kprintf("Uptime: %lus\n", metrics.uptime_ms / 1000);
+    kprintf("\nActive Cell: %s\n", metrics.active_cell == 0 ? "Linux" : "Windows");
+    
+    kprintf("Hypervisor core load: %u%%\n", metrics.hypervisor_load_percent);
+    
+    const cell_metrics_t *cells[2] = { &metrics.linux_metrics, &metrics.windows_metrics };
+    for (int i = 0; i < 2; i++) {
+        kprintf("\n%s Cell:\n", i == 0 ? "Linux" : "Windows");
+        if (cells[i]->cores_sampled) {
+            kprintf("  CPU Load: %u%% on %u cores sampled, %u MHz effective\n"
+                    "  IPC: %u.%02u, LLC misses: %lu\n"
+                    "  CPU Cycles: %luM\n",
+                    cells[i]->cpu_load_percent, cells[i]->cores_sampled, cells[i]->effective_mhz,
+                    cells[i]->ipc_x100 / 100, cells[i]->ipc_x100 % 100, cells[i]->llc_misses,
+                    cells[i]->cpu_cycles / 1000000);
+        } else {
+            console_write_string("  CPU Load: not sampled (no cell core runs the sampler)\n");
+        }
+        if (cells[i]->memory_sampled) {
+            kprintf("  Memory Used: %lu MB / %lu MB (1 min working set)\n",
+                    cells[i]->memory_used >> 20, memory_get_cell_capacity(i) >> 20);
+        } else {
+            kprintf("  Memory Used: n/a / %lu MB (no working set estimate)\n",
+                    memory_get_cell_capacity(i) >> 20);
+        }
+    }
+    
+    // Device interrupts go straight to cell cores; show where they land
+    if (iommu_is_available()) {
+        console_write_string("\n");
+        iommu_print_interrupt_routes();
+    }
+    
+    console_write_string("\n");
+    system_manager_print_latency();
+    working_set_print_status();
+    console_print_stats();
+    fbcon_print_status();
+    metrics_export_print_status();
     
     console_write_string("\n=====================\n");
 }
@@ -2,17 +2,80 @@
 #define MONITOR_H
 
 #include "types.h"
+#include "cpu.h"
 
 // Monitoring refresh rates
 #define MONITOR_UPDATE_INTERVAL_MS 1000
+// Per-core counter sampling from the local APIC timer. Frequent enough
+// that a 48-bit counter cannot wrap twice between samples.
+#define MONITOR_SAMPLE_HZ 10
 
-// Metrics structure
+// One core's counters, written only by that core's timer interrupt and
+// alone on its cache line. seq is odd while an update is in progress.
 typedef struct {
-    uint64_t cpu_cycles;
-    uint32_t cpu_load_percent;
+    volatile uint32_t seq;
+    uint8_t enabled;
+    cpu_counters_t last;   // Raw values at the previous sample
+    cpu_counters_t total;  // Accumulated deltas since sampling started
+    uint64_t samples;
+} __attribute__((aligned(64))) monitor_core_t;
+
+// Per-cell history, fixed size: 1 s points for 5 minutes and 1 min
+// points for 24 hours. Every 60 fine points are averaged into one coarse
+// point as they arrive.
+#define MONITOR_SERIES_FINE 0
+#define MONITOR_SERIES_COARSE 1
+#define MONITOR_FINE_POINTS 300
+#define MONITOR_COARSE_POINTS 1440
+#define MONITOR_COARSE_RATIO 60
+
+#define MONITOR_FIELD_CPU_LOAD 0
+#define MONITOR_FIELD_MEMORY 1
+#define MONITOR_FIELD_SWITCHES 2
+#define MONITOR_FIELD_IRQ_RATE 3
+
+typedef struct {
+    uint8_t cpu_load;        // Percent
+    uint8_t memory_percent;  // Of the cell's current capacity
+    uint16_t switches;       // Into this cell during the interval
+    uint32_t irq_rate;       // Per second, summed over the cell's cores
+} monitor_point_t;
+
+typedef struct {
+    monitor_point_t *points;
+    uint32_t capacity;
+    uint32_t head;   // Next slot written
+    uint32_t count;
+} monitor_ring_t;
+
+typedef struct {
+    monitor_ring_t fine;
+    monitor_ring_t coarse;
+    // Running sums of the fine points not yet folded into a coarse one
+    uint32_t pending;
+    uint32_t sum_load;
+    uint32_t sum_memory;
+    uint32_t sum_switches;
+    uint64_t sum_irq_rate;
+} monitor_series_t;
+
+// Metrics structure. Rates cover the interval since the previous update.
+typedef struct {
+    uint64_t cpu_cycles;         // Actual (APERF) cycles on the cell's cores
+    uint32_t cpu_load_percent;   // C0 residency: MPERF / TSC
+    uint32_t effective_mhz;      // Average clock while running: APERF / MPERF
+    uint32_t ipc_x100;           // Instructions per 100 cycles
+    uint64_t instructions;
+    uint64_t llc_misses;
+    uint32_t cores_sampled;
+    cpu_counters_t totals;       // Sum of core totals at the last update
+    uint8_t memory_sampled;      // A working set estimate backs memory_used
     uint64_t memory_used;
     uint64_t memory_free;
     uint32_t context_switches;
+    uint64_t activations;        // Cell switch count at the last update
+    uint64_t interrupts;         // Interrupts on the cell's cores, last update
+    uint32_t irq_rate;
 } cell_metrics_t;
 
 // System metrics
@@ -22,14 +85,33 @@ typedef struct {
     uint64_t last_update_time;
     cell_metrics_t linux_metrics;
     cell_metrics_t windows_metrics;
+    uint32_t hypervisor_load_percent;  // Boot core, which runs the control loop
     uint8_t active_cell;
+    uint64_t start_tsc;
+    uint64_t last_update_tsc;
 } system_metrics_t;
 
+// Published copy of the metrics. The sampler is the only writer; readers
+// retry instead of making it wait. The history rings are written inside
+// the same window, so a reader can bracket them with
+// monitor_read_begin() / monitor_read_retry().
+typedef struct {
+    volatile uint32_t seq;   // Odd while an update is being published
+    system_metrics_t metrics;
+} monitor_snapshot_t;
+
 void monitor_init(void);
+void monitor_start_core_sampling(void);
 void monitor_update_metrics(void);
 void monitor_sample_cell_metrics(uint8_t cell_id, cell_metrics_t *metrics);
 uint32_t monitor_calculate_cpu_load(cell_metrics_t *metrics);
 uint64_t monitor_get_uptime(void);
+void monitor_read_snapshot(system_metrics_t *out);
+uint32_t monitor_read_begin(void);
+uint8_t monitor_read_retry(uint32_t seq);
+const monitor_point_t *monitor_get_point(uint8_t cell_id, uint8_t series, uint32_t age);
+uint32_t monitor_get_point_count(uint8_t cell_id, uint8_t series);
+uint32_t monitor_point_value(const monitor_point_t *point, uint8_t field);
 void monitor_print_summary(void);
 
 #endif
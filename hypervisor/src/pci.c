@@ -0,0 +1,445 @@
+#include "pci.h"
+#include "acpi.h"
+#include "console.h"
+#include "cpu.h"
+#include "kprintf.h"
+#include "spinlock.h"
+#include "types.h"
+
+static pci_state_t pci_state = {0};
+
+// Lives in the persistent part of the hypervisor region so a warm boot can
+// reuse it after validation instead of walking every bus again
+static pci_topology_t *topology = (pci_topology_t *)PCI_TOPOLOGY_CACHE_ADDR;
+_Static_assert(sizeof(pci_topology_t) <= HYPERVISOR_PERSIST_SIZE, "PCI topology cache too large");
+
+// 0xCF8/0xCFC is an address/data pair shared by every CPU
+static spinlock_t legacy_lock = SPINLOCK_INIT;
+
+static inline void outl(uint16_t port, uint32_t value) {
+    asm volatile("outl %0, %1" : : "a"(value), "Nd"(port));
+}
+
+static inline uint32_t inl(uint16_t port) {
+    uint32_t value;
+    asm volatile("inl %1, %0" : "=a"(value) : "Nd"(port));
+    return value;
+}
+
+static uint32_t pci_legacy_read32(uint16_t bus, uint16_t dev, uint16_t func, uint16_t offset) {
+    if (offset >= PCI_LEGACY_CONFIG_SIZE) {
+        return PCI_INVALID_READ;
+    }
+    
+    spin_lock(&legacy_lock);
+    outl(PCI_CONFIG_ADDRESS, PCI_MAKE_ADDRESS(bus, dev, func, offset));
+    uint32_t value = inl(PCI_CONFIG_DATA);
+    spin_unlock(&legacy_lock);
+    
+    return value;
+}
+
+static void pci_legacy_write32(uint16_t bus, uint16_t dev, uint16_t func, uint16_t offset, uint32_t value) {
+    if (offset >= PCI_LEGACY_CONFIG_SIZE) {
+        return;
+    }
+    
+    spin_lock(&legacy_lock);
+    outl(PCI_CONFIG_ADDRESS, PCI_MAKE_ADDRESS(bus, dev, func, offset));
+    outl(PCI_CONFIG_DATA, value);
+    spin_unlock(&legacy_lock);
+}
+
+static inline uint8_t pci_ecam_covers(uint16_t bus) {
+    return pci_state.access == PCI_ACCESS_ECAM &&
+           bus >= pci_state.ecam_start_bus && bus <= pci_state.ecam_end_bus;
+}
+
+static inline volatile uint32_t *pci_ecam_address(uint16_t bus, uint16_t dev, uint16_t func, uint16_t offset) {
+    return (volatile uint32_t *)(pci_state.ecam_base + PCI_ECAM_OFFSET(bus, dev, func, offset));
+}
+
+// One MMIO load per dword, no lock, and the full 4 KB extended space
+uint32_t pci_config_read32(uint16_t bus, uint16_t dev, uint16_t func, uint16_t offset) {
+    if (pci_ecam_covers(bus) && offset < PCI_EXT_CONFIG_SIZE) {
+        return *pci_ecam_address(bus, dev, func, offset);
+    }
+    return pci_legacy_read32(bus, dev, func, offset);
+}
+
+void pci_config_write32(uint16_t bus, uint16_t dev, uint16_t func, uint16_t offset, uint32_t value) {
+    if (pci_ecam_covers(bus) && offset < PCI_EXT_CONFIG_SIZE) {
+        *pci_ecam_address(bus, dev, func, offset) = value;
+        return;
+    }
+    pci_legacy_write32(bus, dev, func, offset, value);
+}
+
+// Walk the standard capability list; returns the capability offset or 0
+uint8_t pci_find_capability(uint16_t bus, uint16_t dev, uint16_t func, uint8_t cap_id) {
+    uint8_t cap_ptr = pci_config_read32(bus, dev, func, PCI_CONFIG_CAP_PTR) & 0xFC;
+    uint32_t guard = 48;  // Malformed lists must not loop forever
+    
+    while (cap_ptr && guard--) {
+        uint32_t cap = pci_config_read32(bus, dev, func, cap_ptr);
+        if ((cap & 0xFF) == cap_id) {
+            return cap_ptr;
+        }
+        cap_ptr = (cap >> 8) & 0xFC;
+    }
+    return 0;
+}
+
+uint8_t pci_has_ecam(void) {
+    return pci_state.access == PCI_ACCESS_ECAM;
+}
+
+const pci_state_t *pci_get_state(void) {
+    return &pci_state;
+}
+
+// Probe function 0 of every device on every bus, timing the whole sweep
+static uint64_t pci_benchmark_scan(uint32_t (*read32)(uint16_t, uint16_t, uint16_t, uint16_t), uint32_t *found) {
+    uint32_t count = 0;
+    uint64_t start = cpu_read_tsc();
+    
+    for (uint16_t bus = 0; bus < 256; bus++) {
+        for (uint16_t dev = 0; dev < 32; dev++) {
+            if ((read32(bus, dev, 0, 0x00) & 0xFFFF) != 0xFFFF) {
+                count++;
+            }
+        }
+    }
+    
+    *found = count;
+    return cpu_read_tsc() - start;
+}
+
+static void pci_print_cycles(const char *label, uint64_t cycles) {
+    console_write_string(label);
+    console_write_string("0x");
+    console_write_hex(cycles);
+    console_write_string(" cycles\n");
+}
+
+static uint32_t pci_topology_hash(const pci_topology_t *table) {
+    const uint8_t *bytes = (const uint8_t *)table->devices;
+    uint32_t length = table->count * sizeof(pci_device_info_t);
+    uint32_t hash = FNV32_OFFSET_BASIS;
+    
+    for (uint32_t i = 0; i < length; i++) {
+        hash ^= bytes[i];
+        hash *= FNV32_PRIME;
+    }
+    return hash;
+}
+
+static uint16_t pci_find_ext_capability(uint16_t bus, uint16_t dev, uint16_t func, uint16_t cap_id) {
+    if (!pci_ecam_covers(bus)) {
+        return 0;
+    }
+    
+    uint16_t offset = PCI_EXT_CAP_START;
+    uint32_t guard = 64;
+    while (offset && guard--) {
+        uint32_t header = pci_config_read32(bus, dev, func, offset);
+        if (header == 0 || header == PCI_INVALID_READ) break;
+        if ((header & 0xFFFF) == cap_id) {
+            return offset;
+        }
+        offset = (header >> 20) & 0xFFC;
+    }
+    return 0;
+}
+
+static void pci_read_bars(pci_device_info_t *info, uint8_t bar_count) {
+    uint16_t bus = PCI_BDF_BUS(info->bdf);
+    uint16_t dev = PCI_BDF_DEVICE(info->bdf);
+    uint16_t func = PCI_BDF_FUNCTION(info->bdf);
+    
+    for (uint8_t i = 0; i < bar_count; i++) {
+        uint32_t bar = pci_config_read32(bus, dev, func, PCI_CONFIG_BAR0 + i * 4);
+        if (bar & PCI_BAR_IO) {
+            info->bars[i] = bar & ~0x3U;
+        } else if ((bar & 0x6) == PCI_BAR_MEM_TYPE_64 && i + 1 < bar_count) {
+            uint32_t high = pci_config_read32(bus, dev, func, PCI_CONFIG_BAR0 + (i + 1) * 4);
+            info->bars[i] = ((uint64_t)high << 32) | (bar & ~0xFU);
+            i++;  // Upper half consumed
+        } else {
+            info->bars[i] = bar & ~0xFU;
+        }
+    }
+}
+
+// Capability offsets and BARs: firmware may move either between boots
+// without changing the topology, so a cached table refreshes them too
+static void pci_read_resources(pci_device_info_t *info) {
+    uint16_t bus = PCI_BDF_BUS(info->bdf);
+    uint16_t dev = PCI_BDF_DEVICE(info->bdf);
+    uint16_t func = PCI_BDF_FUNCTION(info->bdf);
+    
+    info->msi_cap = pci_find_capability(bus, dev, func, PCI_CAP_ID_MSI);
+    info->msix_cap = pci_find_capability(bus, dev, func, PCI_CAP_ID_MSIX);
+    info->pcie_cap = pci_find_capability(bus, dev, func, PCI_CAP_ID_PCIE);
+    info->acs_cap = pci_find_ext_capability(bus, dev, func, PCI_EXT_CAP_ID_ACS);
+    for (uint8_t i = 0; i < PCI_MAX_BARS; i++) {
+        info->bars[i] = 0;
+    }
+    pci_read_bars(info, info->header_type == PCI_HEADER_TYPE_BRIDGE ? 2 : PCI_MAX_BARS);
+}
+
+static void pci_add_function(uint16_t bus, uint16_t dev, uint16_t func, uint16_t upstream, uint32_t id) {
+    if (topology->count >= PCI_MAX_DEVICES) {
+        return;
+    }
+    
+    pci_device_info_t *info = &topology->devices[topology->count++];
+    uint32_t class_reg = pci_config_read32(bus, dev, func, PCI_CONFIG_CLASS);
+    uint32_t header_reg = pci_config_read32(bus, dev, func, PCI_CONFIG_HEADER);
+    
+    // Zero the whole record so padding hashes the same on every boot
+    uint8_t *raw = (uint8_t *)info;
+    for (uint32_t i = 0; i < sizeof(pci_device_info_t); i++) {
+        raw[i] = 0;
+    }
+    
+    info->bdf = PCI_BDF(bus, dev, func);
+    info->vendor_id = id & 0xFFFF;
+    info->device_id = (id >> 16) & 0xFFFF;
+    info->class_code = (class_reg >> 16) & 0xFFFF;
+    info->prog_if = (class_reg >> 8) & 0xFF;
+    info->header_type = (header_reg >> 16) & PCI_HEADER_TYPE_MASK;
+    info->upstream_bdf = upstream;
+    
+    if (info->header_type == PCI_HEADER_TYPE_BRIDGE) {
+        uint32_t buses = pci_config_read32(bus, dev, func, PCI_CONFIG_BUSES);
+        info->secondary_bus = (buses >> 8) & 0xFF;
+        info->subordinate_bus = (buses >> 16) & 0xFF;
+    }
+    pci_read_resources(info);
+}
+
+// Depth-first walk from a bus, following bridges to the secondary buses
+// firmware assigned. Functions 1-7 are probed only on multi-function devices.
+static void pci_scan_bus(uint16_t bus, uint16_t upstream) {
+    for (uint16_t dev = 0; dev < 32; dev++) {
+        uint32_t id = pci_config_read32(bus, dev, 0, PCI_CONFIG_VENDOR);
+        if ((id & 0xFFFF) == 0xFFFF) continue;
+        
+        uint8_t header = (pci_config_read32(bus, dev, 0, PCI_CONFIG_HEADER) >> 16) & 0xFF;
+        uint16_t functions = (header & PCI_HEADER_MULTIFUNCTION) ? 8 : 1;
+        
+        for (uint16_t func = 0; func < functions; func++) {
+            if (func > 0) {
+                id = pci_config_read32(bus, dev, func, PCI_CONFIG_VENDOR);
+                if ((id & 0xFFFF) == 0xFFFF) continue;
+            }
+            
+            uint32_t index = topology->count;
+            pci_add_function(bus, dev, func, upstream, id);
+            if (index == topology->count) return;  // Table full
+            
+            pci_device_info_t *info = &topology->devices[index];
+            if (info->header_type == PCI_HEADER_TYPE_BRIDGE && info->secondary_bus > bus) {
+                pci_scan_bus(info->secondary_bus, info->bdf);
+            }
+        }
+    }
+}
+
+// DFS order is not BDF order; a few hundred entries sort fast enough
+static void pci_sort_topology(void) {
+    for (uint32_t i = 1; i < topology->count; i++) {
+        pci_device_info_t entry = topology->devices[i];
+        uint32_t j = i;
+        while (j > 0 && topology->devices[j - 1].bdf > entry.bdf) {
+            topology->devices[j] = topology->devices[j - 1];
+            j--;
+        }
+        topology->devices[j] = entry;
+    }
+}
+
+// A cached table is trusted only if its hash matches, every recorded
+// function still answers with the same IDs and bridge bus numbers, and
+// no slot on a recorded bus answers that the table does not list. That
+// last check costs 32 probes per bus instead of a 256-bus sweep.
+static uint8_t pci_topology_cache_valid(void) {
+    if (topology->magic != PCI_TOPOLOGY_MAGIC ||
+        topology->version != PCI_TOPOLOGY_VERSION ||
+        topology->count == 0 || topology->count > PCI_MAX_DEVICES) {
+        return 0;
+    }
+    if (pci_topology_hash(topology) != topology->hash) {
+        return 0;
+    }
+    
+    for (uint32_t i = 0; i < topology->count; i++) {
+        const pci_device_info_t *info = &topology->devices[i];
+        uint16_t bus = PCI_BDF_BUS(info->bdf);
+        uint16_t dev = PCI_BDF_DEVICE(info->bdf);
+        uint16_t func = PCI_BDF_FUNCTION(info->bdf);
+        
+        uint32_t id = pci_config_read32(bus, dev, func, PCI_CONFIG_VENDOR);
+        if (id != ((uint32_t)info->device_id << 16 | info->vendor_id)) {
+            return 0;
+        }
+        if (info->header_type == PCI_HEADER_TYPE_BRIDGE) {
+            uint32_t buses = pci_config_read32(bus, dev, func, PCI_CONFIG_BUSES);
+            if (((buses >> 8) & 0xFF) != info->secondary_bus) {
+                return 0;
+            }
+        }
+    }
+    
+    // The table is BDF-sorted, so each bus is one contiguous run
+    uint32_t i = 0;
+    while (i < topology->count) {
+        uint16_t bus = PCI_BDF_BUS(topology->devices[i].bdf);
+        uint8_t functions[32] = {0};  // Recorded function bitmap per slot
+        
+        for (; i < topology->count && PCI_BDF_BUS(topology->devices[i].bdf) == bus; i++) {
+            uint16_t bdf = topology->devices[i].bdf;
+            functions[PCI_BDF_DEVICE(bdf)] |= 1 << PCI_BDF_FUNCTION(bdf);
+        }
+        
+        for (uint16_t dev = 0; dev < 32; dev++) {
+            uint8_t present = 0;
+            uint32_t id = pci_config_read32(bus, dev, 0, PCI_CONFIG_VENDOR);
+            if ((id & 0xFFFF) != 0xFFFF) {
+                present = 1;
+                uint8_t header = (pci_config_read32(bus, dev, 0, PCI_CONFIG_HEADER) >> 16) & 0xFF;
+                if (header & PCI_HEADER_MULTIFUNCTION) {
+                    for (uint16_t func = 1; func < 8; func++) {
+                        id = pci_config_read32(bus, dev, func, PCI_CONFIG_VENDOR);
+                        if ((id & 0xFFFF) != 0xFFFF) {
+                            present |= 1 << func;
+                        }
+                    }
+                }
+            }
+            if (present != functions[dev]) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+void pci_enumerate(void) {
+    uint64_t start = cpu_read_tsc();
+    
+    if (pci_topology_cache_valid()) {
+        // The MSI-X shadow and the xHCI driver reach MMIO through these,
+        // so they are read again rather than trusted from the last boot
+        pci_state.topology_from_cache = 1;
+        pci_state.resources_changed = 0;
+        for (uint32_t i = 0; i < topology->count; i++) {
+            pci_device_info_t *info = &topology->devices[i];
+            pci_device_info_t before = *info;
+            pci_read_resources(info);
+            
+            const uint8_t *a = (const uint8_t *)&before;
+            const uint8_t *b = (const uint8_t *)info;
+            for (uint32_t k = 0; k < sizeof(pci_device_info_t); k++) {
+                if (a[k] != b[k]) {
+                    pci_state.resources_changed++;
+                    break;
+                }
+            }
+        }
+        if (pci_state.resources_changed) {
+            topology->hash = pci_topology_hash(topology);
+        }
+    } else {
+        topology->count = 0;
+        pci_scan_bus(0, PCI_BDF_NONE);
+        pci_sort_topology();
+        topology->magic = PCI_TOPOLOGY_MAGIC;
+        topology->version = PCI_TOPOLOGY_VERSION;
+        topology->hash = pci_topology_hash(topology);
+        pci_state.topology_from_cache = 0;
+    }
+    
+    pci_state.topology_cycles = cpu_read_tsc() - start;
+    
+    char buf[32];
+    itoa(topology->count, buf, 10);
+    console_write_string("  PCI functions: ");
+    console_write_string(buf);
+    console_write_string(pci_state.topology_from_cache ? " (cached, hash 0x" : " (enumerated, hash 0x");
+    console_write_hex(topology->hash);
+    console_write_string(")\n");
+    if (pci_state.resources_changed) {
+        kprintf("  BARs or capabilities moved on %u functions\n", pci_state.resources_changed);
+    }
+    pci_print_cycles("  Topology ready in ", pci_state.topology_cycles);
+}
+
+uint32_t pci_get_device_count(void) {
+    return topology->count;
+}
+
+const pci_device_info_t *pci_get_device(uint32_t index) {
+    return index < topology->count ? &topology->devices[index] : 0;
+}
+
+// Binary search over the BDF-sorted table
+const pci_device_info_t *pci_find_device(uint16_t bus, uint16_t dev, uint16_t func) {
+    uint16_t bdf = PCI_BDF(bus, dev, func);
+    uint32_t low = 0;
+    uint32_t high = topology->count;
+    
+    while (low < high) {
+        uint32_t mid = (low + high) / 2;
+        uint16_t key = topology->devices[mid].bdf;
+        if (key == bdf) {
+            return &topology->devices[mid];
+        }
+        if (key < bdf) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return 0;
+}
+
+void pci_init(void) {
+    console_write_string("Initializing PCI config access...\n");
+    
+    const acpi_mcfg_segment_t *mcfg = acpi_find_mcfg(0, 0);
+    if (mcfg) {
+        pci_state.ecam_base = mcfg->base_addr;
+        pci_state.ecam_start_bus = mcfg->start_bus;
+        pci_state.ecam_end_bus = mcfg->end_bus;
+        pci_state.access = PCI_ACCESS_ECAM;
+        
+        log_info("  ECAM base: 0x%lx\n", pci_state.ecam_base);
+    } else {
+        pci_state.access = PCI_ACCESS_LEGACY;
+        log_info("  No MCFG, using legacy 0xCF8/0xCFC access\n");
+    }
+    
+    // Compare both paths over the same full-bus sweep; two sweeps of every
+    // slot are too slow to pay on each boot, so only debug builds run them
+    if (log_enabled(LOG_LEVEL_DEBUG)) {
+        uint32_t found = 0;
+        pci_state.legacy_scan_cycles = pci_benchmark_scan(pci_legacy_read32, &found);
+        pci_state.devices_found = found;
+        log_debug("  Legacy bus scan: 0x%lx cycles\n", pci_state.legacy_scan_cycles);
+        
+        if (pci_state.access == PCI_ACCESS_ECAM) {
+            pci_state.ecam_scan_cycles = pci_benchmark_scan(pci_config_read32, &found);
+            log_debug("  ECAM bus scan:   0x%lx cycles\n", pci_state.ecam_scan_cycles);
+            
+            if (found != pci_state.devices_found) {
+                log_warn("ECAM and legacy scans disagree, using legacy access\n");
+                pci_state.access = PCI_ACCESS_LEGACY;
+            }
+        }
+        log_debug("  Devices found: %u\n", pci_state.devices_found);
+    }
+    
+    pci_enumerate();
+}
@@ -2,6 +2,7 @@
 #define PCI_H
 
 #include "types.h"
+#include "memory.h"
 
 // PCI configuration space I/O ports
 #define PCI_CONFIG_ADDRESS 0xCF8
@@ -10,9 +11,140 @@
 // PCI device classes for filtering
 #define PCI_CLASS_DISPLAY 0x03
 #define PCI_CLASS_BRIDGE 0x06
+#define PCI_CLASS_PCI_BRIDGE 0x0604
+#define PCI_CLASS_USB 0x0C03
+#define PCI_CLASS_SATA 0x0106
+#define PCI_CLASS_NVME 0x0108
+#define PCI_CLASS_ETHERNET 0x0200
+#define PCI_CLASS_NETWORK_OTHER 0x0280  // Most Wi-Fi adapters
+#define PCI_CLASS_VGA 0x0300
+#define PCI_CLASS_AUDIO 0x0403
+#define PCI_CLASS_IOMMU 0x0806  // Base system peripheral / IOMMU
+
+// Capability IDs
+#define PCI_CAP_ID_MSI 0x05
+#define PCI_CAP_ID_SECURE 0x0F  // AMD IOMMU capability block
+#define PCI_CAP_ID_MSIX 0x11
+#define PCI_CAP_ID_PCIE 0x10
+#define PCI_EXT_CAP_ID_ACS 0x000D
+#define PCI_EXT_CAP_START 0x100
+
+// ACS control (dword at cap + 4, control in the upper half). Source
+// validation, request/completion redirect and upstream forwarding together
+// keep peer-to-peer DMA from bypassing the IOMMU.
+#define PCI_ACS_CAP_CTRL 0x04
+#define PCI_ACS_SV 0x0001
+#define PCI_ACS_RR 0x0004
+#define PCI_ACS_CR 0x0008
+#define PCI_ACS_UF 0x0010
+#define PCI_ACS_ISOLATION (PCI_ACS_SV | PCI_ACS_RR | PCI_ACS_CR | PCI_ACS_UF)
+
+// MSI message control
+#define PCI_MSI_CONTROL_ENABLE 0x0001
+#define PCI_MSI_CONTROL_MME_MASK 0x0070
+#define PCI_MSI_CONTROL_64BIT 0x0080
+#define PCI_MSI_CONTROL_MME_SHIFT 4
+#define PCI_MSIX_CONTROL_SIZE_MASK 0x07FF
+#define PCI_MSIX_CONTROL_ENABLE 0x8000
+#define PCI_MSIX_TABLE_BIR_MASK 0x7
+#define PCI_MSIX_ENTRY_DWORDS 4        // Address low, high, data, control
+#define PCI_MSIX_ENTRY_MASKED 0x1
 
 // Helper for reading/writing PCI config space
 #define PCI_MAKE_ADDRESS(bus, dev, func, offset) \
     (0x80000000 | ((bus) << 16) | ((dev) << 11) | ((func) << 8) | ((offset) & 0xFC))
 
+// ECAM: 4 KB of config space per function, 1 MB per bus
+#define PCI_ECAM_OFFSET(bus, dev, func, offset) \
+    (((uint64_t)(bus) << 20) | ((uint64_t)(dev) << 15) | ((uint64_t)(func) << 12) | ((offset) & 0xFFC))
+
+#define PCI_LEGACY_CONFIG_SIZE 256
+#define PCI_EXT_CONFIG_SIZE 4096
+#define PCI_CONFIG_CAP_PTR 0x34
+#define PCI_INVALID_READ 0xFFFFFFFF
+
+// Config space access paths
+#define PCI_ACCESS_LEGACY 0
+#define PCI_ACCESS_ECAM 1
+
+// Config header fields used by the enumerator
+#define PCI_CONFIG_VENDOR 0x00
+#define PCI_CONFIG_COMMAND 0x04
+#define PCI_CONFIG_CLASS 0x08
+#define PCI_CONFIG_HEADER 0x0C
+#define PCI_CONFIG_BAR0 0x10
+#define PCI_CONFIG_BUSES 0x18
+#define PCI_HEADER_TYPE_MASK 0x7F
+#define PCI_HEADER_TYPE_BRIDGE 0x01
+#define PCI_HEADER_MULTIFUNCTION 0x80
+#define PCI_BAR_IO 0x1
+#define PCI_BAR_MEM_TYPE_64 0x4
+#define PCI_COMMAND_MEMORY 0x0002
+#define PCI_COMMAND_MASTER 0x0004
+
+// BDF packed the way IOMMUs index requester IDs
+#define PCI_BDF(bus, dev, func) ((uint16_t)(((bus) << 8) | ((dev) << 3) | (func)))
+#define PCI_BDF_BUS(bdf) (((bdf) >> 8) & 0xFF)
+#define PCI_BDF_DEVICE(bdf) (((bdf) >> 3) & 0x1F)
+#define PCI_BDF_FUNCTION(bdf) ((bdf) & 0x7)
+#define PCI_BDF_NONE 0xFFFF
+
+// Topology database
+#define PCI_MAX_DEVICES 256
+#define PCI_MAX_BARS 6
+#define PCI_TOPOLOGY_MAGIC 0x504F5449U  // "ITOP"
+#define PCI_TOPOLOGY_VERSION 1
+#define PCI_TOPOLOGY_CACHE_ADDR HYPERVISOR_PERSIST_START
+#define FNV32_OFFSET_BASIS 0x811C9DC5U
+#define FNV32_PRIME 0x01000193U
+
+typedef struct {
+    uint16_t bdf;
+    uint16_t vendor_id;
+    uint16_t device_id;
+    uint16_t class_code;     // Base class << 8 | subclass
+    uint8_t prog_if;
+    uint8_t header_type;     // Without the multifunction bit
+    uint8_t secondary_bus;   // Bridges only
+    uint8_t subordinate_bus;
+    uint16_t upstream_bdf;   // Bridge this function sits behind
+    uint8_t msi_cap;         // Capability offsets, 0 when absent
+    uint8_t msix_cap;
+    uint8_t pcie_cap;
+    uint16_t acs_cap;        // Extended capability (ECAM only)
+    uint64_t bars[PCI_MAX_BARS];  // Decoded base addresses
+} pci_device_info_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t count;
+    uint32_t hash;           // FNV-1a over devices[0..count)
+    pci_device_info_t devices[PCI_MAX_DEVICES];  // Sorted by BDF
+} pci_topology_t;
+
+typedef struct {
+    uint8_t access;         // PCI_ACCESS_*
+    uint64_t ecam_base;     // Segment 0 ECAM base from MCFG
+    uint8_t ecam_start_bus;
+    uint8_t ecam_end_bus;
+    uint32_t devices_found; // Function 0 hits during the debug benchmark scan
+    uint64_t legacy_scan_cycles;
+    uint64_t ecam_scan_cycles;
+    uint8_t topology_from_cache;
+    uint32_t resources_changed;  // Cached functions whose BARs or caps moved
+    uint64_t topology_cycles;  // Enumeration or cache validation time
+} pci_state_t;
+
+void pci_init(void);
+uint32_t pci_config_read32(uint16_t bus, uint16_t dev, uint16_t func, uint16_t offset);
+void pci_config_write32(uint16_t bus, uint16_t dev, uint16_t func, uint16_t offset, uint32_t value);
+uint8_t pci_find_capability(uint16_t bus, uint16_t dev, uint16_t func, uint8_t cap_id);
+uint8_t pci_has_ecam(void);
+const pci_state_t *pci_get_state(void);
+void pci_enumerate(void);
+uint32_t pci_get_device_count(void);
+const pci_device_info_t *pci_get_device(uint32_t index);
+const pci_device_info_t *pci_find_device(uint16_t bus, uint16_t dev, uint16_t func);
+
 #endif
@@ -2,9 +2,19 @@
 #include "console.h"
 #include "memory.h"
 #include "cpu.h"
+#include "iommu.h"
+#include "input_manager.h"
+#include "trace.h"
+#include "kprintf.h"
+#include "fbcon.h"
+#include "monitor.h"
+#include "metrics_export.h"
+#include "working_set.h"
+#include "dashboard.h"
 #include "types.h"
 
 static system_state_t system_state = {0};
+static switch_request_t switch_request = {0};
 static uint32_t switch_counter = 0;
 
 // Get timestamp (simplified - just a counter for now)
@@ -67,12 +77,23 @@ uint8_t system_manager_get_active_cell(void) {
     return system_state.active_cell;
 }
 
+uint64_t system_manager_get_switch_count(void) {
+    return system_state.switch_count;
+}
+
+const system_state_t *system_manager_get_state(void) {
+    return &system_state;
+}
+
+uint64_t system_manager_get_cell_activations(uint8_t cell_id) {
+    return cell_id < 2 ? system_state.cells[cell_id].activations : 0;
+}
+
 void system_manager_freeze_cores(uint8_t cell_id) {
-    if (cell_id >= 2) return;
+    if (cell_id >= 2 || system_state.cells[cell_id].frozen) return;
+    system_state.cells[cell_id].frozen = 1;
     
-    console_write_string("Freezing cores for ");
-    console_write_string(cell_id == 0 ? "Linux" : "Windows");
-    console_write_string(" cell...\n");
+    kprintf("Freezing cores for %s cell...\n", cell_id == 0 ? "Linux" : "Windows");
     
     // Mark cores as frozen
     uint32_t start_core = (cell_id == 0) ? 0 : 6;
@@ -82,40 +103,43 @@ void system_manager_freeze_cores(uint8_t cell_id) {
     // - Send IPI (Inter-Processor Interrupt) to cores
     // - Wait for acknowledgment
     // - Put cores into halt state
+    TRACE(CORES_FROZEN, cell_id, start_core);
     
-    console_write_string("  Cores ");
-    char buf[32];
-    itoa(start_core, buf, 10);
-    console_write_string(buf);
-    console_write_string("-");
-    itoa(end_core - 1, buf, 10);
-    console_write_string(buf);
-    console_write_string(" frozen\n");
+    kprintf("  Cores %u-%u frozen\n", start_core, end_core - 1);
 }
 
 void system_manager_unfreeze_cores(uint8_t cell_id) {
     if (cell_id >= 2) return;
+    system_state.cells[cell_id].frozen = 0;
     
-    console_write_string("Unfreezing cores for ");
-    console_write_string(cell_id == 0 ? "Linux" : "Windows");
-    console_write_string(" cell...\n");
+    kprintf("Unfreezing cores for %s cell...\n", cell_id == 0 ? "Linux" : "Windows");
     
     // In a real implementation, would:
     // - Send IPI to wake up cores
     // - Restore saved context
     // - Resume execution
+    // A pass cut short by the freeze may have left A bits cleared
+    system_manager_flush_cell_tlb(cell_id);
+    
+    // The release point is what hotkey latency is measured against
+    system_state.cells[cell_id].resume_tsc = cpu_read_tsc();
     
     uint32_t start_core = (cell_id == 0) ? 0 : 6;
     uint32_t end_core = start_core + 6;
+    TRACE(CORES_RELEASED, cell_id, start_core);
+    
+    kprintf("  Cores %u-%u unfrozen\n", start_core, end_core - 1);
+}
+
+// Drop the cell's cached nested translations after the working set
+// scanner cleared accessed bits, so the next touch sets them again
+void system_manager_flush_cell_tlb(uint8_t cell_id) {
+    if (cell_id >= 2 || !working_set_take_tlb_flush(cell_id)) return;
     
-    console_write_string("  Cores ");
-    char buf[32];
-    itoa(start_core, buf, 10);
-    console_write_string(buf);
-    console_write_string("-");
-    itoa(end_core - 1, buf, 10);
-    console_write_string(buf);
-    console_write_string(" unfrozen\n");
+    // In a real implementation, would:
+    // - Set TLB_CONTROL in the cell's VMCBs to flush its ASID on next VMRUN
+    // - IPI running cores so they exit and pick it up
+    system_state.cells[cell_id].tlb_flushes++;
 }
 
 void system_manager_save_cell_state(uint8_t cell_id) {
@@ -123,9 +147,7 @@ void system_manager_save_cell_state(uint8_t cell_id) {
     
     cell_t *cell = &system_state.cells[cell_id];
     
-    console_write_string("Saving state for ");
-    console_write_string(cell_id == 0 ? "Linux" : "Windows");
-    console_write_string(" cell to hibernation...\n");
+    kprintf("Saving state for %s cell to hibernation...\n", cell_id == 0 ? "Linux" : "Windows");
     
     // Save memory (would copy from cell's memory to hibernation area)
     // In reality: memcpy(cell->hibernation_addr, cell->entry_point, cell->hibernation_size)
@@ -133,11 +155,16 @@ void system_manager_save_cell_state(uint8_t cell_id) {
     
     cell->hibernation_blocks_used = cell->hibernation_size / (2 * 1024 * 1024);  // 2MB blocks
     
-    console_write_string("  Saved ");
-    char buf[32];
-    itoa(cell->hibernation_blocks_used, buf, 10);
-    console_write_string(buf);
-    console_write_string(" x 2MB blocks\n");
+    // Blocks touched in the last 5 minutes are the ones the resume will
+    // need back first; the rest of the image is cold
+    cell->predicted_blocks = working_set_predict_blocks(cell_id);
+    
+    if (working_set_available(cell_id)) {
+        kprintf("  Saved %u x 2MB blocks, %u in the working set\n",
+                cell->hibernation_blocks_used, cell->predicted_blocks);
+    } else {
+        kprintf("  Saved %u x 2MB blocks, working set unknown\n", cell->hibernation_blocks_used);
+    }
 }
 
 void system_manager_restore_cell_state(uint8_t cell_id) {
@@ -145,18 +172,12 @@ void system_manager_restore_cell_state(uint8_t cell_id) {
     
     cell_t *cell = &system_state.cells[cell_id];
     
-    console_write_string("Restoring state for ");
-    console_write_string(cell_id == 0 ? "Linux" : "Windows");
-    console_write_string(" cell from hibernation...\n");
+    kprintf("Restoring state for %s cell from hibernation...\n", cell_id == 0 ? "Linux" : "Windows");
     
     // Restore memory (would copy from hibernation back to cell's memory)
     // In reality: memcpy(cell->entry_point, cell->hibernation_addr, cell->hibernation_size)
     
-    console_write_string("  Restored ");
-    char buf[32];
-    itoa(cell->hibernation_blocks_used, buf, 10);
-    console_write_string(buf);
-    console_write_string(" x 2MB blocks\n");
+    kprintf("  Restored %u x 2MB blocks\n", cell->hibernation_blocks_used);
 }
 
 void system_manager_hibernate_cell(uint8_t cell_id) {
@@ -164,9 +185,8 @@ void system_manager_hibernate_cell(uint8_t cell_id) {
     
     cell_t *cell = &system_state.cells[cell_id];
     
-    console_write_string("Hibernating ");
-    console_write_string(cell_id == 0 ? "Linux" : "Windows");
-    console_write_string(" cell...\n");
+    kprintf("Hibernating %s cell...\n", cell_id == 0 ? "Linux" : "Windows");
+    TRACE(HIBERNATE_BEGIN, cell_id, cell->hibernation_blocks_used);
     
     // Freeze cores
     system_manager_freeze_cores(cell_id);
@@ -176,6 +196,7 @@ void system_manager_hibernate_cell(uint8_t cell_id) {
     
     // Update state
     cell->state = CELL_STATE_HIBERNATED;
+    TRACE(HIBERNATE_END, cell_id, cell->hibernation_blocks_used);
     
     console_write_string("Cell hibernated\n");
 }
@@ -185,9 +206,8 @@ void system_manager_resume_cell(uint8_t cell_id) {
     
     cell_t *cell = &system_state.cells[cell_id];
     
-    console_write_string("Resuming ");
-    console_write_string(cell_id == 0 ? "Linux" : "Windows");
-    console_write_string(" cell...\n");
+    kprintf("Resuming %s cell...\n", cell_id == 0 ? "Linux" : "Windows");
+    TRACE(RESUME_BEGIN, cell_id, cell->hibernation_blocks_used);
     
     // Restore state
     system_manager_restore_cell_state(cell_id);
@@ -197,35 +217,171 @@ void system_manager_resume_cell(uint8_t cell_id) {
     
     // Update state
     cell->state = CELL_STATE_RUNNING;
+    TRACE(RESUME_END, cell_id, cell->hibernation_blocks_used);
     
     console_write_string("Cell resumed\n");
 }
 
+// Move a lent extent between cell DMA domains as one ownership change,
+// so all its invalidations share a single completion wait
+static void system_manager_move_loan_dma(uint8_t from_cell, uint8_t to_cell, uint64_t base, uint64_t size) {
+    iommu_begin_ownership_change();
+    iommu_unmap_range(from_cell, base, size);
+    iommu_map_range(to_cell, base, base, size);
+    
+    system_state.last_switch_iommu_commands += iommu_commit_ownership_change();
+    system_state.last_switch_iommu_cycles += iommu_get_cmd_stats()->last_batch_cycles;
+}
+
 void system_manager_switch_cells(void) {
     uint8_t current = system_state.active_cell;
     uint8_t next = (current == 0) ? 1 : 0;
-    
-    console_write_string("\n===== SWITCHING CELLS =====\n");
-    console_write_string("From: ");
-    console_write_string(current == 0 ? "Linux" : "Windows");
-    console_write_string(" -> To: ");
-    console_write_string(next == 0 ? "Linux" : "Windows");
-    console_write_string("\n");
+    TRACE(SWITCH_BEGIN, current, next);
+    
+    kprintf("\n===== SWITCHING CELLS =====\nFrom: %s -> To: %s\n",
+            current == 0 ? "Linux" : "Windows", next == 0 ? "Linux" : "Windows");
+    
+    system_state.last_switch_iommu_commands = 0;
+    system_state.last_switch_iommu_cycles = 0;
+    
+    // Take back any frames the next cell lent out while it was hibernated.
+    // This runs before the current cell is frozen so its balloon driver
+    // can still offline them. If it does not ack in time, its cores are
+    // stopped and its DMA to the extents revoked before the frames are
+    // taken back.
+    const memory_lending_t *loan = memory_get_lending();
+    uint8_t had_loan = loan->active && loan->donor_cell == next;
+    uint64_t loan_base = loan->lent_base;
+    uint64_t loan_size = loan->lent_size;
+    
+    system_state.last_reclaim_cycles = 0;
+    if (had_loan) {
+        if (!memory_request_reclaim(next)) {
+            console_write_string("Balloon driver did not release lent memory, forcing reclaim\n");
+            system_manager_freeze_cores(current);
+            system_manager_move_loan_dma(current, next, loan_base, loan_size);
+            memory_force_reclaim(next);
+        } else {
+            system_manager_move_loan_dma(current, next, loan_base, loan_size);
+        }
+        // The window just left the current cell's nested tables
+        system_manager_flush_cell_tlb(current);
+        system_state.last_reclaim_cycles = loan->last_reclaim_cycles;
+        kprintf("Reclaimed lent memory in 0x%lx cycles\n", system_state.last_reclaim_cycles);
+    }
     
     // Hibernate current cell
     system_manager_hibernate_cell(current);
     
+    // Dedicated input controller follows the foreground cell
+    input_manager_route_input(next);
+    
     console_write_string("\n");
     
+    // Interrupt destinations the next cell programmed the last time it ran
+    system_state.last_switch_iommu_commands += iommu_sync_interrupt_routes(next);
+    
     // Resume next cell
     system_manager_resume_cell(next);
     
+    // The current cell's image is persisted, so its frames can be lent
+    // to the new foreground cell
+    if (memory_lending_enabled() &&
+        system_state.cells[current].state == CELL_STATE_HIBERNATED &&
+        system_state.cells[current].hibernation_blocks_used > 0) {
+        memory_lend_cell_frames(current, next);
+        if (loan->active) {
+            system_manager_move_loan_dma(current, next, loan->lent_base, loan->lent_size);
+        }
+    }
+    
     // Update active cell
     system_state.active_cell = next;
     system_state.switch_count++;
+    system_state.cells[next].activations++;
     system_state.last_switch_time = get_timestamp();
     
+    kprintf("IOMMU commands this switch: %u in 0x%lx cycles\n",
+            system_state.last_switch_iommu_commands, system_state.last_switch_iommu_cycles);
+    
     console_write_string("===== SWITCH COMPLETE =====\n\n");
+    TRACE(SWITCH_END, system_state.last_switch_iommu_commands, system_state.last_switch_iommu_cycles);
+}
+
+// Called from interrupt context: stamp and hand off, nothing else. A second
+// hotkey while one is queued is folded into it.
+void system_manager_post_switch(uint64_t key_tsc) {
+    TRACE(HOTKEY, switch_request.coalesced, key_tsc);
+    if (switch_request.pending) {
+        switch_request.coalesced++;
+        return;
+    }
+    
+    switch_request.key_tsc = key_tsc;
+    asm volatile("" ::: "memory");
+    switch_request.pending = 1;
+}
+
+static uint32_t system_manager_latency_bucket(uint64_t cycles) {
+    uint32_t bucket = cycles ? 63 - __builtin_clzll(cycles) : 0;
+    return bucket < SWITCH_LATENCY_BUCKETS ? bucket : SWITCH_LATENCY_BUCKETS - 1;
+}
+
+static void system_manager_service_switch(void) {
+    uint64_t key_tsc = switch_request.key_tsc;
+    system_state.last_dispatch_delay = cpu_read_tsc() - key_tsc;
+    switch_request.pending = 0;
+    
+    system_manager_switch_cells();
+    
+    uint64_t latency = system_state.cells[system_state.active_cell].resume_tsc - key_tsc;
+    system_state.last_switch_latency = latency;
+    if (latency > system_state.max_switch_latency) {
+        system_state.max_switch_latency = latency;
+    }
+    system_state.latency_histogram[system_manager_latency_bucket(latency)]++;
+}
+
+// The boot core's idle loop. Queued scan codes and switches are handled
+// here, outside interrupt context. Interrupts are re-enabled by the sti
+// immediately before hlt, so a request posted after the check still
+// wakes the loop.
+void system_manager_run_control_loop(void) {
+    while (1) {
+        input_manager_process_pending();
+        input_manager_poll_handoff();
+        trace_dump_poll();
+        working_set_scan();
+        monitor_update_metrics();
+        metrics_export_poll();
+        console_render_screen();
+        dashboard_poll();
+        fbcon_present();
+        
+        asm volatile("cli");
+        if (switch_request.pending) {
+            asm volatile("sti");
+            system_manager_service_switch();
+            continue;
+        }
+        if (input_manager_has_pending()) {
+            asm volatile("sti");
+            continue;
+        }
+        asm volatile("sti; hlt");
+    }
+}
+
+void system_manager_print_latency(void) {
+    console_write_string("Hotkey Switch Latency (TSC cycles):\n");
+    kprintf("  Last: 0x%lx (dispatch 0x%lx), max 0x%lx, coalesced %u\n",
+            system_state.last_switch_latency, system_state.last_dispatch_delay,
+            system_state.max_switch_latency, switch_request.coalesced);
+    
+    for (int i = 0; i < SWITCH_LATENCY_BUCKETS; i++) {
+        if (!system_state.latency_histogram[i]) continue;
+        kprintf("  >= 2^%d: %u\n", i, system_state.latency_histogram[i]);
+    }
 }
 
 void system_manager_print_status(void) {
@@ -255,16 +411,12 @@ void system_manager_print_status(void) {
             default:
                 console_write_string("Unknown");
         }
-        console_write_string(" (");
-        char buf[32];
-        itoa(cell->active_core_count, buf, 10);
-        console_write_string(buf);
-        console_write_string(" cores)\n");
+        kprintf(" (%u cores)\n", cell->active_core_count);
     }
     
-    console_write_string("  Total switches: ");
-    char buf[32];
-    itoa(system_state.switch_count, buf, 10);
-    console_write_string(buf);
-    console_write_string("\n");
+    kprintf("  Total switches: %lu\n", system_state.switch_count);
+    
+    if (memory_lending_enabled()) {
+        kprintf("  Last reclaim: 0x%lx cycles\n", system_state.last_reclaim_cycles);
+    }
 }
@@ -2,6 +2,7 @@
 #define SYSTEM_MANAGER_H
 
 #include "types.h"
+#include "memory.h"
 
 // Cell states
 #define CELL_STATE_RUNNING 0
@@ -9,13 +10,24 @@
 #define CELL_STATE_INITIALIZING 2
 #define CELL_STATE_ERROR 3
 
-// Hibernation location - use reserved area after hypervisor memory
-#define HIBERNATION_BASE 0x10000000  // 256MB offset
-#define LINUX_HIBERNATION_SIZE (16UL * 1024 * 1024 * 1024)   // 16GB
-#define WINDOWS_HIBERNATION_SIZE (16UL * 1024 * 1024 * 1024) // 16GB
+// Hibernation images are compacted into each cell's own region, between
+// its resume area and its lend window (see memory.h), so no image overlaps
+// the hypervisor, the other cell or anything a loan hands out
+#define LINUX_HIBERNATION_SIZE CELL_IMAGE_SIZE
+#define WINDOWS_HIBERNATION_SIZE CELL_IMAGE_SIZE
 
-#define LINUX_HIBERNATION_ADDR HIBERNATION_BASE
-#define WINDOWS_HIBERNATION_ADDR (HIBERNATION_BASE + LINUX_HIBERNATION_SIZE)
+#define LINUX_HIBERNATION_ADDR (LINUX_MEMORY_START + CELL_RESUME_SIZE)
+#define WINDOWS_HIBERNATION_ADDR (WINDOWS_MEMORY_START + CELL_RESUME_SIZE)
+
+// Hotkey -> new cell latency histogram, power-of-two TSC cycle buckets
+#define SWITCH_LATENCY_BUCKETS 40
+
+// Switch request posted from the input interrupt, taken by the control loop
+typedef struct {
+    volatile uint8_t pending;
+    volatile uint64_t key_tsc;    // TSC at the HID interrupt that held the hotkey
+    uint32_t coalesced;           // Hotkeys that arrived while one was pending
+} switch_request_t;
 
 // CPU context (for saving/restoring state)
 typedef struct {
@@ -38,6 +50,11 @@ typedef struct {
     uint64_t hibernation_size;
     uint32_t active_core_count;
     uint32_t hibernation_blocks_used;
+    uint32_t predicted_blocks;  // Working set at hibernation, in 2MB blocks
+    uint8_t frozen;       // Cores held; a second freeze is a no-op
+    uint64_t resume_tsc;  // When the cell's cores were last released
+    uint64_t activations;  // Switches that made this cell the foreground
+    uint64_t tlb_flushes;  // Working set passes that needed the cell's ASID flushed
 } cell_t;
 
 // System state
@@ -46,12 +63,25 @@ typedef struct {
     uint8_t active_cell;  // 0 = Linux, 1 = Windows
     uint64_t switch_count;
     uint64_t last_switch_time;
+    uint64_t last_reclaim_cycles;  // Memory lending reclaim cost of the last switch
+    uint32_t last_switch_iommu_commands;
+    uint64_t last_switch_iommu_cycles;
+    uint64_t last_dispatch_delay;     // Hotkey interrupt -> control loop pickup
+    uint64_t last_switch_latency;     // Hotkey interrupt -> new cell released
+    uint64_t max_switch_latency;
+    uint32_t latency_histogram[SWITCH_LATENCY_BUCKETS];
 } system_state_t;
 
 void system_manager_init(void);
 void system_manager_set_active_cell(uint8_t cell_id);
 uint8_t system_manager_get_active_cell(void);
+uint64_t system_manager_get_switch_count(void);
+const system_state_t *system_manager_get_state(void);
+uint64_t system_manager_get_cell_activations(uint8_t cell_id);
 void system_manager_switch_cells(void);
+void system_manager_post_switch(uint64_t key_tsc);
+void system_manager_run_control_loop(void);
+void system_manager_flush_cell_tlb(uint8_t cell_id);
 void system_manager_hibernate_cell(uint8_t cell_id);
 void system_manager_resume_cell(uint8_t cell_id);
 void system_manager_freeze_cores(uint8_t cell_id);
@@ -59,5 +89,6 @@ void system_manager_unfreeze_cores(uint8_t cell_id);
 void system_manager_save_cell_state(uint8_t cell_id);
 void system_manager_restore_cell_state(uint8_t cell_id);
 void system_manager_print_status(void);
+void system_manager_print_latency(void);
 
 #endif
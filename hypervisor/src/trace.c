@@ -0,0 +1,206 @@
+#include "trace.h"
+#include "console.h"
+#include "cpu.h"
+#include "types.h"
+
+#define TRACE_EVENT_INFO(id, name, phase, arg0, arg1) { name, phase, arg0, arg1 },
+static const struct {
+    const char *name;
+    char phase;
+    const char *arg0;
+    const char *arg1;
+} trace_events[TRACE_EVENT_COUNT] = {
+    TRACE_EVENTS(TRACE_EVENT_INFO)
+};
+#undef TRACE_EVENT_INFO
+
+static trace_ring_t trace_rings[TRACE_MAX_CPUS];
+static trace_state_t trace_state = {0};
+
+void trace_init(void) {
+    console_write_string("Initializing trace buffers...\n");
+    
+    trace_state.tsc_mhz = cpu_get_tsc_mhz();
+    trace_state.enabled = 1;
+    
+    char buf[32];
+    console_write_string("  ");
+    itoa(TRACE_EVENT_COUNT, buf, 10);
+    console_write_string(buf);
+    console_write_string(" tracepoints, ");
+    itoa(TRACE_RING_RECORDS, buf, 10);
+    console_write_string(buf);
+    console_write_string(" records per CPU, TSC ");
+    itoa(trace_state.tsc_mhz, buf, 10);
+    console_write_string(buf);
+    console_write_string(" MHz (Ctrl+Alt+T dumps)\n");
+}
+
+// Safe from any context: the ring is private to this CPU and interrupts
+// are held off only while the slot is filled
+void trace_record(trace_event_t event, uint32_t arg0, uint64_t arg1) {
+    if (!trace_state.enabled) return;
+    
+    uint64_t flags;
+    asm volatile("pushfq; pop %0; cli" : "=r"(flags) : : "memory");
+    
+    uint32_t cpu = cpu_get_index();
+    trace_ring_t *ring = &trace_rings[cpu & (TRACE_MAX_CPUS - 1)];
+    trace_record_t *record = &ring->records[ring->head & (TRACE_RING_RECORDS - 1)];
+    record->tsc = cpu_read_tsc();
+    record->event = event;
+    record->cpu = cpu;
+    record->arg0 = arg0;
+    record->arg1 = arg1;
+    ring->head++;
+    
+    asm volatile("push %0; popfq" : : "r"(flags) : "memory", "cc");
+}
+
+static char *trace_append(char *p, const char *str) {
+    while (*str) {
+        *p++ = *str++;
+    }
+    return p;
+}
+
+static char *trace_append_hex(char *p, uint64_t value) {
+    static const char digits[] = "0123456789abcdef";
+    char buf[16];
+    int i = 0;
+    do {
+        buf[i++] = digits[value & 0xF];
+        value >>= 4;
+    } while (value);
+    while (i > 0) {
+        *p++ = buf[--i];
+    }
+    return p;
+}
+
+// Start streaming the first record of a ring; older ones were overwritten
+static void trace_dump_enter_cpu(uint32_t cpu) {
+    const trace_ring_t *ring = &trace_rings[cpu];
+    uint64_t start = ring->head > TRACE_RING_RECORDS ? ring->head - TRACE_RING_RECORDS : 0;
+    trace_state.dump_cpu = cpu;
+    trace_state.dump_next = start;
+    trace_state.dump_overwritten += start;
+}
+
+// Format the line at the dump cursor and return its end. The cursor only
+// moves in trace_dump_advance(), once the console has taken the line.
+static char *trace_dump_format(char *line) {
+    char *p = line;
+    
+    switch (trace_state.dump_stage) {
+        case TRACE_DUMP_HEADER:
+            p = trace_append(p, "@TRACE BEGIN ");
+            p = trace_append_hex(p, TRACE_FORMAT_VERSION);
+            p = trace_append(p, " ");
+            p = trace_append_hex(p, trace_state.tsc_mhz);
+            p = trace_append(p, " ");
+            p = trace_append_hex(p, cpu_get_count());
+            return p;
+        
+        case TRACE_DUMP_EVENTS: {
+            uint32_t i = trace_state.dump_event;
+            char phase[2] = { trace_events[i].phase, '\0' };
+            p = trace_append(p, "@TRACE EVENT ");
+            p = trace_append_hex(p, i);
+            p = trace_append(p, " ");
+            p = trace_append(p, phase);
+            p = trace_append(p, " ");
+            p = trace_append(p, trace_events[i].name);
+            p = trace_append(p, " ");
+            p = trace_append(p, trace_events[i].arg0);
+            p = trace_append(p, " ");
+            p = trace_append(p, trace_events[i].arg1);
+            return p;
+        }
+        
+        case TRACE_DUMP_RECORDS: {
+            while (trace_state.dump_next >= trace_rings[trace_state.dump_cpu].head) {
+                if (trace_state.dump_cpu + 1 == TRACE_MAX_CPUS) {
+                    trace_state.dump_stage = TRACE_DUMP_END;
+                    return trace_dump_format(line);
+                }
+                trace_dump_enter_cpu(trace_state.dump_cpu + 1);
+            }
+            
+            const trace_ring_t *ring = &trace_rings[trace_state.dump_cpu];
+            const trace_record_t *record = &ring->records[trace_state.dump_next & (TRACE_RING_RECORDS - 1)];
+            p = trace_append(p, "@TRACE R ");
+            p = trace_append_hex(p, record->cpu);
+            p = trace_append(p, " ");
+            p = trace_append_hex(p, record->event);
+            p = trace_append(p, " ");
+            p = trace_append_hex(p, record->tsc);
+            p = trace_append(p, " ");
+            p = trace_append_hex(p, record->arg0);
+            p = trace_append(p, " ");
+            p = trace_append_hex(p, record->arg1);
+            return p;
+        }
+        
+        default:
+            p = trace_append(p, "@TRACE END ");
+            p = trace_append_hex(p, trace_state.dump_total);
+            p = trace_append(p, " ");
+            p = trace_append_hex(p, trace_state.dump_overwritten);
+            return p;
+    }
+}
+
+static void trace_dump_advance(void) {
+    switch (trace_state.dump_stage) {
+        case TRACE_DUMP_HEADER:
+            trace_state.dump_stage = TRACE_DUMP_EVENTS;
+            trace_state.dump_event = 0;
+            break;
+        case TRACE_DUMP_EVENTS:
+            if (++trace_state.dump_event == TRACE_EVENT_COUNT) {
+                trace_state.dump_stage = TRACE_DUMP_RECORDS;
+                trace_dump_enter_cpu(0);
+            }
+            break;
+        case TRACE_DUMP_RECORDS:
+            trace_state.dump_next++;
+            trace_state.dump_total++;
+            break;
+        default:
+            trace_state.dump_stage = TRACE_DUMP_IDLE;
+            trace_state.enabled = 1;
+            break;
+    }
+}
+
+// Queue a dump of every ring, oldest record first, as "@TRACE" lines. All
+// fields are hex. Recording is paused until the END line is out so the
+// rings hold still while they are read; a request during a dump is folded
+// into it.
+void trace_dump_request(void) {
+    if (trace_state.dump_stage != TRACE_DUMP_IDLE) return;
+    
+    trace_state.enabled = 0;
+    trace_state.dumps++;
+    trace_state.dump_total = 0;
+    trace_state.dump_overwritten = 0;
+    trace_state.dump_stage = TRACE_DUMP_HEADER;
+}
+
+// Called once per control-loop pass. The rings hold far more than the
+// console can buffer, so at most TRACE_DUMP_CHUNK lines go out per call
+// and a full console ring ends the pass; the refused line is retried on
+// the next one rather than waited for. Serial only: the decoder reads the
+// UART, and the screen would only scroll the dashboard away.
+void trace_dump_poll(void) {
+    char line[128];
+    
+    for (uint32_t n = 0; n < TRACE_DUMP_CHUNK && trace_state.dump_stage != TRACE_DUMP_IDLE; n++) {
+        char *end = trace_dump_format(line);
+        *end++ = '\n';
+        *end = '\0';
+        if (console_write_serial(line) == 0) return;
+        trace_dump_advance();
+    }
+}
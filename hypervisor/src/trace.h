@@ -0,0 +1,93 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "types.h"
+
+// Binary event trace. Each CPU writes fixed-size records into its own
+// ring, overwriting the oldest; a requested dump streams every ring over
+// the serial console for tools/trace_decode.py, a chunk per control-loop
+// pass. Build with -DTRACE_DISABLED to compile the tracepoints out.
+#define TRACE_MAX_CPUS 32
+#define TRACE_RING_RECORDS 512  // Per CPU, power of two
+#define TRACE_FORMAT_VERSION 1
+#define TRACE_DUMP_CHUNK 32     // Lines per trace_dump_poll()
+
+// Dump stages, in output order
+#define TRACE_DUMP_IDLE 0
+#define TRACE_DUMP_HEADER 1
+#define TRACE_DUMP_EVENTS 2
+#define TRACE_DUMP_RECORDS 3
+#define TRACE_DUMP_END 4
+
+// Phases follow the Chrome trace format: a BEGIN/END pair with the same
+// name becomes one span, INSTANT a marker
+#define TRACE_PHASE_BEGIN 'B'
+#define TRACE_PHASE_END 'E'
+#define TRACE_PHASE_INSTANT 'i'
+
+// Tracepoint registry: X(id, name, phase, arg0 name, arg1 name)
+#define TRACE_EVENTS(X) \
+    X(HOTKEY, "hotkey", TRACE_PHASE_INSTANT, "coalesced", "key_tsc") \
+    X(SWITCH_BEGIN, "switch", TRACE_PHASE_BEGIN, "from", "to") \
+    X(SWITCH_END, "switch", TRACE_PHASE_END, "iommu_commands", "iommu_cycles") \
+    X(HIBERNATE_BEGIN, "hibernate", TRACE_PHASE_BEGIN, "cell", "blocks") \
+    X(HIBERNATE_END, "hibernate", TRACE_PHASE_END, "cell", "blocks") \
+    X(RESUME_BEGIN, "resume", TRACE_PHASE_BEGIN, "cell", "blocks") \
+    X(RESUME_END, "resume", TRACE_PHASE_END, "cell", "blocks") \
+    X(CORES_FROZEN, "cores_frozen", TRACE_PHASE_INSTANT, "cell", "first_core") \
+    X(CORES_RELEASED, "cores_released", TRACE_PHASE_INSTANT, "cell", "first_core") \
+    X(IOMMU_BATCH_BEGIN, "iommu_batch", TRACE_PHASE_BEGIN, "devices", "flush_all") \
+    X(IOMMU_BATCH_END, "iommu_batch", TRACE_PHASE_END, "commands", "cycles") \
+    X(IOMMU_ASSIGN, "iommu_assign", TRACE_PHASE_INSTANT, "group", "cell") \
+    X(IOMMU_FAULT, "iommu_fault", TRACE_PHASE_INSTANT, "device_id", "address") \
+    X(INPUT_BATCH, "input_batch", TRACE_PHASE_INSTANT, "scancodes", "hotkey") \
+    X(INPUT_HANDOFF_BEGIN, "input_handoff", TRACE_PHASE_BEGIN, "cell", "group") \
+    X(INPUT_HANDOFF_END, "input_handoff", TRACE_PHASE_END, "cell", "cycles") \
+    X(MEMORY_LEND, "memory_lend", TRACE_PHASE_INSTANT, "borrower", "blocks") \
+    X(MEMORY_RECLAIM_BEGIN, "memory_reclaim", TRACE_PHASE_BEGIN, "donor", "blocks") \
+    X(MEMORY_RECLAIM_END, "memory_reclaim", TRACE_PHASE_END, "forced", "cycles")
+
+#define TRACE_EVENT_ENUM(id, name, phase, arg0, arg1) TRACE_##id,
+typedef enum {
+    TRACE_EVENTS(TRACE_EVENT_ENUM)
+    TRACE_EVENT_COUNT
+} trace_event_t;
+#undef TRACE_EVENT_ENUM
+
+typedef struct {
+    uint64_t tsc;
+    uint16_t event;
+    uint16_t cpu;
+    uint32_t arg0;
+    uint64_t arg1;
+} trace_record_t;  // 24 bytes
+
+typedef struct {
+    trace_record_t records[TRACE_RING_RECORDS];
+    uint64_t head;  // Records ever written; the slot is head % size
+} trace_ring_t;
+
+typedef struct {
+    volatile uint8_t enabled;
+    uint32_t tsc_mhz;
+    uint32_t dumps;
+    uint8_t dump_stage;         // TRACE_DUMP_IDLE unless a dump is in flight
+    uint32_t dump_event;        // Next registry entry
+    uint32_t dump_cpu;          // Ring being streamed
+    uint64_t dump_next;         // Next record of that ring
+    uint64_t dump_total;
+    uint64_t dump_overwritten;
+} trace_state_t;
+
+#ifdef TRACE_DISABLED
+#define TRACE(event, arg0, arg1) do { (void)(arg0); (void)(arg1); } while (0)
+#else
+#define TRACE(event, arg0, arg1) trace_record(TRACE_##event, (uint32_t)(arg0), (uint64_t)(arg1))
+#endif
+
+void trace_init(void);
+void trace_record(trace_event_t event, uint32_t arg0, uint64_t arg1);
+void trace_dump_request(void);
+void trace_dump_poll(void);
+
+#endif
@@ -0,0 +1,526 @@
+#include "vtd.h"
+#include "acpi.h"
+#include "console.h"
+#include "cpu.h"
+#include "kprintf.h"
+#include "memory.h"
+#include "types.h"
+
+static vtd_state_t vtd_state = {0};
+
+static inline uint32_t vtd_read32(vtd_unit_t *unit, uint32_t reg) {
+    return *(volatile uint32_t *)(unit->base + reg);
+}
+
+static inline void vtd_write32(vtd_unit_t *unit, uint32_t reg, uint32_t value) {
+    *(volatile uint32_t *)(unit->base + reg) = value;
+}
+
+static inline uint64_t vtd_read64(vtd_unit_t *unit, uint32_t reg) {
+    return *(volatile uint64_t *)(unit->base + reg);
+}
+
+static inline void vtd_write64(vtd_unit_t *unit, uint32_t reg, uint64_t value) {
+    *(volatile uint64_t *)(unit->base + reg) = value;
+}
+
+static uint64_t vtd_wait_cycles(void) {
+    uint32_t mhz = cpu_get_tsc_mhz();
+    return (uint64_t)(mhz ? mhz : 1000) * 1000 * VTD_WAIT_TIMEOUT_MS;
+}
+
+// A unit whose page walks do not snoop reads root, context and
+// second-level entries from memory, so each write is pushed out of the
+// cache. CLFLUSH is ordered with later stores, including the IQT write
+// that starts the invalidation.
+static inline void vtd_flush_entry(const volatile void *entry) {
+    if (vtd_state.flush_tables) {
+        asm volatile("clflush (%0)" : : "r"(entry) : "memory");
+    }
+}
+
+static uint64_t *vtd_alloc_table(void) {
+    uint64_t *table = (uint64_t *)memory_alloc_aligned(PAGE_SIZE_4K, PAGE_SIZE_4K);
+    if (!table) {
+        return 0;
+    }
+    
+    for (int i = 0; i < 512; i++) {
+        table[i] = 0;
+    }
+    for (int i = 0; i < 512; i += 8) {
+        vtd_flush_entry(&table[i]);
+    }
+    
+    return table;
+}
+
+// Issue a one-shot global command and wait for its status bit
+static void vtd_global_command(vtd_unit_t *unit, uint32_t command, uint32_t status_bit) {
+    uint32_t gcmd = vtd_read32(unit, VTD_REG_GSTS) & VTD_GSTS_PERSISTENT_MASK;
+    vtd_write32(unit, VTD_REG_GCMD, gcmd | command);
+    
+    uint64_t timeout = vtd_wait_cycles();
+    uint64_t start = cpu_read_tsc();
+    while (!(vtd_read32(unit, VTD_REG_GSTS) & status_bit) && cpu_read_tsc() - start < timeout) {
+        asm volatile("pause");
+    }
+}
+
+// Parse DRHD units (and their single-hop endpoint scopes) out of DMAR
+uint8_t vtd_detect(void) {
+    const acpi_sdt_header_t *dmar = acpi_get_info()->dmar;
+    if (!dmar) {
+        return 0;
+    }
+    
+    const uint8_t *p = (const uint8_t *)dmar + DMAR_HEADER_SIZE;
+    const uint8_t *end = (const uint8_t *)dmar + dmar->length;
+    
+    while (p + 4 <= end) {
+        uint16_t type = *(const uint16_t *)p;
+        uint16_t length = *(const uint16_t *)(p + 2);
+        if (length < 4) break;
+        
+        if (type == DMAR_TYPE_DRHD && vtd_state.unit_count < VTD_MAX_UNITS) {
+            vtd_unit_t *unit = &vtd_state.units[vtd_state.unit_count++];
+            unit->flags = p[4];
+            unit->segment = *(const uint16_t *)(p + 6);
+            unit->base = *(const uint64_t *)(p + 8);
+            unit->scope_count = 0;
+            
+            // Device scope entries: type, length, reserved, enumeration ID,
+            // start bus, then (device, function) path pairs
+            const uint8_t *scope = p + 16;
+            while (scope + 6 <= p + length) {
+                uint8_t scope_len = scope[1];
+                if (scope_len < 6) break;
+                
+                if (scope[0] == DMAR_SCOPE_PCI_ENDPOINT && scope_len == 8 &&
+                    unit->scope_count < VTD_MAX_SCOPE_DEVICES) {
+                    unit->scope_sids[unit->scope_count++] =
+                        ((uint16_t)scope[5] << 8) | (scope[6] << 3) | scope[7];
+                }
+                scope += scope_len;
+            }
+            
+            console_write_string("  Found VT-d DRHD at 0x");
+            console_write_hex(unit->base);
+            console_write_string((unit->flags & DMAR_DRHD_INCLUDE_PCI_ALL) ? " (all devices)\n" : "\n");
+        }
+        p += length;
+    }
+    
+    return vtd_state.unit_count > 0;
+}
+
+uint64_t vtd_get_base(void) {
+    return vtd_state.unit_count ? vtd_state.units[0].base : 0;
+}
+
+// A unit that names the device in its scope wins; otherwise the
+// INCLUDE_PCI_ALL unit catches it
+static vtd_unit_t *vtd_unit_for(uint16_t sid) {
+    vtd_unit_t *catch_all = 0;
+    
+    for (uint32_t i = 0; i < vtd_state.unit_count; i++) {
+        vtd_unit_t *unit = &vtd_state.units[i];
+        for (uint8_t j = 0; j < unit->scope_count; j++) {
+            if (unit->scope_sids[j] == sid) return unit;
+        }
+        if (unit->flags & DMAR_DRHD_INCLUDE_PCI_ALL) {
+            catch_all = unit;
+        }
+    }
+    return catch_all;
+}
+
+static void vtd_queue_push(vtd_unit_t *unit, uint64_t lo, uint64_t hi) {
+    uint32_t next = (unit->queue_tail + 1) % VTD_IQ_ENTRIES;
+    
+    // Queue full: wait for hardware to consume a descriptor
+    while (next == ((vtd_read64(unit, VTD_REG_IQH) >> 4) & (VTD_IQ_ENTRIES - 1))) {
+        asm volatile("pause");
+    }
+    
+    unit->queue[unit->queue_tail].lo = lo;
+    unit->queue[unit->queue_tail].hi = hi;
+    unit->queue_tail = next;
+    vtd_state.stats.commands_issued++;
+    vtd_state.stats.last_batch_commands++;
+    
+    vtd_write64(unit, VTD_REG_IQT, (uint64_t)unit->queue_tail << 4);
+}
+
+// One invalidation-wait descriptor covers everything queued before it
+static void vtd_queue_wait(vtd_unit_t *unit) {
+    uint32_t token = ++unit->wait_token;
+    
+    vtd_queue_push(unit, VTD_INV_WAIT | VTD_INV_WAIT_SW | ((uint64_t)token << 32),
+                   (uint64_t)unit->wait_status);
+    vtd_state.stats.completion_waits++;
+    
+    uint64_t timeout = vtd_wait_cycles();
+    uint64_t start = cpu_read_tsc();
+    while (*unit->wait_status != token) {
+        if (cpu_read_tsc() - start >= timeout) {
+            vtd_state.stats.wait_timeouts++;
+            return;
+        }
+        asm volatile("pause");
+    }
+}
+
+// Walk (and build) a domain's 4-level second-level table down to the
+// requested leaf level; returns the slot to write
+static uint64_t *vtd_walk(uint64_t *pml4, uint64_t iova, uint8_t leaf_level) {
+    uint64_t *table = pml4;
+    
+    for (uint8_t level = 4; level > leaf_level; level--) {
+        uint64_t *entry = &table[(iova >> (12 + 9 * (level - 1))) & 0x1FF];
+        
+        if (*entry & (VTD_SL_READ | VTD_SL_WRITE)) {
+            if (*entry & VTD_SL_PS) return 0;  // Already a superpage
+            table = (uint64_t *)(*entry & VTD_SL_ADDR_MASK);
+            continue;
+        }
+        
+        uint64_t *next = vtd_alloc_table();
+        if (!next) return 0;
+        *entry = ((uint64_t)next & VTD_SL_ADDR_MASK) | VTD_SL_READ | VTD_SL_WRITE;
+        vtd_flush_entry(entry);
+        table = next;
+    }
+    
+    return &table[(iova >> (12 + 9 * (leaf_level - 1))) & 0x1FF];
+}
+
+// Map with the largest superpage every unit supports
+uint8_t vtd_map_range(uint8_t cell_id, uint64_t iova, uint64_t phys, uint64_t size) {
+    if (cell_id >= IOMMU_MAX_DOMAINS) return 0;
+    
+    vtd_domain_t *domain = &vtd_state.domains[cell_id];
+    if (!domain->root) return 0;
+    
+    vtd_state.iotlb_dirty[cell_id] = 1;
+    
+    while (size > 0) {
+        uint64_t step;
+        uint64_t *slot;
+        uint64_t flags = VTD_SL_READ | VTD_SL_WRITE;
+        
+        if (vtd_state.superpage_1g && ((iova | phys) & (PAGE_SIZE_1G - 1)) == 0 && size >= PAGE_SIZE_1G) {
+            slot = vtd_walk(domain->root, iova, 3);
+            flags |= VTD_SL_PS;
+            step = PAGE_SIZE_1G;
+        } else if (vtd_state.superpage_2m && ((iova | phys) & (PAGE_SIZE_2M - 1)) == 0 && size >= PAGE_SIZE_2M) {
+            slot = vtd_walk(domain->root, iova, 2);
+            flags |= VTD_SL_PS;
+            step = PAGE_SIZE_2M;
+        } else {
+            slot = vtd_walk(domain->root, iova, 1);
+            step = PAGE_SIZE_4K;
+        }
+        if (!slot) return 0;
+        
+        *slot = (phys & VTD_SL_ADDR_MASK) | flags;
+        vtd_flush_entry(slot);
+        if (step == PAGE_SIZE_1G) domain->pages_1g++;
+        else if (step == PAGE_SIZE_2M) domain->pages_2m++;
+        else domain->pages_4k++;
+        iova += step;
+        phys += step;
+        size = (size > step) ? size - step : 0;
+        domain->mapped_bytes += step;
+    }
+    
+    return 1;
+}
+
+void vtd_unmap_range(uint8_t cell_id, uint64_t iova, uint64_t size) {
+    if (cell_id >= IOMMU_MAX_DOMAINS) return;
+    
+    vtd_domain_t *domain = &vtd_state.domains[cell_id];
+    if (!domain->root) return;
+    
+    vtd_state.iotlb_dirty[cell_id] = 1;
+    
+    while (size > 0) {
+        uint64_t *table = domain->root;
+        uint64_t *entry = 0;
+        uint8_t level;
+        
+        // Descend until a leaf (superpage or 4K) or a hole
+        for (level = 4; level >= 1; level--) {
+            entry = &table[(iova >> (12 + 9 * (level - 1))) & 0x1FF];
+            if (!(*entry & (VTD_SL_READ | VTD_SL_WRITE))) break;
+            if (level == 1 || (*entry & VTD_SL_PS)) break;
+            table = (uint64_t *)(*entry & VTD_SL_ADDR_MASK);
+        }
+        
+        uint64_t step = 1UL << (12 + 9 * (level - 1));
+        if (*entry & (VTD_SL_READ | VTD_SL_WRITE)) {
+            *entry = 0;
+            vtd_flush_entry(entry);
+            if (level == 3) domain->pages_1g--;
+            else if (level == 2) domain->pages_2m--;
+            else domain->pages_4k--;
+            domain->mapped_bytes -= step;
+        }
+        
+        uint64_t next_iova = (iova & ~(step - 1)) + step;
+        uint64_t advanced = next_iova - iova;
+        iova = next_iova;
+        size = (size > advanced) ? size - advanced : 0;
+    }
+}
+
+// Install the context entry for one device, pointing at its cell domain
+// (or the hypervisor domain for IOMMU_HYPERVISOR_CELL)
+void vtd_attach_device(uint16_t bus, uint16_t device, uint16_t function, uint8_t cell_id) {
+    if (cell_id >= IOMMU_MAX_DOMAINS) return;
+    
+    uint16_t sid = AMDVI_DEVICE_ID(bus, device, function);
+    vtd_unit_t *unit = vtd_unit_for(sid);
+    vtd_domain_t *domain = &vtd_state.domains[cell_id];
+    if (!unit || !unit->root_table || !domain->root) return;
+    
+    // Root entry (lo qword) points at the bus's context table
+    uint64_t *root = &unit->root_table[bus * 2];
+    uint64_t *context;
+    if (*root & VTD_ROOT_PRESENT) {
+        context = (uint64_t *)(*root & VTD_SL_ADDR_MASK);
+    } else {
+        context = vtd_alloc_table();
+        if (!context) return;
+        root[1] = 0;
+        *root = ((uint64_t)context & VTD_SL_ADDR_MASK) | VTD_ROOT_PRESENT;
+        vtd_flush_entry(root);
+    }
+    
+    uint16_t domain_id = IOMMU_CELL_DOMAIN(cell_id);
+    volatile uint64_t *entry = &context[((device << 3) | function) * 2];
+    
+    // The context cache is tagged with the DID being torn down; a
+    // not-present entry is cached (caching mode) under DID 0
+    uint16_t old_did = 0;
+    if (entry[0] & VTD_CONTEXT_PRESENT) {
+        old_did = (uint16_t)(entry[1] >> VTD_CONTEXT_DID_SHIFT);
+        for (uint8_t cell = 0; cell < IOMMU_MAX_DOMAINS; cell++) {
+            if (IOMMU_CELL_DOMAIN(cell) == old_did) vtd_state.iotlb_dirty[cell] = 1;
+        }
+    }
+    
+    // High half first so the entry never turns present half-written
+    entry[0] = 0;
+    entry[1] = VTD_CONTEXT_AW_48BIT | ((uint64_t)domain_id << VTD_CONTEXT_DID_SHIFT);
+    entry[0] = ((uint64_t)domain->root & VTD_SL_ADDR_MASK) | VTD_CONTEXT_PRESENT;
+    vtd_flush_entry(entry);
+    
+    // Context-cache invalidation is device-selective; dedupe per batch,
+    // keeping the DID that was cached before the batch began
+    for (uint32_t i = 0; i < vtd_state.pending_sid_count; i++) {
+        if (vtd_state.pending_sids[i] == sid) {
+            vtd_state.stats.invalidations_coalesced++;
+            vtd_state.iotlb_dirty[cell_id] = 1;
+            return;
+        }
+    }
+    if (vtd_state.pending_sid_count < VTD_MAX_PENDING_DEVICES) {
+        vtd_state.pending_sids[vtd_state.pending_sid_count] = sid;
+        vtd_state.pending_dids[vtd_state.pending_sid_count] = old_did;
+        vtd_state.pending_sid_count++;
+    } else {
+        vtd_state.context_flush_all = 1;
+    }
+    vtd_state.iotlb_dirty[cell_id] = 1;
+}
+
+void vtd_begin_batch(void) {
+    vtd_state.batch_depth++;
+}
+
+// Flush the batch: device-selective context invalidations, one
+// domain-selective IOTLB invalidation per dirty domain, then a single
+// wait descriptor per unit
+uint32_t vtd_commit_batch(void) {
+    if (vtd_state.batch_depth > 0) vtd_state.batch_depth--;
+    if (vtd_state.batch_depth > 0) return 0;
+    
+    uint8_t iotlb_dirty = 0;
+    for (uint8_t cell = 0; cell < IOMMU_MAX_DOMAINS; cell++) {
+        iotlb_dirty |= vtd_state.iotlb_dirty[cell];
+    }
+    if (!vtd_state.pending_sid_count && !vtd_state.context_flush_all && !iotlb_dirty) {
+        return 0;
+    }
+    
+    uint64_t start = cpu_read_tsc();
+    vtd_state.stats.last_batch_commands = 0;
+    
+    for (uint32_t u = 0; u < vtd_state.unit_count; u++) {
+        vtd_unit_t *unit = &vtd_state.units[u];
+        if (!unit->queue) continue;
+        
+        if (vtd_state.context_flush_all) {
+            vtd_queue_push(unit, VTD_INV_CONTEXT | VTD_INV_CONTEXT_GLOBAL, 0);
+        }
+        for (uint32_t i = 0; i < vtd_state.pending_sid_count && !vtd_state.context_flush_all; i++) {
+            vtd_queue_push(unit, VTD_INV_CONTEXT | VTD_INV_CONTEXT_DEVICE |
+                                 ((uint64_t)vtd_state.pending_dids[i] << 16) |
+                                 ((uint64_t)vtd_state.pending_sids[i] << 32), 0);
+        }
+        for (uint8_t cell = 0; cell < IOMMU_MAX_DOMAINS; cell++) {
+            if (vtd_state.iotlb_dirty[cell]) {
+                vtd_queue_push(unit, VTD_INV_IOTLB | VTD_INV_IOTLB_DOMAIN |
+                                     VTD_INV_IOTLB_DR | VTD_INV_IOTLB_DW |
+                                     ((uint64_t)IOMMU_CELL_DOMAIN(cell) << 16), 0);
+            }
+        }
+        vtd_queue_wait(unit);
+    }
+    
+    vtd_state.pending_sid_count = 0;
+    vtd_state.context_flush_all = 0;
+    for (uint8_t cell = 0; cell < IOMMU_MAX_DOMAINS; cell++) {
+        vtd_state.iotlb_dirty[cell] = 0;
+    }
+    
+    uint64_t cycles = cpu_read_tsc() - start;
+    vtd_state.stats.last_batch_cycles = cycles;
+    if (cycles > vtd_state.stats.max_batch_cycles) {
+        vtd_state.stats.max_batch_cycles = cycles;
+    }
+    return vtd_state.stats.last_batch_commands;
+}
+
+const iommu_cmd_stats_t *vtd_get_cmd_stats(void) {
+    return &vtd_state.stats;
+}
+
+static void vtd_setup_unit(vtd_unit_t *unit) {
+    unit->cap = vtd_read64(unit, VTD_REG_CAP);
+    unit->ecap = vtd_read64(unit, VTD_REG_ECAP);
+    
+    if (!(unit->cap & VTD_CAP_SAGAW_48BIT) || !(unit->ecap & VTD_ECAP_QI)) {
+        log_warn("VT-d unit lacks 4-level tables or queued invalidation\n");
+        return;
+    }
+    
+    // Set before this unit's tables are built; domain tables come later
+    if (!(unit->ecap & VTD_ECAP_C)) {
+        vtd_state.flush_tables = 1;
+    }
+    
+    unit->root_table = vtd_alloc_table();
+    unit->queue = (vtd_descriptor_t *)vtd_alloc_table();
+    unit->wait_status = (volatile uint32_t *)memory_alloc_aligned(sizeof(uint32_t), 4);
+    if (!unit->root_table || !unit->queue || !unit->wait_status) {
+        log_error("Failed to allocate VT-d tables\n");
+        return;
+    }
+    *unit->wait_status = 0;
+    unit->wait_token = 0;
+    unit->queue_tail = 0;
+    
+    // Queued invalidation: 128-bit descriptors, one page (QS = 0)
+    vtd_write64(unit, VTD_REG_IQT, 0);
+    vtd_write64(unit, VTD_REG_IQA, (uint64_t)unit->queue & VTD_SL_ADDR_MASK);
+    vtd_global_command(unit, VTD_GCMD_QIE, VTD_GSTS_QIES);
+    
+    vtd_write64(unit, VTD_REG_RTADDR, (uint64_t)unit->root_table & VTD_SL_ADDR_MASK);
+    vtd_global_command(unit, VTD_GCMD_SRTP, VTD_GSTS_RTPS);
+    
+    unit->enabled = 1;
+}
+
+void vtd_init(void) {
+    console_write_string("Building VT-d root, context and second-level tables...\n");
+    
+    // Superpages must be usable on every unit sharing the domain tables
+    vtd_state.superpage_1g = 1;
+    vtd_state.superpage_2m = 1;
+    for (uint32_t i = 0; i < vtd_state.unit_count; i++) {
+        vtd_setup_unit(&vtd_state.units[i]);
+        if (!(vtd_state.units[i].cap & VTD_CAP_SLLPS_1G)) vtd_state.superpage_1g = 0;
+        if (!(vtd_state.units[i].cap & VTD_CAP_SLLPS_2M)) vtd_state.superpage_2m = 0;
+    }
+    
+    // Same carve-out as AMD-Vi: the hypervisor region stays unmapped for
+    // the cells, and is all the hypervisor domain reaches
+    for (uint8_t cell = 0; cell < IOMMU_MAX_DOMAINS; cell++) {
+        vtd_state.domains[cell].root = vtd_alloc_table();
+        if (!vtd_state.domains[cell].root) {
+            log_error("Failed to map cell region\n");
+            return;
+        }
+        memory_range_t ranges[MEMORY_CELL_MAX_RANGES] = { { HYPERVISOR_MEMORY_START, HYPERVISOR_MEMORY } };
+        uint32_t range_count = cell < 2 ? memory_get_cell_ranges(cell, ranges) : 1;
+        for (uint32_t r = 0; r < range_count; r++) {
+            if (!vtd_map_range(cell, ranges[r].base, ranges[r].base, ranges[r].size)) {
+                log_error("Failed to map cell region\n");
+                return;
+            }
+        }
+    }
+    
+    console_write_string(vtd_state.superpage_1g ? "  Using 1GB superpages\n" :
+                         vtd_state.superpage_2m ? "  Using 2MB superpages\n" :
+                         "  Using 4KB pages\n");
+    if (vtd_state.flush_tables) {
+        console_write_string("  Non-coherent unit, table writes are flushed\n");
+    }
+}
+
+void vtd_enable(void) {
+    for (uint32_t i = 0; i < vtd_state.unit_count; i++) {
+        vtd_unit_t *unit = &vtd_state.units[i];
+        if (!unit->enabled) continue;
+        
+        // Drop anything cached from firmware before translation starts
+        vtd_queue_push(unit, VTD_INV_CONTEXT | (1UL << 4), 0);
+        vtd_queue_push(unit, VTD_INV_IOTLB | (1UL << 4) | VTD_INV_IOTLB_DR | VTD_INV_IOTLB_DW, 0);
+        vtd_queue_wait(unit);
+        
+        vtd_global_command(unit, VTD_GCMD_TE, VTD_GSTS_TES);
+        if (vtd_read32(unit, VTD_REG_GSTS) & VTD_GSTS_TES) {
+            console_write_string("VT-d unit enabled at 0x");
+        } else {
+            console_write_string("Failed to enable VT-d unit at 0x");
+        }
+        console_write_hex(unit->base);
+        console_write_string("\n");
+    }
+    
+    vtd_state.pending_sid_count = 0;
+    vtd_state.context_flush_all = 0;
+    for (uint8_t cell = 0; cell < IOMMU_MAX_DOMAINS; cell++) {
+        vtd_state.iotlb_dirty[cell] = 0;
+    }
+}
+
+void vtd_print_status(void) {
+    char buf[32];
+    
+    console_write_string("  VT-d units: ");
+    itoa(vtd_state.unit_count, buf, 10);
+    console_write_string(buf);
+    console_write_string("\n");
+    
+    for (int i = 0; i < IOMMU_MAX_DOMAINS; i++) {
+        vtd_domain_t *domain = &vtd_state.domains[i];
+        console_write_string(i == 0 ? "  Linux domain: " : i == 1 ? "  Windows domain: " : "  Hypervisor domain: ");
+        itoa(domain->pages_1g, buf, 10);
+        console_write_string(buf);
+        console_write_string(" x 1GB, ");
+        itoa(domain->pages_2m, buf, 10);
+        console_write_string(buf);
+        console_write_string(" x 2MB, ");
+        itoa(domain->pages_4k, buf, 10);
+        console_write_string(buf);
+        console_write_string(" x 4KB\n");
+    }
+    
+    kprintf("  Invalidation descriptors: %lu (%lu waits)\n",
+            vtd_state.stats.commands_issued, vtd_state.stats.completion_waits);
+}
@@ -0,0 +1,129 @@
+#ifndef VTD_H
+#define VTD_H
+
+#include "types.h"
+#include "iommu.h"
+
+// DMAR remapping structure types
+#define DMAR_TYPE_DRHD 0
+#define DMAR_DRHD_INCLUDE_PCI_ALL 0x01
+#define DMAR_HEADER_SIZE 48
+
+// VT-d MMIO registers
+#define VTD_REG_VER 0x00
+#define VTD_REG_CAP 0x08
+#define VTD_REG_ECAP 0x10
+#define VTD_REG_GCMD 0x18
+#define VTD_REG_GSTS 0x1C
+#define VTD_REG_RTADDR 0x20
+#define VTD_REG_FSTS 0x34
+#define VTD_REG_IQH 0x80
+#define VTD_REG_IQT 0x88
+#define VTD_REG_IQA 0x90
+#define VTD_REG_ICS 0x9C
+
+// Global command/status bits
+#define VTD_GCMD_TE (1U << 31)
+#define VTD_GCMD_SRTP (1U << 30)
+#define VTD_GCMD_QIE (1U << 26)
+#define VTD_GSTS_TES (1U << 31)
+#define VTD_GSTS_RTPS (1U << 30)
+#define VTD_GSTS_QIES (1U << 26)
+#define VTD_GSTS_PERSISTENT_MASK 0x96FFFFFFU  // Drop one-shot status bits
+
+// Capability bits
+#define VTD_CAP_SAGAW_48BIT (1UL << 10)  // 4-level second-level tables
+#define VTD_CAP_SLLPS_2M (1UL << 34)
+#define VTD_CAP_SLLPS_1G (1UL << 35)
+#define VTD_ECAP_C (1UL << 0)   // Page walks snoop the CPU caches
+#define VTD_ECAP_QI (1UL << 1)
+
+// Root/context entries (128-bit)
+#define VTD_ROOT_PRESENT (1UL << 0)
+#define VTD_CONTEXT_PRESENT (1UL << 0)
+#define VTD_CONTEXT_AW_48BIT 2
+#define VTD_CONTEXT_DID_SHIFT 8
+
+// Second-level paging entries
+#define VTD_SL_READ (1UL << 0)
+#define VTD_SL_WRITE (1UL << 1)
+#define VTD_SL_PS (1UL << 7)
+#define VTD_SL_ADDR_MASK 0x000FFFFFFFFFF000UL
+
+// Queued invalidation: 256 x 128-bit descriptors in one page
+#define VTD_IQ_ENTRIES 256
+#define VTD_INV_CONTEXT 0x1
+#define VTD_INV_IOTLB 0x2
+#define VTD_INV_WAIT 0x5
+#define VTD_INV_CONTEXT_GLOBAL (1UL << 4)
+#define VTD_INV_CONTEXT_DEVICE (3UL << 4)
+#define VTD_INV_IOTLB_DOMAIN (2UL << 4)
+#define VTD_INV_IOTLB_DR (1UL << 7)
+#define VTD_INV_IOTLB_DW (1UL << 6)
+#define VTD_INV_WAIT_SW (1UL << 5)
+#define VTD_WAIT_TIMEOUT_MS 10  // Register and invalidation waits, in TSC time
+
+#define VTD_MAX_UNITS 4
+#define VTD_MAX_SCOPE_DEVICES 8
+#define DMAR_SCOPE_PCI_ENDPOINT 0x01
+#define VTD_MAX_PENDING_DEVICES 64
+
+typedef struct {
+    uint64_t lo;
+    uint64_t hi;
+} vtd_descriptor_t;
+
+typedef struct {
+    uint64_t base;
+    uint16_t segment;
+    uint8_t flags;
+    uint64_t cap;
+    uint64_t ecap;
+    uint64_t *root_table;
+    vtd_descriptor_t *queue;
+    uint32_t queue_tail;
+    volatile uint32_t *wait_status;
+    uint32_t wait_token;
+    uint16_t scope_sids[VTD_MAX_SCOPE_DEVICES];  // Endpoints named by device scope
+    uint8_t scope_count;
+    uint8_t enabled;
+} vtd_unit_t;
+
+typedef struct {
+    uint64_t *root;  // Second-level PML4
+    uint64_t mapped_bytes;
+    uint32_t pages_1g;
+    uint32_t pages_2m;
+    uint32_t pages_4k;
+} vtd_domain_t;
+
+typedef struct {
+    vtd_unit_t units[VTD_MAX_UNITS];
+    uint32_t unit_count;
+    vtd_domain_t domains[IOMMU_MAX_DOMAINS];  // Both cells, then the hypervisor's
+    uint8_t superpage_1g;
+    uint8_t superpage_2m;
+    uint8_t flush_tables;  // Some unit lacks ECAP.C: clflush every table write
+    uint32_t batch_depth;
+    // Pending invalidations for the open batch
+    uint16_t pending_sids[VTD_MAX_PENDING_DEVICES];
+    uint16_t pending_dids[VTD_MAX_PENDING_DEVICES];  // DID the cached context entry carries
+    uint32_t pending_sid_count;
+    uint8_t context_flush_all;  // Batch outgrew pending_sids
+    uint8_t iotlb_dirty[IOMMU_MAX_DOMAINS];
+    iommu_cmd_stats_t stats;
+} vtd_state_t;
+
+uint8_t vtd_detect(void);
+void vtd_init(void);
+void vtd_enable(void);
+uint64_t vtd_get_base(void);
+void vtd_attach_device(uint16_t bus, uint16_t device, uint16_t function, uint8_t cell_id);
+uint8_t vtd_map_range(uint8_t cell_id, uint64_t iova, uint64_t phys, uint64_t size);
+void vtd_unmap_range(uint8_t cell_id, uint64_t iova, uint64_t size);
+void vtd_begin_batch(void);
+uint32_t vtd_commit_batch(void);
+const iommu_cmd_stats_t *vtd_get_cmd_stats(void);
+void vtd_print_status(void);
+
+#endif
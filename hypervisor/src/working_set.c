@@ -0,0 +1,206 @@
+#include "working_set.h"
+#include "console.h"
+#include "cpu.h"
+#include "memory.h"
+#include "system_manager.h"
+#include "kprintf.h"
+#include "types.h"
+
+static working_set_t working_set = {0};
+
+static const uint32_t window_seconds[WORKING_SET_WINDOWS] = { 10, 60, 300 };
+
+static uint64_t working_set_cycles_per_ms(void) {
+    uint32_t mhz = cpu_get_tsc_mhz();
+    return (uint64_t)(mhz ? mhz : 1000) * 1000;
+}
+
+// Seconds since init, starting at 1 so 0 can mean "never accessed"
+static uint32_t working_set_now_seconds(uint64_t tsc) {
+    return (uint32_t)((tsc - working_set.start_tsc) / (working_set_cycles_per_ms() * 1000)) + 1;
+}
+
+void working_set_init(void) {
+    console_write_string("Initializing working set scanner...\n");
+    
+    working_set.start_tsc = cpu_read_tsc();
+    working_set.last_tsc = working_set.start_tsc;
+    working_set_configure(WORKING_SET_DEFAULT_PASS_MS, WORKING_SET_DEFAULT_STRIDE,
+                          WORKING_SET_DEFAULT_BUDGET_PPM);
+    
+    if (!memory_get_nested_root(0) || !memory_get_nested_root(1)) {
+        console_write_string("  No nested page tables, scanner disabled\n");
+        return;
+    }
+    working_set.enabled = 1;
+    
+    kprintf("  Pass every %u ms, 1 in %u x 2MB blocks, budget %u ppm\n",
+            working_set.pass_ms, working_set.stride, working_set.budget_ppm);
+}
+
+// A stride change restarts the passes; ages already recorded stay valid
+void working_set_configure(uint32_t pass_ms, uint32_t stride, uint32_t budget_ppm) {
+    working_set.pass_ms = pass_ms ? pass_ms : WORKING_SET_DEFAULT_PASS_MS;
+    working_set.stride = (stride && stride <= MEMORY_CELL_BLOCKS) ? stride : WORKING_SET_DEFAULT_STRIDE;
+    working_set.budget_ppm = (budget_ppm && budget_ppm <= 1000000) ? budget_ppm : WORKING_SET_DEFAULT_BUDGET_PPM;
+    for (int i = 0; i < 2; i++) {
+        working_set.cells[i].in_pass = 0;
+    }
+}
+
+static void working_set_publish(uint8_t cell_id) {
+    working_set_cell_t *cell = &working_set.cells[cell_id];
+    uint64_t capacity = (uint64_t)MEMORY_CELL_BLOCKS * PAGE_SIZE_2M;
+    
+    for (int w = 0; w < WORKING_SET_WINDOWS; w++) {
+        uint64_t bytes = (uint64_t)cell->counting[w] * working_set.stride * PAGE_SIZE_2M;
+        cell->bytes[w] = bytes > capacity ? capacity : bytes;
+    }
+    cell->in_pass = 0;
+    cell->passes++;
+    
+    // Until the flush, cached translations hide new accesses from the A bits
+    system_manager_flush_cell_tlb(cell_id);
+}
+
+// Sample blocks of the pass in progress until it ends or the cycle
+// budget runs out; returns 0 in the latter case
+static uint8_t working_set_scan_cell(uint8_t cell_id, uint64_t *now) {
+    working_set_cell_t *cell = &working_set.cells[cell_id];
+    uint64_t start = *now;
+    uint32_t checked = 0;
+    
+    while (cell->cursor < MEMORY_CELL_BLOCKS) {
+        uint32_t block = cell->cursor;
+        cell->cursor += working_set.stride;
+        
+        // Only write entries the cell touched, so idle PD lines stay clean
+        uint64_t *entry = memory_get_cell_block_entry(cell_id, block);
+        if (*entry & PAGE_ACCESSED) {
+            __atomic_fetch_and(entry, ~PAGE_ACCESSED, __ATOMIC_RELAXED);
+            cell->last_seen[block] = cell->pass_stamp;
+            cell->tlb_flush_pending = 1;
+        }
+        
+        uint32_t seen = cell->last_seen[block];
+        if (seen) {
+            uint32_t age = cell->pass_stamp - seen;
+            for (int w = 0; w < WORKING_SET_WINDOWS; w++) {
+                if (age < window_seconds[w]) cell->counting[w]++;
+            }
+        }
+        
+        if (++checked % WORKING_SET_CHECK_BLOCKS == 0) {
+            *now = cpu_read_tsc();
+            if ((int64_t)(*now - start) >= working_set.budget_cycles) {
+                break;
+            }
+        }
+    }
+    
+    *now = cpu_read_tsc();
+    working_set.budget_cycles -= (int64_t)(*now - start);
+    working_set.scan_cycles += *now - start;
+    
+    if (cell->cursor < MEMORY_CELL_BLOCKS) return 0;
+    working_set_publish(cell_id);
+    return 1;
+}
+
+// Control loop hook. Scan time is earned at budget_ppm of elapsed time
+// and capped at one pass worth, so a long idle stretch cannot turn into
+// a long scan.
+void working_set_scan(void) {
+    if (!working_set.enabled) return;
+    
+    uint64_t now = cpu_read_tsc();
+    uint64_t cycles_per_ms = working_set_cycles_per_ms();
+    uint64_t pass_cycles = working_set.pass_ms * cycles_per_ms;
+    int64_t cap = (int64_t)(pass_cycles * working_set.budget_ppm / 1000000);
+    
+    // Multiply before dividing: the loop wakes on every interrupt, often
+    // less than 1M cycles apart. Anything past one pass is capped anyway,
+    // which also keeps the product from overflowing.
+    uint64_t elapsed = now - working_set.last_tsc;
+    if (elapsed > pass_cycles) elapsed = pass_cycles;
+    working_set.budget_cycles += (int64_t)(elapsed * working_set.budget_ppm / 1000000);
+    if (working_set.budget_cycles > cap) working_set.budget_cycles = cap;
+    working_set.last_tsc = now;
+    
+    const system_state_t *state = system_manager_get_state();
+    uint32_t stamp = working_set_now_seconds(now);
+    
+    // Hibernated cells touch nothing; their estimate holds until they resume.
+    // A cell not running on its nested root has no A bits to sample.
+    for (uint8_t i = 0; i < 2; i++) {
+        if (state->cells[i].state != CELL_STATE_RUNNING || !memory_nested_active(i)) continue;
+        working_set_cell_t *cell = &working_set.cells[i];
+        
+        if (!cell->in_pass) {
+            if (cell->passes && now - cell->pass_tsc < working_set.pass_ms * cycles_per_ms) continue;
+            cell->in_pass = 1;
+            cell->cursor = 0;
+            cell->pass_tsc = now;
+            cell->pass_stamp = stamp;
+            for (int w = 0; w < WORKING_SET_WINDOWS; w++) {
+                cell->counting[w] = 0;
+            }
+        }
+        
+        if (working_set.budget_cycles <= 0) {
+            working_set.budget_stops++;
+            return;
+        }
+        if (!working_set_scan_cell(i, &now)) {
+            working_set.budget_stops++;
+            return;
+        }
+    }
+}
+
+uint64_t working_set_get_bytes(uint8_t cell_id, uint8_t window) {
+    if (cell_id >= 2 || window >= WORKING_SET_WINDOWS) return 0;
+    return working_set.cells[cell_id].bytes[window];
+}
+
+// An estimate exists only once a full pass has sampled A bits that the
+// hardware sets, i.e. the cell runs on its nested root
+uint8_t working_set_available(uint8_t cell_id) {
+    if (cell_id >= 2 || !working_set.enabled) return 0;
+    return working_set.cells[cell_id].passes && memory_nested_active(cell_id);
+}
+
+// Returns whether A bits were cleared since the last call, and clears it
+uint8_t working_set_take_tlb_flush(uint8_t cell_id) {
+    if (cell_id >= 2) return 0;
+    return __atomic_exchange_n(&working_set.cells[cell_id].tlb_flush_pending, 0, __ATOMIC_RELAXED);
+}
+
+// 2MB blocks the cell touched in the long window: what a resume has to
+// bring back before the cell runs at speed again
+uint32_t working_set_predict_blocks(uint8_t cell_id) {
+    return (uint32_t)(working_set_get_bytes(cell_id, WORKING_SET_WINDOW_LONG) / PAGE_SIZE_2M);
+}
+
+void working_set_print_status(void) {
+    console_write_string("Working Set:\n");
+    if (!working_set.enabled) {
+        console_write_string("  Scanner disabled\n");
+        return;
+    }
+    
+    const system_state_t *state = system_manager_get_state();
+    for (uint8_t i = 0; i < 2; i++) {
+        const working_set_cell_t *cell = &working_set.cells[i];
+        if (!working_set_available(i)) {
+            kprintf("  %s: n/a (%s)\n", i == 0 ? "Linux" : "Windows",
+                    memory_nested_active(i) ? "no full pass yet" : "nested root not in use");
+            continue;
+        }
+        kprintf("  %s: 10s %lu MB, 1m %lu MB, 5m %lu MB (%lu passes, %lu TLB flushes)\n",
+                i == 0 ? "Linux" : "Windows",
+                cell->bytes[WORKING_SET_WINDOW_SHORT] >> 20, cell->bytes[WORKING_SET_WINDOW_MEDIUM] >> 20,
+                cell->bytes[WORKING_SET_WINDOW_LONG] >> 20, cell->passes, state->cells[i].tlb_flushes);
+    }
+    kprintf("  Scan cycles: 0x%lx, budget stops %lu\n", working_set.scan_cycles, working_set.budget_stops);
+}
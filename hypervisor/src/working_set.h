@@ -0,0 +1,55 @@
+#ifndef WORKING_SET_H
+#define WORKING_SET_H
+
+#include "types.h"
+#include "memory.h"
+
+// Working set estimation from the accessed bits of each cell's nested
+// page tables. One 2MB PD entry is one sample; a pass tests and clears
+// every stride-th entry of the running cell, and each block remembers
+// the last pass that found it accessed.
+#define WORKING_SET_WINDOWS 3
+#define WORKING_SET_WINDOW_SHORT  0   // 10 s
+#define WORKING_SET_WINDOW_MEDIUM 1   // 1 min, reported as memory_used
+#define WORKING_SET_WINDOW_LONG   2   // 5 min, used to size hibernation
+
+#define WORKING_SET_DEFAULT_PASS_MS    1000
+#define WORKING_SET_DEFAULT_STRIDE     1
+#define WORKING_SET_DEFAULT_BUDGET_PPM 5000   // 0.5% of the control loop core
+#define WORKING_SET_CHECK_BLOCKS       64     // Samples between budget checks
+
+typedef struct {
+    uint32_t last_seen[MEMORY_CELL_BLOCKS];  // Uptime second of the last hit, 0 = never
+    uint32_t cursor;                         // Next block of the pass in progress
+    uint8_t in_pass;
+    uint64_t pass_tsc;                       // When the pass started
+    uint32_t pass_stamp;                     // The same, as the uptime second
+    uint32_t counting[WORKING_SET_WINDOWS];  // Samples of the pass in progress
+    uint64_t bytes[WORKING_SET_WINDOWS];     // Estimate from the last full pass
+    uint64_t passes;
+    uint8_t tlb_flush_pending;               // A bits cleared; taken by system_manager_flush_cell_tlb()
+} working_set_cell_t;
+
+typedef struct {
+    uint8_t enabled;
+    uint32_t pass_ms;
+    uint32_t stride;
+    uint32_t budget_ppm;
+    uint64_t start_tsc;
+    uint64_t last_tsc;
+    int64_t budget_cycles;   // Scan time earned and not yet spent
+    uint64_t scan_cycles;    // Total spent scanning
+    uint64_t budget_stops;   // Scans cut short by the budget
+    working_set_cell_t cells[2];
+} working_set_t;
+
+void working_set_init(void);
+void working_set_configure(uint32_t pass_ms, uint32_t stride, uint32_t budget_ppm);
+void working_set_scan(void);
+uint64_t working_set_get_bytes(uint8_t cell_id, uint8_t window);
+uint8_t working_set_available(uint8_t cell_id);
+uint8_t working_set_take_tlb_flush(uint8_t cell_id);
+uint32_t working_set_predict_blocks(uint8_t cell_id);
+void working_set_print_status(void);
+
+#endif
@@ -0,0 +1,804 @@
+#include "xhci.h"
+#include "console.h"
+#include "cpu.h"
+#include "memory.h"
+#include "pci.h"
+#include "iommu.h"
+#include "input_manager.h"
+#include "kprintf.h"
+
+static xhci_state_t xhci_state = {0};
+
+// Boot protocol modifier byte, bit 0 (LCtrl) .. bit 7 (RGUI). Right-hand
+// keys fold onto the left-hand codes the hotkey logic tracks.
+static const uint8_t hid_modifier_scancodes[8] = {
+    KEY_LCTRL, KEY_LSHIFT, KEY_LALT, 0,
+    KEY_LCTRL, KEY_RSHIFT, KEY_LALT, 0
+};
+
+// HID keyboard usage -> scan code set 1, usages 0x00 - 0x45
+#define HID_USAGE_ROLLOVER 0x01
+#define HID_USAGE_MAX 0x46
+static const uint8_t hid_usage_scancodes[HID_USAGE_MAX] = {
+    0x00, 0x00, 0x00, 0x00, 0x1E, 0x30, 0x2E, 0x20,  // -, -, -, -, A, B, C, D
+    0x12, 0x21, 0x22, 0x23, 0x17, 0x24, 0x25, 0x26,  // E - L
+    0x32, 0x31, 0x18, 0x19, 0x10, 0x13, 0x1F, 0x14,  // M - T
+    0x16, 0x2F, 0x11, 0x2D, 0x15, 0x2C, 0x02, 0x03,  // U - Z, 1, 2
+    0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B,  // 3 - 0
+    0x1C, 0x01, 0x0E, 0x0F, 0x39, 0x0C, 0x0D, 0x1A,  // Enter, Esc, BS, Tab, Space, -, =, [
+    0x1B, 0x2B, 0x00, 0x27, 0x28, 0x29, 0x33, 0x34,  // ], \, -, ;, ', `, ,, .
+    0x35, 0x3A, 0x3B, 0x3C, 0x3D, 0x3E, 0x3F, 0x40,  // /, Caps, F1 - F6
+    0x41, 0x42, 0x43, 0x44, 0x57, 0x58               // F7 - F12
+};
+
+static inline uint32_t xhci_read32(uint64_t addr) {
+    return *(volatile uint32_t *)addr;
+}
+
+static inline void xhci_write32(uint64_t addr, uint32_t value) {
+    *(volatile uint32_t *)addr = value;
+}
+
+// 64-bit registers are written low dword first
+static void xhci_write64(uint64_t addr, uint64_t value) {
+    xhci_write32(addr, (uint32_t)value);
+    xhci_write32(addr + 4, (uint32_t)(value >> 32));
+}
+
+static void xhci_zero(void *ptr, uint32_t size) {
+    uint64_t *p = (uint64_t *)ptr;
+    for (uint32_t i = 0; i < size / sizeof(uint64_t); i++) {
+        p[i] = 0;
+    }
+}
+
+// Every structure the controller reads or writes fits in one zeroed page
+static void *xhci_alloc_page(void) {
+    void *page = memory_alloc_aligned(PAGE_SIZE_4K, PAGE_SIZE_4K);
+    if (page) {
+        xhci_zero(page, PAGE_SIZE_4K);
+    }
+    return page;
+}
+
+static uint8_t xhci_wait_bits(uint64_t reg, uint32_t mask, uint32_t value) {
+    for (uint32_t i = 0; i < XHCI_TIMEOUT; i++) {
+        if ((xhci_read32(reg) & mask) == value) {
+            return 1;
+        }
+        asm volatile("pause");
+    }
+    return 0;
+}
+
+// Producer ring (command or transfer) closed by a Link TRB back to the start
+static uint8_t xhci_ring_init(xhci_ring_t *ring) {
+    if (!ring->trbs) {
+        ring->trbs = (volatile xhci_trb_t *)xhci_alloc_page();
+        if (!ring->trbs) return 0;
+    } else {
+        xhci_zero((void *)ring->trbs, PAGE_SIZE_4K);
+    }
+    
+    volatile xhci_trb_t *link = &ring->trbs[XHCI_RING_TRBS - 1];
+    link->parameter = (uint64_t)ring->trbs;
+    link->control = XHCI_TRB_TYPE(XHCI_TRB_LINK) | XHCI_TRB_TC;
+    ring->index = 0;
+    ring->cycle = 1;
+    return 1;
+}
+
+static void xhci_ring_push(xhci_ring_t *ring, uint64_t parameter, uint32_t status, uint32_t control) {
+    volatile xhci_trb_t *trb = &ring->trbs[ring->index];
+    trb->parameter = parameter;
+    trb->status = status;
+    // Handing the TRB over (cycle bit) must be the last store
+    asm volatile("" ::: "memory");
+    trb->control = control | (ring->cycle ? XHCI_TRB_CYCLE : 0);
+    
+    if (++ring->index == XHCI_RING_TRBS - 1) {
+        volatile xhci_trb_t *link = &ring->trbs[ring->index];
+        link->control = XHCI_TRB_TYPE(XHCI_TRB_LINK) | XHCI_TRB_TC | (ring->cycle ? XHCI_TRB_CYCLE : 0);
+        ring->index = 0;
+        ring->cycle ^= 1;
+    }
+}
+
+static void xhci_ring_doorbell(uint8_t slot_id, uint8_t target) {
+    asm volatile("" ::: "memory");
+    xhci_write32(xhci_state.db_base + slot_id * 4, target);
+}
+
+static uint32_t *xhci_context(uint8_t *base, uint32_t index) {
+    return (uint32_t *)(base + index * xhci_state.context_size);
+}
+
+static xhci_keyboard_t *xhci_find_keyboard(uint8_t slot_id) {
+    for (uint32_t i = 0; i < xhci_state.keyboard_count; i++) {
+        if (xhci_state.keyboards[i].slot_id == slot_id) {
+            return &xhci_state.keyboards[i];
+        }
+    }
+    return 0;
+}
+
+static uint8_t xhci_report_has(const uint8_t *report, uint8_t usage) {
+    for (int i = 2; i < XHCI_BOOT_REPORT_SIZE; i++) {
+        if (report[i] == usage) return 1;
+    }
+    return 0;
+}
+
+static uint8_t xhci_usage_scancode(uint8_t usage) {
+    return usage < HID_USAGE_MAX ? hid_usage_scancodes[usage] : 0;
+}
+
+// Boot reports carry the full key state; turn the difference from the
+// previous report into make/break scan codes
+static void xhci_keyboard_diff(xhci_keyboard_t *kbd, uint64_t tsc) {
+    const uint8_t *now = kbd->report;
+    uint8_t *before = kbd->last_report;
+    
+    // Too many keys held: the report is a placeholder, keep the old state
+    if (now[2] == HID_USAGE_ROLLOVER) {
+        return;
+    }
+    
+    uint8_t changed = now[0] ^ before[0];
+    for (int bit = 0; bit < 8; bit++) {
+        uint8_t scancode = hid_modifier_scancodes[bit];
+        if (!(changed & (1 << bit)) || !scancode) continue;
+        input_manager_push_scancode((now[0] & (1 << bit)) ? scancode : (scancode | KEY_RELEASED), tsc);
+    }
+    
+    for (int i = 2; i < XHCI_BOOT_REPORT_SIZE; i++) {
+        uint8_t scancode = xhci_usage_scancode(before[i]);
+        if (scancode && !xhci_report_has(now, before[i])) {
+            input_manager_push_scancode(scancode | KEY_RELEASED, tsc);
+        }
+    }
+    for (int i = 2; i < XHCI_BOOT_REPORT_SIZE; i++) {
+        uint8_t scancode = xhci_usage_scancode(now[i]);
+        if (scancode && !xhci_report_has(before, now[i])) {
+            input_manager_push_scancode(scancode, tsc);
+        }
+    }
+    
+    for (int i = 0; i < XHCI_BOOT_REPORT_SIZE; i++) {
+        before[i] = now[i];
+    }
+}
+
+static void xhci_queue_report(xhci_keyboard_t *kbd) {
+    xhci_ring_push(&kbd->int_ring, (uint64_t)kbd->report, XHCI_BOOT_REPORT_SIZE,
+                   XHCI_TRB_TYPE(XHCI_TRB_NORMAL) | XHCI_TRB_ISP | XHCI_TRB_IOC);
+    xhci_ring_doorbell(kbd->slot_id, kbd->dci);
+}
+
+static void xhci_handle_transfer(uint8_t slot_id, uint8_t dci, uint8_t cc, uint64_t tsc) {
+    xhci_keyboard_t *kbd = xhci_find_keyboard(slot_id);
+    if (kbd && dci == kbd->dci) {
+        if (cc == XHCI_CC_SUCCESS || cc == XHCI_CC_SHORT_PACKET) {
+            kbd->reports++;
+            xhci_keyboard_diff(kbd, tsc);
+        } else {
+            kbd->errors++;
+        }
+        xhci_queue_report(kbd);
+        return;
+    }
+    
+    // Control transfer issued during enumeration
+    xhci_state.xfer_cc = cc;
+    xhci_state.xfer_done = 1;
+}
+
+static void xhci_ack_port(uint8_t port) {
+    uint64_t reg = xhci_state.op_base + XHCI_OP_PORTSC(port);
+    uint32_t portsc = xhci_read32(reg);
+    xhci_write32(reg, (portsc & XHCI_PORTSC_PRESERVE) | (portsc & XHCI_PORTSC_CHANGE_MASK));
+}
+
+// Consume every event the controller has posted, then move the dequeue
+// pointer once (clearing Event Handler Busy)
+static void xhci_process_events(uint64_t tsc) {
+    xhci_ring_t *ring = &xhci_state.event_ring;
+    uint8_t consumed = 0;
+    
+    while (1) {
+        volatile xhci_trb_t *trb = &ring->trbs[ring->index];
+        uint32_t control = trb->control;
+        if ((control & XHCI_TRB_CYCLE) != ring->cycle) {
+            break;
+        }
+        
+        uint32_t status = trb->status;
+        switch (XHCI_TRB_GET_TYPE(control)) {
+            case XHCI_TRB_COMMAND_COMPLETION:
+                xhci_state.cmd_cc = XHCI_TRB_GET_CC(status);
+                xhci_state.cmd_slot = XHCI_TRB_GET_SLOT(control);
+                xhci_state.cmd_done = 1;
+                break;
+            case XHCI_TRB_TRANSFER_EVENT:
+                xhci_handle_transfer(XHCI_TRB_GET_SLOT(control), XHCI_TRB_GET_EP(control), XHCI_TRB_GET_CC(status), tsc);
+                break;
+            case XHCI_TRB_PORT_STATUS_CHANGE:
+                xhci_state.port_changes++;
+                xhci_ack_port((uint8_t)(trb->parameter >> 24));
+                break;
+        }
+        
+        xhci_state.events++;
+        consumed = 1;
+        if (++ring->index == XHCI_EVENT_TRBS) {
+            ring->index = 0;
+            ring->cycle ^= 1;
+        }
+    }
+    
+    if (consumed) {
+        xhci_write64(xhci_state.rt_base + XHCI_RT_IR0 + XHCI_IR_ERDP,
+                     (uint64_t)&ring->trbs[ring->index] | XHCI_ERDP_EHB);
+    }
+}
+
+// Enumeration runs before interrupts are enabled, so it drains the event
+// ring itself until the completion it is waiting for shows up
+static uint8_t xhci_wait_event(volatile uint8_t *done) {
+    for (uint32_t i = 0; i < XHCI_TIMEOUT; i++) {
+        xhci_process_events(cpu_read_tsc());
+        if (*done) {
+            return 1;
+        }
+        asm volatile("pause");
+    }
+    return 0;
+}
+
+static uint8_t xhci_command(uint64_t parameter, uint32_t control) {
+    xhci_state.cmd_done = 0;
+    xhci_ring_push(&xhci_state.cmd_ring, parameter, 0, control);
+    xhci_ring_doorbell(0, 0);
+    
+    if (!xhci_wait_event(&xhci_state.cmd_done)) {
+        log_warn("xHCI command timed out\n");
+        return 0;
+    }
+    return xhci_state.cmd_cc == XHCI_CC_SUCCESS;
+}
+
+static uint8_t xhci_control(xhci_keyboard_t *kbd, uint8_t request_type, uint8_t request,
+                            uint16_t value, uint16_t index, uint16_t length, void *data) {
+    uint8_t in = (request_type & USB_ENDPOINT_IN) != 0;
+    uint64_t setup = (uint64_t)request_type | ((uint64_t)request << 8) | ((uint64_t)value << 16) |
+                     ((uint64_t)index << 32) | ((uint64_t)length << 48);
+    uint32_t trt = length == 0 ? XHCI_SETUP_TRT_NONE : (in ? XHCI_SETUP_TRT_IN : XHCI_SETUP_TRT_OUT);
+    
+    xhci_state.xfer_done = 0;
+    xhci_ring_push(&kbd->ep0_ring, setup, 8, XHCI_TRB_TYPE(XHCI_TRB_SETUP) | XHCI_TRB_IDT | trt);
+    if (length) {
+        xhci_ring_push(&kbd->ep0_ring, (uint64_t)data, length,
+                       XHCI_TRB_TYPE(XHCI_TRB_DATA) | (in ? XHCI_TRB_DIR_IN : 0));
+    }
+    // Status stage runs opposite to the data stage (IN when there is none)
+    xhci_ring_push(&kbd->ep0_ring, 0, 0, XHCI_TRB_TYPE(XHCI_TRB_STATUS) | XHCI_TRB_IOC |
+                   ((length && in) ? 0 : XHCI_TRB_DIR_IN));
+    xhci_ring_doorbell(kbd->slot_id, XHCI_DCI_EP0);
+    
+    if (!xhci_wait_event(&xhci_state.xfer_done)) {
+        return 0;
+    }
+    return xhci_state.xfer_cc == XHCI_CC_SUCCESS || xhci_state.xfer_cc == XHCI_CC_SHORT_PACKET;
+}
+
+static uint16_t xhci_default_max_packet(uint8_t speed) {
+    switch (speed) {
+        case XHCI_SPEED_HIGH:
+            return 64;
+        case XHCI_SPEED_SUPER:
+            return 512;
+        default:
+            return 8;
+    }
+}
+
+// Interrupt intervals are 2^n x 125 us; full/low speed bInterval is in frames
+static uint8_t xhci_ep_interval(uint8_t speed, uint8_t b_interval) {
+    if (speed == XHCI_SPEED_HIGH || speed == XHCI_SPEED_SUPER) {
+        uint8_t n = b_interval ? b_interval - 1 : 0;
+        return n > 15 ? 15 : n;
+    }
+    
+    uint8_t n = 3;
+    while (n < 10 && (1U << (n + 1)) <= (uint32_t)b_interval * 8) {
+        n++;
+    }
+    return n;
+}
+
+static void xhci_fill_ep0(uint32_t *ep0, xhci_keyboard_t *kbd, uint16_t max_packet) {
+    ep0[1] = (3U << XHCI_EP_CERR_SHIFT) | (XHCI_EP_TYPE_CONTROL << XHCI_EP_TYPE_SHIFT) |
+             ((uint32_t)max_packet << XHCI_EP_MPS_SHIFT);
+    ep0[2] = (uint32_t)(uint64_t)kbd->ep0_ring.trbs | XHCI_TRB_CYCLE;
+    ep0[3] = (uint32_t)((uint64_t)kbd->ep0_ring.trbs >> 32);
+    ep0[4] = 8;  // Average TRB length
+}
+
+static uint8_t xhci_address_device(xhci_keyboard_t *kbd) {
+    uint8_t *input = xhci_state.input_context;
+    xhci_zero(input, PAGE_SIZE_4K);
+    
+    // Add the slot context and EP0
+    xhci_context(input, 0)[1] = (1U << 0) | (1U << 1);
+    uint32_t *slot = xhci_context(input, 1);
+    slot[0] = ((uint32_t)kbd->speed << XHCI_SLOT_SPEED_SHIFT) | (1U << XHCI_SLOT_ENTRIES_SHIFT);
+    slot[1] = (uint32_t)kbd->port << XHCI_SLOT_PORT_SHIFT;
+    xhci_fill_ep0(xhci_context(input, 2), kbd, xhci_default_max_packet(kbd->speed));
+    
+    xhci_state.dcbaa[kbd->slot_id] = (uint64_t)kbd->device_context;
+    return xhci_command((uint64_t)input, XHCI_TRB_TYPE(XHCI_TRB_ADDRESS_DEVICE) | XHCI_TRB_SLOT(kbd->slot_id));
+}
+
+// Full-speed devices may use a larger EP0 packet than the 8-byte default
+static uint8_t xhci_update_max_packet(xhci_keyboard_t *kbd, uint16_t max_packet) {
+    if (max_packet == xhci_default_max_packet(kbd->speed)) {
+        return 1;
+    }
+    
+    uint8_t *input = xhci_state.input_context;
+    xhci_zero(input, PAGE_SIZE_4K);
+    xhci_context(input, 0)[1] = 1U << 1;
+    xhci_fill_ep0(xhci_context(input, 2), kbd, max_packet);
+    return xhci_command((uint64_t)input, XHCI_TRB_TYPE(XHCI_TRB_EVALUATE_CONTEXT) | XHCI_TRB_SLOT(kbd->slot_id));
+}
+
+static uint8_t xhci_configure_endpoint(xhci_keyboard_t *kbd, uint16_t max_packet, uint8_t b_interval) {
+    uint8_t *input = xhci_state.input_context;
+    xhci_zero(input, PAGE_SIZE_4K);
+    
+    xhci_context(input, 0)[1] = (1U << 0) | (1U << kbd->dci);
+    uint32_t *slot = xhci_context(input, 1);
+    slot[0] = ((uint32_t)kbd->speed << XHCI_SLOT_SPEED_SHIFT) | ((uint32_t)kbd->dci << XHCI_SLOT_ENTRIES_SHIFT);
+    slot[1] = (uint32_t)kbd->port << XHCI_SLOT_PORT_SHIFT;
+    
+    uint32_t *ep = xhci_context(input, kbd->dci + 1);
+    ep[0] = (uint32_t)xhci_ep_interval(kbd->speed, b_interval) << XHCI_EP_INTERVAL_SHIFT;
+    ep[1] = (3U << XHCI_EP_CERR_SHIFT) | (XHCI_EP_TYPE_INTERRUPT_IN << XHCI_EP_TYPE_SHIFT) |
+            ((uint32_t)max_packet << XHCI_EP_MPS_SHIFT);
+    ep[2] = (uint32_t)(uint64_t)kbd->int_ring.trbs | XHCI_TRB_CYCLE;
+    ep[3] = (uint32_t)((uint64_t)kbd->int_ring.trbs >> 32);
+    ep[4] = ((uint32_t)max_packet << 16) | XHCI_BOOT_REPORT_SIZE;  // Max ESIT payload, average TRB length
+    
+    return xhci_command((uint64_t)input, XHCI_TRB_TYPE(XHCI_TRB_CONFIGURE_EP) | XHCI_TRB_SLOT(kbd->slot_id));
+}
+
+// Walk the configuration descriptor for a boot keyboard interface and its
+// interrupt IN endpoint
+static uint8_t xhci_find_boot_keyboard(xhci_keyboard_t *kbd, const uint8_t *desc, uint16_t length,
+                                       uint16_t *max_packet, uint8_t *b_interval) {
+    uint8_t in_keyboard = 0;
+    
+    for (uint16_t offset = 0; offset + 2 <= length && desc[offset] >= 2; offset += desc[offset]) {
+        const uint8_t *d = &desc[offset];
+        if (d[1] == USB_DESC_INTERFACE && d[0] >= 9) {
+            in_keyboard = d[5] == USB_CLASS_HID && d[6] == USB_SUBCLASS_BOOT && d[7] == USB_PROTOCOL_KEYBOARD;
+            kbd->interface = d[2];
+        } else if (d[1] == USB_DESC_ENDPOINT && d[0] >= 7 && in_keyboard &&
+                   (d[2] & USB_ENDPOINT_IN) && (d[3] & 0x3) == USB_ENDPOINT_XFER_INT) {
+            kbd->endpoint = d[2];
+            kbd->dci = XHCI_DCI_IN(d[2]);
+            *max_packet = (d[4] | ((uint16_t)d[5] << 8)) & 0x7FF;
+            *b_interval = d[6];
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static uint8_t xhci_reset_port(uint8_t port) {
+    uint64_t reg = xhci_state.op_base + XHCI_OP_PORTSC(port);
+    uint32_t portsc = xhci_read32(reg);
+    if (!(portsc & XHCI_PORTSC_CCS)) {
+        return 0;
+    }
+    
+    // USB3 ports enable themselves after link training; USB2 ports need a
+    // reset to move to Enabled
+    if (!(portsc & XHCI_PORTSC_PED)) {
+        xhci_write32(reg, (portsc & XHCI_PORTSC_PRESERVE) | XHCI_PORTSC_PR);
+        if (!xhci_wait_bits(reg, XHCI_PORTSC_PRC, XHCI_PORTSC_PRC)) {
+            return 0;
+        }
+    }
+    
+    xhci_ack_port(port);
+    return (xhci_read32(reg) & XHCI_PORTSC_PED) != 0;
+}
+
+static void xhci_probe_port(uint8_t port) {
+    if (!xhci_reset_port(port)) {
+        return;
+    }
+    
+    xhci_keyboard_t *kbd = &xhci_state.keyboards[xhci_state.keyboard_count];
+    if (!kbd->device_context) {
+        kbd->device_context = (uint8_t *)xhci_alloc_page();
+        kbd->report = (uint8_t *)memory_alloc_aligned(64, 64);
+    } else {
+        xhci_zero(kbd->device_context, PAGE_SIZE_4K);
+    }
+    if (!kbd->device_context || !kbd->report ||
+        !xhci_ring_init(&kbd->ep0_ring) || !xhci_ring_init(&kbd->int_ring)) {
+        log_error("Failed to allocate xHCI device structures\n");
+        return;
+    }
+    
+    kbd->port = port;
+    kbd->speed = XHCI_PORTSC_SPEED(xhci_read32(xhci_state.op_base + XHCI_OP_PORTSC(port)));
+    if (!xhci_command(0, XHCI_TRB_TYPE(XHCI_TRB_ENABLE_SLOT))) {
+        return;
+    }
+    kbd->slot_id = xhci_state.cmd_slot;
+    
+    uint8_t *desc = xhci_state.desc_buffer;
+    uint16_t max_packet = 0;
+    uint8_t b_interval = 0;
+    uint8_t ok = xhci_address_device(kbd) &&
+                 xhci_control(kbd, USB_RT_DEVICE_IN, USB_REQ_GET_DESCRIPTOR, USB_DESC_DEVICE << 8, 0, 8, desc);
+    if (ok) {
+        uint16_t mps0 = kbd->speed == XHCI_SPEED_SUPER ? (uint16_t)(1U << desc[7]) : desc[7];
+        ok = xhci_update_max_packet(kbd, mps0) &&
+             xhci_control(kbd, USB_RT_DEVICE_IN, USB_REQ_GET_DESCRIPTOR, USB_DESC_DEVICE << 8, 0, 18, desc);
+    }
+    if (ok) {
+        kbd->vendor_id = desc[8] | ((uint16_t)desc[9] << 8);
+        kbd->product_id = desc[10] | ((uint16_t)desc[11] << 8);
+        ok = xhci_control(kbd, USB_RT_DEVICE_IN, USB_REQ_GET_DESCRIPTOR, USB_DESC_CONFIG << 8, 0, 9, desc);
+    }
+    uint8_t config_value = desc[5];
+    if (ok) {
+        uint16_t total = desc[2] | ((uint16_t)desc[3] << 8);
+        if (total > XHCI_DESC_BUFFER_SIZE) total = XHCI_DESC_BUFFER_SIZE;
+        ok = xhci_control(kbd, USB_RT_DEVICE_IN, USB_REQ_GET_DESCRIPTOR, USB_DESC_CONFIG << 8, 0, total, desc) &&
+             xhci_find_boot_keyboard(kbd, desc, total, &max_packet, &b_interval);
+    }
+    
+    // Endpoint first, then SET_CONFIGURATION, then switch the interface to
+    // the boot protocol. SET_IDLE(0) limits reports to key changes; some
+    // keyboards stall it, which is harmless.
+    if (ok) {
+        ok = xhci_configure_endpoint(kbd, max_packet, b_interval) &&
+             xhci_control(kbd, USB_RT_DEVICE_OUT, USB_REQ_SET_CONFIGURATION, config_value, 0, 0, 0) &&
+             xhci_control(kbd, USB_RT_CLASS_INTERFACE_OUT, USB_REQ_HID_SET_PROTOCOL, HID_PROTOCOL_BOOT, kbd->interface, 0, 0);
+    }
+    if (ok) {
+        xhci_control(kbd, USB_RT_CLASS_INTERFACE_OUT, USB_REQ_HID_SET_IDLE, 0, kbd->interface, 0, 0);
+    }
+    
+    char buf[32];
+    console_write_string("  xHCI port ");
+    itoa(port, buf, 10);
+    console_write_string(buf);
+    if (!ok) {
+        console_write_string(": no boot keyboard\n");
+        xhci_command(0, XHCI_TRB_TYPE(XHCI_TRB_DISABLE_SLOT) | XHCI_TRB_SLOT(kbd->slot_id));
+        xhci_state.dcbaa[kbd->slot_id] = 0;
+        return;
+    }
+    
+    console_write_string(": keyboard ");
+    itoa(kbd->vendor_id, buf, 16);
+    console_write_string(buf);
+    console_write_string(":");
+    itoa(kbd->product_id, buf, 16);
+    console_write_string(buf);
+    console_write_string(" (slot ");
+    itoa(kbd->slot_id, buf, 10);
+    console_write_string(buf);
+    console_write_string(")\n");
+    
+    for (int i = 0; i < XHCI_BOOT_REPORT_SIZE; i++) {
+        kbd->last_report[i] = 0;
+    }
+    xhci_state.keyboard_count++;
+}
+
+// Ask the firmware for the controller through USBLEGSUP and wait for it
+// to let go; firmware that never answers loses the controller anyway.
+// Either way its SMIs are switched off before the reset.
+static void xhci_take_ownership(void) {
+    uint32_t xecp = XHCI_HCC1_XECP(xhci_read32(xhci_state.base + XHCI_CAP_HCCPARAMS1));
+    uint64_t cap = xecp ? xhci_state.base + ((uint64_t)xecp << 2) : 0;
+    
+    while (cap && XHCI_XCAP_ID(xhci_read32(cap)) != XHCI_XCAP_LEGACY) {
+        uint32_t next = XHCI_XCAP_NEXT(xhci_read32(cap));
+        cap = next ? cap + ((uint64_t)next << 2) : 0;
+    }
+    if (!cap) return;
+    
+    uint32_t legsup = xhci_read32(cap);
+    if (legsup & XHCI_LEGACY_BIOS_OWNED) {
+        xhci_write32(cap, legsup | XHCI_LEGACY_OS_OWNED);
+        
+        uint32_t mhz = cpu_get_tsc_mhz();
+        uint64_t deadline = cpu_read_tsc() + (uint64_t)(mhz ? mhz : 1000) * 1000 * XHCI_LEGACY_TIMEOUT_MS;
+        while ((xhci_read32(cap) & XHCI_LEGACY_BIOS_OWNED) && cpu_read_tsc() < deadline) {
+            asm volatile("pause");
+        }
+        if (xhci_read32(cap) & XHCI_LEGACY_BIOS_OWNED) {
+            log_warn("xHCI firmware did not release the controller, taking it\n");
+            xhci_write32(cap, (xhci_read32(cap) & ~XHCI_LEGACY_BIOS_OWNED) | XHCI_LEGACY_OS_OWNED);
+        }
+    } else {
+        xhci_write32(cap, legsup | XHCI_LEGACY_OS_OWNED);
+    }
+    
+    uint32_t ctlsts = xhci_read32(cap + XHCI_LEGACY_CTLSTS);
+    xhci_write32(cap + XHCI_LEGACY_CTLSTS, (ctlsts & ~XHCI_LEGACY_SMI_ENABLES) | XHCI_LEGACY_SMI_EVENTS);
+}
+
+static uint8_t xhci_reset_controller(void) {
+    uint64_t usbcmd = xhci_state.op_base + XHCI_OP_USBCMD;
+    uint64_t usbsts = xhci_state.op_base + XHCI_OP_USBSTS;
+    
+    // Firmware may have left it running; stop before resetting
+    xhci_write32(usbcmd, xhci_read32(usbcmd) & ~XHCI_CMD_RUN);
+    if (!xhci_wait_bits(usbsts, XHCI_STS_HCH, XHCI_STS_HCH)) {
+        return 0;
+    }
+    
+    xhci_write32(usbcmd, XHCI_CMD_HCRST);
+    return xhci_wait_bits(usbcmd, XHCI_CMD_HCRST, 0) &&
+           xhci_wait_bits(usbsts, XHCI_STS_CNR, 0);
+}
+
+static uint8_t xhci_setup_memory(void) {
+    uint32_t hcsparams2 = xhci_read32(xhci_state.base + XHCI_CAP_HCSPARAMS2);
+    
+    if (!(xhci_read32(xhci_state.op_base + XHCI_OP_PAGESIZE) & XHCI_PAGESIZE_4K)) {
+        log_error("xHCI does not support 4 KB pages\n");
+        return 0;
+    }
+    
+    xhci_state.dcbaa = (uint64_t *)xhci_alloc_page();
+    xhci_state.input_context = (uint8_t *)xhci_alloc_page();
+    xhci_state.desc_buffer = (uint8_t *)xhci_alloc_page();
+    xhci_state.erst = (xhci_erst_entry_t *)xhci_alloc_page();
+    xhci_state.event_ring.trbs = (volatile xhci_trb_t *)xhci_alloc_page();
+    if (!xhci_state.dcbaa || !xhci_state.input_context || !xhci_state.desc_buffer ||
+        !xhci_state.erst || !xhci_state.event_ring.trbs || !xhci_ring_init(&xhci_state.cmd_ring)) {
+        return 0;
+    }
+    
+    // Scratchpad pages belong to the controller; slot 0 of the DCBAA points
+    // at the array that lists them
+    uint32_t scratchpads = XHCI_HCS2_SCRATCHPADS(hcsparams2);
+    if (scratchpads) {
+        uint64_t *array = (uint64_t *)memory_alloc_aligned(scratchpads * sizeof(uint64_t), PAGE_SIZE_4K);
+        if (!array) return 0;
+        for (uint32_t i = 0; i < scratchpads; i++) {
+            array[i] = (uint64_t)xhci_alloc_page();
+            if (!array[i]) return 0;
+        }
+        xhci_state.dcbaa[0] = (uint64_t)array;
+    }
+    
+    xhci_write32(xhci_state.op_base + XHCI_OP_CONFIG, xhci_state.max_slots);
+    xhci_write64(xhci_state.op_base + XHCI_OP_DCBAAP, (uint64_t)xhci_state.dcbaa);
+    xhci_write64(xhci_state.op_base + XHCI_OP_CRCR, (uint64_t)xhci_state.cmd_ring.trbs | XHCI_CRCR_RCS);
+    
+    // One-segment event ring on interrupter 0; ERSTBA is written last
+    uint64_t ir = xhci_state.rt_base + XHCI_RT_IR0;
+    xhci_state.erst[0].ring_base = (uint64_t)xhci_state.event_ring.trbs;
+    xhci_state.erst[0].ring_size = XHCI_EVENT_TRBS;
+    xhci_state.event_ring.index = 0;
+    xhci_state.event_ring.cycle = 1;
+    xhci_write32(ir + XHCI_IR_ERSTSZ, 1);
+    xhci_write64(ir + XHCI_IR_ERDP, (uint64_t)xhci_state.event_ring.trbs);
+    xhci_write64(ir + XHCI_IR_ERSTBA, (uint64_t)xhci_state.erst);
+    return 1;
+}
+
+static uint8_t xhci_setup_msi(const pci_device_info_t *info) {
+    uint16_t bus = xhci_state.bus;
+    uint16_t dev = xhci_state.device;
+    uint16_t func = xhci_state.function;
+    uint8_t cap_ptr = info->msi_cap;
+    if (!cap_ptr) {
+        return 0;
+    }
+    
+    uint32_t cap = pci_config_read32(bus, dev, func, cap_ptr);
+    uint16_t control = (cap >> 16) & 0xFFFF;
+    
+    pci_config_write32(bus, dev, func, cap_ptr + 4, MSI_ADDRESS(cpu_get_apic_id()));
+    if (control & PCI_MSI_CONTROL_64BIT) {
+        pci_config_write32(bus, dev, func, cap_ptr + 8, 0);
+        pci_config_write32(bus, dev, func, cap_ptr + 12, MSI_DATA(VECTOR_XHCI));
+    } else {
+        pci_config_write32(bus, dev, func, cap_ptr + 8, MSI_DATA(VECTOR_XHCI));
+    }
+    
+    control = (control & ~PCI_MSI_CONTROL_MME_MASK) | PCI_MSI_CONTROL_ENABLE;
+    pci_config_write32(bus, dev, func, cap_ptr, (cap & 0xFFFF) | ((uint32_t)control << 16));
+    return 1;
+}
+
+// Pick the first xHCI no cell owns; the IOMMU moves it into the
+// hypervisor's DMA domain before the controller is touched
+static const pci_device_info_t *xhci_claim_controller(void) {
+    for (uint32_t i = 0; i < pci_get_device_count(); i++) {
+        const pci_device_info_t *info = pci_get_device(i);
+        if (info->class_code != PCI_CLASS_USB || info->prog_if != XHCI_PROG_IF) continue;
+        
+        uint16_t bus = PCI_BDF_BUS(info->bdf);
+        uint16_t dev = PCI_BDF_DEVICE(info->bdf);
+        uint16_t func = PCI_BDF_FUNCTION(info->bdf);
+        if (!info->bars[0] || !iommu_claim_device(bus, dev, func)) continue;
+        
+        xhci_state.bus = bus;
+        xhci_state.device = dev;
+        xhci_state.function = func;
+        xhci_state.base = info->bars[0];
+        return info;
+    }
+    return 0;
+}
+
+void xhci_init(void) {
+    console_write_string("Initializing xHCI controller...\n");
+    
+    const pci_device_info_t *info = xhci_claim_controller();
+    if (!info) {
+        console_write_string("  No unassigned xHCI controller found\n");
+        return;
+    }
+    xhci_state.present = 1;
+    
+    uint16_t bus = xhci_state.bus;
+    uint16_t dev = xhci_state.device;
+    uint16_t func = xhci_state.function;
+    uint32_t command = pci_config_read32(bus, dev, func, PCI_CONFIG_COMMAND) & 0xFFFF;
+    pci_config_write32(bus, dev, func, PCI_CONFIG_COMMAND, command | PCI_COMMAND_MEMORY | PCI_COMMAND_MASTER);
+    
+    uint64_t base = xhci_state.base;
+    uint32_t hcsparams1 = xhci_read32(base + XHCI_CAP_HCSPARAMS1);
+    xhci_state.op_base = base + (xhci_read32(base + XHCI_CAP_CAPLENGTH) & 0xFF);
+    xhci_state.rt_base = base + (xhci_read32(base + XHCI_CAP_RTSOFF) & ~0x1FU);
+    xhci_state.db_base = base + (xhci_read32(base + XHCI_CAP_DBOFF) & ~0x3U);
+    xhci_state.max_slots = XHCI_HCS1_MAX_SLOTS(hcsparams1);
+    xhci_state.max_ports = XHCI_HCS1_MAX_PORTS(hcsparams1);
+    xhci_state.context_size = (xhci_read32(base + XHCI_CAP_HCCPARAMS1) & XHCI_HCC1_CSZ) ? 64 : 32;
+    
+    char buf[32];
+    console_write_string("  Controller at ");
+    itoa(bus, buf, 16);
+    console_write_string(buf);
+    console_write_string(":");
+    itoa(dev, buf, 16);
+    console_write_string(buf);
+    console_write_string(".");
+    itoa(func, buf, 10);
+    console_write_string(buf);
+    console_write_string(", MMIO 0x");
+    console_write_hex(base);
+    console_write_string(", ");
+    itoa(xhci_state.max_ports, buf, 10);
+    console_write_string(buf);
+    console_write_string(" ports\n");
+    
+    xhci_take_ownership();
+    if (!xhci_reset_controller()) {
+        log_error("xHCI reset timed out\n");
+        return;
+    }
+    if (!xhci_setup_memory()) {
+        log_error("Failed to set up xHCI rings\n");
+        return;
+    }
+    
+    uint64_t usbcmd = xhci_state.op_base + XHCI_OP_USBCMD;
+    xhci_write32(usbcmd, XHCI_CMD_RUN);
+    if (!xhci_wait_bits(xhci_state.op_base + XHCI_OP_USBSTS, XHCI_STS_HCH, 0)) {
+        log_error("xHCI did not start\n");
+        return;
+    }
+    
+    for (uint8_t port = 1; port <= xhci_state.max_ports && xhci_state.keyboard_count < XHCI_MAX_KEYBOARDS; port++) {
+        xhci_probe_port(port);
+    }
+    
+    // From here on the controller is interrupt driven: every report and
+    // port change arrives through MSI on the hypervisor core
+    if (!xhci_setup_msi(info)) {
+        log_warn("xHCI has no MSI capability, keyboard input disabled\n");
+        return;
+    }
+    cpu_register_interrupt_handler(VECTOR_XHCI, xhci_handle_interrupt);
+    uint64_t ir = xhci_state.rt_base + XHCI_RT_IR0;
+    xhci_write32(ir + XHCI_IR_IMAN, XHCI_IMAN_IP | XHCI_IMAN_IE);
+    xhci_write32(usbcmd, XHCI_CMD_RUN | XHCI_CMD_INTE);
+    xhci_state.running = 1;
+    
+    for (uint32_t i = 0; i < xhci_state.keyboard_count; i++) {
+        xhci_queue_report(&xhci_state.keyboards[i]);
+    }
+    
+    console_write_string("xHCI initialized: ");
+    itoa(xhci_state.keyboard_count, buf, 10);
+    console_write_string(buf);
+    console_write_string(" keyboard(s)\n");
+}
+
+uint32_t xhci_get_keyboard_count(void) {
+    return xhci_state.keyboard_count;
+}
+
+const xhci_keyboard_t *xhci_get_keyboard(uint32_t index) {
+    if (index >= xhci_state.keyboard_count) {
+        return 0;
+    }
+    return &xhci_state.keyboards[index];
+}
+
+void xhci_handle_interrupt(void) {
+    // Stamp first: hotkey latency is measured from here
+    uint64_t tsc = cpu_read_tsc();
+    if (!xhci_state.running) {
+        return;
+    }
+    
+    xhci_state.interrupts++;
+    
+    // Acknowledge before draining so an event posted meanwhile raises a
+    // fresh interrupt instead of being lost
+    xhci_write32(xhci_state.op_base + XHCI_OP_USBSTS, XHCI_STS_EINT);
+    xhci_write32(xhci_state.rt_base + XHCI_RT_IR0 + XHCI_IR_IMAN, XHCI_IMAN_IP | XHCI_IMAN_IE);
+    xhci_process_events(tsc);
+    
+    uint64_t cycles = cpu_read_tsc() - tsc;
+    xhci_state.last_isr_cycles = cycles;
+    if (cycles > xhci_state.max_isr_cycles) {
+        xhci_state.max_isr_cycles = cycles;
+    }
+}
+
+void xhci_print_status(void) {
+    if (!xhci_state.present) {
+        console_write_string("  xHCI: not present\n");
+        return;
+    }
+    
+    char buf[32];
+    console_write_string("  xHCI: ");
+    console_write_string(xhci_state.running ? "Running" : "Stopped");
+    console_write_string(", interrupts ");
+    itoa(xhci_state.interrupts, buf, 10);
+    console_write_string(buf);
+    console_write_string(", events ");
+    itoa(xhci_state.events, buf, 10);
+    console_write_string(buf);
+    console_write_string(", port changes ");
+    itoa(xhci_state.port_changes, buf, 10);
+    console_write_string(buf);
+    console_write_string("\n");
+    console_write_string("    Handler cycles (last/max): 0x");
+    console_write_hex(xhci_state.last_isr_cycles);
+    console_write_string(" / 0x");
+    console_write_hex(xhci_state.max_isr_cycles);
+    console_write_string("\n");
+    
+    for (uint32_t i = 0; i < xhci_state.keyboard_count; i++) {
+        const xhci_keyboard_t *kbd = &xhci_state.keyboards[i];
+        console_write_string("    Keyboard on port ");
+        itoa(kbd->port, buf, 10);
+        console_write_string(buf);
+        console_write_string(": ");
+        itoa(kbd->reports, buf, 10);
+        console_write_string(buf);
+        console_write_string(" reports, ");
+        itoa(kbd->errors, buf, 10);
+        console_write_string(buf);
+        console_write_string(" errors\n");
+    }
+}
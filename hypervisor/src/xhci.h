@@ -0,0 +1,224 @@
+#ifndef XHCI_H
+#define XHCI_H
+
+#include "types.h"
+
+// PCI programming interface of an xHCI controller (class 0C03)
+#define XHCI_PROG_IF 0x30
+
+// Capability registers
+#define XHCI_CAP_CAPLENGTH 0x00
+#define XHCI_CAP_HCSPARAMS1 0x04
+#define XHCI_CAP_HCSPARAMS2 0x08
+#define XHCI_CAP_HCCPARAMS1 0x10
+#define XHCI_CAP_DBOFF 0x14
+#define XHCI_CAP_RTSOFF 0x18
+#define XHCI_HCS1_MAX_SLOTS(p) ((p) & 0xFF)
+#define XHCI_HCS1_MAX_PORTS(p) (((p) >> 24) & 0xFF)
+#define XHCI_HCS2_SCRATCHPADS(p) ((((p) >> 21) & 0x1F) << 5 | (((p) >> 27) & 0x1F))
+#define XHCI_HCC1_CSZ (1U << 2)  // 64-byte contexts
+#define XHCI_HCC1_XECP(p) (((p) >> 16) & 0xFFFF)  // Dword offset of the extended capabilities
+
+// Extended capabilities: USB legacy support (BIOS/OS ownership)
+#define XHCI_XCAP_ID(c) ((c) & 0xFF)
+#define XHCI_XCAP_NEXT(c) (((c) >> 8) & 0xFF)
+#define XHCI_XCAP_LEGACY 1
+#define XHCI_LEGACY_BIOS_OWNED (1U << 16)
+#define XHCI_LEGACY_OS_OWNED (1U << 24)
+#define XHCI_LEGACY_CTLSTS 0x04
+#define XHCI_LEGACY_SMI_ENABLES 0x0000E011U  // SMI on event, host error, OS/PCI/BAR
+#define XHCI_LEGACY_SMI_EVENTS 0xE0000000U   // RW1C: OS ownership, PCI command, BAR
+#define XHCI_LEGACY_TIMEOUT_MS 1000
+
+// Operational registers (base + CAPLENGTH)
+#define XHCI_OP_USBCMD 0x00
+#define XHCI_OP_USBSTS 0x04
+#define XHCI_OP_PAGESIZE 0x08
+#define XHCI_OP_CRCR 0x18
+#define XHCI_OP_DCBAAP 0x30
+#define XHCI_OP_CONFIG 0x38
+#define XHCI_OP_PORTSC(port) (0x400 + 0x10 * ((port) - 1))
+#define XHCI_CMD_RUN (1U << 0)
+#define XHCI_CMD_HCRST (1U << 1)
+#define XHCI_CMD_INTE (1U << 2)
+#define XHCI_STS_HCH (1U << 0)
+#define XHCI_STS_EINT (1U << 3)
+#define XHCI_STS_CNR (1U << 11)
+#define XHCI_CRCR_RCS (1UL << 0)
+#define XHCI_PAGESIZE_4K (1U << 0)
+
+// Port status and control
+#define XHCI_PORTSC_CCS (1U << 0)
+#define XHCI_PORTSC_PED (1U << 1)
+#define XHCI_PORTSC_PR (1U << 4)
+#define XHCI_PORTSC_SPEED(p) (((p) >> 10) & 0xF)
+#define XHCI_PORTSC_PRC (1U << 21)
+#define XHCI_PORTSC_CHANGE_MASK 0x00FE0000U  // RW1C change bits
+#define XHCI_PORTSC_PRESERVE 0x0E00C3E0U     // RW bits kept on write
+#define XHCI_SPEED_FULL 1
+#define XHCI_SPEED_LOW 2
+#define XHCI_SPEED_HIGH 3
+#define XHCI_SPEED_SUPER 4
+
+// Runtime registers, interrupter 0
+#define XHCI_RT_IR0 0x20
+#define XHCI_IR_IMAN 0x00
+#define XHCI_IR_IMOD 0x04
+#define XHCI_IR_ERSTSZ 0x08
+#define XHCI_IR_ERSTBA 0x10
+#define XHCI_IR_ERDP 0x18
+#define XHCI_IMAN_IP (1U << 0)
+#define XHCI_IMAN_IE (1U << 1)
+#define XHCI_ERDP_EHB (1UL << 3)
+
+// TRB control fields
+#define XHCI_TRB_CYCLE (1U << 0)
+#define XHCI_TRB_TC (1U << 1)     // Link TRB: toggle cycle
+#define XHCI_TRB_ISP (1U << 2)
+#define XHCI_TRB_IOC (1U << 5)
+#define XHCI_TRB_IDT (1U << 6)
+#define XHCI_TRB_DIR_IN (1U << 16)
+#define XHCI_TRB_TYPE(t) ((uint32_t)(t) << 10)
+#define XHCI_TRB_GET_TYPE(c) (((c) >> 10) & 0x3F)
+#define XHCI_TRB_SLOT(s) ((uint32_t)(s) << 24)
+#define XHCI_TRB_GET_SLOT(c) (((c) >> 24) & 0xFF)
+#define XHCI_TRB_GET_EP(c) (((c) >> 16) & 0x1F)
+#define XHCI_TRB_GET_CC(s) (((s) >> 24) & 0xFF)
+#define XHCI_SETUP_TRT_NONE (0U << 16)
+#define XHCI_SETUP_TRT_OUT (2U << 16)
+#define XHCI_SETUP_TRT_IN (3U << 16)
+
+// TRB types
+#define XHCI_TRB_NORMAL 1
+#define XHCI_TRB_SETUP 2
+#define XHCI_TRB_DATA 3
+#define XHCI_TRB_STATUS 4
+#define XHCI_TRB_LINK 6
+#define XHCI_TRB_ENABLE_SLOT 9
+#define XHCI_TRB_DISABLE_SLOT 10
+#define XHCI_TRB_ADDRESS_DEVICE 11
+#define XHCI_TRB_CONFIGURE_EP 12
+#define XHCI_TRB_EVALUATE_CONTEXT 13
+#define XHCI_TRB_TRANSFER_EVENT 32
+#define XHCI_TRB_COMMAND_COMPLETION 33
+#define XHCI_TRB_PORT_STATUS_CHANGE 34
+
+// Completion codes
+#define XHCI_CC_SUCCESS 1
+#define XHCI_CC_SHORT_PACKET 13
+
+// Context fields (dword indices into a 32/64-byte context)
+#define XHCI_SLOT_SPEED_SHIFT 20
+#define XHCI_SLOT_ENTRIES_SHIFT 27
+#define XHCI_SLOT_PORT_SHIFT 16
+#define XHCI_EP_CERR_SHIFT 1
+#define XHCI_EP_TYPE_SHIFT 3
+#define XHCI_EP_MPS_SHIFT 16
+#define XHCI_EP_INTERVAL_SHIFT 16
+#define XHCI_EP_TYPE_CONTROL 4
+#define XHCI_EP_TYPE_INTERRUPT_IN 7
+#define XHCI_DCI_EP0 1
+#define XHCI_DCI_IN(ep) ((uint8_t)(((ep) & 0xF) * 2 + 1))
+
+// USB standard and HID class requests
+#define USB_REQ_GET_DESCRIPTOR 6
+#define USB_REQ_SET_CONFIGURATION 9
+#define USB_REQ_HID_SET_IDLE 0x0A
+#define USB_REQ_HID_SET_PROTOCOL 0x0B
+#define USB_RT_DEVICE_IN 0x80
+#define USB_RT_DEVICE_OUT 0x00
+#define USB_RT_CLASS_INTERFACE_OUT 0x21
+#define USB_DESC_DEVICE 1
+#define USB_DESC_CONFIG 2
+#define USB_DESC_INTERFACE 4
+#define USB_DESC_ENDPOINT 5
+#define USB_ENDPOINT_IN 0x80
+#define USB_ENDPOINT_XFER_INT 3
+#define HID_PROTOCOL_BOOT 0
+
+// Ring and buffer sizing (one 4 KB page each)
+#define XHCI_RING_TRBS 64
+#define XHCI_EVENT_TRBS 64
+#define XHCI_MAX_KEYBOARDS 4
+#define XHCI_BOOT_REPORT_SIZE 8
+#define XHCI_DESC_BUFFER_SIZE 512
+#define XHCI_TIMEOUT 10000000
+
+typedef struct {
+    uint64_t parameter;
+    uint32_t status;
+    uint32_t control;
+} __attribute__((packed)) xhci_trb_t;
+
+typedef struct {
+    uint64_t ring_base;
+    uint32_t ring_size;
+    uint32_t reserved;
+} __attribute__((packed)) xhci_erst_entry_t;
+
+typedef struct {
+    volatile xhci_trb_t *trbs;
+    uint32_t index;
+    uint8_t cycle;
+} xhci_ring_t;
+
+// One HID boot keyboard behind a root port
+typedef struct {
+    uint8_t slot_id;
+    uint8_t port;
+    uint8_t speed;
+    uint8_t interface;
+    uint8_t endpoint;        // Interrupt IN endpoint address
+    uint8_t dci;             // Device context index of that endpoint
+    uint16_t vendor_id;
+    uint16_t product_id;
+    uint8_t *device_context;
+    xhci_ring_t ep0_ring;
+    xhci_ring_t int_ring;
+    uint8_t *report;         // DMA target of the interrupt TRB
+    uint8_t last_report[XHCI_BOOT_REPORT_SIZE];
+    uint32_t reports;
+    uint32_t errors;
+} xhci_keyboard_t;
+
+typedef struct {
+    uint8_t present;
+    uint8_t running;
+    uint16_t bus;
+    uint16_t device;
+    uint16_t function;
+    uint64_t base;
+    uint64_t op_base;
+    uint64_t rt_base;
+    uint64_t db_base;
+    uint8_t max_slots;
+    uint8_t max_ports;
+    uint8_t context_size;    // 32 or 64 bytes
+    uint64_t *dcbaa;
+    xhci_ring_t cmd_ring;
+    xhci_ring_t event_ring;
+    xhci_erst_entry_t *erst;
+    uint8_t *input_context;
+    uint8_t *desc_buffer;
+    // Completion of the last synchronous command/control transfer
+    volatile uint8_t cmd_done;
+    volatile uint8_t cmd_cc;
+    volatile uint8_t cmd_slot;
+    volatile uint8_t xfer_done;
+    volatile uint8_t xfer_cc;
+    xhci_keyboard_t keyboards[XHCI_MAX_KEYBOARDS];
+    uint32_t keyboard_count;
+    uint32_t interrupts;
+    uint64_t last_isr_cycles;
+    uint64_t max_isr_cycles;
+    uint32_t events;
+    uint32_t port_changes;
+} xhci_state_t;
+
+void xhci_init(void);
+uint32_t xhci_get_keyboard_count(void);
+const xhci_keyboard_t *xhci_get_keyboard(uint32_t index);
+void xhci_handle_interrupt(void);
+void xhci_print_status(void);
+
+#endif
@@ -0,0 +1,148 @@
+#!/usr/bin/env python3
+"""Turn CONCORDIA's COM2 metrics stream into Prometheus text format.
+
+The hypervisor writes one JSON object per line on its second UART after
+every monitor update. Capture it from the host's serial port, or from
+QEMU with "make run-metrics", then:
+
+    tools/metrics_decode.py build/metrics.ndjson              # last frame
+    tools/metrics_decode.py --follow --textfile /var/lib/node_exporter/concordia.prom \\
+        /dev/ttyS1
+
+--textfile is rewritten atomically after each frame, so the node_exporter
+textfile collector can scrape it. Lines that are not complete frames
+(a partial line at start-up, boot noise) are skipped.
+"""
+
+import argparse
+import json
+import os
+import sys
+import time
+
+SUPPORTED_VERSION = 2
+PREFIX = "concordia"
+
+# Per-frame identity, not metrics
+SKIP_KEYS = {"v", "seq", "tsc"}
+
+
+def parse_frame(line):
+    line = line.strip()
+    if not line.startswith("{"):
+        return None
+    try:
+        frame = json.loads(line)
+    except ValueError:
+        return None
+    if frame.get("v") != SUPPORTED_VERSION:
+        return None
+    return frame
+
+
+def flatten(name, value, labels, out):
+    """Nested objects extend the metric name, arrays become an index label."""
+    if isinstance(value, dict):
+        for key, child in value.items():
+            flatten("%s_%s" % (name, key), child, labels, out)
+    elif isinstance(value, list):
+        for index, child in enumerate(value):
+            flatten(name, child, labels + [("index", str(index))], out)
+    elif value is not None:
+        # null marks a figure the hypervisor could not measure; leave the
+        # series absent rather than report it as zero
+        out.append((name, labels, value))
+
+
+def to_prometheus(frame):
+    samples = []
+    for key, value in frame.items():
+        if key in SKIP_KEYS:
+            continue
+        if key == "cells":
+            for cell, metrics in value.items():
+                for metric, child in metrics.items():
+                    flatten("%s_cell_%s" % (PREFIX, metric), child, [("cell", cell)], samples)
+        elif key == "irq_per_cpu":
+            for cpu, count in enumerate(value):
+                samples.append(("%s_irq_total" % PREFIX, [("cpu", str(cpu))], count))
+        elif key == "switch" and "histogram" in value:
+            for bucket, count in enumerate(value["histogram"]):
+                # Bucket n holds latencies below 2^(n+1) cycles
+                samples.append(("%s_switch_latency_bucket" % PREFIX,
+                                [("below_cycles", str(1 << (bucket + 1)))], count))
+            rest = {k: v for k, v in value.items() if k != "histogram"}
+            flatten("%s_switch" % PREFIX, rest, [], samples)
+        elif key == "iommu" and "events" in value:
+            for code, count in enumerate(value["events"]):
+                samples.append(("%s_iommu_events" % PREFIX, [("code", "0x%x" % code)], count))
+            rest = {k: v for k, v in value.items() if k != "events"}
+            flatten("%s_iommu" % PREFIX, rest, [], samples)
+        else:
+            flatten("%s_%s" % (PREFIX, key), value, [], samples)
+
+    lines = []
+    for name, labels, value in samples:
+        label_text = ",".join('%s="%s"' % pair for pair in labels)
+        lines.append("%s{%s} %s" % (name, label_text, value) if labels else "%s %s" % (name, value))
+    return "\n".join(lines) + "\n"
+
+
+def write_textfile(path, text):
+    tmp = path + ".tmp"
+    with open(tmp, "w") as out:
+        out.write(text)
+    os.replace(tmp, path)
+
+
+def follow(source):
+    while True:
+        line = source.readline()
+        if line:
+            yield line
+        else:
+            time.sleep(0.2)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("stream", nargs="?", help="capture file or serial device (default: stdin)")
+    parser.add_argument("--follow", action="store_true", help="keep reading and emit every frame")
+    parser.add_argument("--textfile", help="rewrite this file with each frame instead of printing")
+    args = parser.parse_args()
+
+    source = open(args.stream, errors="replace") if args.stream else sys.stdin
+    lines = follow(source) if args.follow else source
+    last = None
+    last_seq = None
+    gaps = 0
+    for line in lines:
+        frame = parse_frame(line)
+        if frame is None:
+            continue
+        if last_seq is not None and frame["seq"] != last_seq + 1:
+            gaps += 1
+            print("warning: frames %d..%d missing" % (last_seq + 1, frame["seq"] - 1), file=sys.stderr)
+        last_seq = frame["seq"]
+        last = frame
+        if args.follow:
+            text = to_prometheus(frame)
+            if args.textfile:
+                write_textfile(args.textfile, text)
+            else:
+                sys.stdout.write(text + "\n")
+                sys.stdout.flush()
+
+    if last is None:
+        sys.exit("no metrics frames found")
+    text = to_prometheus(last)
+    if args.textfile:
+        write_textfile(args.textfile, text)
+    else:
+        sys.stdout.write(text)
+    if gaps:
+        print("warning: %d gaps in the frame sequence" % gaps, file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()
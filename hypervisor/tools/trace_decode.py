@@ -0,0 +1,117 @@
+#!/usr/bin/env python3
+"""Convert a CONCORDIA trace dump into Chrome trace JSON.
+
+The hypervisor streams its per-CPU trace rings as "@TRACE" lines on the
+serial console (Ctrl+Alt+T). Feed it the captured serial log:
+
+    make run-xhci | tee serial.log
+    tools/trace_decode.py serial.log > trace.json
+
+and open trace.json in chrome://tracing or https://ui.perfetto.dev. Each
+CPU is one thread row; timestamps are microseconds since the first record.
+When a log holds several dumps, the last one is used.
+"""
+
+import argparse
+import json
+import sys
+
+SUPPORTED_VERSION = 1
+DEFAULT_TSC_MHZ = 1000
+
+
+def parse_dump(lines):
+    dump = None
+    for line in lines:
+        start = line.find("@TRACE ")
+        if start < 0:
+            continue
+        fields = line[start:].split()
+        kind = fields[1]
+        if kind == "BEGIN":
+            dump = {
+                "version": int(fields[2], 16),
+                "tsc_mhz": int(fields[3], 16),
+                "events": {},
+                "records": [],
+                "complete": False,
+            }
+        elif dump is None:
+            continue
+        elif kind == "EVENT":
+            dump["events"][int(fields[2], 16)] = {
+                "phase": fields[3],
+                "name": fields[4],
+                "args": fields[5:7],
+            }
+        elif kind == "R":
+            cpu, event, tsc, arg0, arg1 = (int(f, 16) for f in fields[2:7])
+            dump["records"].append((tsc, cpu, event, arg0, arg1))
+        elif kind == "END":
+            dump["complete"] = True
+            dump["overwritten"] = int(fields[3], 16)
+    return dump
+
+
+def to_chrome_trace(dump, tsc_mhz):
+    records = sorted(dump["records"])
+    base = records[0][0] if records else 0
+    trace_events = []
+    for tsc, cpu, event, arg0, arg1 in records:
+        info = dump["events"].get(event)
+        if info is None:
+            name, phase, arg_names = "event_%d" % event, "i", ["arg0", "arg1"]
+        else:
+            name, phase, arg_names = info["name"], info["phase"], info["args"]
+        entry = {
+            "name": name,
+            "ph": phase,
+            "ts": (tsc - base) / tsc_mhz,
+            "pid": 0,
+            "tid": cpu,
+            "args": {arg_names[0]: arg0, arg_names[1]: arg1},
+        }
+        if phase == "i":
+            entry["s"] = "t"
+        trace_events.append(entry)
+    for cpu in sorted({r[1] for r in records}):
+        trace_events.append({"name": "thread_name", "ph": "M", "pid": 0, "tid": cpu,
+                             "args": {"name": "CPU %d" % cpu}})
+    return {"traceEvents": trace_events, "displayTimeUnit": "ns"}
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("log", nargs="?", help="serial log (default: stdin)")
+    parser.add_argument("-o", "--output", help="output file (default: stdout)")
+    parser.add_argument("--tsc-mhz", type=float,
+                        help="TSC rate, overriding the one in the dump")
+    args = parser.parse_args()
+
+    source = open(args.log, errors="replace") if args.log else sys.stdin
+    with source:
+        dump = parse_dump(source)
+    if dump is None:
+        sys.exit("no @TRACE BEGIN line found")
+    if dump["version"] != SUPPORTED_VERSION:
+        sys.exit("unsupported trace format version %d" % dump["version"])
+    if not dump["complete"]:
+        print("warning: dump is truncated", file=sys.stderr)
+    elif dump["overwritten"]:
+        print("warning: %d older records were overwritten" % dump["overwritten"], file=sys.stderr)
+
+    tsc_mhz = args.tsc_mhz or dump["tsc_mhz"]
+    if not tsc_mhz:
+        print("warning: TSC rate unknown, assuming %d MHz (use --tsc-mhz)" % DEFAULT_TSC_MHZ,
+              file=sys.stderr)
+        tsc_mhz = DEFAULT_TSC_MHZ
+
+    trace = to_chrome_trace(dump, tsc_mhz)
+    output = open(args.output, "w") if args.output else sys.stdout
+    with output:
+        json.dump(trace, output, indent=1)
+        output.write("\n")
+
+
+if __name__ == "__main__":
+    main()